@@ -0,0 +1,83 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "backoff.h"
+
+/* Only used by the dispatcher, so one seed will do */
+static unsigned int seed = 0;
+
+/* Returns a random time from low to high */
+static eventloop_time random_between(eventloop_time low, eventloop_time high)
+{
+    if (seed == 0)
+    {
+        seed = (unsigned int) time(NULL) ^ (unsigned int) getpid();
+    }
+
+    return low + (eventloop_time) ((double) (high - low) * rand_r(&seed) / ((double) RAND_MAX + 1));
+}
+
+void backoff_reset(backoff *b)
+{
+    b->delay = 0;
+    b->count = 0;
+}
+
+eventloop_time backoff_next(backoff *b, int policy, eventloop_time base, eventloop_time cap)
+{
+    eventloop_time delay;
+
+    if (cap < base)
+    {
+        cap = base;
+    }
+
+    switch (policy)
+    {
+        case BACKOFF_EXPONENTIAL:
+            /* Halved first so the doubling cannot overflow */
+            delay = b->delay == 0 ? base : b->delay > cap / 2 ? cap : b->delay * 2;
+            break;
+
+        case BACKOFF_DECORRELATED:
+            /* The first is also random, so that slots failing at once are
+               spread out straight away */
+            delay = b->delay == 0 ? base : b->delay;
+            delay = random_between(base, delay > cap / 3 ? cap : delay * 3);
+            break;
+
+        default:
+            delay = base;
+    }
+
+    if (delay > cap)
+    {
+        delay = cap;
+    }
+
+    b->delay = delay;
+    b->count++;
+
+    return delay;
+}
@@ -0,0 +1,65 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+#include "eventloop.h"
+
+/* Backoff policies, for the sleep after a job which found no more work and
+   after a failed job */
+#define BACKOFF_FIXED 1
+#define BACKOFF_EXPONENTIAL 2
+#define BACKOFF_DECORRELATED 3
+
+#define DEFAULT_BACKOFF BACKOFF_FIXED
+
+/*
+    A backoff decides how long to sleep after each of a run of jobs with the
+    same outcome, from the base time (--sleep or --sleep-on-error) up to a
+    cap:
+
+    BACKOFF_FIXED          always the base time (the original behaviour)
+    BACKOFF_EXPONENTIAL    the base time, doubled for each further job
+    BACKOFF_DECORRELATED   a random time between the base time and three
+                           times the last one, so that slots which failed
+                           together do not all retry together ("decorrelated
+                           jitter")
+
+    The run is ended by backoff_reset(), e.g. once a job has succeeded, the
+    next sleep then being back at the base time.
+*/
+typedef struct
+{
+    /* Last time given, 0 once reset */
+    eventloop_time delay;
+
+    /* Times given since the last reset */
+    int count;
+} backoff;
+
+void backoff_reset(backoff *b);
+
+/* Returns the next time to sleep for.   The cap is raised to the base time
+   if it is lower. */
+eventloop_time backoff_next(backoff *b, int policy, eventloop_time base, eventloop_time cap);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+    Time taken to check every one of 10,000 slots, reading the fields used
+    whenever a slot is checked (status, PID, id and wake time), with the
+    slots laid out as they were (an array of pointers to separately allocated
+    slots, each with a separately allocated id and pthread_t, the worker PID
+    standing for the PID) and as they are (one cache line aligned block of
+    slots of three cache lines, see add_slots()).
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <time.h>
+#include "sfmemlib.h"
+#include "jobdispatching.h"
+
+#define SLOTS 10000
+#define PASSES 20000
+
+/* The slot before it was laid out for the cache, only the fields which were
+   there matter */
+typedef struct old_slot
+{
+    long *id;
+    int status;
+    pthread_t *thread;
+    eventloop_time last_started_at;
+    eventloop_time termination_requested;
+    eventloop_time wake_at;
+    int duration_warning_issued;
+    int pidfd;
+    int logger_id;
+    int log_fd_stdout;
+    int log_fd_stderr;
+    char tid[25];
+    pid_t worker_pid;
+    int worker_stdin;
+    int worker_stdout;
+    int worker_jobs;
+    int worker_result;
+    char worker_reply[16];
+    int worker_reply_length;
+    struct jobqueue_item *queue_items;
+    int queue_item_count;
+    slot_list *list;
+    struct old_slot *list_prev;
+    struct old_slot *list_next;
+    int changed;
+    struct old_slot *changed_next;
+} old_slot;
+
+/* Used by sfmemlib */
+void _syslog(int facility_priority, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vsyslog(facility_priority, format, args);
+    va_end(args);
+}
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void report(const char *layout, double elapsed, long sum)
+{
+    /* The sum is printed so that the loops are not optimised away */
+    printf("  %-7s %.1f ns per slot, %.1f us per pass (%ld)\n", layout, elapsed * 1e9 / ((double) SLOTS * PASSES), elapsed * 1e6 / PASSES, sum);
+}
+
+int main()
+{
+    old_slot **old_slots = sfmalloc(SLOTS * sizeof(old_slot *));
+    slot *slots = sfaligned_alloc(SLOT_ALIGNMENT, SLOTS * sizeof(slot));
+    double start;
+    long sum = 0;
+    int i, pass;
+
+    /* Allocated as add_slots() used to, interleaving the slots with their
+       ids and pthread_t */
+    for (i=0; i<SLOTS; i++)
+    {
+        old_slots[i] = sfcalloc(1, sizeof(old_slot));
+        old_slots[i]->id = sfmalloc(sizeof(long));
+        *old_slots[i]->id = i;
+        old_slots[i]->thread = sfcalloc(1, sizeof(pthread_t));
+        old_slots[i]->status = i % 3;
+        old_slots[i]->wake_at = i;
+    }
+
+    for (i=0; i<SLOTS; i++)
+    {
+        slots[i].id = i;
+        slots[i].status = i % 3;
+        slots[i].pid = 0;
+        slots[i].wake_at = i;
+    }
+
+    printf("Checking %d slots, %d passes:\n", SLOTS, PASSES);
+
+    start = seconds();
+
+    for (pass=0; pass<PASSES; pass++)
+    {
+        for (i=0; i<SLOTS; i++)
+        {
+            if (old_slots[i]->status > 0 || old_slots[i]->worker_pid > 0)
+            {
+                sum += *old_slots[i]->id + old_slots[i]->wake_at;
+            }
+        }
+    }
+
+    report("before:", seconds() - start, sum);
+
+    sum = 0;
+    start = seconds();
+
+    for (pass=0; pass<PASSES; pass++)
+    {
+        for (i=0; i<SLOTS; i++)
+        {
+            if (slots[i].status > 0 || slots[i].pid > 0)
+            {
+                sum += slots[i].id + slots[i].wake_at;
+            }
+        }
+    }
+
+    report("after:", seconds() - start, sum);
+
+    return 0;
+}
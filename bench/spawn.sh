@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Spawns per second with each way of starting sub-processes: 8 threads
+# running a program which exits 64 (so is run again at once) for 3s each.
+#
+# spawn.sh [threads] [seconds]   (run from make bench)
+#
+
+THREADS=${1:-8}
+RUN_TIME=${2:-3}
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+FATCONTROLLER=$BENCH/../bin/fatcontroller
+COUNT=$(mktemp)
+
+trap 'rm -f "$COUNT"' EXIT
+
+run()
+{
+    NAME=$1
+    shift
+
+    : > "$COUNT"
+    timeout "$RUN_TIME" "$FATCONTROLLER" -c "$BENCH/spawned" -a "$COUNT" -l /dev/null \
+        -t "$THREADS" -s 0 -e 0 "$@" > /dev/null 2>&1
+
+    printf "  %-32s %6d/s\n" "$NAME:" $(( $(wc -c < "$COUNT") / RUN_TIME ))
+}
+
+echo "Spawns per second, $THREADS threads, ${RUN_TIME}s runs:"
+run "fork"
+run "posix_spawn" --posix-spawn
+run "direct reaping + fork" --direct-reaping
+run "direct reaping + posix_spawn" --direct-reaping --posix-spawn
@@ -0,0 +1,46 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+    Sub-process for spawn.sh: appends one byte to the file given as its
+    first argument, so the file's size is the number of times it ran, and
+    exits 64 so that it is run again at once.
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    int fd;
+
+    if (argc > 1 && (fd = open(argv[1], O_WRONLY | O_APPEND | O_CLOEXEC)) != -1)
+    {
+        if (write(fd, "x", 1) == -1)
+        {
+            /* Not counted */
+        }
+
+        close(fd);
+    }
+
+    return 64;
+}
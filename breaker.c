@@ -0,0 +1,132 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include "sfmemlib.h"
+#include "breaker.h"
+
+static void clear_window(breaker *b)
+{
+    b->count = 0;
+    b->next = 0;
+    b->failures = 0;
+}
+
+static void trip(breaker *b, eventloop_time now)
+{
+    b->state = BREAKER_OPEN;
+    b->opens_until = now + b->open_time;
+    b->trips++;
+}
+
+void breaker_initialize(breaker *b, double threshold, int window, eventloop_time open_time)
+{
+    b->state = BREAKER_CLOSED;
+    b->threshold = threshold;
+    b->window = window;
+    b->outcomes = threshold > 0 ? sfcalloc(window, sizeof(unsigned char)) : NULL;
+    b->open_time = open_time;
+    b->opens_until = 0;
+    b->probe = -1;
+    b->trips = 0;
+
+    clear_window(b);
+}
+
+void breaker_deinitialize(breaker *b)
+{
+    free(b->outcomes);
+    b->outcomes = NULL;
+}
+
+int breaker_allows(breaker *b, eventloop_time now)
+{
+    if (b->state == BREAKER_OPEN && now >= b->opens_until)
+    {
+        b->state = BREAKER_HALF_OPEN;
+        b->probe = -1;
+    }
+
+    return b->state == BREAKER_CLOSED || (b->state == BREAKER_HALF_OPEN && b->probe == -1);
+}
+
+void breaker_probe(breaker *b, long slot_id)
+{
+    b->probe = slot_id;
+}
+
+int breaker_record(breaker *b, long slot_id, int failed, eventloop_time now)
+{
+    failed = failed != 0;
+
+    if (b->threshold <= 0)
+    {
+        return 0;
+    }
+
+    if (b->state == BREAKER_HALF_OPEN)
+    {
+        if (slot_id != b->probe)
+        {
+            return 0;
+        }
+
+        if (failed)
+        {
+            trip(b, now);
+        }
+        else
+        {
+            b->state = BREAKER_CLOSED;
+            clear_window(b);
+        }
+
+        return 1;
+    }
+
+    if (b->state == BREAKER_OPEN)
+    {
+        return 0;
+    }
+
+    /* The oldest outcome makes way once the window is full */
+    if (b->count == b->window)
+    {
+        b->failures -= b->outcomes[b->next];
+    }
+    else
+    {
+        b->count++;
+    }
+
+    b->outcomes[b->next] = (unsigned char) failed;
+    b->failures += failed;
+    b->next = (b->next + 1) % b->window;
+
+    if (b->count == b->window && b->failures >= b->threshold * b->window)
+    {
+        trip(b, now);
+
+        return 1;
+    }
+
+    return 0;
+}
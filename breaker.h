@@ -0,0 +1,95 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include "eventloop.h"
+
+/* Circuit breaker states */
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+
+/* Largest window of job outcomes */
+#define BREAKER_MAX_WINDOW 1000
+
+#define DEFAULT_BREAKER_WINDOW 20
+#define DEFAULT_BREAKER_OPEN_TIME (30 * EVENTLOOP_SECOND)
+
+/*
+    A circuit breaker stops a pool starting jobs which are bound to fail, e.g.
+    while a database they need is down:
+
+    BREAKER_CLOSED     jobs are started, their outcomes being kept for a
+                       window of the last jobs.   Once the window is full and
+                       the share of failures in it reaches the threshold the
+                       breaker opens.
+    BREAKER_OPEN       no jobs are started until the open time has passed,
+                       the breaker then being half-open.   Outcomes of jobs
+                       started before it opened are ignored.
+    BREAKER_HALF_OPEN  one job (the probe) is started.   If it succeeds the
+                       breaker closes, with an empty window, and if it fails
+                       the breaker opens again.
+*/
+typedef struct
+{
+    int state;
+
+    /* Share of failures (0 to 1) which opens it, 0 if it never opens */
+    double threshold;
+
+    /* Outcomes of the last window jobs (1 for a failure), oldest at next
+       once count has reached window */
+    unsigned char *outcomes;
+    int window;
+    int count;
+    int next;
+    int failures;
+
+    eventloop_time open_time;
+
+    /* When an open breaker becomes half-open */
+    eventloop_time opens_until;
+
+    /* Half-open: id of the slot running the probe, -1 until it has started */
+    long probe;
+
+    /* Times it has opened */
+    unsigned long long trips;
+} breaker;
+
+void breaker_initialize(breaker *b, double threshold, int window, eventloop_time open_time);
+
+void breaker_deinitialize(breaker *b);
+
+/* Returns 1 if jobs may be started, an open breaker becoming half-open once
+   its time has passed, and a half-open one only allowing the probe */
+int breaker_allows(breaker *b, eventloop_time now);
+
+/* A half-open breaker's probe has been started in a slot */
+void breaker_probe(breaker *b, long slot_id);
+
+/* Records the outcome of the job of a slot.   Returns 1 if the state has
+   changed. */
+int breaker_record(breaker *b, long slot_id, int failed, eventloop_time now);
+
+#endif
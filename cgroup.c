@@ -0,0 +1,637 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <linux/magic.h>
+#include "extern.h"
+#include "sfmemlib.h"
+#include "cgroup.h"
+
+/* Controllers enabled for the pools if the root has them */
+static const char *wanted_controllers[] = {"cpu", "memory", "io"};
+
+struct cgroup
+{
+    /* Directory, kept open so that files are opened relative to it */
+    int fd;
+
+    /* Name in the root and full path, for messages */
+    char *name;
+    char *path;
+};
+
+static cgroup root = {-1, NULL, NULL};
+
+/* Controllers enabled in the root, as written to cgroup.subtree_control,
+   e.g. "+cpu +memory" */
+static char controllers[64];
+
+/* Cleared once cgroup.kill is found not to be supported */
+static int kill_supported = 1;
+
+static int is_cgroup2(const char *path)
+{
+    struct statfs st;
+
+    return statfs(path, &st) == 0 && st.f_type == CGROUP2_SUPER_MAGIC;
+}
+
+/* Reads the path of the dispatcher's cgroup, below the mount point, from
+   /proc/self/cgroup */
+static int own_cgroup(char *buffer, size_t size)
+{
+    char line[PATH_MAX + 16];
+    int rv = RV_FAIL;
+    FILE *fp = fopen("/proc/self/cgroup", "re");
+
+    if (fp == NULL)
+    {
+        return RV_FAIL;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        /* The v2 hierarchy has ID 0 and no controllers listed */
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+
+            if (snprintf(buffer, size, "%s", line + 3) < (int) size)
+            {
+                rv = RV_OK;
+            }
+
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    return rv;
+}
+
+/* Path of a file of a cgroup or of one of its children, relative to it */
+static void file_path(char *buffer, size_t size, const char *child, const char *file)
+{
+    if (child == NULL)
+    {
+        snprintf(buffer, size, "%s", file);
+    }
+    else
+    {
+        snprintf(buffer, size, "%s/%s", child, file);
+    }
+}
+
+/* Writes a value to a file of a cgroup or child.   Returns 0, or the error
+   number if it could not be written. */
+static int write_file(int dirfd, const char *child, const char *file, const char *value)
+{
+    char path[CGROUP_NAME_SIZE + 32];
+    size_t length = strlen(value);
+    ssize_t written;
+    int fd, err = 0;
+
+    file_path(path, sizeof(path), child, file);
+
+    fd = openat(dirfd, path, O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        return errno;
+    }
+
+    written = write(fd, value, length);
+
+    if (written != (ssize_t) length)
+    {
+        err = written == -1 ? errno : EIO;
+    }
+
+    close(fd);
+
+    return err;
+}
+
+/* Reads a file of a cgroup or child (cut short to fit the buffer).   Returns
+   RV_FAIL if it could not be read. */
+static int read_file(int dirfd, const char *child, const char *file, char *buffer, size_t size)
+{
+    char path[CGROUP_NAME_SIZE + 32];
+    ssize_t length;
+    int fd;
+
+    file_path(path, sizeof(path), child, file);
+
+    fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        return RV_FAIL;
+    }
+
+    do
+    {
+        length = read(fd, buffer, size - 1);
+    } while (length == -1 && errno == EINTR);
+
+    close(fd);
+
+    if (length == -1)
+    {
+        return RV_FAIL;
+    }
+
+    buffer[length] = '\0';
+
+    return RV_OK;
+}
+
+/* Returns 1 if a word is in a list of words separated by spaces */
+static int has_word(const char *list, const char *word)
+{
+    size_t length = strlen(word);
+    const char *p;
+
+    for (p = strstr(list, word); p != NULL; p = strstr(p + 1, word))
+    {
+        if ((p == list || p[-1] == ' ')
+         && (p[length] == '\0' || p[length] == ' ' || p[length] == '\n'))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Enables what controllers the root has, noting which for its children */
+static void enable_root_controllers()
+{
+    char available[256], enable[16];
+    size_t i;
+    int err;
+
+    if (read_file(root.fd, NULL, "cgroup.controllers", available, sizeof(available)) != RV_OK)
+    {
+        available[0] = '\0';
+    }
+
+    controllers[0] = '\0';
+
+    for (i=0; i<sizeof(wanted_controllers)/sizeof(wanted_controllers[0]); i++)
+    {
+        if (!has_word(available, wanted_controllers[i]))
+        {
+            _syslog(LOG_WARNING, "cgroup: The %s controller is not available in %s, its limits cannot be used", wanted_controllers[i], root.path);
+            continue;
+        }
+
+        snprintf(enable, sizeof(enable), "+%s", wanted_controllers[i]);
+
+        err = write_file(root.fd, NULL, "cgroup.subtree_control", enable);
+
+        if (err != 0)
+        {
+            _syslog(LOG_WARNING, "cgroup: Cannot enable the %s controller in %s: [%d] %s", wanted_controllers[i], root.path, err, strerror(err));
+            continue;
+        }
+
+        if (controllers[0] != '\0')
+        {
+            strcat(controllers, " ");
+        }
+
+        strcat(controllers, enable);
+    }
+}
+
+int cgroup_initialize(const char *path)
+{
+    const char *mount = CGROUP_MOUNT;
+    char own[PATH_MAX], own_path[PATH_MAX + sizeof(CGROUP_MOUNT_HYBRID)];
+    struct stat root_st, own_st;
+    int err;
+
+    if (!is_cgroup2(mount))
+    {
+        mount = CGROUP_MOUNT_HYBRID;
+
+        if (!is_cgroup2(mount))
+        {
+            _syslog(LOG_WARNING, "cgroup: cgroup v2 is not mounted at %s or %s", CGROUP_MOUNT, CGROUP_MOUNT_HYBRID);
+
+            return RV_FAIL;
+        }
+    }
+
+    if (own_cgroup(own, sizeof(own)) != RV_OK)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot find the cgroup of The Fat Controller in /proc/self/cgroup");
+
+        return RV_FAIL;
+    }
+
+    snprintf(own_path, sizeof(own_path), "%s%s", mount, own);
+
+    if (strcmp(path, CGROUP_SELF) == 0)
+    {
+        path = own_path;
+    }
+
+    if (!is_cgroup2(path))
+    {
+        _syslog(LOG_WARNING, "cgroup: %s is not a cgroup v2 directory", path);
+
+        return RV_FAIL;
+    }
+
+    root.fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (root.fd == -1)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot open %s: [%d] %s", path, errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    root.path = sfmalloc(strlen(path) + 1);
+    strcpy(root.path, path);
+
+    /* e.g. from the cgroup "/", as the names of cgroups are added to it */
+    while (strlen(root.path) > 1 && root.path[strlen(root.path) - 1] == '/')
+    {
+        root.path[strlen(root.path) - 1] = '\0';
+    }
+
+    /* Once controllers are enabled for its children a cgroup cannot have
+       processes of its own, so the dispatcher moves to a leaf.   This is also
+       where the cgroup is checked to have been delegated to us. */
+    if (stat(own_path, &own_st) == 0 && fstat(root.fd, &root_st) == 0
+     && own_st.st_dev == root_st.st_dev && own_st.st_ino == root_st.st_ino)
+    {
+        if (mkdirat(root.fd, CGROUP_DISPATCHER_NAME, 0755) != 0 && errno != EEXIST)
+        {
+            err = errno;
+        }
+        else
+        {
+            err = write_file(root.fd, CGROUP_DISPATCHER_NAME, "cgroup.procs", "0");
+        }
+
+        if (err != 0)
+        {
+            _syslog(LOG_WARNING, "cgroup: Cannot move The Fat Controller to %s/%s, has the cgroup been delegated? [%d] %s", path, CGROUP_DISPATCHER_NAME, err, strerror(err));
+
+            cgroup_deinitialize();
+
+            return RV_FAIL;
+        }
+    }
+
+    enable_root_controllers();
+
+    _syslog(LOG_INFO, "cgroup: Using %s with controllers: %s", root.path, controllers[0] != '\0' ? controllers : "none");
+
+    return RV_OK;
+}
+
+void cgroup_deinitialize()
+{
+    if (root.fd == -1)
+    {
+        return;
+    }
+
+    /* The dispatcher's own leaf cannot be removed while it is in it, it is
+       used again by the next run */
+    close(root.fd);
+    free(root.path);
+
+    root.fd = -1;
+    root.path = NULL;
+}
+
+cgroup *cgroup_create(const char *name)
+{
+    cgroup *cg;
+    int fd;
+
+    if (mkdirat(root.fd, name, 0755) != 0 && errno != EEXIST)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot create %s/%s: [%d] %s", root.path, name, errno, strerror(errno));
+
+        return NULL;
+    }
+
+    fd = openat(root.fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot open %s/%s: [%d] %s", root.path, name, errno, strerror(errno));
+
+        return NULL;
+    }
+
+    cg = sfmalloc(sizeof(cgroup));
+    cg->fd = fd;
+    cg->name = sfmalloc(strlen(name) + 1);
+    strcpy(cg->name, name);
+    cg->path = sfmalloc(strlen(root.path) + strlen(name) + 2);
+    sprintf(cg->path, "%s/%s", root.path, name);
+
+    return cg;
+}
+
+/* Removes an empty cgroup, one whose processes have not all exited is left
+   where it is */
+static void remove_cgroup(int dirfd, const char *name, const char *parent)
+{
+    if (unlinkat(dirfd, name, AT_REMOVEDIR) == 0)
+    {
+        return;
+    }
+
+    if (errno == EBUSY)
+    {
+        _syslog(LOG_WARNING, "cgroup: %s/%s still has processes, leaving it", parent, name);
+    }
+    else
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot remove %s/%s: [%d] %s", parent, name, errno, strerror(errno));
+    }
+}
+
+void cgroup_destroy(cgroup *cg)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+
+    if (cg == NULL)
+    {
+        return;
+    }
+
+    /* Children first, a cgroup with children cannot be removed */
+    fd = openat(cg->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir = fd == -1 ? NULL : fdopendir(fd);
+
+    if (dir != NULL)
+    {
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_type == DT_DIR && entry->d_name[0] != '.')
+            {
+                remove_cgroup(cg->fd, entry->d_name, cg->path);
+            }
+        }
+
+        closedir(dir);
+    }
+    else if (fd != -1)
+    {
+        close(fd);
+    }
+
+    close(cg->fd);
+
+    remove_cgroup(root.fd, cg->name, root.path);
+
+    free(cg->name);
+    free(cg->path);
+    free(cg);
+}
+
+const char *cgroup_path(cgroup *cg)
+{
+    return cg->path;
+}
+
+int cgroup_enable_controllers(cgroup *cg)
+{
+    int err;
+
+    if (controllers[0] == '\0')
+    {
+        return RV_OK;
+    }
+
+    err = write_file(cg->fd, NULL, "cgroup.subtree_control", controllers);
+
+    if (err != 0)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot enable controllers in %s: [%d] %s", cg->path, err, strerror(err));
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+int cgroup_add_child(cgroup *cg, const char *child)
+{
+    if (mkdirat(cg->fd, child, 0755) != 0 && errno != EEXIST)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot create %s/%s: [%d] %s", cg->path, child, errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+int cgroup_set(cgroup *cg, const char *child, const char *file, const char *value)
+{
+    int err = write_file(cg->fd, child, file, value);
+
+    if (err == ENOENT)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot set %s of %s%s%s, its controller is not enabled", file, cg->path, child != NULL ? "/" : "", child != NULL ? child : "");
+
+        return RV_FAIL;
+    }
+
+    if (err != 0)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot set %s of %s%s%s to %s: [%d] %s", file, cg->path, child != NULL ? "/" : "", child != NULL ? child : "", value, err, strerror(err));
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+int cgroup_set_io_max(cgroup *cg, const char *child, const char *value, int reset)
+{
+    char *copy = sfmalloc(strlen(value) + 1), *entry, *limits, *saved;
+    char line[CGROUP_NAME_SIZE];
+    char device[32];
+    struct stat st;
+    int rv = RV_OK;
+
+    strcpy(copy, value);
+
+    for (entry = strtok_r(copy, ",", &saved); entry != NULL; entry = strtok_r(NULL, ",", &saved))
+    {
+        entry += strspn(entry, " \t");
+        limits = entry + strcspn(entry, " \t");
+
+        if (*limits != '\0')
+        {
+            *limits++ = '\0';
+        }
+
+        /* Devices may be given by path rather than number */
+        if (entry[0] == '/')
+        {
+            if (stat(entry, &st) != 0 || !S_ISBLK(st.st_mode))
+            {
+                _syslog(LOG_WARNING, "cgroup: Cannot set io.max of %s, %s is not a block device", cg->path, entry);
+
+                rv = RV_FAIL;
+                continue;
+            }
+
+            snprintf(device, sizeof(device), "%u:%u", major(st.st_rdev), minor(st.st_rdev));
+            entry = device;
+        }
+
+        snprintf(line, sizeof(line), "%s %s", entry, reset ? "rbps=max wbps=max riops=max wiops=max" : limits);
+
+        if (cgroup_set(cg, child, "io.max", line) != RV_OK)
+        {
+            rv = RV_FAIL;
+        }
+    }
+
+    free(copy);
+
+    return rv;
+}
+
+int cgroup_open(cgroup *cg, const char *child)
+{
+    int fd = openat(cg->fd, child != NULL ? child : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot open %s%s%s: [%d] %s", cg->path, child != NULL ? "/" : "", child != NULL ? child : "", errno, strerror(errno));
+    }
+
+    return fd;
+}
+
+int cgroup_enter(int fd)
+{
+    /* "0" stands for the process writing it */
+    int procs = openat(fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    ssize_t written;
+
+    if (procs == -1)
+    {
+        return RV_FAIL;
+    }
+
+    written = write(procs, "0", 1);
+    close(procs);
+
+    return written == 1 ? RV_OK : RV_FAIL;
+}
+
+int cgroup_attach(int fd, pid_t pid)
+{
+    char value[16];
+    int err;
+
+    snprintf(value, sizeof(value), "%d", (int) pid);
+
+    err = write_file(fd, NULL, "cgroup.procs", value);
+
+    if (err != 0)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot move %d into its cgroup: [%d] %s", (int) pid, err, strerror(err));
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+int cgroup_kill(cgroup *cg, const char *child)
+{
+    int err;
+
+    if (!kill_supported)
+    {
+        return RV_FAIL;
+    }
+
+    err = write_file(cg->fd, child, "cgroup.kill", "1");
+
+    if (err == ENOENT)
+    {
+        _syslog(LOG_WARNING, "cgroup: cgroup.kill is not supported (Linux 5.14 and later), only the processes started are killed");
+
+        kill_supported = 0;
+    }
+    else if (err != 0)
+    {
+        _syslog(LOG_WARNING, "cgroup: Cannot kill %s%s%s: [%d] %s", cg->path, child != NULL ? "/" : "", child != NULL ? child : "", err, strerror(err));
+    }
+
+    return err == 0 ? RV_OK : RV_FAIL;
+}
+
+long long cgroup_oom_kills(cgroup *cg, const char *child)
+{
+    char events[512], *line;
+
+    if (read_file(cg->fd, child, "memory.events", events, sizeof(events)) != RV_OK)
+    {
+        return -1;
+    }
+
+    for (line = events; line != NULL; line = strchr(line, '\n'))
+    {
+        line += line[0] == '\n';
+
+        if (strncmp(line, "oom_kill ", 9) == 0)
+        {
+            return strtoll(line + 9, NULL, 10);
+        }
+    }
+
+    return -1;
+}
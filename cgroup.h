@@ -0,0 +1,118 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <sys/types.h>
+
+#define RV_FAIL -1
+#define RV_OK 0
+
+/* Root given to use the cgroup The Fat Controller was started in, e.g. one
+   delegated by systemd (Delegate=yes) */
+#define CGROUP_SELF "self"
+
+/* Where cgroup v2 is looked for, on its own or beside v1 (hybrid) */
+#define CGROUP_MOUNT "/sys/fs/cgroup"
+#define CGROUP_MOUNT_HYBRID "/sys/fs/cgroup/unified"
+
+/* Leaf the dispatcher moves itself to if it is in the root, as a cgroup with
+   children cannot have processes of its own once controllers are enabled */
+#define CGROUP_DISPATCHER_NAME "dispatcher"
+
+/* Period of cpu.max when it is given as a number of CPUs (us), the kernel's
+   default */
+#define CGROUP_CPU_PERIOD 100000
+
+/* Longest name of a cgroup (including the terminating null) */
+#define CGROUP_NAME_SIZE 256
+
+/*
+    cgroup v2 support.   The Fat Controller is given a root cgroup, which must
+    be delegated to the user it runs as, and creates a cgroup in it for each
+    pool (see cgroup_create()) with the cpu, memory and io controllers enabled
+    where they are available.   Children of a pool's cgroup may be used for
+    each of its jobs.
+
+    Nothing here is required for sub-processes to be run, so failures are
+    logged and left to the caller to carry on without.
+
+    Children are named relative to their cgroup, NULL naming the cgroup
+    itself.
+*/
+
+typedef struct cgroup cgroup;
+
+/* Finds cgroup v2 and the root (a path or CGROUP_SELF), moving the dispatcher
+   out of it if need be and enabling the controllers for the cgroups created
+   in it.   Returns RV_FAIL, having logged why, if cgroups cannot be used. */
+int cgroup_initialize(const char *root);
+
+void cgroup_deinitialize();
+
+/* Creates a cgroup in the root, or uses the one left by a previous run.
+   Returns NULL, having logged why, if it cannot be created. */
+cgroup *cgroup_create(const char *name);
+
+/* Removes a cgroup and its children (unless they still have processes) and
+   frees it */
+void cgroup_destroy(cgroup *cg);
+
+const char *cgroup_path(cgroup *cg);
+
+/* Enables the controllers of the root in a cgroup, for its children.   The
+   cgroup itself can then no longer have processes. */
+int cgroup_enable_controllers(cgroup *cg);
+
+/* Creates a child of a cgroup, using any left by a previous run */
+int cgroup_add_child(cgroup *cg, const char *child);
+
+/* Writes a value to a file of a cgroup or child, e.g. memory.max.   Returns
+   RV_FAIL, having logged why, if it cannot be written. */
+int cgroup_set(cgroup *cg, const char *child, const char *file, const char *value);
+
+/* Writes the limits for each device in value to io.max, e.g.
+   "8:0 rbps=1048576, /dev/sdb wiops=100", or removes them if reset is set */
+int cgroup_set_io_max(cgroup *cg, const char *child, const char *value, int reset);
+
+/* Opens a cgroup or child for processes to be moved into, see cgroup_enter().
+   Returns the descriptor (close-on-exec), or -1 having logged why. */
+int cgroup_open(cgroup *cg, const char *child);
+
+/* Moves the calling process into an open cgroup.   Only makes system calls,
+   so it may be called between fork() and exec. */
+int cgroup_enter(int fd);
+
+/* Moves a process into an open cgroup */
+int cgroup_attach(int fd, pid_t pid);
+
+/* Kills every process in a cgroup or child with SIGKILL.   Returns RV_FAIL if
+   they could not be killed (cgroup.kill needs Linux 5.14), the caller should
+   then signal the ones it knows of. */
+int cgroup_kill(cgroup *cg, const char *child);
+
+/* Returns the number of processes the OOM killer has killed in a cgroup or
+   child (oom_kill of memory.events), or -1 if the memory controller is not
+   enabled for it */
+long long cgroup_oom_kills(cgroup *cg, const char *child);
+
+#endif
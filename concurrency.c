@@ -0,0 +1,95 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "concurrency.h"
+
+static int clamp(concurrency_controller *cc, int limit)
+{
+    if (limit < 1)
+    {
+        return 1;
+    }
+
+    return limit > cc->max ? cc->max : limit;
+}
+
+static int increase_additive(concurrency_controller *cc)
+{
+    return cc->limit + 1;
+}
+
+static int increase_multiplicative(concurrency_controller *cc)
+{
+    return cc->limit * 2;
+}
+
+static int decrease_reset(concurrency_controller *cc)
+{
+    (void) cc;
+
+    return 1;
+}
+
+static int decrease_multiplicative(concurrency_controller *cc)
+{
+    return (int) (cc->limit * cc->decay);
+}
+
+void concurrency_initialize(concurrency_controller *cc, int type, int max, double decay)
+{
+    cc->limit = 1;
+    cc->max = max;
+    cc->decay = decay;
+
+    switch (type)
+    {
+        case CONCURRENCY_AIMD:
+            cc->increase = &increase_additive;
+            cc->decrease = &decrease_multiplicative;
+            break;
+
+        case CONCURRENCY_MULTIPLICATIVE:
+            cc->increase = &increase_multiplicative;
+            cc->decrease = &decrease_multiplicative;
+            break;
+
+        default:
+            cc->increase = &increase_additive;
+            cc->decrease = &decrease_reset;
+    }
+}
+
+void concurrency_more(concurrency_controller *cc)
+{
+    cc->limit = clamp(cc, (*cc->increase)(cc));
+}
+
+int concurrency_no_more(concurrency_controller *cc)
+{
+    cc->limit = clamp(cc, (*cc->decrease)(cc));
+
+    return cc->limit == 1;
+}
+
+void concurrency_failed(concurrency_controller *cc)
+{
+    cc->limit = 1;
+}
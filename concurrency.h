@@ -0,0 +1,76 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CONCURRENCY_H
+#define CONCURRENCY_H
+
+/* Concurrency controllers (dependent thread model) */
+#define CONCURRENCY_LINEAR 1
+#define CONCURRENCY_AIMD 2
+#define CONCURRENCY_MULTIPLICATIVE 3
+
+#define DEFAULT_CONCURRENCY_CONTROLLER CONCURRENCY_LINEAR
+#define DEFAULT_CONCURRENCY_DECAY 0.5
+
+/*
+    A concurrency controller decides how many slots the dependent thread model
+    may use at once, based on the outcome of each job:
+
+    - ok+more means there is more work, so the limit is raised
+    - ok means the work has run out, so the limit is lowered
+    - fail always drops the limit to one
+
+    The controllers differ in how far they move the limit:
+
+    CONCURRENCY_LINEAR          +1 on ok+more, back to 1 on ok (the original
+                                behaviour)
+    CONCURRENCY_AIMD            +1 on ok+more, multiplied by the decay on ok
+    CONCURRENCY_MULTIPLICATIVE  doubled on ok+more, multiplied by the decay on
+                                ok, so full concurrency is reached after a few
+                                jobs rather than one job per slot
+*/
+typedef struct concurrency_controller
+{
+    /* Number of slots which may be used, 1 to max */
+    int limit;
+
+    int max;
+
+    /* Factor applied to the limit when work runs out (0 to 1) */
+    double decay;
+
+    int (*increase)(struct concurrency_controller *cc);
+    int (*decrease)(struct concurrency_controller *cc);
+} concurrency_controller;
+
+void concurrency_initialize(concurrency_controller *cc, int type, int max, double decay);
+
+/* A job has finished with ok+more */
+void concurrency_more(concurrency_controller *cc);
+
+/* A job has finished with ok.   Returns 1 if the limit has dropped to one, in
+   which case the dispatcher should sleep before starting another job. */
+int concurrency_no_more(concurrency_controller *cc);
+
+/* A job has failed */
+void concurrency_failed(concurrency_controller *cc);
+
+#endif
@@ -0,0 +1,552 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "sfmemlib.h"
+#include "config.h"
+
+/*
+    The config loader only understands the syntax of config files (see
+    config.h), it is the callback which knows what the settings mean.   It
+    does not run a shell, so settings cannot be commands, e.g. $(hostname).
+*/
+
+/* A setting of the file being read, for expansion */
+typedef struct config_variable
+{
+    struct config_variable *next;
+    char *name;
+    char *value;
+} config_variable;
+
+/* File being read */
+typedef struct config_file
+{
+    const char *path;
+    int line;
+    config_variable *variables;
+    config_callback callback;
+    void *data;
+    FILE *error_stream;
+    int errors;
+} config_file;
+
+/* Value being built */
+typedef struct config_value
+{
+    char *data;
+    size_t length;
+    size_t size;
+} config_value;
+
+static void report(config_file *file, const char *format, ...)
+{
+    va_list va;
+
+    fprintf(file->error_stream, "%s:%d: ", file->path, file->line);
+
+    va_start(va, format);
+    vfprintf(file->error_stream, format, va);
+    va_end(va);
+
+    fprintf(file->error_stream, "\n");
+
+    file->errors++;
+}
+
+static void append(config_value *value, const char *text, size_t length)
+{
+    if (value->length + length + 1 > value->size)
+    {
+        value->size = (value->length + length + 1) * 2;
+        value->data = sfrealloc(value->data, value->size);
+    }
+
+    memcpy(value->data + value->length, text, length);
+    value->length += length;
+    value->data[value->length] = '\0';
+}
+
+static char *copy_string(const char *text)
+{
+    char *copy = sfmalloc(strlen(text) + 1);
+
+    strcpy(copy, text);
+
+    return copy;
+}
+
+static int is_name_start(char c)
+{
+    return isalpha((unsigned char) c) || c == '_';
+}
+
+static int is_name_char(char c)
+{
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+/* Returns the value of a setting earlier in the file or of an environment
+   variable, NULL if there is neither */
+static const char *lookup(config_file *file, const char *name)
+{
+    config_variable *variable;
+
+    for (variable = file->variables; variable != NULL; variable = variable->next)
+    {
+        if (strcmp(variable->name, name) == 0)
+        {
+            return variable->value;
+        }
+    }
+
+    return getenv(name);
+}
+
+static void set_variable(config_file *file, const char *name, const char *value)
+{
+    config_variable *variable;
+
+    for (variable = file->variables; variable != NULL; variable = variable->next)
+    {
+        if (strcmp(variable->name, name) == 0)
+        {
+            break;
+        }
+    }
+
+    if (variable == NULL)
+    {
+        variable = sfmalloc(sizeof(config_variable));
+        variable->name = copy_string(name);
+        variable->value = NULL;
+        variable->next = file->variables;
+        file->variables = variable;
+    }
+
+    free(variable->value);
+    variable->value = copy_string(value);
+}
+
+static void free_variables(config_file *file)
+{
+    config_variable *next;
+
+    while (file->variables != NULL)
+    {
+        next = file->variables->next;
+
+        free(file->variables->name);
+        free(file->variables->value);
+        free(file->variables);
+
+        file->variables = next;
+    }
+}
+
+/* Expands $NAME or ${NAME} at text (just after the $), returning the
+   character after it.   A $ not followed by a name is kept. */
+static const char *expand(config_file *file, const char *text, config_value *value)
+{
+    const char *start = text, *end, *expansion;
+    char name[256];
+    size_t length;
+
+    if (*text == '{')
+    {
+        start = text + 1;
+
+        for (end = start; is_name_char(*end); end++);
+
+        if (*end != '}' || end == start || !is_name_start(*start))
+        {
+            report(file, "Invalid ${NAME} expansion.");
+
+            return text + strlen(text);
+        }
+
+        text = end + 1;
+    }
+    else if (*text == '(')
+    {
+        report(file, "Commands cannot be used in config files.");
+
+        return text + strlen(text);
+    }
+    else
+    {
+        for (end = start; is_name_char(*end); end++);
+
+        if (end == start || !is_name_start(*start))
+        {
+            append(value, "$", 1);
+
+            return start;
+        }
+
+        text = end;
+    }
+
+    length = (size_t) (end - start);
+
+    if (length >= sizeof(name))
+    {
+        report(file, "Name too long in $ expansion.");
+
+        return text;
+    }
+
+    memcpy(name, start, length);
+    name[length] = '\0';
+
+    expansion = lookup(file, name);
+
+    if (expansion == NULL)
+    {
+        report(file, "%s is not set.", name);
+
+        return text;
+    }
+
+    append(value, expansion, strlen(expansion));
+
+    return text;
+}
+
+/* Parses the value of a setting (after the =), unquoting and expanding it.
+   Returns RV_FAIL if it is not valid. */
+static int parse_value(config_file *file, const char *text, config_value *value)
+{
+    int errors = file->errors;
+    char quote = 0;
+
+    append(value, "", 0);
+
+    while (*text != '\0')
+    {
+        if (quote == '\'')
+        {
+            if (*text == '\'')
+            {
+                quote = 0;
+            }
+            else
+            {
+                append(value, text, 1);
+            }
+
+            text++;
+        }
+        else if (*text == '$')
+        {
+            text = expand(file, text + 1, value);
+        }
+        else if (*text == '\\' && text[1] != '\0'
+              && (quote == 0 || strchr("\"\\$`", text[1]) != NULL))
+        {
+            append(value, text + 1, 1);
+            text += 2;
+        }
+        else if (quote == '"')
+        {
+            if (*text == '"')
+            {
+                quote = 0;
+            }
+            else
+            {
+                append(value, text, 1);
+            }
+
+            text++;
+        }
+        else if (*text == '"' || *text == '\'')
+        {
+            quote = *text++;
+        }
+        else if (isspace((unsigned char) *text))
+        {
+            /* End of the value, only a comment may follow */
+            while (isspace((unsigned char) *text))
+            {
+                text++;
+            }
+
+            if (*text != '\0' && *text != '#')
+            {
+                report(file, "Unexpected text after value (quote values with spaces).");
+            }
+
+            break;
+        }
+        else if (*text == '`' || *text == ';' || *text == '|' || *text == '&')
+        {
+            report(file, "Commands cannot be used in config files.");
+
+            break;
+        }
+        else
+        {
+            append(value, text, 1);
+            text++;
+        }
+    }
+
+    if (quote != 0)
+    {
+        report(file, "Missing closing %c.", quote);
+    }
+
+    return file->errors == errors ? RV_OK : RV_FAIL;
+}
+
+/* Parses "[pool NAME]", line being just after the [ */
+static void parse_section(config_file *file, char *line)
+{
+    char *end, *name;
+
+    end = strchr(line, ']');
+
+    if (end == NULL || end[1 + strspn(end + 1, " \t")] != '\0')
+    {
+        report(file, "Expected [pool NAME].");
+
+        return;
+    }
+
+    *end = '\0';
+
+    if (strncmp(line, "pool", 4) != 0 || (line[4] != '\0' && !isspace((unsigned char) line[4])))
+    {
+        report(file, "Unrecognised section: [%s]", line);
+
+        return;
+    }
+
+    name = line + 4 + strspn(line + 4, " \t");
+    name[strcspn(name, " \t")] = '\0';
+
+    if (*name == '\0')
+    {
+        report(file, "Missing pool name.");
+
+        return;
+    }
+
+    if (file->callback(file->path, file->line, NULL, name, file->data) != RV_OK)
+    {
+        file->errors++;
+    }
+}
+
+static void parse_line(config_file *file, char *line)
+{
+    config_value value = {NULL, 0, 0};
+    char *name;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    line += strspn(line, " \t");
+
+    if (*line == '\0' || *line == '#')
+    {
+        return;
+    }
+
+    if (*line == '[')
+    {
+        parse_section(file, line + 1);
+
+        return;
+    }
+
+    /* Allow files written to be sourced and exported by a shell */
+    if (strncmp(line, "export ", 7) == 0)
+    {
+        line += 7 + strspn(line + 7, " \t");
+    }
+
+    name = line;
+
+    if (!is_name_start(*line))
+    {
+        report(file, "Expected NAME=value.");
+
+        return;
+    }
+
+    while (is_name_char(*line))
+    {
+        line++;
+    }
+
+    if (*line != '=')
+    {
+        report(file, "Expected NAME=value.");
+
+        return;
+    }
+
+    *line++ = '\0';
+
+    if (parse_value(file, line, &value) == RV_OK)
+    {
+        set_variable(file, name, value.data);
+
+        if (value.length > 0
+         && file->callback(file->path, file->line, name, value.data, file->data) != RV_OK)
+        {
+            file->errors++;
+        }
+    }
+
+    free(value.data);
+}
+
+/* Reads one file, starting a pool called pool_name first unless it is NULL.
+   Returns the number of errors. */
+static int load_file(const char *path, const char *pool_name, config_callback callback, void *data, FILE *error_stream)
+{
+    config_file file;
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+
+    file.path = path;
+    file.line = 0;
+    file.variables = NULL;
+    file.callback = callback;
+    file.data = data;
+    file.error_stream = error_stream;
+    file.errors = 0;
+
+    fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        fprintf(error_stream, "Cannot open config file %s: %s\n", path, strerror(errno));
+
+        return 1;
+    }
+
+    if (pool_name != NULL)
+    {
+        line = copy_string(pool_name);
+
+        if (callback(path, 0, NULL, line, data) != RV_OK)
+        {
+            file.errors++;
+        }
+
+        free(line);
+        line = NULL;
+    }
+
+    while (getline(&line, &size, fp) != -1)
+    {
+        file.line++;
+
+        parse_line(&file, line);
+    }
+
+    if (ferror(fp))
+    {
+        fprintf(error_stream, "Cannot read config file %s: %s\n", path, strerror(errno));
+
+        file.errors++;
+    }
+
+    free(line);
+    free_variables(&file);
+    fclose(fp);
+
+    return file.errors;
+}
+
+static int is_config_file(const struct dirent *entry)
+{
+    size_t length = strlen(entry->d_name), suffix = strlen(CONFIG_FILE_SUFFIX);
+
+    return entry->d_name[0] != '.' && length > suffix
+        && strcmp(entry->d_name + length - suffix, CONFIG_FILE_SUFFIX) == 0;
+}
+
+int config_load(const char *path, config_callback callback, void *data, FILE *error_stream)
+{
+    struct dirent **entries;
+    struct stat st;
+    char *file_path;
+    int i, count, errors = 0;
+
+    if (stat(path, &st) != 0)
+    {
+        fprintf(error_stream, "Cannot open config file %s: %s\n", path, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        return load_file(path, NULL, callback, data, error_stream) == 0 ? RV_OK : RV_FAIL;
+    }
+
+    count = scandir(path, &entries, is_config_file, alphasort);
+
+    if (count == -1)
+    {
+        fprintf(error_stream, "Cannot read config directory %s: %s\n", path, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    if (count == 0)
+    {
+        fprintf(error_stream, "No config files (*%s) in %s\n", CONFIG_FILE_SUFFIX, path);
+
+        errors++;
+    }
+
+    for (i=0; i<count; i++)
+    {
+        file_path = sfmalloc(strlen(path) + strlen(entries[i]->d_name) + 2);
+        sprintf(file_path, "%s/%s", path, entries[i]->d_name);
+
+        /* The pool is named after the file */
+        entries[i]->d_name[strlen(entries[i]->d_name) - strlen(CONFIG_FILE_SUFFIX)] = '\0';
+
+        errors += load_file(file_path, entries[i]->d_name, callback, data, error_stream);
+
+        free(file_path);
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    return errors == 0 ? RV_OK : RV_FAIL;
+}
@@ -0,0 +1,62 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+
+#define RV_FAIL -1
+#define RV_OK 0
+
+/* Files read from a config directory end with this */
+#define CONFIG_FILE_SUFFIX ".fat"
+
+/*
+    Config files are written as shell variable assignments, as in
+    scripts/service.fat.example, so existing files can be read as they are:
+
+        # A comment
+        NAME=value
+        NAME="a value with spaces and ${OTHER}"
+        NAME='a value without expansion'
+
+    $NAME and ${NAME} are replaced by the value of a setting earlier in the
+    same file, or else of an environment variable.   Empty settings are
+    ignored, as if not set.   "[pool NAME]" starts the settings of a pool.
+
+    When a directory is given, each file in it ending in CONFIG_FILE_SUFFIX is
+    read in name order.   Each file starts a pool named after it (without the
+    suffix), as if it began with "[pool NAME]".
+*/
+
+/* Called for each setting with the file and line it was found on.   key is
+   NULL at the start of a pool, value then being the name of the pool.   value
+   may be changed.   Returns RV_OK, or RV_FAIL having reported the error. */
+typedef int (*config_callback)(const char *file, int line, const char *key, char *value, void *data);
+
+/* Reads a config file, or each config file in a directory, calling callback
+   for each setting.   Errors are written to error_stream (e.g. stderr) and
+   reading carries on so that every error is reported.   Returns RV_OK if
+   there were no errors, including from callback. */
+int config_load(const char *path, config_callback callback, void *data, FILE *error_stream);
+
+#endif
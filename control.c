@@ -0,0 +1,479 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "extern.h"
+#include "eventloop.h"
+#include "sfmemlib.h"
+#include "control.h"
+
+/*
+    Connections to the control socket are handled by the dispatcher itself,
+    from the event loop, so that commands can look at and change slots and
+    pools without any locking.   Nothing blocks: commands are read as they
+    arrive and replies are kept until the client can take them.   While a
+    reply is being sent no more commands are read from that client.
+*/
+
+struct control_client
+{
+    /* -1 if the entry is not in use */
+    int fd;
+
+    /* Incomplete command */
+    char input[CONTROL_LINE_SIZE];
+    size_t input_length;
+
+    /* Replies not yet sent */
+    char *output;
+    size_t output_length;
+    size_t output_size;
+    size_t output_sent;
+
+    /* Set while waiting for the socket to become writable */
+    int writing;
+
+    /* Set once the client has finished sending, the connection is closed
+       once the replies have been sent */
+    int closing;
+};
+
+static int listen_fd = -1;
+static char *socket_path = NULL;
+static control_handler handler = NULL;
+static control_client clients[CONTROL_MAX_CLIENTS];
+
+/* Makes room for length more bytes of replies */
+static void reserve(control_client *client, size_t length)
+{
+    if (client->output_length + length > client->output_size)
+    {
+        client->output_size = (client->output_length + length) * 2;
+        client->output = sfrealloc(client->output, client->output_size);
+    }
+}
+
+static void append(control_client *client, const char *text, size_t length)
+{
+    reserve(client, length);
+
+    memcpy(client->output + client->output_length, text, length);
+    client->output_length += length;
+}
+
+/* Appends a formatted line */
+static void append_line(control_client *client, const char *prefix, const char *format, va_list va)
+{
+    va_list copy;
+    int length;
+
+    append(client, prefix, strlen(prefix));
+
+    va_copy(copy, va);
+    length = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+
+    if (length > 0)
+    {
+        /* With room for the terminating null, which is not kept */
+        reserve(client, (size_t) length + 1);
+
+        vsnprintf(client->output + client->output_length, (size_t) length + 1, format, va);
+        client->output_length += (size_t) length;
+    }
+
+    append(client, "\n", 1);
+}
+
+static void close_client(control_client *client)
+{
+    /* Closing also removes it from the event loop */
+    if (close(client->fd) != 0)
+    {
+        _syslog(LOG_WARNING, "control: cannot close connection: [%d] %s", errno, strerror(errno));
+    }
+
+    free(client->output);
+
+    client->fd = -1;
+    client->output = NULL;
+}
+
+/* Changes the events the connection is watched for */
+static int watch(control_client *client, uint32_t events)
+{
+    if (eventloop_remove(client->fd) != RV_OK
+     || eventloop_add(client->fd, EVENTLOOP_SOURCE_CONTROL, (int) (client - clients), events) != RV_OK)
+    {
+        close_client(client);
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+/* Sends as much of the replies as the socket will take, closing the
+   connection once they have all been sent if the client has finished */
+static void flush(control_client *client)
+{
+    ssize_t sent;
+
+    while (client->output_sent < client->output_length)
+    {
+        sent = send(client->fd, client->output + client->output_sent,
+                    client->output_length - client->output_sent, MSG_NOSIGNAL);
+
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (client->writing == 0 && watch(client, EPOLLOUT) == RV_OK)
+                {
+                    client->writing = 1;
+                }
+
+                return;
+            }
+
+            /* Gone without waiting for the reply */
+            close_client(client);
+
+            return;
+        }
+
+        client->output_sent += (size_t) sent;
+    }
+
+    client->output_length = 0;
+    client->output_sent = 0;
+
+    if (client->closing)
+    {
+        close_client(client);
+    }
+    else if (client->writing)
+    {
+        if (watch(client, EPOLLIN) == RV_OK)
+        {
+            client->writing = 0;
+        }
+    }
+}
+
+/* Splits a command into words and passes it to the handler */
+static void run_command(control_client *client, char *line)
+{
+    char *argv[CONTROL_MAX_ARGS + 1], *word, *saved;
+    int argc = 0;
+
+    for (word = strtok_r(line, " \t\r", &saved); word != NULL; word = strtok_r(NULL, " \t\r", &saved))
+    {
+        if (argc == CONTROL_MAX_ARGS)
+        {
+            control_error(client, "Too many arguments");
+
+            return;
+        }
+
+        argv[argc++] = word;
+    }
+
+    /* Blank lines are ignored */
+    if (argc == 0)
+    {
+        return;
+    }
+
+    argv[argc] = NULL;
+
+    handler(client, argc, argv);
+}
+
+/* Runs each complete command read so far */
+static void run_commands(control_client *client)
+{
+    char *line = client->input, *newline;
+    size_t remaining = client->input_length;
+
+    while ((newline = memchr(line, '\n', remaining)) != NULL)
+    {
+        *newline = '\0';
+
+        run_command(client, line);
+
+        remaining -= (size_t) (newline + 1 - line);
+        line = newline + 1;
+    }
+
+    if (remaining == sizeof(client->input))
+    {
+        control_error(client, "Command longer than %d bytes", CONTROL_LINE_SIZE - 1);
+
+        client->closing = 1;
+        remaining = 0;
+    }
+
+    memmove(client->input, line, remaining);
+    client->input_length = remaining;
+}
+
+/* Reads commands and runs them, then sends the replies.   Only one read is
+   done for each event, so that no more commands are read while replies are
+   waiting to be sent. */
+static void read_commands(control_client *client)
+{
+    ssize_t bytes_read;
+
+    do
+    {
+        bytes_read = read(client->fd, client->input + client->input_length,
+                          sizeof(client->input) - client->input_length);
+    } while (bytes_read == -1 && errno == EINTR);
+
+    if (bytes_read == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            close_client(client);
+
+            return;
+        }
+    }
+    else if (bytes_read == 0)
+    {
+        /* A last command without a newline is still run */
+        if (client->input_length > 0)
+        {
+            client->input[client->input_length++] = '\n';
+            run_commands(client);
+        }
+
+        client->closing = 1;
+    }
+    else
+    {
+        client->input_length += (size_t) bytes_read;
+
+        run_commands(client);
+    }
+
+    flush(client);
+}
+
+static void accept_clients()
+{
+    control_client *client = NULL;
+    int fd, i;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        for (i=0; i<CONTROL_MAX_CLIENTS; i++)
+        {
+            if (clients[i].fd == -1)
+            {
+                client = &clients[i];
+                break;
+            }
+        }
+
+        if (i == CONTROL_MAX_CLIENTS)
+        {
+            _syslog(LOG_WARNING, "control: refusing connection, %d already open", CONTROL_MAX_CLIENTS);
+
+            close(fd);
+            continue;
+        }
+
+        memset(client, 0, sizeof(control_client));
+        client->fd = fd;
+
+        if (eventloop_add(fd, EVENTLOOP_SOURCE_CONTROL, i, EPOLLIN) != RV_OK)
+        {
+            close_client(client);
+        }
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+    {
+        _syslog(LOG_ERR, "control: cannot accept connection: [%d] %s", errno, strerror(errno));
+    }
+}
+
+int control_initialize(const char *path, control_handler command_handler)
+{
+    struct sockaddr_un address;
+    struct stat st;
+    int i;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        _syslog(LOG_CRIT, "control: socket path too long: %s", path);
+
+        return RV_FAIL;
+    }
+
+    /* Remove a socket left behind by a previous run */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    /* Anyone connecting can stop jobs, so only the owner may.   On Linux the
+       mode of the socket is given to the file created by bind(), so there is
+       no moment at which others could connect. */
+    if (listen_fd == -1
+     || fchmod(listen_fd, S_IRUSR | S_IWUSR) != 0
+     || bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0
+     || chmod(path, S_IRUSR | S_IWUSR) != 0
+     || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        _syslog(LOG_CRIT, "control: cannot create socket %s: [%d] %s", path, errno, strerror(errno));
+
+        if (listen_fd != -1)
+        {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+
+        return RV_FAIL;
+    }
+
+    for (i=0; i<CONTROL_MAX_CLIENTS; i++)
+    {
+        clients[i].fd = -1;
+    }
+
+    socket_path = sfmalloc(strlen(path) + 1);
+    strcpy(socket_path, path);
+    handler = command_handler;
+
+    if (eventloop_add(listen_fd, EVENTLOOP_SOURCE_CONTROL, CONTROL_LISTENER_ID, EPOLLIN) != RV_OK)
+    {
+        control_deinitialize();
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+void control_deinitialize()
+{
+    int i;
+
+    if (listen_fd == -1)
+    {
+        return;
+    }
+
+    for (i=0; i<CONTROL_MAX_CLIENTS; i++)
+    {
+        if (clients[i].fd != -1)
+        {
+            close_client(&clients[i]);
+        }
+    }
+
+    close(listen_fd);
+    listen_fd = -1;
+
+    unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+}
+
+void control_event(int id, uint32_t events)
+{
+    control_client *client;
+
+    (void) events;
+
+    if (id == CONTROL_LISTENER_ID)
+    {
+        accept_clients();
+
+        return;
+    }
+
+    client = &clients[id];
+
+    /* Closed earlier in the same wait */
+    if (client->fd == -1)
+    {
+        return;
+    }
+
+    if (client->writing)
+    {
+        flush(client);
+    }
+    else
+    {
+        read_commands(client);
+    }
+}
+
+void control_reply(control_client *client, const char *format, ...)
+{
+    va_list va;
+
+    va_start(va, format);
+    append_line(client, "", format, va);
+    va_end(va);
+}
+
+void control_ok(control_client *client)
+{
+    append(client, "ok\n", 3);
+}
+
+void control_error(control_client *client, const char *format, ...)
+{
+    va_list va;
+
+    va_start(va, format);
+    append_line(client, "error: ", format, va);
+    va_end(va);
+}
@@ -0,0 +1,82 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+
+#define RV_FAIL -1
+#define RV_OK 0
+
+/* Connections open at once, others are refused */
+#define CONTROL_MAX_CLIENTS 16
+
+/* Longest command (including the newline) and most words in one */
+#define CONTROL_LINE_SIZE 1024
+#define CONTROL_MAX_ARGS 8
+
+/* Event loop id of the listening socket, clients are numbered below it */
+#define CONTROL_LISTENER_ID CONTROL_MAX_CLIENTS
+
+/*
+    The control socket is a Unix domain stream socket on which commands are
+    read, one per line, e.g. with
+
+        echo status | socat - UNIX-CONNECT:/run/fatcontroller.sock
+
+    Each command is split into words on spaces and tabs.   The reply is any
+    number of lines followed by a line which is either "ok" or starts with
+    "error: ".   Several commands may be sent on one connection, their replies
+    being sent in order.
+
+    The socket only deals with connections, what the commands do is up to the
+    handler (see control_command() in jobdispatching.c).   Everything is done
+    from the event loop (EVENTLOOP_SOURCE_CONTROL) without blocking.
+*/
+
+typedef struct control_client control_client;
+
+/* Called for each command, argv[0] being the command itself.   The reply is
+   written with control_reply(), ending with control_ok() or
+   control_error(). */
+typedef void (*control_handler)(control_client *client, int argc, char **argv);
+
+/* Creates the socket (replacing a socket left behind by a previous run),
+   readable and writable by its owner only, and watches it with the event
+   loop.   Returns RV_FAIL, having logged why, if it could not be created. */
+int control_initialize(const char *path, control_handler handler);
+
+/* Closes every connection and the socket, removing it */
+void control_deinitialize();
+
+/* Accepts connections, or reads commands and sends replies, called when the
+   event loop reports a control socket event */
+void control_event(int id, uint32_t events);
+
+/* Adds a line to the reply to a command */
+void control_reply(control_client *client, const char *format, ...);
+
+/* Ends the reply to a command */
+void control_ok(control_client *client);
+void control_error(control_client *client, const char *format, ...);
+
+#endif
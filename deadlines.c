@@ -0,0 +1,192 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include "sfmemlib.h"
+#include "deadlines.h"
+
+/* Slot ids ordered as a heap on their deadline */
+static int *heap = NULL;
+static int heap_length = 0;
+
+/* Per slot: its deadline and its position in the heap (-1 if none) */
+static eventloop_time *deadline_of = NULL;
+static int *position_of = NULL;
+
+/* Number of slots */
+static int capacity = 0;
+
+static void place(int index, int id)
+{
+    heap[index] = id;
+    position_of[id] = index;
+}
+
+static void sift_up(int index)
+{
+    int id = heap[index], parent;
+
+    while (index > 0)
+    {
+        parent = (index - 1) / 2;
+
+        if (deadline_of[heap[parent]] <= deadline_of[id])
+        {
+            break;
+        }
+
+        place(index, heap[parent]);
+        index = parent;
+    }
+
+    place(index, id);
+}
+
+static void sift_down(int index)
+{
+    int id = heap[index], child;
+
+    while ((child = 2 * index + 1) < heap_length)
+    {
+        if (child + 1 < heap_length && deadline_of[heap[child + 1]] < deadline_of[heap[child]])
+        {
+            child++;
+        }
+
+        if (deadline_of[id] <= deadline_of[heap[child]])
+        {
+            break;
+        }
+
+        place(index, heap[child]);
+        index = child;
+    }
+
+    place(index, id);
+}
+
+static void remove_at(int index)
+{
+    int id = heap[index];
+
+    position_of[id] = -1;
+    heap_length--;
+
+    if (index < heap_length)
+    {
+        place(index, heap[heap_length]);
+        sift_down(index);
+        sift_up(position_of[heap[index]]);
+    }
+}
+
+int deadlines_initialize(int size)
+{
+    heap_length = 0;
+    capacity = 0;
+
+    deadlines_resize(size);
+
+    return RV_OK;
+}
+
+void deadlines_resize(int size)
+{
+    int i;
+
+    if (size <= capacity)
+    {
+        return;
+    }
+
+    heap = sfrealloc(heap, size * sizeof(int));
+    deadline_of = sfrealloc(deadline_of, size * sizeof(eventloop_time));
+    position_of = sfrealloc(position_of, size * sizeof(int));
+
+    for (i=capacity; i<size; i++)
+    {
+        deadline_of[i] = 0;
+        position_of[i] = -1;
+    }
+
+    capacity = size;
+}
+
+void deadlines_deinitialize()
+{
+    free(heap);
+    free(deadline_of);
+    free(position_of);
+
+    heap = NULL;
+    deadline_of = NULL;
+    position_of = NULL;
+    heap_length = 0;
+    capacity = 0;
+}
+
+void deadlines_set(int id, eventloop_time deadline)
+{
+    eventloop_time previous;
+
+    previous = deadline_of[id];
+    deadline_of[id] = deadline;
+
+    if (position_of[id] == -1)
+    {
+        if (deadline != 0)
+        {
+            place(heap_length++, id);
+            sift_up(heap_length - 1);
+        }
+    }
+    else if (deadline == 0)
+    {
+        remove_at(position_of[id]);
+    }
+    else if (deadline < previous)
+    {
+        sift_up(position_of[id]);
+    }
+    else
+    {
+        sift_down(position_of[id]);
+    }
+}
+
+eventloop_time deadlines_next()
+{
+    return heap_length > 0 ? deadline_of[heap[0]] : 0;
+}
+
+int deadlines_pop_expired(eventloop_time now)
+{
+    int id = -1;
+
+    if (heap_length > 0 && deadline_of[heap[0]] <= now)
+    {
+        id = heap[0];
+        deadline_of[id] = 0;
+        remove_at(0);
+    }
+
+    return id;
+}
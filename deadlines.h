@@ -0,0 +1,55 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DEADLINES_H
+#define DEADLINES_H
+
+#include "eventloop.h"
+
+/*
+    The deadline queue holds the next time something has to be done for each
+    slot (wake it up, warn that it has run too long, send SIGTERM or SIGKILL),
+    so that the dispatcher only needs to look at slots whose deadline has
+    passed rather than checking every slot on every scan.
+
+    It is a binary min-heap with one entry per slot.   It is only used by the
+    dispatcher thread, so there is no locking.
+*/
+
+int deadlines_initialize(int size);
+
+/* Makes room for slot ids up to size - 1, keeping existing deadlines */
+void deadlines_resize(int size);
+
+void deadlines_deinitialize();
+
+/* Sets the deadline of a slot, replacing any previous one.   A deadline of 0
+   removes it. */
+void deadlines_set(int id, eventloop_time deadline);
+
+/* Earliest deadline, 0 if there are none */
+eventloop_time deadlines_next();
+
+/* Removes and returns the id of a slot whose deadline is at or before now,
+   or -1 if there are none */
+int deadlines_pop_expired(eventloop_time now);
+
+#endif
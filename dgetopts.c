@@ -21,13 +21,16 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
 #include "fatcontroller.h"
 #include "daemonise.h"
 #include "jobdispatching.h"
+#include "jobqueue.h"
 #include "dgetopts.h"
+#include "config.h"
 #include "sfmemlib.h"
 
     static int flag_help;
@@ -35,9 +38,102 @@
     static int flag_debug;
     static int flag_itm;
     static int flag_ftm;
+    static int flag_ptm;
     static int flag_ati;
     static int flag_run_once;
     static int flag_test_fire;
+    static int flag_direct_reaping;
+    static int flag_posix_spawn;
+    static int flag_log_splice;
+    static int flag_log_lines;
+    static int flag_log_line_prefix;
+    static int flag_cgroup_per_job;
+    static int flag_pin_threads;
+    
+    /* Where errors in the options are written, see reprocessOptions() */
+    static FILE *error_stream;
+    
+    /* Options being parsed, from the command line or config files */
+    struct option_state
+    {
+        struct daemon_settings *dm_settings;
+        struct dispatching_settings *dp_settings;
+        
+        /* Pool the options apply to */
+        struct dispatching_settings *pool;
+        
+        /* Whether -i, -w, -l, -p and -c have been given (for the pool), and
+           the number of queue sources given for the pool */
+        int fi, fw, fl, fp, fc, fq;
+    };
+    
+    static const struct option long_options[] =
+    {
+        {"pid-file",               required_argument, 0,               'i'},
+        {"working-directory",      required_argument, 0,               'w'},
+        {"log-file",               required_argument, 0,               'l'},
+        {"log-format",             required_argument, 0,               'f'},
+        {"sleep",                  required_argument, 0,               's'},
+        {"sleep-on-error",         required_argument, 0,               'e'},
+        {"path",                   required_argument, 0,               'p'},
+        {"help",                   no_argument,       &flag_help,      1},
+        {"threads",                required_argument, 0,               't'},
+        {"daemon-name",            required_argument, 0,               'n'},
+        {"debug",                  no_argument,       &flag_debug,     1},
+        {"daemonise",              no_argument,       &flag_daemonise, 1},
+        {"command",                required_argument, 0,               'c'},
+        {"arguments",              required_argument, 0,               'a'},
+        {"independent-threads",    no_argument,       &flag_itm,       1},
+        {"fixed-interval-threads", no_argument,       &flag_ftm,       1},
+        {"persistent-threads",     no_argument,       &flag_ptm,       1},
+        {"proc-run-time-warn",     required_argument, 0,               256},
+        {"proc-run-time-max",      required_argument, 0,               257},
+        {"proc-term-timeout",      required_argument, 0,               258},
+        {"fixed-interval-wait",    required_argument, 0,               259},
+        {"err-log-file",           required_argument, 0,               260},
+        {"max-jobs-per-child",     required_argument, 0,               261},
+        {"queue-fifo",             required_argument, 0,               262},
+        {"queue-spool",            required_argument, 0,               263},
+        {"queue-socket",           required_argument, 0,               264},
+        {"queue-delivery",         required_argument, 0,               265},
+        {"queue-batch",            required_argument, 0,               266},
+        {"concurrency",            required_argument, 0,               267},
+        {"concurrency-decay",      required_argument, 0,               268},
+        {"pool",                   required_argument, 0,               269},
+        {"max-processes",          required_argument, 0,               270},
+        {"config",                 required_argument, 0,               271},
+        {"control-socket",         required_argument, 0,               272},
+        {"metrics-file",           required_argument, 0,               273},
+        {"metrics-interval",       required_argument, 0,               274},
+        {"cgroup",                 required_argument, 0,               275},
+        {"cgroup-cpu-max",         required_argument, 0,               276},
+        {"cgroup-memory-max",      required_argument, 0,               277},
+        {"cgroup-io-max",          required_argument, 0,               278},
+        {"cpus",                   required_argument, 0,               279},
+        {"numa-nodes",             required_argument, 0,               280},
+        {"nice",                   required_argument, 0,               281},
+        {"ionice",                 required_argument, 0,               282},
+        {"scheduler",              required_argument, 0,               283},
+        {"dispatcher-cpus",        required_argument, 0,               284},
+        {"sleep-backoff",          required_argument, 0,               285},
+        {"sleep-max",              required_argument, 0,               286},
+        {"sleep-on-error-backoff", required_argument, 0,               287},
+        {"sleep-on-error-max",     required_argument, 0,               288},
+        {"breaker-threshold",      required_argument, 0,               289},
+        {"breaker-window",         required_argument, 0,               290},
+        {"breaker-open-time",      required_argument, 0,               291},
+        {"append-thread-id",       no_argument,       &flag_ati,         1},
+        {"run-once",               no_argument,       &flag_run_once,    1},
+        {"test-fire",              no_argument,       &flag_test_fire,   1},
+        {"direct-reaping",         no_argument,       &flag_direct_reaping, 1},
+        {"posix-spawn",            no_argument,       &flag_posix_spawn, 1},
+        {"log-splice",             no_argument,       &flag_log_splice,  1},
+        {"log-lines",              no_argument,       &flag_log_lines,   1},
+        {"log-line-prefix",        no_argument,       &flag_log_line_prefix, 1},
+        {"cgroup-per-job",         no_argument,       &flag_cgroup_per_job, 1},
+        {"pin-threads",            no_argument,       &flag_pin_threads, 1},
+        {0, 0, 0, 0}
+    };
 
     static void showhelp()
     {
@@ -56,24 +152,109 @@
         printf("    -i, --pid-file               File in which to store process ID\n");
         printf("\n");
         printf("Optional arguments:\n");
+        printf("        --pool                   Starts a new pool with this name, the options\n");
+        printf("                                 after it (up to the next --pool) apply to the\n");
+        printf("                                 pool and -c and -l are required for each pool\n");
+        printf("        --max-processes          Processes running at once in all pools\n");
+        printf("                                 (default: 0, unlimited)\n");
+        printf("        --config                 Reads settings from a config file, or each\n");
+        printf("                                 *%s file in a directory (one pool each)\n", CONFIG_FILE_SUFFIX);
+        printf("        --control-socket         Unix domain socket on which the running\n");
+        printf("                                 threads can be inspected and changed\n");
+        printf("        --metrics-file           File to which metrics are written in the\n");
+        printf("                                 Prometheus text format\n");
+        printf("        --metrics-interval       Time between writes of the metrics file\n");
+        printf("                                 (default: 15)\n");
+        printf("        --cgroup                 Delegated cgroup v2 directory in which each\n");
+        printf("                                 pool is given a cgroup, or \"%s\" for the\n", CGROUP_SELF);
+        printf("                                 one The Fat Controller was started in\n");
+        printf("        --cgroup-cpu-max         CPUs the pool's processes may use, e.g. 1.5,\n");
+        printf("                                 or as cpu.max, e.g. \"50000 100000\"\n");
+        printf("        --cgroup-memory-max      Memory the pool's processes may use, e.g. 512M\n");
+        printf("        --cgroup-io-max          I/O limits as io.max for each device, e.g.\n");
+        printf("                                 \"/dev/sda wbps=1048576, 8:16 riops=100\"\n");
+        printf("        --cgroup-per-job         Gives each job a cgroup within the pool's, the\n");
+        printf("                                 limits then applying to each job\n");
+        printf("        --cpus                   CPUs the pool's processes run on, e.g. 0-3,8\n");
+        printf("        --pin-threads            Pins the process of thread i to the ith of\n");
+        printf("                                 the CPUs, in turn\n");
+        printf("        --numa-nodes             NUMA nodes the pool's processes allocate\n");
+        printf("                                 memory from and run on, e.g. 1 (not with\n");
+        printf("                                 --posix-spawn)\n");
+        printf("        --nice                   Nice level of the pool's processes\n");
+        printf("        --ionice                 I/O class of the pool's processes: idle,\n");
+        printf("                                 best-effort[:0-7] or realtime[:0-7]\n");
+        printf("        --scheduler              Scheduling policy of the pool's processes:\n");
+        printf("                                 other, batch or idle\n");
+        printf("        --dispatcher-cpus        CPUs The Fat Controller itself runs on, the\n");
+        printf("                                 processes of pools without --cpus run on the\n");
+        printf("                                 ones it was started with\n");
         printf("    -f, --log-format             A printf style format string for use as log format.\n");
         printf("    -n, --daemon-name            Name of the daemon (primarily for syslog).\n");
         printf("        --daemonise              Specifies to run as a daemon.\n");
         printf("        --debug                  Debug mode - prints lots of info to syslog.\n");
-        printf("    -s, --sleep                  Sleep time(s) between processes (default: 30)\n");
-        printf("    -e, --sleep-on-error         Sleep time (s) on error (default: 300)\n");
+        printf("    -s, --sleep                  Sleep time between processes (default: 30)\n");
+        printf("    -e, --sleep-on-error         Sleep time on error (default: 300)\n");
+        printf("                                 Times may be fractional or have a unit, e.g.\n");
+        printf("                                 0.1, 100ms, 1.5s, 5m or 1h\n");
+        printf("        --sleep-backoff          How the sleep grows while there is no more\n");
+        printf("                                 work: fixed, exponential (doubled each time)\n");
+        printf("                                 or decorrelated (random, up to three times\n");
+        printf("                                 the last) (default: fixed)\n");
+        printf("        --sleep-max              Longest sleep with a backoff (default: 1h)\n");
+        printf("        --sleep-on-error-backoff How the sleep on error grows while jobs keep\n");
+        printf("                                 failing, as --sleep-backoff\n");
+        printf("        --sleep-on-error-max     Longest sleep on error with a backoff\n");
+        printf("                                 (default: 1h)\n");
+        printf("        --breaker-threshold      Share of failed jobs (0 to 1) in the window\n");
+        printf("                                 at which no more jobs are started for a\n");
+        printf("                                 while (default: 0, never)\n");
+        printf("        --breaker-window         Last jobs the share is taken over (default:\n");
+        printf("                                 %d)\n", DEFAULT_BREAKER_WINDOW);
+        printf("        --breaker-open-time      Time before one job is tried again (default:\n");
+        printf("                                 30)\n");
         printf("    -t, --threads                Number of threads (default: 1)\n");
         printf("    -a, --arguments              Command arguments, e.g. \"-f hello.php\"\n");
         printf("        --independent-threads    Specifies independent thread model\n");
         printf("        --fixed-interval-threads Specifies fixed-interval thread model\n");
-        printf("        --proc-run-time-warn     Warn if child process runs longer than (s)\n");
-        printf("        --proc-run-time-max      Maximum child process run time (s)\n");
-        printf("        --proc-term-timeout      Maximum wait for process termination (s)\n");
-        printf("        --fixed-interval-wait    Maximum wait for free thread in FI mode (s)\n");
+        printf("        --persistent-threads     Specifies persistent thread model, each thread\n");
+        printf("                                 keeps its process and sends it jobs on STDIN\n");
+        printf("        --max-jobs-per-child     Jobs run by a persistent process before it is\n");
+        printf("                                 replaced (default: 0, unlimited)\n");
+        printf("        --concurrency            How the dependent thread model ramps up and\n");
+        printf("                                 down: linear, aimd or multiplicative\n");
+        printf("                                 (default: linear)\n");
+        printf("        --concurrency-decay      Factor threads in use are reduced by when work\n");
+        printf("                                 runs out with aimd and multiplicative (default:\n");
+        printf("                                 0.5)\n");
+        printf("        --queue-fifo             Read work items (one per line) from this FIFO\n");
+        printf("        --queue-spool            Read work items from files in this directory,\n");
+        printf("                                 deleting each file once its items are taken\n");
+        printf("        --queue-socket           Read work items from datagrams sent to this\n");
+        printf("                                 Unix domain socket\n");
+        printf("        --queue-delivery         How work items are given to processes: argv,\n");
+        printf("                                 env (%s) or stdin (default: argv)\n", JOBQUEUE_ENV_NAME);
+        printf("        --queue-batch            Work items given to each process (default: 1)\n");
+        printf("        --proc-run-time-warn     Warn if child process runs longer than this\n");
+        printf("        --proc-run-time-max      Maximum child process run time\n");
+        printf("        --proc-term-timeout      Maximum wait for process termination\n");
+        printf("        --fixed-interval-wait    Maximum wait for free thread in FI mode,\n");
+        printf("                                 negative to wait indefinitely\n");
+        printf("                                 Times are in seconds unless they have a unit,\n");
+        printf("                                 ns, us, ms, s, m or h, e.g. 250ms or 1.5m\n");
         printf("        --append-thread-id       Will append --tid=x to processes.\n");
         printf("        --err-log-file           Logs stderr of child processes.\n");
         printf("        --run-once               Run script only once, e.g. if daemon proc\n");
         printf("        --test-fire              Initialise but do not run, useful for testing\n");
+        printf("        --direct-reaping         Reap processes from the dispatcher rather than\n");
+        printf("                                 dedicating a thread to each process\n");
+        printf("        --posix-spawn            Start processes with posix_spawn, not fork\n");
+        printf("        --log-splice             Move output to log files with splice(), only\n");
+        printf("                                 if The Fat Controller is the only writer\n");
+        printf("        --log-lines              Only write whole lines to log files, so lines\n");
+        printf("                                 from different processes are not mixed\n");
+        printf("        --log-line-prefix        As --log-lines, prefixing each line with the\n");
+        printf("                                 time, thread ID and PID\n");
         printf("        --help                   This help screen\n");
         printf("\n");
         printf("For more details on how to use these options, see the website.\n");
@@ -83,6 +264,96 @@
         
     }
 
+    /* Longest duration accepted, so that adding one to the time of the event
+       loop (or a backoff to it) cannot overflow */
+    #define DURATION_MAX ((eventloop_time) 10 * 366 * 24 * 3600 * EVENTLOOP_SECOND)
+    
+    /* Parses a duration such as "30", "1.5s", "100ms" or "5m".   A number
+       without a unit is in seconds.   Durations longer than ten years, either
+       way, are invalid.   Returns 0 on success. */
+    static int parseDuration(const char *text, eventloop_time *duration)
+    {
+        static const struct
+        {
+            const char *suffix;
+            double scale;
+        } units[] = {
+            {"",   EVENTLOOP_SECOND},
+            {"ns", 1},
+            {"us", EVENTLOOP_MICROSECOND},
+            {"ms", EVENTLOOP_MILLISECOND},
+            {"s",  EVENTLOOP_SECOND},
+            {"m",  60 * EVENTLOOP_SECOND},
+            {"h",  3600 * EVENTLOOP_SECOND}
+        };
+        char *end;
+        double value;
+        unsigned int i;
+        
+        value = strtod(text, &end);
+        
+        /* Not "nan" or "inf", which strtod() accepts */
+        if (end == text || !isfinite(value))
+        {
+            return 1;
+        }
+        
+        for (i=0; i<sizeof(units)/sizeof(units[0]); i++)
+        {
+            if (strcmp(end, units[i].suffix) == 0)
+            {
+                if (fabs(value * units[i].scale) > (double) DURATION_MAX)
+                {
+                    return 1;
+                }
+                
+                *duration = (eventloop_time) (value * units[i].scale);
+                
+                return 0;
+            }
+        }
+        
+        return 1;
+    }
+    
+    /* Parses a backoff policy, reporting an unrecognised one */
+    static int parseBackoff(const char *option, const char *text, int *policy)
+    {
+        if (strcmp(text, "fixed") == 0)
+        {
+            *policy = BACKOFF_FIXED;
+        }
+        else if (strcmp(text, "exponential") == 0)
+        {
+            *policy = BACKOFF_EXPONENTIAL;
+        }
+        else if (strcmp(text, "decorrelated") == 0)
+        {
+            *policy = BACKOFF_DECORRELATED;
+        }
+        else
+        {
+            fprintf(error_stream, "Unrecognised backoff for --%s: %s\n", option, text);
+            
+            return 1;
+        }
+        
+        return 0;
+    }
+    
+    /* As parseDuration() but reports an invalid or negative duration */
+    static int parseOptionDuration(const char *option, const char *text, eventloop_time *duration)
+    {
+        if (parseDuration(text, duration) != 0 || *duration < 0)
+        {
+            fprintf(error_stream, "Invalid duration for --%s: %s\n", option, text);
+            
+            return 1;
+        }
+        
+        return 0;
+    }
+    
     static void splitArgs(char *input, char ***argv, int *argc)
     {
         char *token, **data;
@@ -131,160 +402,771 @@
         return;
     }
     
-    static int parseOptions(int argc, char **argv, struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings)
+    /* Reports an error in the settings of a pool, naming the pool unless it
+       is the default one */
+    static int poolError(struct dispatching_settings *pool, const char *message)
     {
-        int c, err=0;
-        int fi=0, fw=0, fl=0, fp=0, fc=0;
-        opterr = 0;
+        if (strcmp(pool->pool_name, DEFAULT_POOL_NAME) != 0)
+        {
+            fprintf(error_stream, "Pool %s: %s\n", pool->pool_name, message);
+        }
+        else
+        {
+            fprintf(error_stream, "%s\n", message);
+        }
         
-        /* Reset option flags */
-        flag_help = 0, flag_daemonise = 0, flag_debug = 0, flag_itm = 0;
-        flag_ftm = 0, flag_ati = 0, flag_run_once = 0, flag_test_fire = 0;
+        return 1;
+    }
+    
+    /* Applies the flags given for a pool and checks its settings, then resets
+       the flags for the next pool.   fl, fc and fq count the log file, command
+       and queue options given for the pool. */
+    static int finishPool(struct dispatching_settings *dp_settings, struct dispatching_settings *pool, int fl, int fc, int fq)
+    {
+        struct dispatching_settings *other;
+        char message[64];
+        int err = 0;
         
-        while (1)
+        if (pool->pool_name == NULL)
+        {
+            pool->pool_name = sfmalloc(sizeof(char) * (strlen(DEFAULT_POOL_NAME)+1));
+            strcpy(pool->pool_name, DEFAULT_POOL_NAME);
+        }
+        
+        for (other = dp_settings; other != pool; other = other->next_pool)
         {
-            static struct option long_options[] =
+            if (strcmp(other->pool_name, pool->pool_name) == 0)
             {
-                {"pid-file",               required_argument, 0,               'i'},
-                {"working-directory",      required_argument, 0,               'w'},
-                {"log-file",               required_argument, 0,               'l'},
-                {"log-format",             required_argument, 0,               'f'},
-                {"sleep",                  required_argument, 0,               's'},
-                {"sleep-on-error",         required_argument, 0,               'e'},
-                {"path",                   required_argument, 0,               'p'},
-                {"help",                   no_argument,       &flag_help,      1},
-                {"threads",                required_argument, 0,               't'},
-                {"daemon-name",            required_argument, 0,               'n'},
-                {"debug",                  no_argument,       &flag_debug,     1},
-                {"daemonise",              no_argument,       &flag_daemonise, 1},
-                {"command",                required_argument, 0,               'c'},
-                {"arguments",              required_argument, 0,               'a'},
-                {"independent-threads",    no_argument,       &flag_itm,       1},
-                {"fixed-interval-threads", no_argument,       &flag_ftm,       1},
-                {"proc-run-time-warn",     required_argument, 0,               256},
-                {"proc-run-time-max",      required_argument, 0,               257},
-                {"proc-term-timeout",      required_argument, 0,               258},
-                {"fixed-interval-wait",    required_argument, 0,               259},
-                {"err-log-file",           required_argument, 0,               260},
-                {"append-thread-id",       no_argument,       &flag_ati,         1},
-                {"run-once",               no_argument,       &flag_run_once,    1},
-                {"test-fire",              no_argument,       &flag_test_fire,   1},
-                {0, 0, 0, 0}
-            };
+                err = poolError(pool, "Pool name used more than once.");
+            }
+        }
+        
+        if (flag_itm + flag_ftm + flag_ptm > 1)
+        {
+            err = poolError(pool, "Multiple thread models specified.");
+        }
+        
+        if (flag_itm)
+        {
+            pool->threadModel = THREAD_MODEL_INDEPENDENT;
+        }
+        else if (flag_ftm)
+        {
+            pool->threadModel = THREAD_MODEL_FIXED_INTERVAL;
+        }
+        else if (flag_ptm)
+        {
+            pool->threadModel = THREAD_MODEL_PERSISTENT;
             
-            /* getopt_long stores the option index here. */
-            int option_index = 0;
-
-            c = getopt_long (argc, argv, "i:w:f:l:n:s:e:t:p:c:a:", long_options, &option_index);
+            /* Workers outlive jobs so cannot be waited for by a thread */
+            pool->direct_reaping = 1;
+        }
+        
+        if (flag_ati)
+        {
+            pool->append_thread_id = 1;
+        }
 
-            /* Detect the end of the options. */
-            if (c == -1)
+        if (flag_run_once)
+        {
+            pool->run_once = 1;
+        }
+        
+        if (flag_direct_reaping)
+        {
+            pool->direct_reaping = 1;
+        }
+        
+        if (flag_posix_spawn)
+        {
+            pool->posix_spawn = 1;
+        }
+        
+        if (flag_cgroup_per_job)
+        {
+            pool->cgroup_per_job = 1;
+        }
+        
+        if (flag_pin_threads)
+        {
+            pool->pin_threads = 1;
+        }
+        
+        flag_itm = 0, flag_ftm = 0, flag_ptm = 0, flag_ati = 0, flag_run_once = 0;
+        flag_direct_reaping = 0, flag_posix_spawn = 0, flag_cgroup_per_job = 0;
+        flag_pin_threads = 0;
+        
+        if (fq > 1)
+        {
+            err = poolError(pool, "Multiple queue sources specified.");
+        }
+        
+        if (fq && pool->threadModel == THREAD_MODEL_FIXED_INTERVAL)
+        {
+            err = poolError(pool, "A queue cannot be used with the fixed-interval thread model.");
+        }
+        
+        if (pool->queue_batch < 1 || pool->queue_batch > JOBQUEUE_MAX_BATCH)
+        {
+            snprintf(message, sizeof(message), "Queue batch must be between 1 and %d.", JOBQUEUE_MAX_BATCH);
+            
+            err = poolError(pool, message);
+        }
+        
+        if (pool->concurrency_decay < 0 || pool->concurrency_decay >= 1)
+        {
+            err = poolError(pool, "Concurrency decay must be at least 0 and less than 1.");
+        }
+        
+        if (pool->breaker_threshold < 0 || pool->breaker_threshold > 1)
+        {
+            err = poolError(pool, "Breaker threshold must be between 0 and 1.");
+        }
+        
+        if (pool->breaker_window < 1 || pool->breaker_window > BREAKER_MAX_WINDOW)
+        {
+            snprintf(message, sizeof(message), "Breaker window must be between 1 and %d.", BREAKER_MAX_WINDOW);
+            
+            err = poolError(pool, message);
+        }
+        
+        if (pool->nice != PLACEMENT_UNSET && (pool->nice < -20 || pool->nice > 19))
+        {
+            err = poolError(pool, "Nice level must be between -20 and 19.");
+        }
+        
+        /* The memory policy can only be set by the sub-process itself */
+        if (pool->numa_nodes != NULL && pool->posix_spawn)
+        {
+            err = poolError(pool, "NUMA nodes cannot be used with --posix-spawn.");
+        }
+        
+        /* Check we found all the required args */
+        if (fc == 0 || fl == 0)
+        {
+            err = poolError(pool, "Missing required arguments.");
+        }
+        
+        return err;
+    }
+    
+    static int setOption(struct option_state *state, int c, char *value);
+    
+    /* Settings of config files (see scripts/service.fat.example) and the
+       options they stand for.   Global settings apply to all pools. */
+    static const struct
+    {
+        const char *key;
+        const char *option;
+        int global;
+    } config_keys[] =
+    {
+        {"APPLICATION_NAME",    "daemon-name",            1},
+        {"WORKING_DIRECTORY",   "working-directory",      1},
+        {"PID_FILE",            "pid-file",               1},
+        {"LOG_FORMAT",          "log-format",             1},
+        {"DAEMONISE",           "daemonise",              1},
+        {"DEBUG",               "debug",                  1},
+        {"TEST_FIRE",           "test-fire",              1},
+        {"MAX_PROCESSES",       "max-processes",          1},
+        {"LOG_SPLICE",          "log-splice",             1},
+        {"LOG_LINES",           "log-lines",              1},
+        {"LOG_LINE_PREFIX",     "log-line-prefix",        1},
+        {"CONTROL_SOCKET",      "control-socket",         1},
+        {"METRICS_FILE",        "metrics-file",           1},
+        {"METRICS_INTERVAL",    "metrics-interval",       1},
+        {"CGROUP",              "cgroup",                 1},
+        {"DISPATCHER_CPUS",     "dispatcher-cpus",        1},
+        {"COMMAND",             "command",                0},
+        {"ARGUMENTS",           "arguments",              0},
+        {"LOG_FILE",            "log-file",               0},
+        {"ERR_LOG_FILE",        "err-log-file",           0},
+        {"SLEEP",               "sleep",                  0},
+        {"SLEEP_ON_ERROR",      "sleep-on-error",         0},
+        {"SLEEP_BACKOFF",       "sleep-backoff",          0},
+        {"SLEEP_MAX",           "sleep-max",              0},
+        {"SLEEP_ON_ERROR_BACKOFF", "sleep-on-error-backoff", 0},
+        {"SLEEP_ON_ERROR_MAX",  "sleep-on-error-max",     0},
+        {"BREAKER_THRESHOLD",   "breaker-threshold",      0},
+        {"BREAKER_WINDOW",      "breaker-window",         0},
+        {"BREAKER_OPEN_TIME",   "breaker-open-time",      0},
+        {"THREADS",             "threads",                0},
+        {"THREAD_MODEL",        NULL,                     0},
+        {"PROC_RUN_TIME_WARN",  "proc-run-time-warn",     0},
+        {"PROC_RUN_TIME_MAX",   "proc-run-time-max",      0},
+        {"PROC_TERM_TIMEOUT",   "proc-term-timeout",      0},
+        {"FIXED_INTERVAL_WAIT", "fixed-interval-wait",    0},
+        {"MAX_JOBS_PER_CHILD",  "max-jobs-per-child",     0},
+        {"CONCURRENCY",         "concurrency",            0},
+        {"CONCURRENCY_DECAY",   "concurrency-decay",      0},
+        {"APPEND_THREAD_ID",    "append-thread-id",       0},
+        {"RUN_ONCE",            "run-once",               0},
+        {"DIRECT_REAPING",      "direct-reaping",         0},
+        {"POSIX_SPAWN",         "posix-spawn",            0},
+        {"QUEUE_FIFO",          "queue-fifo",             0},
+        {"QUEUE_SPOOL",         "queue-spool",            0},
+        {"QUEUE_SOCKET",        "queue-socket",           0},
+        {"QUEUE_DELIVERY",      "queue-delivery",         0},
+        {"QUEUE_BATCH",         "queue-batch",            0},
+        {"CGROUP_CPU_MAX",      "cgroup-cpu-max",         0},
+        {"CGROUP_MEMORY_MAX",   "cgroup-memory-max",      0},
+        {"CGROUP_IO_MAX",       "cgroup-io-max",          0},
+        {"CGROUP_PER_JOB",      "cgroup-per-job",         0},
+        {"CPUS",                "cpus",                   0},
+        {"PIN_THREADS",         "pin-threads",            0},
+        {"NUMA_NODES",          "numa-nodes",             0},
+        {"NICE",                "nice",                   0},
+        {"IONICE",              "ionice",                 0},
+        {"SCHEDULER",           "scheduler",              0},
+        /* Only used by scripts/fatcontrollerd */
+        {"APPLICATION",         NULL,                     0}
+    };
+    
+    #define CONFIG_KEYS (sizeof(config_keys)/sizeof(config_keys[0]))
+    
+    /* The value of each global setting and the file it was read from, so that
+       config files in a directory cannot give different values */
+    static struct
+    {
+        char *value;
+        char *file;
+    } config_globals[CONFIG_KEYS];
+    
+    static void freeConfigGlobals()
+    {
+        unsigned int i;
+        
+        for (i=0; i<CONFIG_KEYS; i++)
+        {
+            free(config_globals[i].value);
+            free(config_globals[i].file);
+            
+            config_globals[i].value = NULL;
+            config_globals[i].file = NULL;
+        }
+    }
+    
+    static const struct option *findOption(const char *name)
+    {
+        const struct option *option;
+        
+        for (option = long_options; option->name != NULL; option++)
+        {
+            if (strcmp(option->name, name) == 0)
+            {
+                return option;
+            }
+        }
+        
+        abort();
+    }
+    
+    /* Checks that a global setting has not been given a different value by
+       another file, then remembers it */
+    static int checkConfigGlobal(unsigned int key, const char *file, int line, const char *value)
+    {
+        if (config_globals[key].file != NULL && strcmp(config_globals[key].file, file) != 0
+         && strcmp(config_globals[key].value, value) != 0)
+        {
+            fprintf(error_stream, "%s:%d: %s is set differently in %s.\n", file, line, config_keys[key].key, config_globals[key].file);
+            
+            return 1;
+        }
+        
+        free(config_globals[key].value);
+        free(config_globals[key].file);
+        
+        config_globals[key].value = sfmalloc(sizeof(char) * (strlen(value)+1));
+        strcpy(config_globals[key].value, value);
+        config_globals[key].file = sfmalloc(sizeof(char) * (strlen(file)+1));
+        strcpy(config_globals[key].file, file);
+        
+        return 0;
+    }
+    
+    /* Applies a setting of a config file as the option it stands for (see
+       config_load()) */
+    static int configSetting(const char *file, int line, const char *key, char *value, void *data)
+    {
+        struct option_state *state = data;
+        const struct option *option;
+        unsigned int i;
+        
+        if (key == NULL)
+        {
+            option = findOption("pool");
+            
+            return setOption(state, option->val, value) == 0 ? RV_OK : RV_FAIL;
+        }
+        
+        for (i=0; i<CONFIG_KEYS; i++)
+        {
+            if (strcmp(config_keys[i].key, key) == 0)
             {
                 break;
             }
-
-
-            switch (c)
+        }
+        
+        if (i == CONFIG_KEYS)
+        {
+            fprintf(error_stream, "%s:%d: Unrecognised setting: %s\n", file, line, key);
+            
+            return RV_FAIL;
+        }
+        
+        if (config_keys[i].global && checkConfigGlobal(i, file, line, value) != 0)
+        {
+            return RV_FAIL;
+        }
+        
+        if (strcmp(key, "THREAD_MODEL") == 0)
+        {
+            flag_itm = 0, flag_ftm = 0, flag_ptm = 0;
+            
+            if (strcmp(value, "INDEPENDENT") == 0)
             {
-                case 0:
-                    /* If this option set a flag, do nothing else now. */
-                    if (long_options[option_index].flag != 0)
-                    {
-                        break;
-                    }
-                    break;
+                flag_itm = 1;
+            }
+            else if (strcmp(value, "FIXED") == 0)
+            {
+                flag_ftm = 1;
+            }
+            else if (strcmp(value, "PERSISTENT") == 0)
+            {
+                flag_ptm = 1;
+            }
+            else if (strcmp(value, "DEPENDENT") != 0)
+            {
+                fprintf(error_stream, "%s:%d: Unrecognised thread model: %s\n", file, line, value);
+                
+                return RV_FAIL;
+            }
+            
+            return RV_OK;
+        }
+        
+        if (config_keys[i].option == NULL)
+        {
+            return RV_OK;
+        }
+        
+        option = findOption(config_keys[i].option);
+        
+        if (option->flag != NULL)
+        {
+            /* As in the shell script, 1 sets the option */
+            if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0)
+            {
+                fprintf(error_stream, "%s:%d: %s must be 0 or 1.\n", file, line, key);
+                
+                return RV_FAIL;
+            }
+            
+            *option->flag = value[0] == '1' ? option->val : 0;
+            
+            return RV_OK;
+        }
+        
+        if (setOption(state, option->val, value) != 0)
+        {
+            fprintf(error_stream, "%s:%d: Invalid value for %s.\n", file, line, key);
+            
+            return RV_FAIL;
+        }
+        
+        return RV_OK;
+    }
+    
+    /* Applies an option (the value returned by getopt_long) from the command
+       line or a config file.   Returns the number of errors. */
+    static int setOption(struct option_state *state, int c, char *value)
+    {
+        struct daemon_settings *dm_settings = state->dm_settings;
+        struct dispatching_settings *dp_settings = state->dp_settings;
+        struct dispatching_settings *pool = state->pool;
+        char quota[48], *end;
+        double cpus;
+        int err = 0;
+        
+        switch (c)
+        {
+            case 'i':
+                dm_settings->pidfile = sfrealloc(dm_settings->pidfile, sizeof(char) * (strlen(value)+1));
+                strcpy(dm_settings->pidfile, value);
+                state->fi = 1;
+                break;
 
-                case 'i':
-                    dm_settings->pidfile = sfmalloc(sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dm_settings->pidfile, optarg);
-                    fi = 1;
-                    break;
+            case 'w':
+                dm_settings->rundir = sfrealloc(dm_settings->rundir, sizeof(char) * (strlen(value)+1));
+                strcpy(dm_settings->rundir, value);
+                state->fw = 1;
+                break;
+                
+            case 'l':
+                pool->logfile = sfrealloc(pool->logfile, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->logfile, value);
+                state->fl = 1;
+                break;
 
-                case 'w':
-                    dm_settings->rundir = sfmalloc(sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dm_settings->rundir, optarg);
-                    fw = 1;
-                    break;
+            case 'f':
+                if (dp_settings->logformat != NULL) {
+                    free(dp_settings->logformat);
+                }
+                dp_settings->logformat = sfmalloc(sizeof(char) * (strlen(value)+1));
+                strcpy(dp_settings->logformat, value);
+                state->fl = 1;
+                break;
+
+            case 'n':
+                dm_settings->name = sfrealloc(dm_settings->name, sizeof(char) * (strlen(value)+1));
+                strcpy(dm_settings->name, value);
+                break;
                 
-                case 'l':
-                    dp_settings->logfile = sfmalloc(sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dp_settings->logfile, optarg);
-                    fl = 1;
-                    break;
+            case 's':
+                err += parseOptionDuration("sleep", value, &pool->sleep);
+                break;
+                
+            case 'e':
+                err += parseOptionDuration("sleep-on-error", value, &pool->sleepOnError);
+                break;
+                
+            case 't':
+                pool->threads = atoi(&value[0]);
+                break;
+                
+            case 'p':
+                pool->path = sfrealloc(pool->path, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->path, value);
+                state->fp = 1;
+                break;
+                
+            case 'c':
+                pool->cmd = sfrealloc(pool->cmd, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->cmd, value);
+                state->fc = 1;
+                break;
+                
+            case 'a':
+                splitArgs(value, &pool->argv, &pool->argc);
+                break;
+                
+            case 256:
+                err += parseOptionDuration("proc-run-time-warn", value, &pool->thread_run_time_warn);
+                break;
 
-                case 'f':
-                    if (dp_settings->logformat != NULL) {
-                        free(dp_settings->logformat);
-                    }
-                    dp_settings->logformat = sfmalloc(sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dp_settings->logformat, optarg);
-                    fl = 1;
-                    break;
+            case 257:
+                err += parseOptionDuration("proc-run-time-max", value, &pool->thread_run_time_max);
+                break;
 
-                case 'n':
-                    dm_settings->name = sfrealloc(dm_settings->name, sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dm_settings->name, optarg);
-                    break;
+            case 258:
+                err += parseOptionDuration("proc-term-timeout", value, &pool->termination_timeout);
+                break;
+
+            case 259:
+                /* Negative means wait indefinitely */
+                if (parseDuration(value, &pool->fi_wait_time_max) != 0)
+                {
+                    fprintf(error_stream, "Invalid duration for --fixed-interval-wait: %s\n", value);
+                    err++;
+                }
+                else if (pool->fi_wait_time_max < 0)
+                {
+                    pool->fi_wait_time_max = FI_WAIT_INDEFINITELY;
+                }
+                break;
                 
-                case 's':
-                    dp_settings->sleep = atoi(&optarg[0]);
-                    break;
+            case 260:
+                pool->errlogfile = sfrealloc(pool->errlogfile, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->errlogfile, value);
+                break;
                 
-                case 'e':
-                    dp_settings->sleepOnError = atoi(&optarg[0]);
-                    break;
+            case 261:
+                pool->max_jobs_per_child = atoi(&value[0]);
+                break;
                 
-                case 't':
-                    dp_settings->threads = atoi(&optarg[0]);
-                    break;
+            case 262:
+            case 263:
+            case 264:
+                pool->queue_source = c == 262 ? JOBQUEUE_SOURCE_FIFO
+                                          : c == 263 ? JOBQUEUE_SOURCE_SPOOL
+                                                     : JOBQUEUE_SOURCE_SOCKET;
+                pool->queue_location = sfrealloc(pool->queue_location, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->queue_location, value);
+                state->fq++;
+                break;
                 
-                case 'p':
-                    dp_settings->path = sfmalloc(sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dp_settings->path, optarg);
-                    fp = 1;
-                    break;
+            case 265:
+                if (strcmp(value, "argv") == 0)
+                {
+                    pool->queue_delivery = JOBQUEUE_DELIVERY_ARGV;
+                }
+                else if (strcmp(value, "env") == 0)
+                {
+                    pool->queue_delivery = JOBQUEUE_DELIVERY_ENV;
+                }
+                else if (strcmp(value, "stdin") == 0)
+                {
+                    pool->queue_delivery = JOBQUEUE_DELIVERY_STDIN;
+                }
+                else
+                {
+                    fprintf(error_stream, "Unrecognised queue delivery: %s\n", value);
+                    err++;
+                }
+                break;
+                
+            case 266:
+                pool->queue_batch = atoi(&value[0]);
+                break;
+                
+            case 267:
+                if (strcmp(value, "linear") == 0)
+                {
+                    pool->concurrency_controller = CONCURRENCY_LINEAR;
+                }
+                else if (strcmp(value, "aimd") == 0)
+                {
+                    pool->concurrency_controller = CONCURRENCY_AIMD;
+                }
+                else if (strcmp(value, "multiplicative") == 0)
+                {
+                    pool->concurrency_controller = CONCURRENCY_MULTIPLICATIVE;
+                }
+                else
+                {
+                    fprintf(error_stream, "Unrecognised concurrency controller: %s\n", value);
+                    err++;
+                }
+                break;
+                
+            case 268:
+                pool->concurrency_decay = atof(&value[0]);
+                break;
+                
+            case 269:
+                /* Options given before the first --pool without a command
+                   are for the first pool */
+                if (pool->pool_name != NULL || state->fc != 0)
+                {
+                    err += finishPool(dp_settings, pool, state->fl, state->fc, state->fq);
+                        
+                    pool->next_pool = sfmalloc(sizeof(struct dispatching_settings));
+                    pool = pool->next_pool;
+                    state->pool = pool;
+                        
+                    initDispatchingSettings(pool);
+                        
+                    state->fl = 0, state->fc = 0, state->fq = 0;
+                }
+                    
+                pool->pool_name = sfmalloc(sizeof(char) * (strlen(value)+1));
+                strcpy(pool->pool_name, value);
+                break;
                 
-                case 'c':
-                    dp_settings->cmd = sfmalloc(sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dp_settings->cmd, optarg);
-                    fc = 1;
+            case 270:
+                dp_settings->max_processes = atoi(&value[0]);
+                break;
+                
+            case 271:
+                if (config_load(value, configSetting, state, error_stream) != RV_OK)
+                {
+                    err++;
+                }
+                break;
+                
+            case 272:
+                dp_settings->control_socket = sfrealloc(dp_settings->control_socket, sizeof(char) * (strlen(value)+1));
+                strcpy(dp_settings->control_socket, value);
+                break;
+                
+            case 273:
+                dp_settings->metrics_file = sfrealloc(dp_settings->metrics_file, sizeof(char) * (strlen(value)+1));
+                strcpy(dp_settings->metrics_file, value);
+                break;
+                
+            case 274:
+                err += parseOptionDuration("metrics-interval", value, &dp_settings->metrics_interval);
+                break;
+                
+            case 275:
+                dp_settings->cgroup = sfrealloc(dp_settings->cgroup, sizeof(char) * (strlen(value)+1));
+                strcpy(dp_settings->cgroup, value);
+                break;
+                
+            case 276:
+                /* A number of CPUs is turned into a quota for each period */
+                cpus = strtod(value, &end);
+                
+                if (end != value && *end == '\0')
+                {
+                    if (cpus <= 0)
+                    {
+                        fprintf(error_stream, "Invalid number of CPUs for --cgroup-cpu-max: %s\n", value);
+                        err++;
+                        break;
+                    }
+                    
+                    snprintf(quota, sizeof(quota), "%lld %d", (long long) (cpus * CGROUP_CPU_PERIOD), CGROUP_CPU_PERIOD);
+                    value = quota;
+                }
+                
+                pool->cgroup_cpu_max = sfrealloc(pool->cgroup_cpu_max, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->cgroup_cpu_max, value);
+                break;
+                
+            case 277:
+                pool->cgroup_memory_max = sfrealloc(pool->cgroup_memory_max, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->cgroup_memory_max, value);
+                break;
+                
+            case 278:
+                pool->cgroup_io_max = sfrealloc(pool->cgroup_io_max, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->cgroup_io_max, value);
+                break;
+                
+            case 279:
+                if (placement_check_list(value) != RV_OK)
+                {
+                    fprintf(error_stream, "Invalid list of CPUs for --cpus: %s\n", value);
+                    err++;
                     break;
+                }
                 
-                case 'a':
-                    splitArgs(optarg, &dp_settings->argv, &dp_settings->argc);
+                pool->cpus = sfrealloc(pool->cpus, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->cpus, value);
+                break;
+                
+            case 280:
+                if (placement_check_list(value) != RV_OK)
+                {
+                    fprintf(error_stream, "Invalid list of NUMA nodes for --numa-nodes: %s\n", value);
+                    err++;
                     break;
+                }
+                
+                pool->numa_nodes = sfrealloc(pool->numa_nodes, sizeof(char) * (strlen(value)+1));
+                strcpy(pool->numa_nodes, value);
+                break;
+                
+            case 281:
+                pool->nice = atoi(&value[0]);
+                break;
+                
+            case 282:
+                if (placement_parse_ionice(value, &pool->ionice) != RV_OK)
+                {
+                    fprintf(error_stream, "Unrecognised I/O class: %s\n", value);
+                    err++;
+                }
+                break;
+                
+            case 283:
+                if (placement_parse_policy(value, &pool->scheduler) != RV_OK)
+                {
+                    fprintf(error_stream, "Unrecognised scheduling policy: %s\n", value);
+                    err++;
+                }
+                break;
                 
-                case 256:
-                    dp_settings->thread_run_time_warn = atoi(&optarg[0]);
+            case 284:
+                if (placement_check_list(value) != RV_OK)
+                {
+                    fprintf(error_stream, "Invalid list of CPUs for --dispatcher-cpus: %s\n", value);
+                    err++;
                     break;
+                }
+                
+                dp_settings->dispatcher_cpus = sfrealloc(dp_settings->dispatcher_cpus, sizeof(char) * (strlen(value)+1));
+                strcpy(dp_settings->dispatcher_cpus, value);
+                break;
+                
+            case 285:
+                err += parseBackoff("sleep-backoff", value, &pool->sleep_backoff);
+                break;
+                
+            case 286:
+                err += parseOptionDuration("sleep-max", value, &pool->sleep_max);
+                break;
+                
+            case 287:
+                err += parseBackoff("sleep-on-error-backoff", value, &pool->sleep_on_error_backoff);
+                break;
+                
+            case 288:
+                err += parseOptionDuration("sleep-on-error-max", value, &pool->sleep_on_error_max);
+                break;
+                
+            case 289:
+                pool->breaker_threshold = atof(&value[0]);
+                break;
+                
+            case 290:
+                pool->breaker_window = atoi(&value[0]);
+                break;
+                
+            case 291:
+                err += parseOptionDuration("breaker-open-time", value, &pool->breaker_open_time);
+                break;
 
-                case 257:
-                    dp_settings->thread_run_time_max = atoi(&optarg[0]);
-                    break;
+            default:
+                abort();
+        }
+        
+        return err;
+    }
+    
+    static int parseOptions(int argc, char **argv, struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings)
+    {
+        struct option_state state;
+        struct dispatching_settings *pool;
+        int c, err=0;
+        
+        state.dm_settings = dm_settings;
+        state.dp_settings = dp_settings;
+        state.pool = dp_settings;
+        state.fi = 0, state.fw = 0, state.fl = 0, state.fp = 0, state.fc = 0, state.fq = 0;
+        
+        opterr = 0;
+        
+        /* Reset option flags */
+        flag_help = 0, flag_daemonise = 0, flag_debug = 0, flag_itm = 0;
+        flag_ftm = 0, flag_ptm = 0, flag_ati = 0, flag_run_once = 0, flag_test_fire = 0;
+        flag_direct_reaping = 0, flag_posix_spawn = 0, flag_log_splice = 0;
+        flag_log_lines = 0, flag_log_line_prefix = 0, flag_cgroup_per_job = 0;
+        flag_pin_threads = 0;
+        
+        while (1)
+        {
+            /* getopt_long stores the option index here. */
+            int option_index = 0;
 
-                case 258:
-                    dp_settings->termination_timeout = atoi(&optarg[0]);
-                    break;
+            c = getopt_long (argc, argv, "i:w:f:l:n:s:e:t:p:c:a:", long_options, &option_index);
 
-                case 259:
-                    dp_settings->fi_wait_time_max = atoi(&optarg[0]);
-                    break;
-                
-                case 260:
-                    dp_settings->errlogfile = sfmalloc(sizeof(char) * (strlen(optarg)+1));
-                    strcpy(dp_settings->errlogfile, optarg);
+            /* Detect the end of the options. */
+            if (c == -1)
+            {
+                break;
+            }
+
+
+            switch (c)
+            {
+                case 0:
+                    /* If this option set a flag, do nothing else now. */
                     break;
 
                 case '?':
-                    fprintf(stderr, "Unrecognised option: %s\n", argv[optind-1]);
+                    fprintf(error_stream, "Unrecognised option: %s\n", argv[optind-1]);
                     err++;
                     break;
 
                 default:
-                    abort();
+                    err += setOption(&state, c, optarg);
             }
         }
         
+        freeConfigGlobals();
+        
         if (flag_help) /* help, nothing to check */
         {
             return 0;
@@ -301,30 +1183,57 @@
             ap_settings->daemonise = 1;
         }
 
-        if (flag_itm && flag_ftm)
+        /* The last pool */
+        if (finishPool(dp_settings, state.pool, state.fl, state.fc, state.fq) != 0)
         {
-            fprintf(stderr, "Multiple thread models specified.\n");
+            return 1;
+        }
+        
+        if (dp_settings->max_processes < 0)
+        {
+            fprintf(error_stream, "Max processes must be at least 0.\n");
             
             return 1;
         }
         
-        if (flag_itm)
+        if (dp_settings->metrics_interval <= 0)
         {
-            dp_settings->threadModel = THREAD_MODEL_INDEPENDENT;
+            fprintf(error_stream, "Metrics interval must be more than 0.\n");
+            
+            return 1;
         }
-        else if (flag_ftm)
+        
+        for (pool = dp_settings; pool != NULL && dp_settings->cgroup == NULL; pool = pool->next_pool)
         {
-            dp_settings->threadModel = THREAD_MODEL_FIXED_INTERVAL;
+            if (pool->cgroup_cpu_max != NULL || pool->cgroup_memory_max != NULL
+             || pool->cgroup_io_max != NULL || pool->cgroup_per_job)
+            {
+                poolError(pool, "cgroup settings need --cgroup.");
+                
+                return 1;
+            }
         }
         
-        if (flag_ati)
+        if (flag_log_splice && (flag_log_lines || flag_log_line_prefix))
         {
-            dp_settings->append_thread_id = 1;
+            fprintf(error_stream, "Multiple log capture modes specified.\n");
+            
+            return 1;
         }
-
-        if (flag_run_once)
+        
+        if (flag_log_splice)
         {
-            dp_settings->run_once = 1;
+            dp_settings->log_splice = 1;
+        }
+        
+        if (flag_log_lines || flag_log_line_prefix)
+        {
+            dp_settings->log_lines = 1;
+        }
+        
+        if (flag_log_line_prefix)
+        {
+            dp_settings->log_line_prefix = 1;
         }
         
         if (flag_test_fire)
@@ -337,17 +1246,9 @@
             ap_settings->debug = 1;
         }
         
-        /* Check we found all the required args */
-        if (fc == 0 || fl == 0)
-        {
-            fprintf(stderr, "Missing required arguments.\n");
-            
-            return 1;
-        }
-        
-        if (flag_daemonise && (fi == 0 || fw == 0))
+        if (flag_daemonise && (state.fi == 0 || state.fw == 0))
         {
-            fprintf(stderr, "Missing required arguments for daemon operation.\n");
+            fprintf(error_stream, "Missing required arguments for daemon operation.\n");
             
             return 1;
         }
@@ -355,10 +1256,22 @@
         return 0;
     }
     
+    int reprocessOptions(int argc, char **argv, struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings, FILE *errors)
+    {
+        error_stream = errors;
+        
+        /* Start getopt_long from the beginning again */
+        optind = 0;
+        
+        return parseOptions(argc, argv, ap_settings, dm_settings, dp_settings) != 0 || flag_help;
+    }
+    
     int processOptions(int argc, char **argv, struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings)
     {
         int c;
         
+        error_stream = stderr;
+        
         if ( argc == 1 ) /* without arguments */
         {
     	    showhelp();
@@ -22,6 +22,8 @@
 #ifndef DGETOPTS_H
 #define DGETOPTS_H
 
+#include <stdio.h>
+
 /* 
  * Processes the command line arguments, populating the passed settings structs
  * 
@@ -35,4 +37,13 @@
  */
 int processOptions(int argc, char **argv, struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings);
 
+/*
+ * Processes the same arguments again, for a reload.   Config files are read
+ * again.   Errors are written to errors rather than stderr.
+ *
+ * Returns 0 if they are valid, 1 if not (the help is not shown).
+ *
+ */
+int reprocessOptions(int argc, char **argv, struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings, FILE *errors);
+
 #endif
@@ -0,0 +1,319 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "extern.h"
+#include "eventloop.h"
+
+/*
+    The event loop replaces the fixed 200ms polling interval of the dispatcher.
+
+    Everything the dispatcher needs to react to is turned into a file
+    descriptor and watched with epoll:
+
+    - signals are read from a signalfd (rather than a sigwait() thread)
+    - threads (and anything else) wake the loop by writing to an eventfd
+    - time based decisions (sleeping slots, run time limits etc.) are collected
+      as deadlines during each scan and the earliest is armed on a timerfd
+    - any other descriptors, e.g. pidfds of sub-processes, can be added
+
+    When there is nothing to do, the dispatcher blocks in epoll_wait() and uses
+    no CPU at all.
+*/
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int timer_fd = -1;
+static int notify_fd = -1;
+
+/* Earliest requested deadline, 0 if none */
+static eventloop_time wake_at = 0;
+
+/* Set if the next wait should not block */
+static int rescan_required = 0;
+
+static uint64_t pack_data(int type, int id)
+{
+    return ((uint64_t) (uint32_t) type << 32) | (uint32_t) id;
+}
+
+static int add_internal(int fd, int type)
+{
+    return eventloop_add(fd, type, 0, EPOLLIN);
+}
+
+/* Arms (or disarms if there is no deadline) the timer */
+static int arm_timer()
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+
+    if (wake_at > 0)
+    {
+        its.it_value.tv_sec = wake_at / EVENTLOOP_SECOND;
+        its.it_value.tv_nsec = wake_at % EVENTLOOP_SECOND;
+    }
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+    {
+        _syslog(LOG_ERR, "eventloop: cannot arm timer: [%d] %s", errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+/* Reads (and so resets) a counter style file descriptor, i.e. eventfd or timerfd */
+static void drain_counter(int fd)
+{
+    uint64_t counter;
+
+    if (read(fd, &counter, sizeof(counter)) == -1 && errno != EAGAIN)
+    {
+        _syslog(LOG_WARNING, "eventloop: cannot read counter: [%d] %s", errno, strerror(errno));
+    }
+}
+
+/* Reads one pending signal, returns 0 if none could be read */
+static int read_signal()
+{
+    struct signalfd_siginfo info;
+
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+    {
+        return 0;
+    }
+
+    return (int) info.ssi_signo;
+}
+
+int eventloop_initialize(int catch_sigchld)
+{
+    sigset_t signal_set;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epoll_fd == -1)
+    {
+        _syslog(LOG_CRIT, "eventloop: cannot create epoll instance: [%d] %s", errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    /* Catch every signal we can, as the old sigwait() handler did.   SIGCHLD
+       is of no interest while threads reap their own children. */
+    sigfillset(&signal_set);
+    
+    if (catch_sigchld == 0)
+    {
+        sigdelset(&signal_set, SIGCHLD);
+    }
+
+    signal_fd = signalfd(-1, &signal_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (signal_fd == -1 || timer_fd == -1 || notify_fd == -1)
+    {
+        _syslog(LOG_CRIT, "eventloop: cannot create file descriptors: [%d] %s", errno, strerror(errno));
+
+        eventloop_deinitialize();
+
+        return RV_FAIL;
+    }
+
+    if (add_internal(signal_fd, EVENTLOOP_SOURCE_SIGNAL) != RV_OK
+     || add_internal(timer_fd, EVENTLOOP_SOURCE_TIMER) != RV_OK
+     || add_internal(notify_fd, EVENTLOOP_SOURCE_NOTIFY) != RV_OK)
+    {
+        eventloop_deinitialize();
+
+        return RV_FAIL;
+    }
+
+    wake_at = 0;
+    rescan_required = 0;
+
+    return RV_OK;
+}
+
+void eventloop_deinitialize()
+{
+    int *fds[] = {&notify_fd, &timer_fd, &signal_fd, &epoll_fd};
+    unsigned int i;
+
+    for (i=0; i<sizeof(fds)/sizeof(fds[0]); i++)
+    {
+        if (*fds[i] != -1)
+        {
+            if (close(*fds[i]) != 0)
+            {
+                _syslog(LOG_WARNING, "eventloop: cannot close file descriptor: [%d] %s", errno, strerror(errno));
+            }
+
+            *fds[i] = -1;
+        }
+    }
+}
+
+int eventloop_add(int fd, int type, int id, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = pack_data(type, id);
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        _syslog(LOG_ERR, "eventloop: cannot watch fd %d: [%d] %s", fd, errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+int eventloop_remove(int fd)
+{
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0)
+    {
+        _syslog(LOG_ERR, "eventloop: cannot stop watching fd %d: [%d] %s", fd, errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+void eventloop_notify()
+{
+    uint64_t one = 1;
+
+    if (write(notify_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        _syslog(LOG_WARNING, "eventloop: cannot notify: [%d] %s", errno, strerror(errno));
+    }
+}
+
+void eventloop_wake_at(eventloop_time deadline)
+{
+    if (wake_at == 0 || deadline < wake_at)
+    {
+        wake_at = deadline;
+    }
+}
+
+eventloop_time eventloop_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (eventloop_time) ts.tv_sec * EVENTLOOP_SECOND + ts.tv_nsec;
+}
+
+void eventloop_rescan()
+{
+    rescan_required = 1;
+}
+
+int eventloop_wait(eventloop_event *events, int max_events)
+{
+    struct epoll_event raw[EVENTLOOP_MAX_EVENTS];
+    int i, n, count = 0, timeout;
+    uint32_t type;
+
+    if (max_events > EVENTLOOP_MAX_EVENTS)
+    {
+        max_events = EVENTLOOP_MAX_EVENTS;
+    }
+
+    timeout = (rescan_required || (wake_at > 0 && wake_at <= eventloop_now())) ? 0 : -1;
+
+    if (timeout != 0 && arm_timer() != RV_OK)
+    {
+        return RV_FAIL;
+    }
+
+    /* Deadlines must be requested again by the next scan */
+    wake_at = 0;
+    rescan_required = 0;
+
+    do
+    {
+        n = epoll_wait(epoll_fd, raw, max_events, timeout);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1)
+    {
+        _syslog(LOG_CRIT, "eventloop: epoll_wait failed: [%d] %s", errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    for (i=0; i<n; i++)
+    {
+        type = (uint32_t) (raw[i].data.u64 >> 32);
+
+        events[count].type = (int) type;
+        events[count].id = (int) (uint32_t) raw[i].data.u64;
+        events[count].events = raw[i].events;
+        events[count].signal = 0;
+
+        switch (type)
+        {
+            case EVENTLOOP_SOURCE_SIGNAL:
+                /* signalfd is level triggered, so any further pending signals
+                   will be reported by the next wait */
+                events[count].signal = read_signal();
+
+                if (events[count].signal == 0)
+                {
+                    continue;
+                }
+                break;
+
+            case EVENTLOOP_SOURCE_TIMER:
+                drain_counter(timer_fd);
+                break;
+
+            case EVENTLOOP_SOURCE_NOTIFY:
+                drain_counter(notify_fd);
+                break;
+        }
+
+        count++;
+    }
+
+    return count;
+}
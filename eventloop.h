@@ -0,0 +1,104 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define RV_FAIL -1
+#define RV_OK 0
+
+/* Event source types */
+#define EVENTLOOP_SOURCE_SIGNAL 1
+#define EVENTLOOP_SOURCE_TIMER 2
+#define EVENTLOOP_SOURCE_NOTIFY 3
+#define EVENTLOOP_SOURCE_CHILD 5
+#define EVENTLOOP_SOURCE_WORKER 6
+#define EVENTLOOP_SOURCE_QUEUE 7
+#define EVENTLOOP_SOURCE_CONTROL 8
+#define EVENTLOOP_SOURCE_EXEC 9
+
+#define EVENTLOOP_MAX_EVENTS 64
+
+/* Times and durations are in nanoseconds.   Times are on CLOCK_MONOTONIC, so
+   deadlines are not moved by changes to the wall clock. */
+typedef int64_t eventloop_time;
+
+#define EVENTLOOP_MICROSECOND 1000LL
+#define EVENTLOOP_MILLISECOND 1000000LL
+#define EVENTLOOP_SECOND 1000000000LL
+
+/* Converts a duration to seconds, for log messages */
+#define EVENTLOOP_SECONDS(duration) ((double) (duration) / EVENTLOOP_SECOND)
+
+typedef struct
+{
+    /* One of EVENTLOOP_SOURCE_* */
+    int type;
+
+    /* Identifier given when the file descriptor was added */
+    int id;
+
+    /* epoll event flags */
+    uint32_t events;
+
+    /* Signal number (EVENTLOOP_SOURCE_SIGNAL only) */
+    int signal;
+} eventloop_event;
+
+/* Creates the epoll instance along with the signalfd, timerfd and eventfd it
+   watches.   All signals must already be blocked in every thread.   SIGCHLD is
+   only reported if catch_sigchld is 1. */
+int eventloop_initialize(int catch_sigchld);
+
+/* Closes all file descriptors owned by the event loop */
+void eventloop_deinitialize();
+
+/* Watches a file descriptor, events are reported with the given type and id.
+   Closing the file descriptor removes it from the loop. */
+int eventloop_add(int fd, int type, int id, uint32_t events);
+
+/* Stops watching a file descriptor */
+int eventloop_remove(int fd);
+
+/* Wakes the loop from any thread, e.g. when a slot changes state */
+void eventloop_notify();
+
+/* Requests a wake-up no later than the given timestamp.   Deadlines are
+   forgotten each time eventloop_wait() returns, so they must be requested
+   again on every scan. */
+void eventloop_wake_at(eventloop_time deadline);
+
+/* Current time on CLOCK_MONOTONIC */
+eventloop_time eventloop_now();
+
+/* Requests that eventloop_wait() returns immediately, used when a state
+   transition means another scan is required */
+void eventloop_rescan();
+
+/* Blocks until at least one event arrives, a requested deadline passes or a
+   rescan was requested.   Returns the number of events written to events, or
+   RV_FAIL on error. */
+int eventloop_wait(eventloop_event *events, int max_events);
+
+#endif
@@ -26,12 +26,17 @@
 #include <string.h>
 #include "daemonise.h"
 #include "jobdispatching.h"
+#include "jobqueue.h"
 #include "fatcontroller.h"
 #include "dgetopts.h"
 #include "sfmemlib.h"
 
 static const char *LOG_FORMAT = NULL;
 
+/* Arguments given at startup, parsed again for a reload */
+static int saved_argc = 0;
+static char **saved_argv = NULL;
+
     void _syslog(int facility_priority, const char *format, ...)
     {
         char message[2048];
@@ -70,6 +75,7 @@ static const char *LOG_FORMAT = NULL;
 
     void showStartupOptions(struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings)
     {
+        struct dispatching_settings *pool;
         int i=0;
         
         if (!ap_settings->debug)
@@ -91,41 +97,262 @@ static const char *LOG_FORMAT = NULL;
         
         /* Dispatcher settings */
         printf("\nDispatcher settings:\n");
-        printf("Logfile: %s\n", dp_settings->logfile);
-        printf("Error logfile: %s\n", dp_settings->errlogfile);
-        printf("Sleep: %d\n", dp_settings->sleep);
-        printf("SleepOnError: %d\n", dp_settings->sleepOnError);
-        printf("Threads: %d\n", dp_settings->threads);
-        printf("Run once: %d\n", dp_settings->run_once);
-        printf("Cmd: %s\n", dp_settings->cmd);
-        
-        switch (dp_settings->threadModel)
+        printf("Log splice: %s\n", dp_settings->log_splice == 1 ? "YES" : "NO");
+        printf("Log lines: %s\n", dp_settings->log_lines == 1 ? "YES" : "NO");
+        printf("Log line prefix: %s\n", dp_settings->log_line_prefix == 1 ? "YES" : "NO");
+        printf("Max processes: %d\n", dp_settings->max_processes);
+        printf("Control socket: %s\n", dp_settings->control_socket);
+        printf("Metrics file: %s\n", dp_settings->metrics_file);
+        printf("Metrics interval: %.3fs\n", EVENTLOOP_SECONDS(dp_settings->metrics_interval));
+        printf("cgroup: %s\n", dp_settings->cgroup);
+        printf("Dispatcher CPUs: %s\n", dp_settings->dispatcher_cpus);
+        
+        /* Settings of each pool */
+        for (pool = dp_settings; pool != NULL; pool = pool->next_pool)
         {
-            case THREAD_MODEL_INDEPENDENT:
-                printf("Thread model: INDEPENDENT\n");
-                break;
-            case THREAD_MODEL_DEPENDENT:
-                printf("Thread model: DEPENDENT\n");
-                break;
-            case THREAD_MODEL_FIXED_INTERVAL:
-                 printf("Thread model: FIXED INTERVAL\n");
-                break;
-            default:
-                 printf("Thread model: Unknown (error)\n");
+            printf("\nPool %s:\n", pool->pool_name);
+            printf("Logfile: %s\n", pool->logfile);
+            printf("Error logfile: %s\n", pool->errlogfile);
+            printf("Sleep: %.3fs\n", EVENTLOOP_SECONDS(pool->sleep));
+            printf("SleepOnError: %.3fs\n", EVENTLOOP_SECONDS(pool->sleepOnError));
+            printf("Sleep backoff: %s\n", pool->sleep_backoff == BACKOFF_EXPONENTIAL ? "EXPONENTIAL"
+                                         : pool->sleep_backoff == BACKOFF_DECORRELATED ? "DECORRELATED" : "FIXED");
+            printf("Sleep max: %.3fs\n", EVENTLOOP_SECONDS(pool->sleep_max));
+            printf("SleepOnError backoff: %s\n", pool->sleep_on_error_backoff == BACKOFF_EXPONENTIAL ? "EXPONENTIAL"
+                                                : pool->sleep_on_error_backoff == BACKOFF_DECORRELATED ? "DECORRELATED" : "FIXED");
+            printf("SleepOnError max: %.3fs\n", EVENTLOOP_SECONDS(pool->sleep_on_error_max));
+            printf("Breaker threshold: %.2f\n", pool->breaker_threshold);
+            printf("Breaker window: %d\n", pool->breaker_window);
+            printf("Breaker open time: %.3fs\n", EVENTLOOP_SECONDS(pool->breaker_open_time));
+            printf("Threads: %d\n", pool->threads);
+            printf("Run once: %d\n", pool->run_once);
+            printf("Cmd: %s\n", pool->cmd);
+        
+            switch (pool->threadModel)
+            {
+                case THREAD_MODEL_INDEPENDENT:
+                    printf("Thread model: INDEPENDENT\n");
+                    break;
+                case THREAD_MODEL_DEPENDENT:
+                    printf("Thread model: DEPENDENT\n");
+                    break;
+                case THREAD_MODEL_FIXED_INTERVAL:
+                     printf("Thread model: FIXED INTERVAL\n");
+                    break;
+                case THREAD_MODEL_PERSISTENT:
+                     printf("Thread model: PERSISTENT\n");
+                    break;
+                default:
+                     printf("Thread model: Unknown (error)\n");
+            }
+            
+            printf("Run time warn:: %.3fs\n", EVENTLOOP_SECONDS(pool->thread_run_time_warn));
+            printf("Run time max: %.3fs\n", EVENTLOOP_SECONDS(pool->thread_run_time_max));
+            printf("Termination timeout: %.3fs\n", EVENTLOOP_SECONDS(pool->termination_timeout));
+            printf("Maximum FI wait time: %.3fs\n", EVENTLOOP_SECONDS(pool->fi_wait_time_max));
+            printf("Append thread ID: %s\n", pool->append_thread_id == 1 ? "YES" : "NO");
+            printf("Max jobs per child: %d\n", pool->max_jobs_per_child);
+            printf("Direct reaping: %s\n", pool->direct_reaping == 1 ? "YES" : "NO");
+            printf("posix_spawn: %s\n", pool->posix_spawn == 1 ? "YES" : "NO");
+        
+            switch (pool->queue_source)
+            {
+                case JOBQUEUE_SOURCE_FIFO:
+                    printf("Queue: FIFO %s\n", pool->queue_location);
+                    break;
+                case JOBQUEUE_SOURCE_SPOOL:
+                    printf("Queue: SPOOL %s\n", pool->queue_location);
+                    break;
+                case JOBQUEUE_SOURCE_SOCKET:
+                    printf("Queue: SOCKET %s\n", pool->queue_location);
+                    break;
+                default:
+                    printf("Queue: NONE\n");
+            }
+        
+            printf("Queue delivery: %s\n", pool->queue_delivery == JOBQUEUE_DELIVERY_ENV ? "ENV"
+                                          : pool->queue_delivery == JOBQUEUE_DELIVERY_STDIN ? "STDIN" : "ARGV");
+            printf("Queue batch: %d\n", pool->queue_batch);
+            printf("Concurrency: %s\n", pool->concurrency_controller == CONCURRENCY_AIMD ? "AIMD"
+                                       : pool->concurrency_controller == CONCURRENCY_MULTIPLICATIVE ? "MULTIPLICATIVE" : "LINEAR");
+            printf("Concurrency decay: %.2f\n", pool->concurrency_decay);
+            printf("cgroup cpu.max: %s\n", pool->cgroup_cpu_max);
+            printf("cgroup memory.max: %s\n", pool->cgroup_memory_max);
+            printf("cgroup io.max: %s\n", pool->cgroup_io_max);
+            printf("cgroup per job: %s\n", pool->cgroup_per_job == 1 ? "YES" : "NO");
+            printf("CPUs: %s\n", pool->cpus);
+            printf("Pin threads: %s\n", pool->pin_threads == 1 ? "YES" : "NO");
+            printf("NUMA nodes: %s\n", pool->numa_nodes);
+            printf("Nice: %d\n", pool->nice);
+            printf("I/O priority: %d\n", pool->ionice);
+            printf("Scheduling policy: %d\n", pool->scheduler);
+        
+            printf("argc: %d\n", pool->argc);
+        
+            for (i=0; i<pool->argc; i++)
+            {
+                printf("argv[%d]: %s\n", i, pool->argv[i]);
+            }
         }
+    }
+    
+    void initDispatchingSettings(struct dispatching_settings *settings)
+    {
+        settings->pool_name = NULL;
+        settings->logformat = NULL;
+        settings->sleep = DEFAULT_SLEEP;
+        settings->sleepOnError = DEFAULT_SLEEP_ON_ERROR;
+        settings->sleep_backoff = DEFAULT_BACKOFF;
+        settings->sleep_max = DEFAULT_SLEEP_MAX;
+        settings->sleep_on_error_backoff = DEFAULT_BACKOFF;
+        settings->sleep_on_error_max = DEFAULT_SLEEP_ON_ERROR_MAX;
+        settings->breaker_threshold = 0;
+        settings->breaker_window = DEFAULT_BREAKER_WINDOW;
+        settings->breaker_open_time = DEFAULT_BREAKER_OPEN_TIME;
+        settings->threads = DEFAULT_NO_THREADS;
+        settings->logfile = NULL;
+        settings->errlogfile = NULL;
+        settings->path = NULL;
+        settings->cmd = NULL;
+        settings->argc = 0;
+        settings->argv = NULL;
+        settings->threadModel = THREAD_MODEL_DEPENDENT;
+        settings->thread_run_time_warn = DEFAULT_THREAD_RUN_TIME_WARN;
+        settings->thread_run_time_max = DEFAULT_THREAD_RUN_TIME_MAX;
+        settings->termination_timeout = DEFAULT_TERMINATION_TIMEOUT;
+        settings->fi_wait_time_max = DEFAULT_FI_WAIT_TIME_MAX;
+        settings->append_thread_id = 0;
+        settings->max_jobs_per_child = 0;
+        settings->run_once = 0;
+        settings->direct_reaping = 0;
+        settings->posix_spawn = 0;
+        settings->log_splice = 0;
+        settings->log_lines = 0;
+        settings->log_line_prefix = 0;
+        settings->queue_source = JOBQUEUE_SOURCE_NONE;
+        settings->queue_location = NULL;
+        settings->queue_delivery = JOBQUEUE_DELIVERY_ARGV;
+        settings->queue_batch = 1;
+        settings->concurrency_controller = DEFAULT_CONCURRENCY_CONTROLLER;
+        settings->concurrency_decay = DEFAULT_CONCURRENCY_DECAY;
+        settings->cgroup_cpu_max = NULL;
+        settings->cgroup_memory_max = NULL;
+        settings->cgroup_io_max = NULL;
+        settings->cgroup_per_job = 0;
+        settings->cpus = NULL;
+        settings->pin_threads = 0;
+        settings->numa_nodes = NULL;
+        settings->nice = PLACEMENT_UNSET;
+        settings->ionice = PLACEMENT_UNSET;
+        settings->scheduler = PLACEMENT_UNSET;
+        settings->max_processes = 0;
+        settings->control_socket = NULL;
+        settings->metrics_file = NULL;
+        settings->metrics_interval = DEFAULT_METRICS_INTERVAL;
+        settings->cgroup = NULL;
+        settings->dispatcher_cpus = NULL;
+        settings->next_pool = NULL;
+    }
+    
+    void freeDispatchingSettings(struct dispatching_settings *settings)
+    {
+        struct dispatching_settings *next;
+        int fargc;
+        
+        while (settings != NULL)
+        {
+            next = settings->next_pool;
+            
+            free(settings->pool_name);
+            free(settings->logfile);
+            free(settings->logformat);
+            free(settings->path);
+            free(settings->cmd);
+            free(settings->errlogfile);
+            free(settings->queue_location);
+            free(settings->control_socket);
+            free(settings->metrics_file);
+            free(settings->cgroup);
+            free(settings->cgroup_cpu_max);
+            free(settings->cgroup_memory_max);
+            free(settings->cgroup_io_max);
+            free(settings->cpus);
+            free(settings->numa_nodes);
+            free(settings->dispatcher_cpus);
             
-        printf("Run time warn:: %d\n", dp_settings->thread_run_time_warn);
-        printf("Run time max: %d\n", dp_settings->thread_run_time_max);
-        printf("Termination timeout: %d\n", dp_settings->termination_timeout);
-        printf("Maximum FI wait time: %d\n", dp_settings->fi_wait_time_max);
-        printf("Append thread ID: %s\n", dp_settings->append_thread_id == 1 ? "YES" : "NO");
+            for (fargc = 0; fargc < settings->argc; fargc++)
+            {
+                free(settings->argv[fargc]);
+            }
+            
+            free(settings->argv);
+            
+            free(settings);
+            
+            settings = next;
+        }
+    }
+    
+    /* Loads the settings again from the arguments given at startup, reading
+       any config files again (see reload_pools()).   Errors are logged, as
+       STDERR is not seen once daemonised.   Returns NULL if the settings are
+       not valid. */
+    struct dispatching_settings *reloadDispatchingSettings()
+    {
+        struct application_settings ap_settings = {0, 0, 0};
+        struct daemon_settings dm_settings = {NULL, NULL, NULL, -1};
+        struct dispatching_settings *dp_settings;
+        FILE *errors;
+        char *messages = NULL, *line, *next;
+        size_t size = 0;
+        int err;
+        
+        dp_settings = sfmalloc(sizeof (struct dispatching_settings));
+        initDispatchingSettings(dp_settings);
+        
+        /* Collect the errors reported while parsing to log them.   stderr
+           itself is left alone, as other threads may be writing to it. */
+        errors = open_memstream(&messages, &size);
         
-        printf("argc: %d\n", dp_settings->argc);
+        err = reprocessOptions(saved_argc, saved_argv, &ap_settings, &dm_settings, dp_settings, errors != NULL ? errors : stderr);
+        
+        if (errors != NULL)
+        {
+            fclose(errors);
+            
+            for (line = messages; line != NULL && *line != '\0'; line = next)
+            {
+                next = strchr(line, '\n');
+                
+                if (next != NULL)
+                {
+                    *next++ = '\0';
+                }
+                
+                _syslog(LOG_ERR, "Reload: %s", line);
+            }
+            
+            free(messages);
+        }
         
-        for (i=0; i<dp_settings->argc; i++)
+        /* Only read at startup */
+        if (err == 0 && dp_settings->logformat != NULL && strcmp(dp_settings->logformat, LOG_FORMAT) != 0)
         {
-            printf("argv[%d]: %s\n", i, dp_settings->argv[i]);
+            _syslog(LOG_WARNING, "The log format can only be changed by a restart");
         }
+        
+        free(dm_settings.name);
+        free(dm_settings.rundir);
+        free(dm_settings.pidfile);
+        
+        if (err != 0)
+        {
+            freeDispatchingSettings(dp_settings);
+            
+            return NULL;
+        }
+        
+        return dp_settings;
     }
     
     int main(int argc, char **argv)
@@ -133,7 +360,7 @@ static const char *LOG_FORMAT = NULL;
         struct application_settings *ap_settings;
         struct daemon_settings *dm_settings;
         struct dispatching_settings *dp_settings;
-        int fargc, err=1, daemonise_return_value=-2;
+        int err=1, daemonise_return_value=-2;
         
         /* Assign heap space */
         ap_settings = sfmalloc(sizeof (struct application_settings));
@@ -151,23 +378,11 @@ static const char *LOG_FORMAT = NULL;
         dm_settings->pidfile = NULL;
         dm_settings->pidfd = -1;
         
-        dp_settings->sleep = DEFAULT_SLEEP;
-        dp_settings->sleepOnError = DEFAULT_SLEEP_ON_ERROR;
-        dp_settings->threads = DEFAULT_NO_THREADS;
-        dp_settings->logfile = NULL;
-        dp_settings->errlogfile = NULL;
-        dp_settings->path = NULL;
-        dp_settings->cmd = NULL;
-        dp_settings->argc = 0;
-        dp_settings->argv = NULL;
-        dp_settings->threadModel = THREAD_MODEL_DEPENDENT;
-        dp_settings->thread_run_time_warn = DEFAULT_THREAD_RUN_TIME_WARN;
-        dp_settings->thread_run_time_max = DEFAULT_THREAD_RUN_TIME_MAX;
-        dp_settings->termination_timeout = DEFAULT_TERMINATION_TIMEOUT;
-        dp_settings->fi_wait_time_max = DEFAULT_FI_WAIT_TIME_MAX;
-        dp_settings->append_thread_id = 0;
-        dp_settings->run_once = 0;
-
+        initDispatchingSettings(dp_settings);
+        
+        saved_argc = argc;
+        saved_argv = argv;
+        
         dp_settings->logformat = sfmalloc(sizeof(char) * (strlen(DEFAULT_LOG_FORMAT)+1));;
         strcpy(dp_settings->logformat, DEFAULT_LOG_FORMAT);
 
@@ -199,7 +414,7 @@ static const char *LOG_FORMAT = NULL;
                         err = 0;
                         
                         /* Start the job dispatcher - this is the main part of the application */
-                        dispatch(dp_settings, ap_settings->daemonise);
+                        dispatch(dp_settings, ap_settings->daemonise, reloadDispatchingSettings);
                     
                         daemonShutdown(dm_settings);
                     }
@@ -217,7 +432,7 @@ static const char *LOG_FORMAT = NULL;
                 {
                     /* Start the job dispatcher - this is the main part of the application */
                     //dispatch(dp_settings, ap_settings->daemonise);
-                    dispatch(dp_settings, 1);
+                    dispatch(dp_settings, 1, reloadDispatchingSettings);
                 } 
             }
         }
@@ -229,20 +444,7 @@ static const char *LOG_FORMAT = NULL;
         free(dm_settings->pidfile);
         free(dm_settings);
         
-        free(dp_settings->logfile);
-        free(dp_settings->logformat);
-        free(dp_settings->path);
-        free(dp_settings->cmd);
-        free(dp_settings->errlogfile);
-        
-        for (fargc = 0; fargc < dp_settings->argc; fargc++)
-        {
-            free(dp_settings->argv[fargc]);
-        }
-        
-        free(dp_settings->argv);
-        
-        free(dp_settings);
+        freeDispatchingSettings(dp_settings);
         
         closelog();
 
@@ -40,6 +40,9 @@ struct application_settings
 
 void _syslog(int facility_priority, const char *format, ...);
 void setupSyslog(int debug, char *name, int daemonise, char *format);
+void initDispatchingSettings(struct dispatching_settings *settings);
+void freeDispatchingSettings(struct dispatching_settings *settings);
+struct dispatching_settings *reloadDispatchingSettings();
 void showStartupOptions(struct application_settings *ap_settings, struct daemon_settings *dm_settings, struct dispatching_settings *dp_settings);
 int main(int argc, char **argv);
 
@@ -19,32 +19,117 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <spawn.h>
 #include "extern.h"
+#include "eventloop.h"
 #include "jobdispatching.h"
+#include "fatcontroller.h"
 #include "sfmemlib.h"
 #include "subprocslog.h"
+#include "jobqueue.h"
+#include "concurrency.h"
+#include "deadlines.h"
+#include "control.h"
+#include "cgroup.h"
+#include "placement.h"
+
+/* Slots of every pool by id.   Slots are allocated in blocks which never move
+   (see add_slots()), so a slot may be referred to by pointer. */
+static slot **slots = NULL;
+static int slot_count = 0;
+
+/* Blocks of slots, to free them */
+static slot **slot_blocks = NULL;
+static int slot_block_count = 0;
+
+static pool **pools = NULL;
+static int pool_count = 0;
+
+/* Loads the settings again when SIGHUP is received */
+static settings_loader load_settings = NULL;
+
+/* Log capture mode, which cannot be changed by a reload */
+static int capture_mode = SUBPROCSLOG_CAPTURE_COPY;
+
+/* Most jobs running at once across all pools, 0 for no limit */
+static int max_processes = 0;
+
+/* Control socket, which cannot be changed by a reload, NULL if none */
+static const char *control_socket = NULL;
 
-pthread_mutex_t mutexSignal, mutexLog;
-struct dispatching_settings *dp_settings;
-slot **slots;
 int handledSignal = -1;
 
+/* Direct reaping: set if sub-processes are watched with pidfds */
+static int reap_with_pidfd = 0;
+
+/* Direct reaping: set if sub-processes without a pidfd are reaped on SIGCHLD */
+static int sigchld_caught = 0;
+
+/* Direct reaping: number of running sub-processes without a pidfd */
+static int unwatched_processes = 0;
+
+/* Persistent model: set once idle workers are being stopped for shutdown */
+static int workers_stopping = 0;
+
+/* Metrics file, NULL if none, how often it is written and when next */
+static const char *metrics_file = NULL;
+static eventloop_time metrics_interval = DEFAULT_METRICS_INTERVAL;
+static eventloop_time metrics_due = 0;
+
+/* cgroup root, which cannot be changed by a reload, NULL if none, and whether
+   it is used (see cgroup_initialize()) */
+static const char *cgroup_root = NULL;
+static int cgroups = 0;
+
+/* CPUs the dispatcher is pinned to, which cannot be changed by a reload, NULL
+   if it is not */
+static const char *dispatcher_cpus = NULL;
+
+/* Set if forked sub-processes are timed until they call exec, which takes a
+   pipe watched by the event loop, so only if the metrics are read */
+static int time_exec = 0;
+
+/* Left in the exec pipe of a forked sub-process, see watch_exec() */
+typedef struct
+{
+    eventloop_time spawned_at;
+    int pool;
+} exec_timing;
+
+/* Slots whose state has changed since they were last filed, pushed by any
+   thread and taken all at once by the dispatcher, see slot_changed() */
+static _Atomic(slot *) changed_slots = NULL;
+
+/* Changed slots taken by the dispatcher but not yet filed, oldest first */
+static slot *changed_slots_taken = NULL;
+
+extern char **environ;
+
 /* Same as pipe but writes an error and halts execution on failure
  *
+ * Both ends are close-on-exec so that pipes belonging to one sub-process are
+ * never inherited by another (dup2 clears the flag on the duplicate).
  */
 static int pipe_safe(int pipefd[2])
 {
-    int pipe_err = pipe(pipefd);
+    int pipe_err = pipe2(pipefd, O_CLOEXEC);
     
     /* Check the pipe was created */
     if (pipe_err != 0)
@@ -56,8 +141,56 @@ static int pipe_safe(int pipefd[2])
     return pipe_err;
 }
 
+/* Writes an error of a forked sub-process to its STDERR and, if errnum is not
+ * 0, the error number (strerror() is not safe here).   Nothing between fork()
+ * and exec may take a lock (syslog, stdio, malloc) as another thread may have
+ * held it when we forked, so this only uses write().
+ */
+static void child_error(const char *message, const char *detail, int errnum)
+{
+    char number[16];
+    int i = sizeof(number);
+    
+    if (write(STDERR_FILENO, message, strlen(message)) == -1)
+    {
+        /* Nowhere left to report it */
+        return;
+    }
+    
+    if (detail != NULL && write(STDERR_FILENO, detail, strlen(detail)) == -1)
+    {
+        return;
+    }
+    
+    if (errnum != 0)
+    {
+        number[--i] = ']';
+        
+        do
+        {
+            number[--i] = '0' + errnum % 10;
+            errnum /= 10;
+        }
+        while (errnum > 0 && i > 1);
+        
+        number[--i] = '[';
+        
+        if (write(STDERR_FILENO, "   Error: ", 10) == -1 || write(STDERR_FILENO, number + i, sizeof(number) - i) == -1)
+        {
+            return;
+        }
+    }
+    
+    if (write(STDERR_FILENO, "\n", 1) == -1)
+    {
+        /* Nowhere left to report it */
+    }
+}
+
 /* Connects the input of a pipe to a file descriptor and closes the output
- * (this is only required in the process which reads from the pipe).
+ * (this is only required in the process which reads from the pipe).   Only
+ * called in a forked sub-process, so errors go to STDERR and it halts with
+ * _exit().
  *
  */
 static int connect_pipe_input(int pipefd[2], int input_fd)
@@ -66,14 +199,37 @@ static int connect_pipe_input(int pipefd[2], int input_fd)
     
     if ((fd = dup2(pipefd[1], input_fd)) == -1)
     {
-        _syslog(LOG_CRIT, "Cannot duplicate stream file descriptor: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+        child_error("Cannot duplicate stream file descriptor in child process", NULL, errno);
+        _exit(EXIT_FAILURE);
     }
     
     if (close(pipefd[0]) != 0)
     {
-        _syslog(LOG_CRIT, "Cannot close pipe file descriptor in child process: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+        child_error("Cannot close pipe file descriptor in child process", NULL, errno);
+        _exit(EXIT_FAILURE);
+    }
+    
+    return fd;
+}
+
+/* Connects the output of a pipe to a file descriptor and closes the input,
+ * i.e. the reverse of connect_pipe_input() (used for STDIN of workers).
+ *
+ */
+static int connect_pipe_output(int pipefd[2], int output_fd)
+{
+    int fd;
+    
+    if ((fd = dup2(pipefd[0], output_fd)) == -1)
+    {
+        child_error("Cannot duplicate stream file descriptor in child process", NULL, errno);
+        _exit(EXIT_FAILURE);
+    }
+    
+    if (close(pipefd[1]) != 0)
+    {
+        child_error("Cannot close pipe file descriptor in child process", NULL, errno);
+        _exit(EXIT_FAILURE);
     }
     
     return fd;
@@ -91,668 +247,3803 @@ static void sfclose(const int fd, const char *error_message)
     }
 }
 
-/**
- * Each thread will do this
- *
+/* Hands the exec pipe of a forked sub-process to the event loop, which reports
+ * a hang-up once the sub-process has called exec (or exited) and so closed its
+ * end, see exec_done().   The time it was forked is left in the pipe, so the
+ * parent never waits.   Sub-processes forked at the same time by other threads
+ * hold the pipe until they call exec too, so the time may be a little long.
  */
-void *task(void *i)
+static void watch_exec(int pipefd[2], int pool_id, eventloop_time spawned_at)
 {
-    /* Declarations - lots of comments due to poor variable names */
-    
-        /* Used in to unblock all signals in the sub-process before exec */
-        sigset_t signalSet;
+    exec_timing timing = {spawned_at, pool_id};
     
-        /* Used for the thread id from the function param */
-        long iid;
-        char *tid;
-        long *piid;
-        
-        /* Will contain the status of the sub-process when it ends */
-        int stat_loc=0;
-    
-        /* Return value of waitpid */
-        int wpid=0;
-    
-        int pipes=0, pipefd_stdout[2], pipefd_stderr[2];
-        
-        /* PID of the sub-process */
-        pid_t pid;
-        
-        /* Variables only needed in the child process */
-        int argc=0, argc_i, errsv;
-        char **argv;
-        
-        int logger_id = -1;
+    /* Only hang-ups are wanted, which epoll always reports */
+    if (write(pipefd[1], &timing, sizeof(timing)) != (ssize_t) sizeof(timing)
+     || eventloop_add(pipefd[0], EVENTLOOP_SOURCE_EXEC, pipefd[0], 0) != RV_OK)
+    {
+        sfclose(pipefd[0], "Cannot close exec pipe output in parent process.");
+    }
     
+    sfclose(pipefd[1], "Cannot close exec pipe input in parent process.");
+}
 
-    piid = (long *)i;
-    iid = *piid;
+/* Records the exec latency of a sub-process once it has closed its end of the
+ * exec pipe, see watch_exec()
+ */
+static void exec_done(int fd)
+{
+    eventloop_time now = eventloop_now();
+    exec_timing timing;
     
-    /* Say hello and show the thread number */
-    _syslog(LOG_DEBUG, "Thread %ld: starting", iid);
-
-    if (dp_settings->logfile != NULL)
+    if (read(fd, &timing, sizeof(timing)) == (ssize_t) sizeof(timing) && timing.pool < pool_count)
     {
-        pipes = pipe_safe(pipefd_stdout) + pipe_safe(pipefd_stderr);
+        metrics_observe(&pools[timing.pool]->metrics.exec_latency, now - timing.spawned_at);
     }
+    
+    /* Removed explicitly as a child not yet exec'd may have a copy */
+    eventloop_remove(fd);
+    sfclose(fd, "Cannot close exec pipe output.");
+}
 
-    /* Spawn a sub-process to run the program. */
-    pid = fork();
-
-    switch (pid)
+/* Logs the status of a sub-process as returned by wait4 */
+static void log_wait_status(long iid, int stat_loc)
+{
+    if (WIFEXITED(stat_loc))
     {
-        case 0:
-            setsid();
-            sigfillset(&signalSet);
-            pthread_sigmask(SIG_UNBLOCK, &signalSet, NULL );
-
-            /* 25 = "--tid=" plus 19 character spaces for characters required to represent maximum long */
-            tid = sfcalloc(25, sizeof(char));
-
-            sprintf(tid, "--tid=%ld", iid);
-        
-            if (pipes == 0)
-            {
-                /* Pipe STDOUT of child to parent */
-                connect_pipe_input(pipefd_stdout, STDOUT_FILENO);
-                
-                /* Pipe STDERR of child to parent */
-                connect_pipe_input(pipefd_stderr, STDERR_FILENO);
-            }
-            
-            /* We need to make an array containing the command plus all the individual arguments */
-            argv = sfmalloc(sizeof(char *));
-            argv[0] = sfmalloc((strlen(dp_settings->cmd) +1) * sizeof(char));
-            strcpy(argv[0], dp_settings->cmd);
-        
-            /* Now add all the arguments */
-            for (argc=0; argc<dp_settings->argc; argc++)
-            {
-                argv = sfrealloc(argv, (argc+2) *sizeof(char *));
-                argv[(argc+1)] = sfmalloc(sizeof(char) * ( strlen(dp_settings->argv[argc])+1) );
-                strcpy(argv[(argc+1)], dp_settings->argv[argc]);
-            }
-
-            if (dp_settings->append_thread_id == 1)
-            {
-                /* Add thread ID to args */
-                argv = sfrealloc(argv, (argc+2) *sizeof(char *));
-                argv[(argc+1)] = sfmalloc(sizeof(char) * (strlen(tid)+1) );
-                strcpy(argv[(argc+1)], tid);
-                
-                argc++;
-            }
-
-            /* Null terminate the array */
-            argv = sfrealloc(argv, (argc+2) *sizeof(char *));
-            argv[(argc+1)] = sfmalloc(sizeof(NULL));
-            argv[(argc+1)] = NULL;
-            
-            argc++;
-            
-            /* Close the logging so that the open file descriptor is closed in this child process */
-            closelog();
-        
-            /* Replace this process */
-            execv(argv[0],argv);
-
-            _syslog(LOG_CRIT, "Failed to execute command %s   Error: [%d] %s", argv[0], errno, strerror(errno));
-            
-            /* Anything that executes after this point is an indication that execv failed, i.e. processes replacement failed */
-            errsv = errno;
-            
-            _syslog(LOG_DEBUG, "EXECV: %s", strerror(errsv));
-            _syslog(LOG_DEBUG, "Cmd: %s", argv[0]);
-
-            /* Memory deassignment is purely academic as if we've got this far the we're heading to oblivion anyway */
-            free(tid);
-            
-            for (argc_i=0; argc_i<argc; argc_i++)
-            {
-                free(argv[argc_i]);
-            }
-            free(argv);
-            
-            /* Close the pipe fd */
-            if (close(pipefd_stdout[1]) != 0)
-            {
-                _syslog(LOG_CRIT, "Cannot close pipe file descriptor in child process.");
-            }
-            
-            exit(EXIT_FAILURE); /* only if execv fails */
-        case -1:
-            /*printf("Thread %d: Fork failed\n", iid);*/
-            _syslog(LOG_WARNING, "Thread %ld: Fork failed", iid);
-            slots[iid]->status = -1 * (time(0) + dp_settings->sleepOnError);
-            break;
-        default:
-            /*  parent process */
-            slots[iid]->status = pid;
-
-            if (pipes == 0)
-            {
-                sfclose(pipefd_stdout[1], "Cannot close STDOUT pipe input in parent process.");
-                sfclose(pipefd_stderr[1], "Cannot close STDERR pipe input parent process.");
-
-                /* Attach source ends of the pipe to the sub-process to the logging system */
-                logger_id = subprocslog_append_source(pipefd_stdout[0], pipefd_stderr[0]);
-                
-                if (logger_id == RV_FAIL)
-                {
-                    _syslog(LOG_WARNING, "Could not append sub-process' pipes to logging system.");
-                    
-                    sfclose(pipefd_stdout[0], "Cannot close STDOUT pipe output in parent process.");
-                    sfclose(pipefd_stderr[0], "Cannot close STDERR pipe output parent process.");
-                }
-            }
-            
-            do
-            {
-                wpid = waitpid(pid, &stat_loc, WUNTRACED
-#ifdef WCONTINUED       /* Not all implementations support this */
-                | WCONTINUED
-#endif
-                );
-                
-                if (wpid == -1)
-                {
-                    char buf[256];
-                    strerror_r(errno, buf, 256);
-                    _syslog(LOG_CRIT, "waitpid failed - errno:%d(%s)", errno, buf);
-                    exit(EXIT_FAILURE);
-                }
-
-
-                if (WIFEXITED(stat_loc))
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: Exited", iid);
-                }
-                else if (WIFSIGNALED(stat_loc))
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: Killed with signal %d", iid, WTERMSIG(stat_loc));
-                } 
-                else if (WIFSTOPPED(stat_loc))
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: Stopped (signal %d)", iid, WSTOPSIG(stat_loc));
+        _syslog(LOG_DEBUG, "Thread %ld: Exited", iid);
+    }
+    else if (WIFSIGNALED(stat_loc))
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: Killed with signal %d", iid, WTERMSIG(stat_loc));
+    } 
+    else if (WIFSTOPPED(stat_loc))
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: Stopped (signal %d)", iid, WSTOPSIG(stat_loc));
 #ifdef WIFCONTINUED     /* Not all implementations support this */
-                }
-                else if (WIFCONTINUED(stat_loc))
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: Continued", iid);
+    }
+    else if (WIFCONTINUED(stat_loc))
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: Continued", iid);
 #endif
-                }
-                else
-                {    /* Non-standard case -- may never happen */
-                    _syslog(LOG_DEBUG, "Thread %ld: Unexpected status (0x%x)", iid, stat_loc);
-                }
-            } while (!WIFEXITED(stat_loc) && !WIFSIGNALED(stat_loc));            
-            
-            
-            _syslog(LOG_DEBUG, "Thread %ld: Child finished with exit code: %d", iid, WEXITSTATUS(stat_loc));
-
-            if (pipes == 0 && logger_id != RV_FAIL)
-            {
-                if (subprocslog_remove_source(logger_id) != RV_OK)
-                {
-                    _syslog(LOG_WARNING, "Could not remove sub-process pipes from logging system. Source id: %d, fd_stdout: %d, fd_stderr: %d", logger_id, pipefd_stdout[0], pipefd_stderr[0]);
-                    
-                    sfclose(pipefd_stdout[0], "Cannot close STDOUT pipe output in parent process.");
-                    sfclose(pipefd_stderr[0], "Cannot close STDERR pipe output in parent process.");
-                }
-            }
-            else
-            {
-                _syslog(LOG_DEBUG, "Not removing source. Source id: %d, fd_stdout: %d, fd_stderr: %d", logger_id, pipefd_stdout[0], pipefd_stderr[0]);
-            }
-            
-            /*
-                if independent thread model
-                    if exit status = EXIT_STATUS_OK_MORE
-                        set THREAD_STATUS_AVAILABLE so thread can be restarted
-                    else if is EXIT_STATUS_OK
-                        set to sleep
-                    else
-                        set to sleepOnError
-                else
-                    if exit_status = EXIT_STATUS_OK_MORE
-                        set to THREAD_STATUS_DONE_MORE
-                    else if is EXIT_STATUS_OK
-                        set to THREAD_STATUS_DONE_OK   (thread handler will then sleep)
-                    else
-                        set to THREAD_STATUS_DONE_FAIL (thread handler will then sleepOnError)
-            */
-            
-            /*
-                Log messages should perhaps be moved to the thread check and control logic (below)
-                In Fixed interval mode, the messages here from dependent mode do not make sense
-            */
-            
-            if (dp_settings->threadModel == THREAD_MODEL_INDEPENDENT)
-            {
-                if (WEXITSTATUS(stat_loc) == EXIT_STATUS_OK_MORE)
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: EXIT_STATUS_OK_MORE Returning to pool", iid);
-                    slots[iid]->status = THREAD_STATUS_AVAILABLE;
-                }
-                else if (WEXITSTATUS(stat_loc) == EXIT_STATUS_OK)
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: EXIT_STATUS_OK Putting thread to sleep", iid);
-                    slots[iid]->status = -1 * (time(0) + dp_settings->sleep);
-                }
-                else
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: Exit Fail Putting thread to sleepOnError", iid);
-                    slots[iid]->status = -1 * (time(0) + dp_settings->sleepOnError);
-                }
-            }
-            else
-            {
-                if (WEXITSTATUS(stat_loc) == EXIT_STATUS_OK_MORE)
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: EXIT_STATUS_OK_MORE Returning to pool", iid);
-                    slots[iid]->status = THREAD_STATUS_DONE_MORE;
-                }
-                else if (WEXITSTATUS(stat_loc) == EXIT_STATUS_OK)
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: EXIT_STATUS_OK Going to sleep", iid);
-                    slots[iid]->status = THREAD_STATUS_DONE_OK;
-                }
-                else
-                {
-                    _syslog(LOG_DEBUG, "Thread %ld: Exit Fail Going to sleepOnError", iid);
-                    slots[iid]->status = THREAD_STATUS_DONE_FAIL;
-                }
-            }
     }
+    else
+    {    /* Non-standard case -- may never happen */
+        _syslog(LOG_DEBUG, "Thread %ld: Unexpected status (0x%x)", iid, stat_loc);
+    }
+}
 
-    /* Re-initialise the slot struct ready for the next job */
-    slot_reset(slots[iid]);
+/* Builds the argument vector used for every sub-process of a pool: the
+ * command, its arguments, an optional --tid=x placeholder and a terminating
+ * NULL.   Only the placeholder differs between slots and it is patched when
+ * spawning.
+ */
+static void build_argv_template(pool_spawn *spawn)
+{
+    struct dispatching_settings *settings = spawn->settings;
+    int i;
     
-    /*printf("Thread %d: Finished\n", iid);*/
-    _syslog(LOG_DEBUG, "Thread %ld: Finished", iid);
+    spawn->argv_template_size = settings->argc + (settings->append_thread_id == 1 ? 3 : 2);
+    spawn->argv_template = sfcalloc(spawn->argv_template_size, sizeof(char *));
+    
+    spawn->argv_template[0] = settings->cmd;
+    
+    for (i=0; i<settings->argc; i++)
+    {
+        spawn->argv_template[i+1] = settings->argv[i];
+    }
+    
+    spawn->tid_index = settings->append_thread_id == 1 ? settings->argc + 1 : -1;
+    
+    spawn->argv_template[spawn->argv_template_size - 1] = NULL;
+}
 
-    /* Terminate the thread */
-    pthread_exit((void*) i);
+static void free_spawn(pool_spawn *spawn)
+{
+    if (spawn->reloaded)
+    {
+        freeDispatchingSettings(spawn->settings);
+    }
+    
+    placement_free(spawn->placement);
+    free(spawn->argv_template);
+    free(spawn);
 }
 
-void thread_proc_term(slot *slot)
+/* Frees the older spawns of a pool which no slot uses any more */
+static void free_unused_spawns(pool *pool)
 {
-    if (slot->termination_requested == 0)
+    pool_spawn **link = &pool->spawn->next, *spawn;
+    
+    while ((spawn = *link) != NULL)
     {
-        if (slot->status > 0)
+        if (spawn->users == 0)
         {
-            int kv = kill(slot->status, SIGTERM);
-            
-            slot->termination_requested = time(NULL);
-            
-            _syslog(LOG_INFO, "Terminating %d.   Signal sent: %s", slot->status, kv ==0?"ok":"fail");
+            *link = spawn->next;
+            free_spawn(spawn);
         }
         else
         {
-            _syslog(LOG_WARNING, "Attempted termination of thread that is not running.");
+            link = &spawn->next;
         }
     }
-    else
-    {
-        _syslog(LOG_WARNING, "Attempted termination of thread that is already pending termination");
-    }
 }
 
-void thread_proc_kill(slot *slot)
+/* Returns 1 if two possibly NULL strings differ */
+static int setting_changed(const char *a, const char *b)
 {
-    int kv = kill(slot->status, SIGKILL);
-    
-    _syslog(LOG_INFO, "Killed %d.   Signal sent: %s", slot->status, kv ==0?"ok":"fail");
+    return (a == NULL) != (b == NULL) || (a != NULL && strcmp(a, b) != 0);
 }
 
-void thread_proc_term_all()
+/* Returns 1 if sub-processes are started in the same way with both spawns */
+static int same_command(pool_spawn *a, pool_spawn *b)
 {
     int i;
-
-    for (i=0; i<dp_settings->threads;i++)
+    
+    if (a->argv_template_size != b->argv_template_size
+     || a->tid_index != b->tid_index
+     || a->log_destination != b->log_destination
+     || a->settings->posix_spawn != b->settings->posix_spawn
+     || a->settings->queue_delivery != b->settings->queue_delivery
+     || setting_changed(a->settings->logfile, b->settings->logfile)
+     || !placement_equal(a->placement, b->placement))
     {
-        /*
-            Would be good to do a check to make sure we're not killing something important
-            For now we'll just make sure we're not going to kill init
-        */
-        if (slots[i]->status > 1)
+        return 0;
+    }
+    
+    for (i=0; a->argv_template[i] != NULL; i++)
+    {
+        if (i != a->tid_index && strcmp(a->argv_template[i], b->argv_template[i]) != 0)
         {
-            thread_proc_term(slots[i]);
+            return 0;
         }
     }
+    
+    return 1;
 }
 
-void check_thread(slot *slot)
+/* Makes the given settings the ones a pool starts sub-processes with from
+ * now on.   reloaded is set if the settings are to be freed with the spawn.
+ */
+static void set_spawn(pool *pool, struct dispatching_settings *settings, int log_destination, int reloaded)
 {
-    /* Check if running */
-    if (slot->status > 0)
-    {
-        /* Check if termination requested */
-        if (slot->termination_requested != 0)
+    pool_spawn *spawn = sfmalloc(sizeof(pool_spawn));
+    
+    spawn->settings = settings;
+    spawn->log_destination = log_destination;
+    spawn->users = 0;
+    spawn->reloaded = reloaded;
+    spawn->next = pool->spawn;
+    
+    build_argv_template(spawn);
+    
+    spawn->placement = placement_create(settings->cpus, settings->pin_threads, settings->numa_nodes,
+                                        settings->nice, settings->ionice, settings->scheduler);
+    
+    /* Workers started with an older version are replaced, see retire_slot() */
+    spawn->version = spawn->next == NULL ? 0
+                   : same_command(spawn, spawn->next) ? spawn->next->version
+                                                      : spawn->next->version + 1;
+    
+    pool->spawn = spawn;
+    pool->settings = settings;
+    
+    free_unused_spawns(pool);
+}
+
+/* Called before starting a sub-process or worker for a slot */
+static void use_spawn(slot *slot)
+{
+    if (slot->spawn == NULL)
+    {
+        slot->spawn = slot->pool->spawn;
+        slot->spawn->users++;
+    }
+}
+
+/* Called once a slot's sub-process or worker has gone */
+static void release_spawn(slot *slot)
+{
+    if (slot->spawn != NULL)
+    {
+        slot->spawn->users--;
+        slot->spawn = NULL;
+        
+        free_unused_spawns(slot->pool);
+    }
+}
+
+/* Starts the sub-process with posix_spawn (vfork + exec), so the cost does not
+ * grow with the memory mapped by the dispatcher.   If pipes are given then
+ * STDOUT and STDERR of the sub-process are connected to them, and STDIN if
+ * pipefd_stdin is not NULL.   If cgroup_fd is not -1 the sub-process is put in
+ * that cgroup, from the start with glibc 2.41 and later or else once it has
+ * called exec.
+ *
+ * Returns the PID of the sub-process, or -1 on failure.
+ */
+static pid_t posix_spawn_process(char **argv, char **envp, int pipes, int *pipefd_stdin, int pipefd_stdout[2], int pipefd_stderr[2], int cgroup_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signalSet;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    pid_t pid;
+    int rv;
+    
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    
+    if (pipefd_stdin != NULL)
+    {
+        posix_spawn_file_actions_adddup2(&actions, pipefd_stdin[0], STDIN_FILENO);
+    }
+    
+    if (pipes == 0)
+    {
+        /* The original pipe descriptors are close-on-exec */
+        posix_spawn_file_actions_adddup2(&actions, pipefd_stdout[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, pipefd_stderr[1], STDERR_FILENO);
+    }
+    
+    /* Unblock all signals in the sub-process */
+    sigemptyset(&signalSet);
+    posix_spawnattr_setsigmask(&attr, &signalSet);
+    
+#ifdef POSIX_SPAWN_SETSID   /* glibc 2.26 and later */
+    flags |= POSIX_SPAWN_SETSID;
+#else
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, 0);
+#endif
+    
+#ifdef POSIX_SPAWN_SETCGROUP   /* glibc 2.41 and later */
+    if (cgroup_fd != -1)
+    {
+        flags |= POSIX_SPAWN_SETCGROUP;
+        posix_spawnattr_setcgroup_np(&attr, cgroup_fd);
+    }
+#endif
+    
+    posix_spawnattr_setflags(&attr, flags);
+    
+    rv = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp);
+    
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    
+    if (rv != 0)
+    {
+        _syslog(LOG_CRIT, "Failed to execute command %s   Error: [%d] %s", argv[0], rv, strerror(rv));
+        
+        return -1;
+    }
+    
+#ifndef POSIX_SPAWN_SETCGROUP
+    if (cgroup_fd != -1)
+    {
+        cgroup_attach(cgroup_fd, pid);
+    }
+#endif
+    
+    return pid;
+}
+
+/* Joins work items into one string after the given prefix, each item followed
+ * by a newline.   Returns the string (to be freed) and its length in length.
+ */
+static char *join_queue_items(jobqueue_item *items, const char *prefix, size_t *length)
+{
+    jobqueue_item *item;
+    size_t prefix_length = strlen(prefix);
+    char *joined, *p;
+    
+    *length = prefix_length;
+    
+    for (item = items; item != NULL; item = item->next)
+    {
+        *length += item->length + 1;
+    }
+    
+    joined = sfmalloc(*length + 1);
+    memcpy(joined, prefix, prefix_length);
+    p = joined + prefix_length;
+    
+    for (item = items; item != NULL; item = item->next)
+    {
+        memcpy(p, item->data, item->length);
+        p += item->length;
+        *p++ = '\n';
+    }
+    
+    *p = '\0';
+    
+    return joined;
+}
+
+/* Builds an environment for a sub-process: the dispatcher's environment with
+ * the work items in JOBQUEUE_ENV_NAME, one per line.   The array and the
+ * variable it adds are freed with free_queue_environment().
+ */
+static char **build_queue_environment(jobqueue_item *items)
+{
+    static const char prefix[] = JOBQUEUE_ENV_NAME "=";
+    char **envp;
+    size_t length;
+    int i, n = 0;
+    
+    for (i=0; environ[i] != NULL; i++);
+    
+    envp = sfmalloc((i + 2) * sizeof(char *));
+    
+    for (i=0; environ[i] != NULL; i++)
+    {
+        /* Any inherited value is replaced */
+        if (strncmp(environ[i], prefix, sizeof(prefix) - 1) != 0)
+        {
+            envp[n++] = environ[i];
+        }
+    }
+    
+    envp[n] = join_queue_items(items, prefix, &length);
+    
+    /* No newline after the last item */
+    envp[n][length - 1] = '\0';
+    
+    envp[n + 1] = NULL;
+    
+    return envp;
+}
+
+static void free_queue_environment(char **envp)
+{
+    int i;
+    
+    for (i=0; envp[i + 1] != NULL; i++);
+    
+    free(envp[i]);
+    free(envp);
+}
+
+/* Writes work items to the STDIN pipe of a sub-process, one per line, and
+ * closes it.   A full batch fits in the pipe so this does not block.
+ */
+static void write_queue_items(long iid, int fd, jobqueue_item *items)
+{
+    size_t length, written = 0;
+    ssize_t rv;
+    char *joined = join_queue_items(items, "", &length);
+    
+    while (written < length)
+    {
+        rv = write(fd, joined + written, length - written);
+        
+        if (rv == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            
+            /* e.g. EPIPE if the sub-process has already exited */
+            _syslog(LOG_WARNING, "Thread %ld: Cannot write work items to sub-process: [%d] %s", iid, errno, strerror(errno));
+            break;
+        }
+        
+        written += rv;
+    }
+    
+    free(joined);
+    
+    sfclose(fd, "Cannot close STDIN pipe input in parent process.");
+}
+
+/* Returns the name of the cgroup within its pool's for the jobs of a slot,
+ * written to name (CGROUP_NAME_SIZE), or NULL if its jobs are put in the
+ * pool's cgroup itself.
+ */
+static const char *job_cgroup_name(slot *slot, char *name)
+{
+    if (!slot->pool->cgroup_per_job)
+    {
+        return NULL;
+    }
+    
+    snprintf(name, CGROUP_NAME_SIZE, "thread-%d", slot->number);
+    
+    return name;
+}
+
+/* Opens the cgroup a slot's sub-process is put in, see cgroup_open().
+ * Returns -1 if there is none.
+ */
+static int open_job_cgroup(slot *slot)
+{
+    char name[CGROUP_NAME_SIZE];
+    
+    if (slot->pool->cgroup == NULL)
+    {
+        return -1;
+    }
+    
+    return cgroup_open(slot->pool->cgroup, job_cgroup_name(slot, name));
+}
+
+/* Forks and executes the command for a slot, connecting STDOUT and STDERR of
+ * the sub-process to the logging system.
+ *
+ * Any work items taken from the job queue for the slot are given to the
+ * sub-process as extra arguments, in its environment or on its STDIN,
+ * depending on the delivery setting, and then freed.
+ *
+ * Workers of the persistent model are instead given a pipe on STDIN to
+ * receive commands and their STDOUT is kept by the slot to read replies, so
+ * only STDERR is logged.
+ *
+ * With cgroups the sub-process is put in its pool's cgroup, or its slot's if
+ * each job has one, before exec.   It is then given its pool's CPUs, NUMA
+ * nodes and priorities, see placement_apply().
+ *
+ * Returns the PID of the sub-process, or -1 if it could not be started.
+ */
+static pid_t spawn_process(slot *slot)
+{
+    /* Used in to unblock all signals in the sub-process before exec */
+    sigset_t signalSet;
+
+    long iid = slot->id;
+    
+    /* Only read, a reload does not change it */
+    pool_spawn *spawn = slot->spawn;
+    struct dispatching_settings *settings = spawn->settings;
+    
+    int pipes=0, pipefd_stdout[2], pipefd_stderr[2], pipefd_stdin[2];
+    
+    /* Closed by exec, see watch_exec() */
+    int exec_pipe = 0, pipefd_exec[2];
+    
+    /* Time the sub-process was started, for the exec latency */
+    eventloop_time spawned_at;
+    
+    /* cgroup the sub-process is put in, -1 if none */
+    int cgroup_fd;
+    
+    /* What of the placement could not be set, NULL if all was */
+    const char *misplaced;
+    
+    int worker = settings->threadModel == THREAD_MODEL_PERSISTENT;
+    
+    /* Work items for the sub-process (workers are given theirs per job) */
+    jobqueue_item *items = worker ? NULL : slot->queue_items, *item;
+    int delivery = items != NULL ? settings->queue_delivery : 0;
+    int stdin_pipe = worker || delivery == JOBQUEUE_DELIVERY_STDIN;
+    
+    /* PID of the sub-process */
+    pid_t pid;
+    
+    /* Copy of the template with this slot's thread ID and any work items */
+    char *argv[spawn->argv_template_size + (delivery == JOBQUEUE_DELIVERY_ARGV ? slot->queue_item_count : 0)];
+    char **envp = delivery == JOBQUEUE_DELIVERY_ENV ? build_queue_environment(items) : environ;
+    int argc = spawn->argv_template_size - 1;
+    
+    /* 20 = "--tid=" plus 10 characters for the largest thread number (an int) and the null */
+    char tid[20];
+    
+    memcpy(argv, spawn->argv_template, argc * sizeof(char *));
+    
+    if (spawn->tid_index != -1)
+    {
+        /* Thread IDs given to sub-processes are numbered within the pool */
+        snprintf(tid, sizeof(tid), "--tid=%d", slot->number);
+        argv[spawn->tid_index] = tid;
+    }
+    
+    if (delivery == JOBQUEUE_DELIVERY_ARGV)
+    {
+        for (item = items; item != NULL; item = item->next)
+        {
+            argv[argc++] = item->data;
+        }
+    }
+    
+    argv[argc] = NULL;
+    
+    slot->logger_id = RV_FAIL;
+    
+    if (settings->logfile != NULL)
+    {
+        pipes = pipe_safe(pipefd_stdout) + pipe_safe(pipefd_stderr);
+    }
+    
+    if (stdin_pipe)
+    {
+        pipe_safe(pipefd_stdin);
+    }
+
+    cgroup_fd = open_job_cgroup(slot);
+    
+    spawned_at = eventloop_now();
+    
+    if (settings->posix_spawn == 1)
+    {
+        /* Returns once the sub-process has called exec */
+        pid = posix_spawn_process(argv, envp, pipes, stdin_pipe ? pipefd_stdin : NULL, pipefd_stdout, pipefd_stderr, cgroup_fd);
+        
+        /* posix_spawn() cannot place the sub-process itself, so it is placed
+           from here once it has called exec */
+        if (pid > 0 && (misplaced = placement_apply(spawn->placement, slot->number, pid)) != NULL)
+        {
+            _syslog(LOG_WARNING, "Thread %ld: Could not set the %s of the sub-process", iid, misplaced);
+        }
+    }
+    else
+    {
+        if (time_exec)
+        {
+            exec_pipe = pipe_safe(pipefd_exec) == 0;
+        }
+        
+        /* Spawn a sub-process to run the program. */
+        pid = fork();
+    }
+
+    switch (pid)
+    {
+        case 0:
+            setsid();
+            sigfillset(&signalSet);
+            pthread_sigmask(SIG_UNBLOCK, &signalSet, NULL );
+            
+            if (stdin_pipe)
+            {
+                /* Commands or work items from the dispatcher */
+                connect_pipe_output(pipefd_stdin, STDIN_FILENO);
+            }
+        
+            if (pipes == 0)
+            {
+                /* Pipe STDOUT of child to parent */
+                connect_pipe_input(pipefd_stdout, STDOUT_FILENO);
+                
+                /* Pipe STDERR of child to parent */
+                connect_pipe_input(pipefd_stderr, STDERR_FILENO);
+            }
+            
+            /* Note that nothing here may take a lock (syslog, stdio) as another
+               thread may have held it when we forked, see child_error().   The
+               syslog socket is close-on-exec so there is no need for
+               closelog(). */
+            
+            if (cgroup_fd != -1 && cgroup_enter(cgroup_fd) != RV_OK)
+            {
+                child_error("Could not move the sub-process into its cgroup", NULL, 0);
+            }
+            
+            if ((misplaced = placement_apply(spawn->placement, slot->number, 0)) != NULL)
+            {
+                child_error("Could not set the sub-process's ", misplaced, 0);
+            }
+        
+            /* Replace this process */
+            execve(argv[0], argv, envp);
+
+            /* Anything that executes after this point is an indication that execv failed, i.e. processes replacement failed */
+            child_error("Failed to execute command ", argv[0], errno);
+            
+            _exit(EXIT_FAILURE); /* only if execv fails */
+        case -1:
+            /*printf("Thread %d: Fork failed\n", iid);*/
+            _syslog(LOG_WARNING, "Thread %ld: Fork failed", iid);
+            
+            metrics_add(&slot->pool->metrics.spawn_failures, 1);
+            
+            if (exec_pipe)
+            {
+                sfclose(pipefd_exec[0], "Cannot close exec pipe output after failed fork.");
+                sfclose(pipefd_exec[1], "Cannot close exec pipe input after failed fork.");
+            }
+            
+            if (pipes == 0)
+            {
+                sfclose(pipefd_stdout[0], "Cannot close STDOUT pipe output after failed fork.");
+                sfclose(pipefd_stdout[1], "Cannot close STDOUT pipe input after failed fork.");
+                sfclose(pipefd_stderr[0], "Cannot close STDERR pipe output after failed fork.");
+                sfclose(pipefd_stderr[1], "Cannot close STDERR pipe input after failed fork.");
+            }
+            
+            if (stdin_pipe)
+            {
+                sfclose(pipefd_stdin[0], "Cannot close STDIN pipe output after failed fork.");
+                sfclose(pipefd_stdin[1], "Cannot close STDIN pipe input after failed fork.");
+            }
+            break;
+        default:
+            /*  parent process */
+            if (exec_pipe)
+            {
+                watch_exec(pipefd_exec, slot->pool->id, spawned_at);
+            }
+            
+            metrics_add(&slot->pool->metrics.spawns, 1);
+            
+            if (settings->posix_spawn == 1)
+            {
+                metrics_observe(&slot->pool->metrics.exec_latency, eventloop_now() - spawned_at);
+            }
+            
+            if (worker)
+            {
+                sfclose(pipefd_stdin[0], "Cannot close STDIN pipe output in parent process.");
+                
+                slot->worker_stdin = pipefd_stdin[1];
+                slot->worker_stdout = pipefd_stdout[0];
+                slot->worker_line = sfmalloc(WORKER_LINE_SIZE);
+                slot->worker_line_length = 0;
+                
+                /* Replies are read from the event loop */
+                fcntl(slot->worker_stdout, F_SETFL, O_NONBLOCK);
+                eventloop_add(slot->worker_stdout, EVENTLOOP_SOURCE_WORKER, (int) iid, EPOLLIN);
+            }
+            else if (stdin_pipe)
+            {
+                sfclose(pipefd_stdin[0], "Cannot close STDIN pipe output in parent process.");
+                
+                write_queue_items(iid, pipefd_stdin[1], items);
+            }
+            
+            if (pipes == 0)
+            {
+                sfclose(pipefd_stdout[1], "Cannot close STDOUT pipe input in parent process.");
+                sfclose(pipefd_stderr[1], "Cannot close STDERR pipe input parent process.");
+
+                /* Attach source ends of the pipe to the sub-process to the logging system */
+                slot->log_fd_stdout = worker ? -1 : pipefd_stdout[0];
+                slot->log_fd_stderr = pipefd_stderr[0];
+                slot->logger_id = subprocslog_append_source(slot->log_fd_stdout, slot->log_fd_stderr, iid, pid, spawn->log_destination);
+                
+                if (slot->logger_id == RV_FAIL)
+                {
+                    _syslog(LOG_WARNING, "Could not append sub-process' pipes to logging system.");
+                    
+                    if (!worker)
+                    {
+                        sfclose(pipefd_stdout[0], "Cannot close STDOUT pipe output in parent process.");
+                    }
+                    
+                    sfclose(pipefd_stderr[0], "Cannot close STDERR pipe output parent process.");
+                }
+            }
+    }
+    
+    if (cgroup_fd != -1)
+    {
+        sfclose(cgroup_fd, "Cannot close cgroup in parent process.");
+    }
+    
+    if (items != NULL)
+    {
+        if (pid == -1)
+        {
+            _syslog(LOG_WARNING, "Thread %ld: Dropped %d work items as the sub-process could not be started", iid, slot->queue_item_count);
+        }
+        
+        if (envp != environ)
+        {
+            free_queue_environment(envp);
+        }
+        
+        jobqueue_free(items);
+        slot->queue_items = NULL;
+        slot->queue_item_count = 0;
+    }
+    
+    return pid;
+}
+
+/* Sets the deadline queue entry of a slot to the next time something has to
+ * be done for it: waking it up if it is sleeping or, if it is running,
+ * whichever is next of the run time warning, SIGTERM at the maximum run time
+ * or SIGKILL after the termination timeout.   See check_thread().
+ */
+static void schedule_slot(slot *slot)
+{
+    struct dispatching_settings *settings = slot->pool->settings;
+    eventloop_time deadline = 0, warn_at;
+    
+    if (slot->status == THREAD_STATUS_RUNNING || slot->status == THREAD_STATUS_BOOTSTRAPPING)
+    {
+        if (slot->termination_requested != 0)
+        {
+            deadline = slot->termination_requested + settings->termination_timeout;
+            
+            /* SIGKILL has already been sent */
+            if (deadline <= eventloop_now())
+            {
+                deadline = 0;
+            }
+        }
+        else
+        {
+            if (settings->thread_run_time_max > 0)
+            {
+                deadline = slot->last_started_at + settings->thread_run_time_max;
+            }
+            
+            if (settings->thread_run_time_warn > 0 && slot->duration_warning_issued == 0)
+            {
+                warn_at = slot->last_started_at + settings->thread_run_time_warn;
+                
+                if (deadline == 0 || warn_at < deadline)
+                {
+                    deadline = warn_at;
+                }
+            }
+        }
+    }
+    else if (slot->status == THREAD_STATUS_SLEEPING)
+    {
+        deadline = slot->wake_at;
+    }
+    
+    deadlines_set((int) slot->id, deadline);
+}
+
+/* Puts a slot to sleep for the given duration */
+static void slot_sleep(slot *slot, eventloop_time duration)
+{
+    slot->wake_at = eventloop_now() + duration;
+    slot->status = THREAD_STATUS_SLEEPING;
+    
+    schedule_slot(slot);
+}
+
+static void slot_list_remove(slot *slot, eventloop_time now)
+{
+    slot_list *list = slot->list;
+    
+    list->time += now - slot->listed_at;
+    list->listed_at_sum -= (uint64_t) slot->listed_at;
+    
+    if (slot->list_prev != NULL)
+    {
+        slot->list_prev->list_next = slot->list_next;
+    }
+    else
+    {
+        list->head = slot->list_next;
+    }
+    
+    if (slot->list_next != NULL)
+    {
+        slot->list_next->list_prev = slot->list_prev;
+    }
+    else
+    {
+        list->tail = slot->list_prev;
+    }
+    
+    list->length--;
+    slot->list = NULL;
+}
+
+static void slot_list_append(slot_list *list, slot *slot, eventloop_time now)
+{
+    slot->listed_at = now;
+    list->listed_at_sum += (uint64_t) now;
+    
+    slot->list = list;
+    slot->list_next = NULL;
+    slot->list_prev = list->tail;
+    
+    if (list->tail != NULL)
+    {
+        list->tail->list_next = slot;
+    }
+    else
+    {
+        list->head = slot;
+    }
+    
+    list->tail = slot;
+    list->length++;
+}
+
+/* Moves a slot to its pool's list for its state, so that the dispatcher can
+ * find available slots and the longest running slot without scanning every
+ * slot.   A slot which stays on the same list keeps its place.
+ */
+static void file_slot(slot *slot)
+{
+    slot_list *list;
+    eventloop_time now;
+    
+    if (slot->status == THREAD_STATUS_AVAILABLE)
+    {
+        list = &slot->pool->ready_slots;
+    }
+    else if (slot->status == THREAD_STATUS_RUNNING || slot->status == THREAD_STATUS_BOOTSTRAPPING)
+    {
+        list = &slot->pool->running_slots;
+    }
+    else if (slot->status == THREAD_STATUS_SLEEPING)
+    {
+        list = &slot->pool->sleeping_slots;
+    }
+    else
+    {
+        list = &slot->pool->other_slots;
+    }
+    
+    if (slot->list != list)
+    {
+        now = eventloop_now();
+        
+        if (slot->list != NULL)
+        {
+            slot_list_remove(slot, now);
+        }
+        
+        slot_list_append(list, slot, now);
+    }
+}
+
+/* Queues a slot whose status has changed to be filed (and passed to the
+ * thread model) by the dispatcher.   May be called from any thread, without
+ * locking: the slot is pushed onto changed_slots with compare-and-swap.
+ */
+static void slot_changed(slot *slot)
+{
+    struct slot *head;
+    
+    if (atomic_exchange(&slot->changed, 1) == 0)
+    {
+        head = atomic_load(&changed_slots);
+        
+        do
+        {
+            slot->changed_next = head;
+        } while (!atomic_compare_exchange_weak(&changed_slots, &head, slot));
+    }
+}
+
+/* Takes every slot queued by slot_changed() so far, reversing them into the
+   order they were queued in.   Slots queued after this are left for the next
+   pass of the dispatcher, so that jobs which end as fast as they are started
+   cannot keep it from the event loop. */
+static void take_changed_slots()
+{
+    struct slot *taken, *next;
+    
+    taken = atomic_exchange(&changed_slots, NULL);
+    
+    while (taken != NULL)
+    {
+        next = taken->changed_next;
+        taken->changed_next = changed_slots_taken;
+        changed_slots_taken = taken;
+        taken = next;
+    }
+}
+
+/* Takes the next slot taken by take_changed_slots(), NULL if there are none */
+static slot *next_changed_slot()
+{
+    struct slot *slot;
+    
+    slot = changed_slots_taken;
+    
+    if (slot != NULL)
+    {
+        changed_slots_taken = slot->changed_next;
+        
+        /* From here on a change queues the slot again */
+        atomic_store(&slot->changed, 0);
+    }
+    
+    return slot;
+}
+
+/* Changes the status of a slot, only if it is still in the state expected.
+ * Returns 1 if it was changed.
+ *
+ * While a sub-process is starting or running (BOOTSTRAPPING, RUNNING) the
+ * status belongs to whoever waits for it, in threaded mode a thread of its
+ * own, which moves it on to a DONE_* state with this and queues the slot with
+ * slot_changed().   At all other times only the dispatcher changes it.
+ */
+static int slot_transition(slot *slot, int from, int to)
+{
+    return atomic_compare_exchange_strong(&slot->status, &from, to);
+}
+
+/* Sends a signal to the sub-process of a slot.   Returns the result of kill(),
+ * or -1 if the slot has no sub-process.
+ *
+ * The thread waiting for a sub-process clears its PID before reaping it, and
+ * then waits until the dispatcher is not signalling (see slot_forget_pid()),
+ * so a PID is never signalled once it may have been reused.
+ */
+static int signal_slot(slot *slot, int sig)
+{
+    pid_t pid;
+    int rv = -1;
+    
+    atomic_store(&slot->signalling, 1);
+    
+    pid = atomic_load(&slot->pid);
+    
+    /* Make sure we're not going to kill init */
+    if (pid > 1)
+    {
+        rv = kill(pid, sig);
+    }
+    
+    atomic_store(&slot->signalling, 0);
+    
+    return rv;
+}
+
+/* Called before reaping the sub-process of a slot, see signal_slot() */
+static void slot_forget_pid(slot *slot)
+{
+    atomic_store(&slot->pid, 0);
+    
+    while (atomic_load(&slot->signalling) != 0)
+    {
+        sched_yield();
+    }
+}
+
+/* Sets the status of a slot whose sub-process could not be started, as if
+ * it had failed.
+ */
+static void process_not_started(slot *slot)
+{
+    if (slot_transition(slot, THREAD_STATUS_BOOTSTRAPPING, THREAD_STATUS_DONE_FAIL))
+    {
+        slot_changed(slot);
+    }
+    else
+    {
+        _syslog(LOG_ERR, "Thread %ld: not started in unexpected state %d", slot->id, atomic_load(&slot->status));
+    }
+}
+
+/* Adds what a reaped sub-process used to a usage record */
+static void add_usage(resource_usage *record, struct rusage *usage)
+{
+    metrics_add(&record->processes, 1);
+    metrics_add(&record->user_time, (unsigned long long) usage->ru_utime.tv_sec * EVENTLOOP_SECOND + usage->ru_utime.tv_usec * EVENTLOOP_MICROSECOND);
+    metrics_add(&record->system_time, (unsigned long long) usage->ru_stime.tv_sec * EVENTLOOP_SECOND + usage->ru_stime.tv_usec * EVENTLOOP_MICROSECOND);
+    metrics_max(&record->max_rss, usage->ru_maxrss);
+    metrics_add(&record->minor_faults, usage->ru_minflt);
+    metrics_add(&record->major_faults, usage->ru_majflt);
+    metrics_add(&record->voluntary_switches, usage->ru_nvcsw);
+    metrics_add(&record->involuntary_switches, usage->ru_nivcsw);
+    metrics_add(&record->blocks_in, usage->ru_inblock);
+    metrics_add(&record->blocks_out, usage->ru_oublock);
+}
+
+/* Records the resources used by a reaped sub-process (including any of its
+ * own children it waited for) for its slot and pool.
+ */
+static void account_usage(slot *slot, struct rusage *usage)
+{
+    _syslog(LOG_DEBUG, "Thread %ld: Used %ld.%06lds user, %ld.%06lds system, max RSS %ldkB, %ld/%ld minor/major page faults, %ld/%ld voluntary/involuntary context switches, %ld/%ld blocks in/out",
+            slot->id, (long) usage->ru_utime.tv_sec, (long) usage->ru_utime.tv_usec,
+            (long) usage->ru_stime.tv_sec, (long) usage->ru_stime.tv_usec, usage->ru_maxrss,
+            usage->ru_minflt, usage->ru_majflt, usage->ru_nvcsw, usage->ru_nivcsw,
+            usage->ru_inblock, usage->ru_oublock);
+    
+    add_usage(slot->usage, usage);
+    add_usage(&slot->pool->metrics.usage, usage);
+}
+
+/* Returns 1 if a job killed by SIGKILL was killed by the OOM killer, going by
+ * oom_kill of memory.events of its cgroup having gone up.   If jobs share the
+ * pool's cgroup then another job killed at about the same time may be taken
+ * for it.
+ */
+static int killed_by_oom(slot *slot)
+{
+    char name[CGROUP_NAME_SIZE];
+    resource_usage *record = slot->pool->cgroup_per_job ? slot->usage : &slot->pool->metrics.usage;
+    unsigned long long seen = atomic_load(&record->oom_events);
+    long long events;
+    
+    if (slot->pool->cgroup == NULL)
+    {
+        return 0;
+    }
+    
+    events = cgroup_oom_kills(slot->pool->cgroup, job_cgroup_name(slot, name));
+    
+    while (events > 0 && (unsigned long long) events > seen)
+    {
+        if (atomic_compare_exchange_weak(&record->oom_events, &seen, (unsigned long long) events))
+        {
+            metrics_add(&slot->usage->oom_kills, 1);
+            metrics_add(&slot->pool->metrics.usage.oom_kills, 1);
+            
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Records the wait status of a job which has ended (a worker's reply as the
+ * exit status it stands for), for the control socket and the metrics.
+ */
+static void job_ended(slot *slot, int stat_loc)
+{
+    pool_metrics *metrics = &slot->pool->metrics;
+    int outcome;
+    
+    atomic_store(&slot->last_status, stat_loc);
+    
+    if (WIFSIGNALED(stat_loc))
+    {
+        outcome = JOB_EXIT_SIGNAL;
+        
+        if (WTERMSIG(stat_loc) == SIGKILL && killed_by_oom(slot))
+        {
+            _syslog(LOG_WARNING, "Thread %ld: Killed by the OOM killer", slot->id);
+        }
+    }
+    else
+    {
+        outcome = WEXITSTATUS(stat_loc) == EXIT_STATUS_OK ? JOB_EXIT_OK
+                : WEXITSTATUS(stat_loc) == EXIT_STATUS_OK_MORE ? JOB_EXIT_OK_MORE
+                                                               : JOB_EXIT_FAIL;
+    }
+    
+    metrics_add(&metrics->exits[outcome], 1);
+    metrics_observe(&metrics->job_duration, eventloop_now() - slot->last_started_at);
+}
+
+/* Detaches the pipes of a finished sub-process from the logging system */
+static void detach_logger(slot *slot)
+{
+    if (slot->logger_id != RV_FAIL)
+    {
+        if (subprocslog_remove_source(slot->logger_id) != RV_OK)
+        {
+            _syslog(LOG_WARNING, "Could not remove sub-process pipes from logging system. Source id: %d, fd_stdout: %d, fd_stderr: %d", slot->logger_id, slot->log_fd_stdout, slot->log_fd_stderr);
+            
+            if (slot->log_fd_stdout != -1)
+            {
+                sfclose(slot->log_fd_stdout, "Cannot close STDOUT pipe output in parent process.");
+            }
+            
+            sfclose(slot->log_fd_stderr, "Cannot close STDERR pipe output in parent process.");
+        }
+        
+        slot->logger_id = RV_FAIL;
+    }
+    else
+    {
+        _syslog(LOG_DEBUG, "Not removing source. Source id: %d", slot->logger_id);
+    }
+}
+
+/* Detaches a finished sub-process from the logging system and sets the slot
+ * status according to its exit status.
+ */
+static void process_ended(slot *slot, int stat_loc)
+{
+    long iid = slot->id;
+    int exit_status = WEXITSTATUS(stat_loc);
+    int result;
+    
+    _syslog(LOG_DEBUG, "Thread %ld: Child finished with exit code: %d", iid, exit_status);
+
+    detach_logger(slot);
+    
+    job_ended(slot, stat_loc);
+    
+    /* With a job queue there is no need to sleep when a sub-process has no
+       more work, the slot is only used again once items are queued */
+    if (exit_status == EXIT_STATUS_OK && slot->spawn->settings->queue_source != JOBQUEUE_SOURCE_NONE)
+    {
+        exit_status = EXIT_STATUS_OK_MORE;
+    }
+    
+    /*
+        if exit_status = EXIT_STATUS_OK_MORE
+            set to THREAD_STATUS_DONE_MORE
+        else if is EXIT_STATUS_OK
+            set to THREAD_STATUS_DONE_OK   (thread model will then sleep)
+        else
+            set to THREAD_STATUS_DONE_FAIL (thread model will then sleepOnError)
+    */
+    
+    if (exit_status == EXIT_STATUS_OK_MORE)
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: EXIT_STATUS_OK_MORE", iid);
+        result = THREAD_STATUS_DONE_MORE;
+    }
+    else if (exit_status == EXIT_STATUS_OK)
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: EXIT_STATUS_OK", iid);
+        result = THREAD_STATUS_DONE_OK;
+    }
+    else
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: Exit Fail", iid);
+        result = THREAD_STATUS_DONE_FAIL;
+    }
+    
+    /* The slot is reset by the dispatcher before its next job */
+    if (slot_transition(slot, THREAD_STATUS_RUNNING, result))
+    {
+        slot_changed(slot);
+    }
+    else
+    {
+        _syslog(LOG_ERR, "Thread %ld: ended in unexpected state %d", iid, atomic_load(&slot->status));
+    }
+}
+
+/**
+ * Each thread will do this
+ *
+ */
+void *task(void *i)
+{
+    /* Slot the thread runs a sub-process for */
+    slot *slot = (struct slot *) i;
+    long iid = slot->id;
+    
+    /* Will contain the status of the sub-process when it ends */
+    int stat_loc=0;
+
+    /* Sub-process state reported by waitid */
+    siginfo_t info;
+    
+    /* Resources used by the sub-process */
+    struct rusage usage;
+    
+    /* PID of the sub-process */
+    pid_t pid;
+    
+    /* Say hello and show the thread number */
+    _syslog(LOG_DEBUG, "Thread %ld: starting", iid);
+
+    pid = spawn_process(slot);
+    
+    if (pid == -1)
+    {
+        process_not_started(slot);
+    }
+    else
+    {
+        atomic_store(&slot->pid, pid);
+        slot_transition(slot, THREAD_STATUS_BOOTSTRAPPING, THREAD_STATUS_RUNNING);
+        
+        /* Let the dispatcher know, it may need to schedule run time checks */
+        eventloop_notify();
+        
+        /* Wait for the sub-process to end without reaping it, so that its PID
+           is not reused while the dispatcher may still signal it */
+        while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+        {
+            if (errno != EINTR)
+            {
+                char buf[256];
+                strerror_r(errno, buf, 256);
+                _syslog(LOG_CRIT, "waitid failed - errno:%d(%s)", errno, buf);
+                exit(EXIT_FAILURE);
+            }
+        }
+        
+        slot_forget_pid(slot);
+        
+        if (wait4(pid, &stat_loc, 0, &usage) == -1)
+        {
+            char buf[256];
+            strerror_r(errno, buf, 256);
+            _syslog(LOG_CRIT, "wait4 failed - errno:%d(%s)", errno, buf);
+            exit(EXIT_FAILURE);
+        }
+        
+        log_wait_status(iid, stat_loc);
+        account_usage(slot, &usage);
+        
+        process_ended(slot, stat_loc);
+    }
+    
+    /*printf("Thread %d: Finished\n", iid);*/
+    _syslog(LOG_DEBUG, "Thread %ld: Finished", iid);
+    
+    /* Wake the dispatcher so the slot can be refilled straight away */
+    eventloop_notify();
+
+    /* Terminate the thread */
+    pthread_exit((void*) i);
+}
+
+/* Opens a pidfd for a sub-process, returns -1 if not supported */
+static int pidfd_open_safe(pid_t pid)
+{
+#ifdef SYS_pidfd_open   /* Linux 5.3 and later */
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    UNUSED(pid);
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Direct reaping: the dispatcher spawns sub-processes itself, without a
+ * thread per sub-process, and reaps them when their pidfd becomes readable.
+ * If pidfds are not available then sub-processes are reaped on SIGCHLD.
+ */
+static void start_process(slot *slot)
+{
+    pid_t pid;
+    
+    _syslog(LOG_DEBUG, "Main: starting process for slot %ld", slot->id);
+    
+    pid = spawn_process(slot);
+    
+    if (pid == -1)
+    {
+        process_not_started(slot);
+        eventloop_rescan();
+        
+        return;
+    }
+    
+    atomic_store(&slot->pid, pid);
+    slot->status = THREAD_STATUS_RUNNING;
+    slot->pidfd = reap_with_pidfd ? pidfd_open_safe(pid) : -1;
+    
+    if (slot->pidfd != -1
+     && eventloop_add(slot->pidfd, EVENTLOOP_SOURCE_CHILD, (int) slot->id, EPOLLIN) != RV_OK)
+    {
+        sfclose(slot->pidfd, "Cannot close pidfd.");
+        slot->pidfd = -1;
+    }
+    
+    if (slot->pidfd == -1)
+    {
+        /* Will be reaped on SIGCHLD */
+        unwatched_processes++;
+    }
+}
+
+static void worker_ended(slot *slot, int stat_loc);
+
+/* Reaps the sub-process of a slot if it has ended.   Returns 1 if reaped. */
+static int reap_process(slot *slot)
+{
+    int stat_loc = 0;
+    struct rusage usage;
+    pid_t wpid, pid;
+    
+    /* A worker may be reaped while it has no job */
+    pid = slot->worker_pid > 0 ? slot->worker_pid : atomic_load(&slot->pid);
+    
+    wpid = wait4(pid, &stat_loc, WNOHANG, &usage);
+    
+    if (wpid == 0)
+    {
+        /* Still running */
+        return 0;
+    }
+    
+    if (wpid == -1)
+    {
+        _syslog(LOG_CRIT, "wait4 failed - errno:%d(%s)", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    
+    log_wait_status(slot->id, stat_loc);
+    account_usage(slot, &usage);
+    
+    /* Signalled from this thread only, so no need to wait */
+    atomic_store(&slot->pid, 0);
+    
+    if (slot->pidfd != -1)
+    {
+        /* Closing also removes it from the event loop */
+        sfclose(slot->pidfd, "Cannot close pidfd.");
+        slot->pidfd = -1;
+    }
+    else
+    {
+        unwatched_processes--;
+    }
+    
+    if (slot->worker_pid > 0)
+    {
+        worker_ended(slot, stat_loc);
+    }
+    else
+    {
+        process_ended(slot, stat_loc);
+    }
+    
+    _syslog(LOG_DEBUG, "Thread %ld: Finished", slot->id);
+    
+    /* The slot can be refilled straight away */
+    eventloop_rescan();
+    
+    return 1;
+}
+
+/* Reaps any ended sub-processes which are not watched with a pidfd */
+static void reap_unwatched_processes()
+{
+    int i;
+    
+    for (i=0; i<slot_count && unwatched_processes > 0; i++)
+    {
+        if ((slots[i]->pid > 0 || slots[i]->worker_pid > 0) && slots[i]->pidfd == -1)
+        {
+            reap_process(slots[i]);
+        }
+    }
+}
+
+/**
+ * Persistent model: each slot keeps its sub-process (a worker) running between
+ * jobs.   A job is started by writing a line to STDIN of the worker:
+ *
+ *     run
+ *
+ * and the worker replies with one line on STDOUT when it has finished:
+ *
+ *     ok        (as EXIT_STATUS_OK)
+ *     ok-more   (as EXIT_STATUS_OK_MORE)
+ *     fail      (as EXIT_STATUS_FAIL)
+ *
+ * STDERR of workers is logged as normal, as are lines on STDOUT other than
+ * replies (see worker_line()).   Workers are sent EOF on STDIN when they have
+ * run the maximum number of jobs, the settings they were started with have
+ * been reloaded or The Fat Controller is shutting down, and should then exit.
+ * If a worker exits during a job then its exit status is used as for any
+ * other sub-process, so a command which does not know the protocol runs one
+ * process per job.   Workers are always reaped directly by the dispatcher.
+ */
+
+/* Closes the pipes to and from a worker */
+static void worker_close_pipes(slot *slot)
+{
+    if (slot->worker_stdin != -1)
+    {
+        sfclose(slot->worker_stdin, "Cannot close STDIN pipe input of worker.");
+        slot->worker_stdin = -1;
+    }
+    
+    if (slot->worker_stdout != -1)
+    {
+        /* Removed explicitly in case a child not yet exec'd has a copy */
+        eventloop_remove(slot->worker_stdout);
+        sfclose(slot->worker_stdout, "Cannot close STDOUT pipe output of worker.");
+        slot->worker_stdout = -1;
+    }
+}
+
+/* Sends EOF to a worker so that it exits once it has finished any job */
+static void worker_retire(slot *slot)
+{
+    if (slot->worker_stdin != -1)
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: Retiring worker %d after %d jobs", slot->id, slot->worker_pid, slot->worker_jobs);
+        
+        sfclose(slot->worker_stdin, "Cannot close STDIN pipe input of worker.");
+        slot->worker_stdin = -1;
+    }
+}
+
+/* Starts a job for a slot, starting a worker first if it has none.   Work
+ * items taken from the job queue for the slot follow the command, as
+ * "run <count>" and then one item per line.
+ */
+static void run_worker_job(slot *slot)
+{
+    static const char command[] = WORKER_COMMAND_RUN "\n";
+    char prefix[sizeof(WORKER_COMMAND_RUN) + 16];
+    const char *message = command;
+    char *joined = NULL;
+    size_t length = sizeof(command) - 1;
+    
+    if (slot->worker_pid == 0)
+    {
+        slot->worker_jobs = 0;
+        slot->worker_result = 0;
+        
+        start_process(slot);
+        
+        if (slot->status != THREAD_STATUS_RUNNING)
+        {
+            /* Not started, so the items taken for its job are dropped as
+               for any other sub-process (see spawn_process()) */
+            if (slot->queue_items != NULL)
+            {
+                _syslog(LOG_WARNING, "Thread %ld: Dropped %d work items as the worker could not be started", slot->id, slot->queue_item_count);
+                
+                jobqueue_free(slot->queue_items);
+                slot->queue_items = NULL;
+                slot->queue_item_count = 0;
+            }
+            
+            return;
+        }
+        
+        slot->worker_pid = slot->pid;
+        
+        _syslog(LOG_DEBUG, "Thread %ld: Started worker %d", slot->id, slot->worker_pid);
+    }
+    
+    /* The worker is signalled if the job runs too long */
+    atomic_store(&slot->pid, slot->worker_pid);
+    slot->status = THREAD_STATUS_RUNNING;
+    
+    if (slot->queue_items != NULL)
+    {
+        snprintf(prefix, sizeof(prefix), "%s %d\n", WORKER_COMMAND_RUN, slot->queue_item_count);
+        
+        message = joined = join_queue_items(slot->queue_items, prefix, &length);
+        
+        jobqueue_free(slot->queue_items);
+        slot->queue_items = NULL;
+        slot->queue_item_count = 0;
+    }
+    
+    /* If this fails then the worker has gone and will be reaped shortly.   A
+       full batch of items fits in the pipe, so it is written in one go. */
+    if (write(slot->worker_stdin, message, length) != (ssize_t) length)
+    {
+        _syslog(LOG_WARNING, "Thread %ld: Cannot send command to worker %d: [%d] %s", slot->id, slot->worker_pid, errno, strerror(errno));
+    }
+    
+    free(joined);
+}
+
+/* Acts on a reply from a worker, the result of its job */
+static void worker_reply(slot *slot, const char *reply, int result)
+{
+    if (slot->status != THREAD_STATUS_RUNNING || slot->worker_result != 0)
+    {
+        _syslog(LOG_WARNING, "Thread %ld: Reply from worker %d without a job", slot->id, slot->worker_pid);
+        
+        return;
+    }
+    
+    _syslog(LOG_DEBUG, "Thread %ld: Worker %d replied: %s", slot->id, slot->worker_pid, reply);
+    
+    job_ended(slot, W_EXITCODE(result == THREAD_STATUS_DONE_OK ? EXIT_STATUS_OK
+                              : result == THREAD_STATUS_DONE_MORE ? EXIT_STATUS_OK_MORE
+                                                                  : EXIT_STATUS_FAIL, 0));
+    
+    /* As for other sub-processes, see process_ended() */
+    if (result == THREAD_STATUS_DONE_OK && slot->pool->settings->queue_source != JOBQUEUE_SOURCE_NONE)
+    {
+        result = THREAD_STATUS_DONE_MORE;
+    }
+    
+    slot->worker_jobs++;
+    
+    if (workers_stopping
+     || (slot->pool->settings->max_jobs_per_child > 0 && slot->worker_jobs >= slot->pool->settings->max_jobs_per_child)
+     || slot->spawn->version != slot->pool->spawn->version
+     || slot->number >= slot->pool->threads)
+    {
+        /* The job only ends when the worker does, so that a new worker is
+           never started for the slot before the old one has gone */
+        slot->worker_result = result;
+        worker_retire(slot);
+        
+        return;
+    }
+    
+    atomic_store(&slot->pid, 0);
+    
+    if (slot_transition(slot, THREAD_STATUS_RUNNING, result))
+    {
+        slot_changed(slot);
+    }
+    
+    eventloop_rescan();
+}
+
+/* Acts on a line from a worker's STDOUT, which is either a reply or output
+ * to be logged (e.g. from a command which does not know the protocol and
+ * runs one process per job)
+ */
+static void worker_line(slot *slot, const char *line, size_t length)
+{
+    if (strcmp(line, WORKER_REPLY_OK) == 0)
+    {
+        worker_reply(slot, line, THREAD_STATUS_DONE_OK);
+    }
+    else if (strcmp(line, WORKER_REPLY_OK_MORE) == 0)
+    {
+        worker_reply(slot, line, THREAD_STATUS_DONE_MORE);
+    }
+    else if (strcmp(line, WORKER_REPLY_FAIL) == 0)
+    {
+        worker_reply(slot, line, THREAD_STATUS_DONE_FAIL);
+    }
+    else if (subprocslog_write_line(slot->spawn->log_destination, slot->id, slot->worker_pid, line, length) != RV_OK)
+    {
+        _syslog(LOG_WARNING, "Thread %ld: Cannot log output of worker %d", slot->id, slot->worker_pid);
+    }
+}
+
+/* Reads replies and other output from a worker */
+static void read_worker_replies(slot *slot)
+{
+    ssize_t bytes_read;
+    char *newline;
+    size_t length;
+    
+    while (slot->worker_stdout != -1)
+    {
+        bytes_read = read(slot->worker_stdout, slot->worker_line + slot->worker_line_length, WORKER_LINE_SIZE - 1 - slot->worker_line_length);
+        
+        if (bytes_read == 0)
+        {
+            /* The worker has closed STDOUT, it will be reaped when it exits */
+            eventloop_remove(slot->worker_stdout);
+            sfclose(slot->worker_stdout, "Cannot close STDOUT pipe output of worker.");
+            slot->worker_stdout = -1;
+            
+            /* Output not ending with a newline */
+            if (slot->worker_line_length > 0)
+            {
+                worker_line(slot, slot->worker_line, slot->worker_line_length);
+                slot->worker_line_length = 0;
+            }
+            
+            break;
+        }
+        else if (bytes_read == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            
+            if (errno != EAGAIN)
+            {
+                _syslog(LOG_WARNING, "Thread %ld: Cannot read from worker: [%d] %s", slot->id, errno, strerror(errno));
+            }
+            
+            break;
+        }
+        
+        slot->worker_line_length += bytes_read;
+        slot->worker_line[slot->worker_line_length] = '\0';
+        
+        /* Act on each complete line */
+        while ((newline = memchr(slot->worker_line, '\n', slot->worker_line_length)) != NULL)
+        {
+            *newline = '\0';
+            
+            worker_line(slot, slot->worker_line, newline - slot->worker_line);
+            
+            length = slot->worker_line_length - (newline + 1 - slot->worker_line);
+            memmove(slot->worker_line, newline + 1, length + 1);
+            slot->worker_line_length = length;
+        }
+        
+        if (slot->worker_line_length == WORKER_LINE_SIZE - 1)
+        {
+            /* Too long for a reply */
+            worker_line(slot, slot->worker_line, slot->worker_line_length);
+            
+            slot->worker_line_length = 0;
+        }
+    }
+}
+
+/* Cleans up after a worker has exited.   If it was running a job then the job
+ * ends with the reply already received or, if none, the exit status.
+ */
+static void worker_ended(slot *slot, int stat_loc)
+{
+    pid_t pid = slot->worker_pid;
+    
+    /* Set if the worker was not asked to exit */
+    int unexpected = slot->worker_stdin != -1;
+    
+    /* Any replies still in the pipe, and the last of the output if another
+       process still holds it open */
+    read_worker_replies(slot);
+    
+    if (slot->worker_line_length > 0)
+    {
+        worker_line(slot, slot->worker_line, slot->worker_line_length);
+    }
+    
+    worker_close_pipes(slot);
+    
+    slot->worker_pid = 0;
+    
+    free(slot->worker_line);
+    slot->worker_line = NULL;
+    slot->worker_line_length = 0;
+    
+    if (slot->status == THREAD_STATUS_RUNNING)
+    {
+        if (slot->worker_result != 0)
+        {
+            _syslog(LOG_DEBUG, "Thread %ld: Worker %d exited after %d jobs", slot->id, pid, slot->worker_jobs);
+            
+            detach_logger(slot);
+            
+            if (slot_transition(slot, THREAD_STATUS_RUNNING, slot->worker_result))
+            {
+                slot_changed(slot);
+            }
+        }
+        else
+        {
+            process_ended(slot, stat_loc);
+        }
+    }
+    else
+    {
+        /* Exited between jobs */
+        if (unexpected)
+        {
+            _syslog(LOG_WARNING, "Thread %ld: Worker %d exited between jobs", slot->id, pid);
+        }
+        
+        detach_logger(slot);
+        
+        /* A worker retired by a reload is replaced by the next job, see
+           retire_slot() */
+        if (slot->status == THREAD_STATUS_UNAVAILABLE && slot->number < slot->pool->threads)
+        {
+            slot->status = THREAD_STATUS_AVAILABLE;
+            file_slot(slot);
+        }
+    }
+    
+    slot->worker_result = 0;
+    slot->worker_jobs = 0;
+    
+    release_spawn(slot);
+}
+
+/* Asks all workers to exit, idle workers straight away and busy workers once
+ * they have finished their job
+ */
+static void stop_workers()
+{
+    int i;
+    
+    workers_stopping = 1;
+    
+    for (i=0; i<slot_count; i++)
+    {
+        if (slots[i]->worker_pid > 0 && slots[i]->status != THREAD_STATUS_RUNNING)
+        {
+            worker_retire(slots[i]);
+            
+            /* In case it is not reading STDIN between jobs */
+            kill(slots[i]->worker_pid, SIGTERM);
+        }
+    }
+}
+
+void thread_proc_term(slot *slot)
+{
+    if (slot->termination_requested == 0)
+    {
+        if (slot->status == THREAD_STATUS_RUNNING)
+        {
+            pid_t pid = slot->pid;
+            int kv = signal_slot(slot, SIGTERM);
+            
+            slot->termination_requested = eventloop_now();
+            
+            /* Send SIGKILL if it has not ended by the termination timeout */
+            schedule_slot(slot);
+            
+            _syslog(LOG_INFO, "Terminating %d.   Signal sent: %s", pid, kv ==0?"ok":"fail");
+        }
+        else
+        {
+            _syslog(LOG_WARNING, "Attempted termination of thread that is not running.");
+        }
+    }
+    else
+    {
+        _syslog(LOG_WARNING, "Attempted termination of thread that is already pending termination");
+    }
+}
+
+void thread_proc_kill(slot *slot)
+{
+    pid_t pid = slot->pid;
+    char name[CGROUP_NAME_SIZE];
+    int kv;
+    
+    /* A job with a cgroup of its own is killed with anything it has started */
+    if (slot->pool->cgroup_per_job && cgroup_kill(slot->pool->cgroup, job_cgroup_name(slot, name)) == RV_OK)
+    {
+        _syslog(LOG_INFO, "Killed %d and the rest of cgroup %s/%s", pid, cgroup_path(slot->pool->cgroup), name);
+        
+        return;
+    }
+    
+    kv = signal_slot(slot, SIGKILL);
+    
+    _syslog(LOG_INFO, "Killed %d.   Signal sent: %s", pid, kv ==0?"ok":"fail");
+}
+
+void thread_proc_term_all()
+{
+    int i;
+
+    for (i=0; i<slot_count;i++)
+    {
+        /*
+            Would be good to do a check to make sure we're not killing something important
+            For now we'll just make sure we're not going to kill init (see signal_slot())
+        */
+        if (slots[i]->status == THREAD_STATUS_RUNNING)
+        {
+            thread_proc_term(slots[i]);
+        }
+    }
+}
+
+/* Acts on the run time limits of a slot (warning, SIGTERM, SIGKILL) that have
+ * been reached and schedules the next one.   Only called for slots whose
+ * deadline has passed, see run_deadlines().
+ */
+void check_thread(slot *slot)
+{
+    struct dispatching_settings *settings = slot->pool->settings;
+    eventloop_time now = eventloop_now();
+    
+    /* Check if running */
+    if (slot->status == THREAD_STATUS_RUNNING)
+    {
+        /* Check if termination requested */
+        if (slot->termination_requested != 0)
+        {
+            /* Check for termination timeout */
+            if (now >= (slot->termination_requested + settings->termination_timeout))
+            {
+                _syslog(LOG_WARNING, "Thread %d has not shutdown %.3fs after being issued SIGTERM", (int) slot->id, EVENTLOOP_SECONDS(settings->termination_timeout));
+                /* Zap! */
+                thread_proc_kill(slot);
+            }
+        }
+        else
+        {
+            /* Determine how long thread has run */
+            eventloop_time duration = now - slot->last_started_at;
+            
+            /* Check duration: error */
+            if (settings->thread_run_time_max > 0
+             && duration >= settings->thread_run_time_max)
+            {
+                _syslog(LOG_WARNING, "Thread %d has been running more than %.3fs.   Sending SIGTERM.", (int) slot->id, EVENTLOOP_SECONDS(settings->thread_run_time_max));
+                thread_proc_term(slot);
+            } /* Check duration: warning */
+            else if (settings->thread_run_time_warn > 0
+                  && duration >= settings->thread_run_time_warn
+                  && slot->duration_warning_issued == 0)
+            {
+                _syslog(LOG_WARNING, "Thread %d has been running more than %.3fs", (int) slot->id, EVENTLOOP_SECONDS(settings->thread_run_time_warn));
+                slot->duration_warning_issued = 1;
+            }
+        }
+    }
+    
+    /* Make sure we come back for whichever limit is next */
+    schedule_slot(slot);
+}
+
+/* Acts on every slot whose deadline has passed.   Sleeping slots are woken
+ * up (in daemon mode only, in application mode a sleeping slot is finished)
+ * and running slots are checked against their run time limits.
+ */
+static void run_deadlines(int daemon)
+{
+    eventloop_time now = eventloop_now();
+    slot *slot;
+    int id;
+    
+    while ((id = deadlines_pop_expired(now)) != -1)
+    {
+        slot = slots[id];
+        
+        if (slot->status == THREAD_STATUS_SLEEPING)
+        {
+            if (slot->wake_at > now)
+            {
+                /* Put back to sleep since the deadline was set */
+                schedule_slot(slot);
+            }
+            else if (daemon != 0)
+            {
+                /* Thread has slept long enough so let's wake it up */
+                slot->status = THREAD_STATUS_AVAILABLE;
+                slot_changed(slot);
+                eventloop_rescan();
+            }
+        }
+        else
+        {
+            check_thread(slot);
+        }
+    }
+}
+
+/* Makes a sleeping slot available straight away */
+static void wake_slot(slot *slot)
+{
+    slot->status = THREAD_STATUS_AVAILABLE;
+    
+    /* No longer woken up by run_deadlines() */
+    schedule_slot(slot);
+    file_slot(slot);
+    
+    eventloop_rescan();
+}
+
+/**
+ * Resets any variables that are specific to the runtime of the thread, ready
+ * for being run again.
+ */
+void slot_reset(slot *slot)
+{
+    slot->termination_requested = 0;
+    slot->duration_warning_issued = 0;
+}
+
+/* Records a signal read by the event loop so it can be acted upon */
+static void handleSignal(int sig)
+{
+    _syslog(LOG_DEBUG, "Main signal handler, caught signal: %d", sig);
+
+    switch(sig)
+    {
+        /* SIGQUIT */
+        case SIGTERM:
+        case SIGQUIT:
+            handledSignal = SIGQUIT;
+            break;
+
+        /* SIGINT */
+        case SIGINT:
+            handledSignal = SIGINT;
+            break;
+
+        /* SIGHUP */
+        case SIGHUP:
+            handledSignal = SIGHUP;
+            break;
+
+        /* other signals are ignored */
+    }
+}
+
+/* Blocks until a thread changes state, a signal arrives, a deadline requested
+ * during the last scan passes or a sub-process ends.
+ */
+static void waitForEvents()
+{
+    eventloop_event events[EVENTLOOP_MAX_EVENTS];
+    eventloop_time next = deadlines_next();
+    int i, n;
+
+    /* Sleep no longer than the next slot deadline */
+    if (next != 0)
+    {
+        eventloop_wake_at(next);
+    }
+
+    n = eventloop_wait(events, EVENTLOOP_MAX_EVENTS);
+
+    if (n == RV_FAIL)
+    {
+        _syslog(LOG_CRIT, "Event loop failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i=0; i<n; i++)
+    {
+        switch (events[i].type)
+        {
+            case EVENTLOOP_SOURCE_SIGNAL:
+                if (events[i].signal == SIGCHLD)
+                {
+                    reap_unwatched_processes();
+                }
+                else
+                {
+                    handleSignal(events[i].signal);
+                }
+                break;
+            
+            case EVENTLOOP_SOURCE_CHILD:
+                if (slots[events[i].id]->pid > 0 || slots[events[i].id]->worker_pid > 0)
+                {
+                    reap_process(slots[events[i].id]);
+                }
+                break;
+            
+            case EVENTLOOP_SOURCE_WORKER:
+                read_worker_replies(slots[events[i].id]);
+                break;
+            
+            case EVENTLOOP_SOURCE_QUEUE:
+                /* The queue of a removed pool is closed */
+                if (pools[events[i].id]->queue != NULL)
+                {
+                    jobqueue_read(pools[events[i].id]->queue);
+                }
+                break;
+            
+            case EVENTLOOP_SOURCE_CONTROL:
+                control_event(events[i].id, events[i].events);
+                break;
+            
+            case EVENTLOOP_SOURCE_EXEC:
+                exec_done(events[i].id);
+                break;
+        }
+    }
+}
+
+static void waitForThreads()
+{
+    int i, stoppedThreads, keepWaiting, stopSignals=0;
+    
+    keepWaiting = 1;
+
+    /*printf("Waiting for threads to finish\n");*/
+    _syslog(LOG_DEBUG, "Waiting for threads to finish");
+
+    while(keepWaiting)
+    {
+        stoppedThreads = 0;
+        
+        /* Check for long-running threads */
+        run_deadlines(0);
+        
+        for (i=0; i<slot_count;i++)
+        {
+            /* Check if thread has finished or is sleeping (and has no worker) */
+            if (slots[i]->status != THREAD_STATUS_RUNNING
+             && slots[i]->status != THREAD_STATUS_BOOTSTRAPPING
+             && slots[i]->worker_pid == 0)
+            {
+                stoppedThreads++;
+            }
+        }
+
+        if (stoppedThreads == slot_count)
+        {
+            break;
+        }
+
+        /* Check for signals */
+        switch ( handledSignal )
+        {
+            case -1:
+                break;
+
+            case 0:
+                /* The case for signals we're not interested in */
+                handledSignal = -1;
+                break;
+
+            case SIGTERM:
+            case SIGQUIT:
+            case SIGINT:
+                
+                _syslog(LOG_DEBUG, "WaitForThreads: signal received: %d", handledSignal);
+            
+                if (stopSignals == 0)
+                {
+                    /* If this is the first extra stop signal after the initial signal was received 
+                       to stop creating new instances and shutdown The Fat Controller, then nicely
+                       ask all instances to terminate by sending them SIGTERM */
+                    thread_proc_term_all();
+                }
+                else
+                {
+                    /* If this is the second extra stop signal then the user is obviously in a hurry
+                       so we will stop the main Fat Controller process which will in turn terminate
+                       all other processes */
+                    keepWaiting = 0;
+                }
+                
+                stopSignals++;
+                
+                handledSignal = -1;
+                break;
+        }
+
+        if (keepWaiting)
+        {
+            waitForEvents();
+        }
+    }
+}
+
+/* Starts a job in an available slot, returns 0 if there was nothing to
+ * start (the job queue is empty)
+ */
+static int start_slot(slot *slot, pthread_attr_t *attr)
+{
+    struct dispatching_settings *settings = slot->pool->settings;
+    pthread_t thread;
+    int rc;
+    
+    if (slot->pool->queue != NULL)
+    {
+        /* Nothing to do, the slot stays available until items are queued
+           (which wakes the event loop) */
+        if (jobqueue_length(slot->pool->queue) == 0)
+        {
+            return 0;
+        }
+        
+        slot->queue_items = jobqueue_take(slot->pool->queue, settings->queue_batch, &slot->queue_item_count);
+    }
+    
+    /* A half-open breaker lets one job through, nothing more is started
+       until it has ended */
+    if (slot->pool->breaker.state == BREAKER_HALF_OPEN)
+    {
+        breaker_probe(&slot->pool->breaker, slot->id);
+        slot->pool->active = 0;
+    }
+    
+    /* Re-initialise the slot struct ready for the job */
+    slot_reset(slot);
+    
+    /* Set this slot as used, until the sub-process is running (prevents race hazards) */
+    slot->status = THREAD_STATUS_BOOTSTRAPPING;
+    slot->last_started_at = eventloop_now();
+    
+    file_slot(slot);
+    
+    /* Run time limits */
+    schedule_slot(slot);
+    
+    /* Workers keep the settings they were started with */
+    use_spawn(slot);
+    
+    if (settings->threadModel == THREAD_MODEL_PERSISTENT)
+    {
+        run_worker_job(slot);
+        
+        return 1;
+    }
+    
+    if (settings->direct_reaping == 1)
+    {
+        start_process(slot);
+        
+        return 1;
+    }
+    
+    /* Create a new thread */
+    _syslog(LOG_DEBUG, "Main: creating thread %ld", slot->id);
+    
+    rc = pthread_create(&thread, attr, task, slot);
+    
+    if (rc)
+    {
+        _syslog(LOG_CRIT, "ERROR: return code from pthread_create() is %d", rc);
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_detach(thread);
+    
+    return 1;
+}
+
+/* Returns the number of jobs running in all pools */
+static int running_processes()
+{
+    int i, running = 0;
+    
+    for (i=0; i<pool_count; i++)
+    {
+        running += pools[i]->running_slots.length;
+    }
+    
+    return running;
+}
+
+/* Returns 1 if another job may be started without exceeding max_processes */
+static int below_process_limit()
+{
+    return max_processes == 0 || running_processes() < max_processes;
+}
+
+static const char *breaker_state_name(int state)
+{
+    return state == BREAKER_OPEN ? "open" : state == BREAKER_HALF_OPEN ? "half-open" : "closed";
+}
+
+/* Returns 1 if a pool's circuit breaker lets it start jobs, logging it
+ * becoming half-open
+ */
+static int pool_breaker_allows(pool *pool, eventloop_time now)
+{
+    int state = pool->breaker.state;
+    int allows = breaker_allows(&pool->breaker, now);
+    
+    if (pool->breaker.state != state)
+    {
+        _syslog(LOG_INFO, "Pool %s: Circuit breaker half-open, trying one job", pool->settings->pool_name);
+    }
+    
+    return allows;
+}
+
+/* Gives the outcome of a slot's job to its pool's circuit breaker, logging
+ * any change of state
+ */
+static void breaker_outcome(slot *slot)
+{
+    pool *pool = slot->pool;
+    breaker *b = &pool->breaker;
+    int state = b->state;
+    
+    if (!breaker_record(b, slot->id, slot->status == THREAD_STATUS_DONE_FAIL, eventloop_now()))
+    {
+        return;
+    }
+    
+    if (b->state == BREAKER_CLOSED)
+    {
+        _syslog(LOG_NOTICE, "Pool %s: Circuit breaker closed, thread %ld succeeded", pool->settings->pool_name, slot->id);
+    }
+    else if (state == BREAKER_HALF_OPEN)
+    {
+        _syslog(LOG_WARNING, "Pool %s: Circuit breaker open again for %.3fs, thread %ld failed",
+                pool->settings->pool_name, EVENTLOOP_SECONDS(b->open_time), slot->id);
+    }
+    else
+    {
+        _syslog(LOG_WARNING, "Pool %s: Circuit breaker open for %.3fs, %d of the last %d jobs failed",
+                pool->settings->pool_name, EVENTLOOP_SECONDS(b->open_time), b->failures, b->count);
+    }
+}
+
+/* Decides which pools may start jobs in the next pass of the dispatcher,
+ * returns 0 once none may.   A pool which is to run only once gets a single
+ * pass.   A paused pool, or one whose circuit breaker is open, starts nothing
+ * but keeps the dispatcher going until it is resumed (or the breaker closes)
+ * unless it is shutting down.
+ */
+static int activate_pools()
+{
+    eventloop_time now = eventloop_now();
+    int i, active = 0;
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (pools[i]->paused)
+        {
+            pools[i]->active = 0;
+            active |= pools[i]->running >= 0;
+        }
+        else if (!pool_breaker_allows(pools[i], now))
+        {
+            pools[i]->active = 0;
+            active |= pools[i]->running >= 0;
+            
+            if (pools[i]->breaker.state == BREAKER_OPEN)
+            {
+                eventloop_wake_at(pools[i]->breaker.opens_until);
+            }
+        }
+        else
+        {
+            pools[i]->active = pools[i]->running > 0 || pools[i]->settings->run_once-- > 0;
+            active |= pools[i]->active;
+        }
+    }
+    
+    return active;
+}
+
+/* Returns the log capture mode given by the settings (see subprocslog.h) */
+static int log_capture_mode(struct dispatching_settings *settings)
+{
+    return settings->log_splice == 1 ? SUBPROCSLOG_CAPTURE_SPLICE
+                                     : settings->log_lines == 1 ? SUBPROCSLOG_CAPTURE_LINES
+                                                                : SUBPROCSLOG_CAPTURE_COPY;
+}
+
+/* Writes a limit of a cgroup (or child) if it has changed, "max" if it has
+ * been removed
+ */
+static void set_cgroup_limit(cgroup *cg, const char *child, const char *file, const char *old, const char *value)
+{
+    if (value != NULL ? setting_changed(old, value) : old != NULL)
+    {
+        cgroup_set(cg, child, file, value != NULL ? value : "max");
+    }
+}
+
+/* Sets the limits of a pool's cgroup, or of one of its jobs' cgroups, to
+ * those of its settings.   old are the settings they were set to, NULL if
+ * none.
+ */
+static void set_cgroup_limits(cgroup *cg, const char *child, struct dispatching_settings *old, struct dispatching_settings *settings)
+{
+    set_cgroup_limit(cg, child, "cpu.max", old != NULL ? old->cgroup_cpu_max : NULL, settings->cgroup_cpu_max);
+    set_cgroup_limit(cg, child, "memory.max", old != NULL ? old->cgroup_memory_max : NULL, settings->cgroup_memory_max);
+    
+    if (old != NULL && old->cgroup_io_max != NULL && setting_changed(old->cgroup_io_max, settings->cgroup_io_max))
+    {
+        cgroup_set_io_max(cg, child, old->cgroup_io_max, 1);
+    }
+    
+    if (settings->cgroup_io_max != NULL && (old == NULL || setting_changed(old->cgroup_io_max, settings->cgroup_io_max)))
+    {
+        cgroup_set_io_max(cg, child, settings->cgroup_io_max, 0);
+    }
+}
+
+/* Notes how many OOM kills a cgroup has had before any of our jobs were in
+ * it, see killed_by_oom()
+ */
+static void set_oom_events(resource_usage *record, cgroup *cg, const char *child)
+{
+    long long events = cgroup_oom_kills(cg, child);
+    
+    atomic_store(&record->oom_events, events > 0 ? (unsigned long long) events : 0);
+}
+
+/* Creates the cgroup of a pool, named after it, with its limits or, if each
+ * job is to have a cgroup, with the controllers enabled for them.   A pool
+ * whose cgroup cannot be created runs without.
+ */
+static void create_pool_cgroup(pool *pool, struct dispatching_settings *settings)
+{
+    char name[CGROUP_NAME_SIZE], *p;
+    
+    snprintf(name, sizeof(name), "pool-%s", settings->pool_name);
+    
+    /* Pool names may be anything */
+    for (p = name; *p != '\0'; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '_';
+        }
+    }
+    
+    pool->cgroup = cgroup_create(name);
+    
+    if (pool->cgroup == NULL)
+    {
+        _syslog(LOG_WARNING, "Pool %s: Running without a cgroup", settings->pool_name);
+        
+        return;
+    }
+    
+    if (settings->cgroup_per_job)
+    {
+        pool->cgroup_per_job = cgroup_enable_controllers(pool->cgroup) == RV_OK;
+        
+        if (!pool->cgroup_per_job)
+        {
+            _syslog(LOG_WARNING, "Pool %s: Jobs share the pool's cgroup", settings->pool_name);
+        }
+    }
+    
+    if (!pool->cgroup_per_job)
+    {
+        set_cgroup_limits(pool->cgroup, NULL, NULL, settings);
+        set_oom_events(&pool->metrics.usage, pool->cgroup, NULL);
+    }
+    
+    _syslog(LOG_DEBUG, "Pool %s: cgroup %s", settings->pool_name, cgroup_path(pool->cgroup));
+}
+
+/* Creates the cgroups of slots for their jobs, with the pool's limits.   Any
+ * which cannot be created are left to fail when they are opened.
+ */
+static void create_job_cgroups(pool *pool, int from, int to)
+{
+    char name[CGROUP_NAME_SIZE];
+    int i;
+    
+    for (i=from; i<to; i++)
+    {
+        if (cgroup_add_child(pool->cgroup, job_cgroup_name(pool->slots[i], name)) == RV_OK)
+        {
+            set_cgroup_limits(pool->cgroup, name, NULL, pool->settings);
+            set_oom_events(pool->slots[i]->usage, pool->cgroup, name);
+        }
+    }
+}
+
+/* Adds slots to a pool, in one block so that they are next to each other and
+ * each starts on a cache line.   A slot is three cache lines (make bench
+ * checks how long a pass over them takes): with a power of two the first
+ * lines of the slots would all fall in a fraction of the cache's sets.   They
+ * are numbered on from the pool's other slots and are available straight
+ * away.
+ */
+static void add_slots(pool *pool, int count)
+{
+    slot *block, *slot;
+    int i;
+    
+    if (count <= 0)
+    {
+        return;
+    }
+    
+    _syslog(LOG_DEBUG, "Pool %s: threads %d to %d", pool->settings->pool_name, slot_count, slot_count + count - 1);
+    
+    /* With the usage records and backoffs of the slots after them, see
+       slot->usage */
+    block = sfaligned_alloc(SLOT_ALIGNMENT, count * (sizeof(struct slot) + sizeof(resource_usage) + sizeof(slot_backoffs)));
+    memset(block + count, 0, count * sizeof(resource_usage));
+    
+    slot_blocks = sfrealloc(slot_blocks, (slot_block_count + 1) * sizeof(struct slot *));
+    slot_blocks[slot_block_count++] = block;
+    
+    slots = sfrealloc(slots, (slot_count + count) * sizeof(struct slot *));
+    pool->slots = sfrealloc(pool->slots, (pool->size + count) * sizeof(struct slot *));
+    
+    deadlines_resize(slot_count + count);
+    
+    for (i=0; i<count; i++)
+    {
+        slot = &block[i];
+        
+        slot->id = slot_count;
+        slot->number = pool->size;
+        slot->pool = pool;
+        slot->usage = (resource_usage *) (block + count) + i;
+        slot->backoffs = (slot_backoffs *) ((resource_usage *) (block + count) + count) + i;
+        slot->status = THREAD_STATUS_AVAILABLE;
+        slot->pid = 0;
+        slot->signalling = 0;
+        slot->last_started_at = 0;
+        slot->termination_requested = 0;
+        slot->wake_at = 0;
+        slot->pidfd = -1;
+        slot->logger_id = RV_FAIL;
+        slot->worker_pid = 0;
+        slot->worker_stdin = -1;
+        slot->worker_stdout = -1;
+        slot->worker_jobs = 0;
+        slot->worker_result = 0;
+        slot->worker_line = NULL;
+        slot->worker_line_length = 0;
+        slot->queue_items = NULL;
+        slot->queue_item_count = 0;
+        slot->last_status = -1;
+        slot->spawn = NULL;
+        slot->list = NULL;
+        slot->changed = 0;
+        
+        backoff_reset(&slot->backoffs->sleep);
+        backoff_reset(&slot->backoffs->error);
+        
+        slot_reset(slot);
+        
+        slots[slot_count++] = slot;
+        pool->slots[pool->size++] = slot;
+        
+        /* Available slots are used in order */
+        file_slot(slot);
+    }
+    
+    if (pool->cgroup_per_job)
+    {
+        create_job_cgroups(pool, pool->size - count, pool->size);
+    }
+}
+
+/* Takes an idle slot out of use (THREAD_STATUS_UNAVAILABLE) if its pool has
+ * shrunk below it.   An idle worker started with settings which have since
+ * been reloaded is asked to exit, its slot being unavailable until it has.
+ * Returns 1 if the slot is unavailable.
+ */
+static int retire_slot(slot *slot)
+{
+    pool *pool = slot->pool;
+    
+    if (slot->status != THREAD_STATUS_AVAILABLE && slot->status != THREAD_STATUS_SLEEPING)
+    {
+        return slot->status == THREAD_STATUS_UNAVAILABLE;
+    }
+    
+    if (slot->worker_pid > 0 && (slot->number >= pool->threads || slot->spawn->version != pool->spawn->version))
+    {
+        worker_retire(slot);
+        
+        /* In case it is not reading STDIN between jobs, see worker_ended() */
+        kill(slot->worker_pid, SIGTERM);
+    }
+    else if (slot->worker_pid > 0 || slot->number < pool->threads)
+    {
+        return 0;
+    }
+    
+    slot->status = THREAD_STATUS_UNAVAILABLE;
+    
+    /* No longer woken up */
+    schedule_slot(slot);
+    file_slot(slot);
+    
+    return 1;
+}
+
+/* Changes the number of slots a pool uses.   Slots are added, or brought back
+ * into use, straight away.   Slots beyond the new number are retired straight
+ * away if idle, otherwise once their job has ended.
+ */
+static void resize_pool(pool *pool, int threads)
+{
+    slot *slot;
+    int i;
+    
+    pool->threads = threads;
+    
+    for (i=0; i<pool->size; i++)
+    {
+        slot = pool->slots[i];
+        
+        if (i < threads && slot->status == THREAD_STATUS_UNAVAILABLE && slot->worker_pid == 0)
+        {
+            slot->status = THREAD_STATUS_AVAILABLE;
+            file_slot(slot);
+        }
+        else
+        {
+            retire_slot(slot);
+        }
+    }
+    
+    add_slots(pool, threads - pool->size);
+}
+
+/* Changes the number of slots a pool uses (see resize_pool()), keeping the
+ * concurrency reached by the dependent thread model within it
+ */
+static void set_pool_threads(pool *pool, int threads)
+{
+    struct dispatching_settings *settings = pool->settings;
+    dependent_model_state *state;
+    int limit;
+    
+    resize_pool(pool, threads);
+    
+    if (settings->threadModel == THREAD_MODEL_DEPENDENT)
+    {
+        state = (dependent_model_state *) pool->state;
+        limit = state->concurrency.limit;
+        
+        concurrency_initialize(&state->concurrency, settings->concurrency_controller, pool->threads, settings->concurrency_decay);
+        
+        state->concurrency.limit = limit < pool->threads ? limit : pool->threads;
+        
+        if (state->concurrency.limit < 1)
+        {
+            state->concurrency.limit = 1;
+        }
+    }
+}
+
+/* Sets up the thread model of a pool */
+static void init_thread_model(pool *pool)
+{
+    struct dispatching_settings *settings = pool->settings;
+    
+    if (settings->threadModel == THREAD_MODEL_INDEPENDENT)
+    {
+        pool->threadModel = &independentThreadModel;
+        pool->pre_state_check = &presc_independent_model;
+        pool->post_state_check = &postsc_independent_model;
+        pool->wake = &wake_independent_model;
+        pool->sleeping = &sleeping_independent_model;
+        
+        init_state_independent_model(pool);
+    }
+    else if (settings->threadModel == THREAD_MODEL_DEPENDENT)
+    {
+        pool->threadModel = &dependentThreadModel;
+        pool->pre_state_check = &presc_dependent_model;
+        pool->post_state_check = &postsc_dependent_model;
+        pool->wake = &wake_dependent_model;
+        pool->sleeping = &sleeping_dependent_model;
+        
+        init_state_dependent_model(pool);
+    }
+    else if (settings->threadModel == THREAD_MODEL_FIXED_INTERVAL)
+    {
+        pool->threadModel = &fixedIntervalThreadModel;
+        pool->pre_state_check = &presc_fixed_interval;
+        pool->post_state_check = &postsc_fixed_interval;
+        pool->wake = &wake_fixed_interval;
+        pool->sleeping = &sleeping_fixed_interval;
+        
+        init_state_fixed_interval(pool);
+    }
+    else if (settings->threadModel == THREAD_MODEL_PERSISTENT)
+    {
+        /* Scheduled as the independent model */
+        pool->threadModel = &independentThreadModel;
+        pool->pre_state_check = &presc_independent_model;
+        pool->post_state_check = &postsc_independent_model;
+        pool->wake = &wake_independent_model;
+        pool->sleeping = &sleeping_independent_model;
+        
+        init_state_independent_model(pool);
+    }
+}
+
+/* Opens the job queue given by settings for a pool, if any.   Returns
+ * RV_FAIL, having logged why, if it could not be opened.
+ */
+static int open_queue(pool *pool, struct dispatching_settings *settings, int priority)
+{
+    pool->queue = NULL;
+    
+    if (settings->queue_source != JOBQUEUE_SOURCE_NONE)
+    {
+        pool->queue = jobqueue_initialize(settings->queue_source, settings->queue_location, pool->id);
+        
+        if (pool->queue == NULL)
+        {
+            _syslog(priority, "Pool %s: Could not open the job queue %s", settings->pool_name, settings->queue_location);
+            
+            return RV_FAIL;
+        }
+    }
+    
+    return RV_OK;
+}
+
+/* Adds a pool running the given settings, with its thread model and slots.
+ * reloaded is set if the settings were loaded by a reload.   Its job queue is
+ * opened separately, see open_queue().
+ */
+static pool *add_pool(struct dispatching_settings *settings, int log_destination, int reloaded)
+{
+    pool *pool = sfcalloc(1, sizeof(struct pool));
+    
+    pool->id = pool_count;
+    pool->queue = NULL;
+    pool->threads = settings->threads;
+    
+    breaker_initialize(&pool->breaker, settings->breaker_threshold, settings->breaker_window, settings->breaker_open_time);
+    
+    pools = sfrealloc(pools, (pool_count + 1) * sizeof(struct pool *));
+    pools[pool_count++] = pool;
+    
+    set_spawn(pool, settings, log_destination, reloaded);
+    
+    if (cgroups)
+    {
+        create_pool_cgroup(pool, settings);
+    }
+    
+    init_thread_model(pool);
+    
+    add_slots(pool, settings->threads);
+    
+    /* If we're to run only once, then we must turn off repeated running */
+    pool->running = (settings->run_once > 0) ? 0 : 1;
+    
+    return pool;
+}
+
+/* Returns the pool with the given name, NULL if there is none */
+static pool *find_pool(const char *name)
+{
+    int i;
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (strcmp(pools[i]->settings->pool_name, name) == 0)
+        {
+            return pools[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/* Opens the log files of settings reloaded for a pool, if they have changed.
+ * Returns the log destination, or RV_FAIL having logged why.
+ */
+static int reload_log_destination(pool *pool, struct dispatching_settings *settings)
+{
+    int destination;
+    
+    if (pool != NULL
+     && !setting_changed(pool->settings->logfile, settings->logfile)
+     && !setting_changed(pool->settings->errlogfile, settings->errlogfile))
+    {
+        return pool->spawn->log_destination;
+    }
+    
+    /* Files which are no longer used stay open, they are shared by any
+       destination using them again */
+    destination = subprocslog_add_destination(settings->logfile, settings->errlogfile == NULL ? settings->logfile : settings->errlogfile);
+    
+    if (destination == RV_FAIL)
+    {
+        _syslog(LOG_ERR, "Pool %s: Could not open the log file %s", settings->pool_name, settings->logfile);
+    }
+    
+    return destination;
+}
+
+/* Changes the limits of a pool's cgroup, or of each of its jobs' cgroups, to
+ * those of reloaded settings
+ */
+static void update_cgroup_limits(pool *pool, struct dispatching_settings *old, struct dispatching_settings *settings)
+{
+    char name[CGROUP_NAME_SIZE];
+    int i;
+    
+    if (pool->cgroup == NULL)
+    {
+        return;
+    }
+    
+    if (!pool->cgroup_per_job)
+    {
+        set_cgroup_limits(pool->cgroup, NULL, old, settings);
+        
+        return;
+    }
+    
+    /* Including retired slots, whose cgroups are kept */
+    for (i=0; i<pool->size; i++)
+    {
+        set_cgroup_limits(pool->cgroup, job_cgroup_name(pool->slots[i], name), old, settings);
+    }
+}
+
+/* Applies reloaded settings to a pool.   The thread model, direct reaping,
+ * --run-once and --cgroup-per-job are kept as they are.
+ */
+static void update_pool(pool *pool, struct dispatching_settings *settings, int log_destination)
+{
+    struct dispatching_settings *old = pool->settings;
+    jobqueue *queue = pool->queue;
+    
+    if (settings->threadModel != old->threadModel || settings->direct_reaping != old->direct_reaping)
+    {
+        _syslog(LOG_WARNING, "Pool %s: The thread model and direct reaping can only be changed by a restart", settings->pool_name);
+        
+        settings->threadModel = old->threadModel;
+        settings->direct_reaping = old->direct_reaping;
+    }
+    
+    settings->run_once = old->run_once;
+    
+    if (settings->cgroup_per_job != old->cgroup_per_job && pool->cgroup != NULL)
+    {
+        _syslog(LOG_WARNING, "Pool %s: Whether each job has a cgroup can only be changed by a restart", settings->pool_name);
+    }
+    
+    settings->cgroup_per_job = old->cgroup_per_job;
+    
+    update_cgroup_limits(pool, old, settings);
+    
+    /* The breaker starts again closed if it has changed */
+    if (settings->breaker_threshold != old->breaker_threshold || settings->breaker_window != old->breaker_window)
+    {
+        breaker_deinitialize(&pool->breaker);
+        breaker_initialize(&pool->breaker, settings->breaker_threshold, settings->breaker_window, settings->breaker_open_time);
+    }
+    
+    pool->breaker.open_time = settings->breaker_open_time;
+    
+    /* A removed pool's queue is closed, and opened again when it is back */
+    if (queue == NULL || settings->queue_source != old->queue_source || setting_changed(settings->queue_location, old->queue_location))
+    {
+        /* A socket is unlinked when closed, so is closed before being created
+           again */
+        if (queue != NULL && !setting_changed(settings->queue_location, old->queue_location))
+        {
+            jobqueue_deinitialize(queue);
+            queue = NULL;
+        }
+        
+        if (open_queue(pool, settings, LOG_ERR) != RV_OK)
+        {
+            /* Not used until the queue can be opened */
+            settings->threads = 0;
+        }
+        
+        jobqueue_deinitialize(queue);
+    }
+    
+    set_spawn(pool, settings, log_destination, 1);
+    
+    set_pool_threads(pool, settings->threads);
+    
+    pool->removed = 0;
+}
+
+/* Takes a pool which is no longer in the settings out of use.   Its slots are
+ * retired once their jobs have ended.
+ */
+static void remove_pool(pool *pool)
+{
+    _syslog(LOG_INFO, "Pool %s: Removed", pool->settings->pool_name);
+    
+    jobqueue_deinitialize(pool->queue);
+    pool->queue = NULL;
+    
+    resize_pool(pool, 0);
+    
+    pool->removed = 1;
+}
+
+/**
+ * Reload: the settings are loaded again (as given at startup, reading any
+ * config files again) and applied to the running pools, matched by name,
+ * without waiting for jobs to end.   A pool which has grown gets its new slots
+ * straight away and one which has shrunk retires its last slots once their
+ * jobs have ended.   Sub-processes are started with the new command and
+ * settings from then on, persistent workers being replaced once they are
+ * idle.   Pools are added and removed as in the settings.
+ *
+ * If the settings are not valid then nothing is changed.
+ */
+static void reload_pools()
+{
+    struct dispatching_settings *settings, *pool_settings, *next;
+    int i, n, count = 0, err = 0;
+    pool *pool;
+    
+    _syslog(LOG_INFO, "Reloading settings");
+    
+    settings = load_settings();
+    
+    if (settings == NULL)
+    {
+        _syslog(LOG_ERR, "Settings not reloaded, carrying on with the current settings");
+        
+        return;
+    }
+    
+    for (pool_settings = settings; pool_settings != NULL; pool_settings = pool_settings->next_pool)
+    {
+        count++;
+    }
+    
+    {
+        /* Log destination of each pool, opened before anything is changed */
+        int log_destinations[count];
+        
+        /* Set for each existing pool which is still in the settings */
+        char kept[pool_count + 1];
+        
+        memset(kept, 0, sizeof(kept));
+        
+        for (i=0, pool_settings=settings; pool_settings != NULL; i++, pool_settings=pool_settings->next_pool)
+        {
+            pool = find_pool(pool_settings->pool_name);
+            
+            if (pool == NULL && pool_settings->direct_reaping == 1 && !reap_with_pidfd && !sigchld_caught)
+            {
+                _syslog(LOG_ERR, "Pool %s: Direct reaping is not available, a restart is needed to add this pool", pool_settings->pool_name);
+                err++;
+            }
+            
+            log_destinations[i] = reload_log_destination(pool, pool_settings);
+            
+            if (log_destinations[i] == RV_FAIL)
+            {
+                err++;
+            }
+        }
+        
+        if (err != 0)
+        {
+            _syslog(LOG_ERR, "Settings not reloaded, carrying on with the current settings");
+            
+            freeDispatchingSettings(settings);
+            
+            return;
+        }
+        
+        if (log_capture_mode(settings) != capture_mode)
+        {
+            _syslog(LOG_WARNING, "The log capture mode can only be changed by a restart");
+        }
+        
+        if (setting_changed(settings->control_socket, control_socket))
+        {
+            _syslog(LOG_WARNING, "The control socket can only be changed by a restart");
+        }
+        
+        if (setting_changed(settings->cgroup, cgroup_root))
+        {
+            _syslog(LOG_WARNING, "The cgroup can only be changed by a restart");
+        }
+        
+        if (setting_changed(settings->dispatcher_cpus, dispatcher_cpus))
+        {
+            _syslog(LOG_WARNING, "The dispatcher's CPUs can only be changed by a restart");
+        }
+        
+        if (setting_changed(settings->metrics_file, metrics_file))
+        {
+            _syslog(LOG_WARNING, "The metrics file can only be changed by a restart");
+        }
+        
+        metrics_interval = settings->metrics_interval;
+        
+        max_processes = settings->max_processes;
+        
+        /* Each pool takes its own settings */
+        n = pool_count;
+        
+        for (i=0, pool_settings=settings; pool_settings != NULL; i++, pool_settings=next)
+        {
+            next = pool_settings->next_pool;
+            pool_settings->next_pool = NULL;
+            
+            pool = find_pool(pool_settings->pool_name);
+            
+            if (pool == NULL)
+            {
+                _syslog(LOG_INFO, "Pool %s: Added", pool_settings->pool_name);
+                
+                pool = add_pool(pool_settings, log_destinations[i], 1);
+                
+                if (open_queue(pool, pool_settings, LOG_ERR) != RV_OK)
+                {
+                    resize_pool(pool, 0);
+                }
+            }
+            else
+            {
+                update_pool(pool, pool_settings, log_destinations[i]);
+                
+                kept[pool->id] = 1;
+            }
+        }
+        
+        for (i=0; i<n; i++)
+        {
+            if (!kept[i] && pools[i]->threads > 0)
+            {
+                remove_pool(pools[i]);
+            }
+        }
+    }
+    
+    _syslog(LOG_INFO, "Settings reloaded");
+    
+    /* Start jobs in any new slots */
+    eventloop_rescan();
+}
+
+/* Time the slots of a list have spent on it, see slot_list */
+static eventloop_time slot_list_time(slot_list *list, eventloop_time now)
+{
+    return list->time + (eventloop_time) ((uint64_t) list->length * (uint64_t) now - list->listed_at_sum);
+}
+
+/* Notes when the thread model of a pool starts or stops the whole pool
+ * sleeping.   Its slots stay on ready_slots meanwhile, so the time they spend
+ * there is counted as sleeping rather than idle.   Called by the dispatcher
+ * after each pass.
+ */
+static void account_pool_sleep(pool *pool, eventloop_time now)
+{
+    int asleep = (*pool->sleeping)(pool);
+    
+    if (asleep == pool->asleep)
+    {
+        return;
+    }
+    
+    if (asleep)
+    {
+        pool->asleep_from = slot_list_time(&pool->ready_slots, now);
+    }
+    else
+    {
+        pool->asleep_time += slot_list_time(&pool->ready_slots, now) - pool->asleep_from;
+    }
+    
+    pool->asleep = asleep;
+}
+
+/* Time the ready slots of a pool have spent sleeping with it, see
+ * account_pool_sleep()
+ */
+static eventloop_time pool_asleep_time(pool *pool, eventloop_time now)
+{
+    if (pool->asleep)
+    {
+        return pool->asleep_time + slot_list_time(&pool->ready_slots, now) - pool->asleep_from;
+    }
+    
+    return pool->asleep_time;
+}
+
+/* Writes a sample of a metric for a pool with one more label, e.g. mode="user" */
+static void write_pool_value(FILE *fp, const char *name, const char *pool_label, const char *label, double value)
+{
+    char labels[METRICS_LABEL_SIZE + 32];
+    
+    snprintf(labels, sizeof(labels), "%s,%s", pool_label, label);
+    metrics_write_value(fp, name, labels, value);
+}
+
+/* Writes the metrics of every pool in the Prometheus text format, see
+ * metrics.h.   Called by the dispatcher, which owns the slot lists.
+ */
+static void write_metrics(FILE *fp)
+{
+    static const char *exit_names[JOB_EXITS] = {"ok", "ok_more", "fail", "signal"};
+    char (*pool_labels)[METRICS_LABEL_SIZE];
+    char labels[METRICS_LABEL_SIZE + 32];
+    unsigned long long bytes_stdout, bytes_stderr;
+    eventloop_time now = eventloop_now();
+    eventloop_time asleep_time;
+    resource_usage *usage;
+    pool *pool;
+    int asleep;
+    int i, j;
+    
+    pool_labels = sfmalloc(pool_count * sizeof(*pool_labels));
+    
+    for (i=0; i<pool_count; i++)
+    {
+        metrics_format_label(pool_labels[i], METRICS_LABEL_SIZE, "pool", pools[i]->settings->pool_name);
+    }
+    
+    /* Each metric is written for every pool in turn, as the samples of a
+       metric must be together.   Removed pools are left out, as in status. */
+    metrics_write_header(fp, "fatcontroller_threads", "gauge", "Threads of the pool.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            metrics_write_value(fp, "fatcontroller_threads", pool_labels[i], pools[i]->threads);
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_slots", "gauge", "Threads by state.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        pool = pools[i];
+        
+        if (!pool->removed)
+        {
+            /* Ready slots of a sleeping pool are sleeping */
+            asleep = pool->asleep ? pool->ready_slots.length : 0;
+            
+            snprintf(labels, sizeof(labels), "%s,state=\"idle\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_slots", labels, pool->ready_slots.length - asleep);
+            snprintf(labels, sizeof(labels), "%s,state=\"running\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_slots", labels, pool->running_slots.length);
+            snprintf(labels, sizeof(labels), "%s,state=\"sleeping\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_slots", labels, pool->sleeping_slots.length + asleep);
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_slot_seconds_total", "counter", "Time threads have spent idle (ready to run a job), running a job or sleeping.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        pool = pools[i];
+        
+        if (!pool->removed)
+        {
+            asleep_time = pool_asleep_time(pool, now);
+            
+            snprintf(labels, sizeof(labels), "%s,state=\"idle\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_slot_seconds_total", labels, EVENTLOOP_SECONDS(slot_list_time(&pool->ready_slots, now) - asleep_time));
+            snprintf(labels, sizeof(labels), "%s,state=\"running\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_slot_seconds_total", labels, EVENTLOOP_SECONDS(slot_list_time(&pool->running_slots, now)));
+            snprintf(labels, sizeof(labels), "%s,state=\"sleeping\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_slot_seconds_total", labels, EVENTLOOP_SECONDS(slot_list_time(&pool->sleeping_slots, now) + asleep_time));
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_queued_items", "gauge", "Work items waiting in the job queue.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed && pools[i]->queue != NULL)
+        {
+            metrics_write_value(fp, "fatcontroller_queued_items", pool_labels[i], jobqueue_length(pools[i]->queue));
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_spawns_total", "counter", "Sub-processes started.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            metrics_write_value(fp, "fatcontroller_spawns_total", pool_labels[i], atomic_load(&pools[i]->metrics.spawns));
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_spawn_failures_total", "counter", "Sub-processes which could not be started.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            metrics_write_value(fp, "fatcontroller_spawn_failures_total", pool_labels[i], atomic_load(&pools[i]->metrics.spawn_failures));
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_exits_total", "counter", "Jobs ended, by exit status: ok (0), ok_more (64), fail (any other) or signal.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            for (j=0; j<JOB_EXITS; j++)
+            {
+                snprintf(labels, sizeof(labels), "%s,status=\"%s\"", pool_labels[i], exit_names[j]);
+                metrics_write_value(fp, "fatcontroller_exits_total", labels, atomic_load(&pools[i]->metrics.exits[j]));
+            }
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_job_duration_seconds", "histogram", "Time from the start of a job to its end.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            metrics_write_histogram(fp, "fatcontroller_job_duration_seconds", pool_labels[i], &pools[i]->metrics.job_duration);
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_exec_latency_seconds", "histogram", "Time from fork() or posix_spawn() until the sub-process has called exec.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            metrics_write_histogram(fp, "fatcontroller_exec_latency_seconds", pool_labels[i], &pools[i]->metrics.exec_latency);
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_log_bytes_total", "counter", "Output of sub-processes written to the log files of the pool since it last changed them.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed
+         && subprocslog_destination_bytes(pools[i]->spawn->log_destination, &bytes_stdout, &bytes_stderr) == RV_OK)
+        {
+            snprintf(labels, sizeof(labels), "%s,stream=\"stdout\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_log_bytes_total", labels, bytes_stdout);
+            snprintf(labels, sizeof(labels), "%s,stream=\"stderr\"", pool_labels[i]);
+            metrics_write_value(fp, "fatcontroller_log_bytes_total", labels, bytes_stderr);
+        }
+    }
+    
+    /* Resources used by sub-processes which have been reaped */
+    metrics_write_header(fp, "fatcontroller_cpu_seconds_total", "counter", "CPU time used by sub-processes in user and kernel mode.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            usage = &pools[i]->metrics.usage;
+            write_pool_value(fp, "fatcontroller_cpu_seconds_total", pool_labels[i], "mode=\"user\"", EVENTLOOP_SECONDS(atomic_load(&usage->user_time)));
+            write_pool_value(fp, "fatcontroller_cpu_seconds_total", pool_labels[i], "mode=\"system\"", EVENTLOOP_SECONDS(atomic_load(&usage->system_time)));
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_max_rss_bytes", "gauge", "Largest resident set size of any one sub-process.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            metrics_write_value(fp, "fatcontroller_max_rss_bytes", pool_labels[i], atomic_load(&pools[i]->metrics.usage.max_rss) * 1024.0);
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_page_faults_total", "counter", "Page faults of sub-processes, minor (no I/O) or major.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            usage = &pools[i]->metrics.usage;
+            write_pool_value(fp, "fatcontroller_page_faults_total", pool_labels[i], "type=\"minor\"", atomic_load(&usage->minor_faults));
+            write_pool_value(fp, "fatcontroller_page_faults_total", pool_labels[i], "type=\"major\"", atomic_load(&usage->major_faults));
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_context_switches_total", "counter", "Context switches of sub-processes, voluntary (waiting) or involuntary.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
         {
-            /* Check for termination timeout */
-            if (time(NULL) >= (slot->termination_requested + dp_settings->termination_timeout))
-            {
-                _syslog(LOG_WARNING, "Thread %d has not shutdown %ds after being issued SIGTERM", (int) *slot->id, dp_settings->termination_timeout);
-                /* Zap! */
-                thread_proc_kill(slot);
-            }
+            usage = &pools[i]->metrics.usage;
+            write_pool_value(fp, "fatcontroller_context_switches_total", pool_labels[i], "type=\"voluntary\"", atomic_load(&usage->voluntary_switches));
+            write_pool_value(fp, "fatcontroller_context_switches_total", pool_labels[i], "type=\"involuntary\"", atomic_load(&usage->involuntary_switches));
         }
-        else
+    }
+    
+    metrics_write_header(fp, "fatcontroller_block_io_bytes_total", "counter", "Bytes read and written to block devices by sub-processes.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
         {
-            /* Determine how long thread has run */
-            int duration = time(NULL) - slot->last_started_at;
-            
-            /* Check duration: error */
-            if (dp_settings->thread_run_time_max > 0
-             && duration > dp_settings->thread_run_time_max)
-            {
-                _syslog(LOG_WARNING, "Thread %d has been running more than %ds.   Sending SIGTERM.", (int) *slot->id, dp_settings->thread_run_time_max);
-                thread_proc_term(slot);
-            } /* Check duration: warning */
-            else if (dp_settings->thread_run_time_warn > 0
-                  && duration > dp_settings->thread_run_time_warn
-                  && slot->duration_warning_issued == 0)
+            usage = &pools[i]->metrics.usage;
+            write_pool_value(fp, "fatcontroller_block_io_bytes_total", pool_labels[i], "direction=\"read\"", atomic_load(&usage->blocks_in) * 512.0);
+            write_pool_value(fp, "fatcontroller_block_io_bytes_total", pool_labels[i], "direction=\"write\"", atomic_load(&usage->blocks_out) * 512.0);
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_oom_kills_total", "counter", "Jobs killed by the OOM killer, as seen in the memory.events of their cgroup.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed)
+        {
+            metrics_write_value(fp, "fatcontroller_oom_kills_total", pool_labels[i], atomic_load(&pools[i]->metrics.usage.oom_kills));
+        }
+    }
+    
+    metrics_write_header(fp, "fatcontroller_breaker_state", "gauge", "State of the circuit breaker, 1 for the state it is in.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        pool = pools[i];
+        
+        if (!pool->removed && pool->breaker.threshold > 0)
+        {
+            for (j=BREAKER_CLOSED; j<=BREAKER_HALF_OPEN; j++)
             {
-                _syslog(LOG_WARNING, "Thread %d has been running more than %ds", (int) *slot->id, dp_settings->thread_run_time_warn);
-                slot->duration_warning_issued = 1;
+                snprintf(labels, sizeof(labels), "%s,state=\"%s\"", pool_labels[i], breaker_state_name(j));
+                metrics_write_value(fp, "fatcontroller_breaker_state", labels, pool->breaker.state == j);
             }
         }
     }
+    
+    metrics_write_header(fp, "fatcontroller_breaker_trips_total", "counter", "Times the circuit breaker has opened.");
+    
+    for (i=0; i<pool_count; i++)
+    {
+        if (!pools[i]->removed && pools[i]->breaker.threshold > 0)
+        {
+            metrics_write_value(fp, "fatcontroller_breaker_trips_total", pool_labels[i], pools[i]->breaker.trips);
+        }
+    }
+    
+    free(pool_labels);
 }
 
-/**
- * Resets any variables that are specific to the runtime of the thread, ready
- * for being run again.
+/* Writes the metrics file if it is due and asks to be woken when it next is */
+static void export_metrics()
+{
+    eventloop_time now;
+    
+    if (metrics_file == NULL)
+    {
+        return;
+    }
+    
+    now = eventloop_now();
+    
+    if (now >= metrics_due)
+    {
+        metrics_write_file(metrics_file, write_metrics);
+        
+        metrics_due = now + metrics_interval;
+    }
+    
+    eventloop_wake_at(metrics_due);
+}
+
+/* Name of a slot status, for the control socket */
+static const char *status_name(int status)
+{
+    switch (status)
+    {
+        case THREAD_STATUS_AVAILABLE:
+            return "available";
+        case THREAD_STATUS_RUNNING:
+            return "running";
+        case THREAD_STATUS_BOOTSTRAPPING:
+            return "starting";
+        case THREAD_STATUS_SLEEPING:
+            return "sleeping";
+        case THREAD_STATUS_UNAVAILABLE:
+            return "unavailable";
+        default:
+            return "finished";
+    }
+}
+
+/* Reports the state of a slot on the control socket.   Times on the
+ * monotonic clock are shown as wall clock times, now and wall_now being the
+ * same moment on both clocks (CLOCK_REALTIME for wall_now).
  */
-void slot_reset(slot *slot)
+static void control_slot_status(control_client *client, slot *slot, eventloop_time now, eventloop_time wall_now)
 {
-    slot->termination_requested = 0;
-    slot->duration_warning_issued = 0;
+    char pid[16] = "-", started[32] = "-", run_time[32] = "-", wakes_in[32] = "-", last_exit[32] = "-";
+    int status = atomic_load(&slot->status), last_status = atomic_load(&slot->last_status);
+    pid_t running_pid = atomic_load(&slot->pid);
+    time_t started_at;
+    struct tm tm;
+    
+    if (running_pid > 0 || slot->worker_pid > 0)
+    {
+        snprintf(pid, sizeof(pid), "%d", running_pid > 0 ? running_pid : slot->worker_pid);
+    }
+    
+    if (slot->last_started_at != 0)
+    {
+        started_at = (time_t) ((wall_now - (now - slot->last_started_at)) / EVENTLOOP_SECOND);
+        localtime_r(&started_at, &tm);
+        strftime(started, sizeof(started), "%Y-%m-%dT%H:%M:%S", &tm);
+    }
+    
+    if (status == THREAD_STATUS_RUNNING || status == THREAD_STATUS_BOOTSTRAPPING)
+    {
+        snprintf(run_time, sizeof(run_time), "%.3fs", EVENTLOOP_SECONDS(now - slot->last_started_at));
+    }
+    else if (status == THREAD_STATUS_SLEEPING)
+    {
+        snprintf(wakes_in, sizeof(wakes_in), "%.3fs", EVENTLOOP_SECONDS(slot->wake_at > now ? slot->wake_at - now : 0));
+    }
+    
+    if (last_status != -1 && WIFSIGNALED(last_status))
+    {
+        snprintf(last_exit, sizeof(last_exit), "signal:%d", WTERMSIG(last_status));
+    }
+    else if (last_status != -1)
+    {
+        snprintf(last_exit, sizeof(last_exit), "%d", WEXITSTATUS(last_status));
+    }
+    
+    control_reply(client, "slot %s %d id=%ld state=%s pid=%s started=%s run_time=%s wakes_in=%s last_exit=%s",
+                  slot->pool->settings->pool_name, slot->number, slot->id, status_name(status),
+                  pid, started, run_time, wakes_in, last_exit);
 }
 
-static void waitForThreads(int logging_enabled)
+/* Reports the state of a pool and its slots on the control socket */
+static void control_pool_status(control_client *client, pool *pool, eventloop_time now, eventloop_time wall_now)
 {
-    int i, stoppedThreads, keepWaiting, stopSignals=0;
+    int i;
     
-    keepWaiting = 1;
+    control_reply(client, "pool %s threads=%d running=%d ready=%d sleeping=%d paused=%d queued=%d breaker=%s",
+                  pool->settings->pool_name, pool->threads, pool->running_slots.length,
+                  pool->ready_slots.length, pool->sleeping_slots.length, pool->paused,
+                  pool->queue != NULL ? jobqueue_length(pool->queue) : 0, breaker_state_name(pool->breaker.state));
+    
+    /* Retired slots are only shown until their last job has ended */
+    for (i=0; i<pool->size; i++)
+    {
+        if (i < pool->threads || pool->slots[i]->status != THREAD_STATUS_UNAVAILABLE || pool->slots[i]->worker_pid > 0)
+        {
+            control_slot_status(client, pool->slots[i], now, wall_now);
+        }
+    }
+}
 
-    /*printf("Waiting for threads to finish\n");*/
-    _syslog(LOG_DEBUG, "Waiting for threads to finish");
+/* Replies with a usage record, after what it is for, e.g. "pool default" */
+static void control_usage(control_client *client, const char *what, resource_usage *usage)
+{
+    control_reply(client, "%s processes=%llu user=%.3fs system=%.3fs max_rss=%llukB minor_faults=%llu major_faults=%llu voluntary_switches=%llu involuntary_switches=%llu blocks_in=%llu blocks_out=%llu oom_kills=%llu",
+                  what, atomic_load(&usage->processes),
+                  EVENTLOOP_SECONDS(atomic_load(&usage->user_time)), EVENTLOOP_SECONDS(atomic_load(&usage->system_time)),
+                  atomic_load(&usage->max_rss), atomic_load(&usage->minor_faults), atomic_load(&usage->major_faults),
+                  atomic_load(&usage->voluntary_switches), atomic_load(&usage->involuntary_switches),
+                  atomic_load(&usage->blocks_in), atomic_load(&usage->blocks_out), atomic_load(&usage->oom_kills));
+}
 
-    while(keepWaiting)
+static void control_pool_usage(control_client *client, pool *pool)
+{
+    char what[METRICS_LABEL_SIZE];
+    int i;
+    
+    snprintf(what, sizeof(what), "pool %s", pool->settings->pool_name);
+    control_usage(client, what, &pool->metrics.usage);
+    
+    /* Retired slots are shown if they were used */
+    for (i=0; i<pool->size; i++)
     {
-        stoppedThreads = 0;
+        if (i < pool->threads || atomic_load(&pool->slots[i]->usage->processes) > 0)
+        {
+            snprintf(what, sizeof(what), "slot %s %d", pool->settings->pool_name, i);
+            control_usage(client, what, pool->slots[i]->usage);
+        }
+    }
+}
+
+/* Returns the pool named in a command, NULL having replied with an error if
+ * there is none
+ */
+static pool *control_pool(control_client *client, const char *name)
+{
+    pool *pool = find_pool(name);
+    
+    if (pool == NULL || pool->removed)
+    {
+        control_error(client, "No pool called %s", name);
+        
+        return NULL;
+    }
+    
+    return pool;
+}
+
+/* Returns the slot of a pool numbered in a command (as --tid=x), NULL having
+ * replied with an error if there is none
+ */
+static slot *control_slot(control_client *client, pool *pool, const char *number)
+{
+    char *end;
+    long n = strtol(number, &end, 10);
+    
+    if (*number == '\0' || *end != '\0' || n < 0 || n >= pool->size)
+    {
+        control_error(client, "No thread %s in pool %s", number, pool->settings->pool_name);
+        
+        return NULL;
+    }
+    
+    return pool->slots[n];
+}
+
+/* Runs a command read from the control socket, see control.h.   Changes are
+ * only made to the running pools, a reload sets them back to their settings.
+ */
+static void control_command(control_client *client, int argc, char **argv)
+{
+    eventloop_time now = eventloop_now(), wall_now;
+    struct timespec ts;
+    char *end;
+    long threads;
+    pool *pool = NULL;
+    slot *slot;
+    char *buffer;
+    size_t size;
+    FILE *fp;
+    int i;
+    
+    if (strcmp(argv[0], "help") == 0 && argc == 1)
+    {
+        control_reply(client, "status [POOL]          State of each pool and thread");
+        control_reply(client, "threads POOL N         Changes the number of threads");
+        control_reply(client, "pause POOL             Stops starting jobs");
+        control_reply(client, "resume POOL            Starts jobs again");
+        control_reply(client, "run POOL [THREAD]      Wakes sleeping threads to run a job now");
+        control_reply(client, "terminate POOL THREAD  Sends SIGTERM to the job of a thread");
+        control_reply(client, "usage [POOL]           Resources used by the processes of each pool and thread");
+        control_reply(client, "metrics                Metrics in the Prometheus text format");
+        control_ok(client);
+    }
+    else if (strcmp(argv[0], "status") == 0 && argc <= 2)
+    {
+        if (argc == 2 && (pool = control_pool(client, argv[1])) == NULL)
+        {
+            return;
+        }
+        
+        clock_gettime(CLOCK_REALTIME, &ts);
+        wall_now = (eventloop_time) ts.tv_sec * EVENTLOOP_SECOND + ts.tv_nsec;
         
-        for (i=0; i<dp_settings->threads;i++)
+        for (i=0; i<pool_count; i++)
         {
-            /* Check for long-running threads */
-            check_thread(slots[i]);
-            
-            /* Check if thread has finished or is sleeping */
-            if (slots[i]->status == 0 || slots[i]->status < -1)
+            if (pools[i] == pool || (pool == NULL && !pools[i]->removed))
             {
-                stoppedThreads++;
+                control_pool_status(client, pools[i], now, wall_now);
             }
         }
-
-        if (stoppedThreads == dp_settings->threads)
+        
+        control_ok(client);
+    }
+    else if (strcmp(argv[0], "threads") == 0 && argc == 3)
+    {
+        if ((pool = control_pool(client, argv[1])) == NULL)
         {
-            break;
+            return;
         }
-
-        /* Check for signals */
-        pthread_mutex_lock(&mutexSignal);
-
-        switch ( handledSignal )
+        
+        threads = strtol(argv[2], &end, 10);
+        
+        if (*argv[2] == '\0' || *end != '\0' || threads < 0 || threads > CONTROL_MAX_THREADS)
         {
-            case -1:
-                break;
-
-            case 0:
-                /* The case for signals we're not interested in */
-                handledSignal = -1;
-                break;
-
-            case SIGTERM:
-            case SIGQUIT:
-            case SIGINT:
-                
-                _syslog(LOG_DEBUG, "WaitForThreads: signal received: %d", handledSignal);
+            control_error(client, "The number of threads must be from 0 to %d", CONTROL_MAX_THREADS);
             
-                if (stopSignals == 0)
-                {
-                    /* If this is the first extra stop signal after the initial signal was received 
-                       to stop creating new instances and shutdown The Fat Controller, then nicely
-                       ask all instances to terminate by sending them SIGTERM */
-                    thread_proc_term_all();
-                }
-                else
-                {
-                    /* If this is the second extra stop signal then the user is obviously in a hurry
-                       so we will stop the main Fat Controller process which will in turn terminate
-                       all other processes */
-                    keepWaiting = 0;
-                }
-                
-                stopSignals++;
+            return;
+        }
+        
+        _syslog(LOG_INFO, "Pool %s: Threads changed from %d to %ld", pool->settings->pool_name, pool->threads, threads);
+        
+        set_pool_threads(pool, (int) threads);
+        eventloop_rescan();
+        
+        control_ok(client);
+    }
+    else if ((strcmp(argv[0], "pause") == 0 || strcmp(argv[0], "resume") == 0) && argc == 2)
+    {
+        if ((pool = control_pool(client, argv[1])) == NULL)
+        {
+            return;
+        }
+        
+        pool->paused = strcmp(argv[0], "pause") == 0;
+        
+        _syslog(LOG_INFO, "Pool %s: %s", pool->settings->pool_name, pool->paused ? "Paused" : "Resumed");
+        
+        eventloop_rescan();
+        
+        control_ok(client);
+    }
+    else if (strcmp(argv[0], "run") == 0 && (argc == 2 || argc == 3))
+    {
+        if ((pool = control_pool(client, argv[1])) == NULL)
+        {
+            return;
+        }
+        
+        if (pool->paused)
+        {
+            control_error(client, "Pool %s is paused", argv[1]);
+            
+            return;
+        }
+        
+        if (argc == 2)
+        {
+            (*pool->wake)(pool);
+        }
+        else
+        {
+            if ((slot = control_slot(client, pool, argv[2])) == NULL)
+            {
+                return;
+            }
+            
+            if (slot->status != THREAD_STATUS_SLEEPING)
+            {
+                control_error(client, "Thread %s of pool %s is not sleeping", argv[2], argv[1]);
                 
-                handledSignal = -1;
-                break;
+                return;
+            }
+            
+            wake_slot(slot);
         }
-
-        pthread_mutex_unlock(&mutexSignal);
-
-        /* Write logs */
-        if (logging_enabled == 1)
+        
+        control_ok(client);
+    }
+    else if (strcmp(argv[0], "terminate") == 0 && argc == 3)
+    {
+        if ((pool = control_pool(client, argv[1])) == NULL || (slot = control_slot(client, pool, argv[2])) == NULL)
+        {
+            return;
+        }
+        
+        if (slot->status != THREAD_STATUS_RUNNING || atomic_load(&slot->pid) <= 0)
+        {
+            control_error(client, "Thread %s of pool %s has no job running", argv[2], argv[1]);
+            
+            return;
+        }
+        
+        if (slot->termination_requested != 0)
+        {
+            control_error(client, "Thread %s of pool %s is already being terminated", argv[2], argv[1]);
+            
+            return;
+        }
+        
+        /* SIGKILL follows if it has not ended by the termination timeout */
+        thread_proc_term(slot);
+        
+        control_ok(client);
+    }
+    else if (strcmp(argv[0], "usage") == 0 && argc <= 2)
+    {
+        if (argc == 2 && (pool = control_pool(client, argv[1])) == NULL)
+        {
+            return;
+        }
+        
+        for (i=0; i<pool_count; i++)
         {
-            if (subprocslog_write_buffers() != RV_OK)
+            if (pools[i] == pool || (pool == NULL && !pools[i]->removed))
             {
-                logging_enabled = 0;
+                control_pool_usage(client, pools[i]);
             }
         }
         
-        usleep(200000);
+        control_ok(client);
     }
-}
-
-void* signalHandler()
-{
-    sigset_t signal_set;
-    int sig;
-
-    while (1)
+    else if (strcmp(argv[0], "metrics") == 0 && argc == 1)
     {
-        /* Wait for any and all signals */
-        sigfillset(&signal_set);
-
-        sigwait(&signal_set, &sig);
-
-        /* When we get this far, we've caught a signal */
-        _syslog(LOG_DEBUG, "Main signal handler, caught signal: %d", sig);
-
-        switch(sig)
+        buffer = NULL;
+        fp = open_memstream(&buffer, &size);
+        
+        if (fp == NULL)
         {
-            /* SIGQUIT */
-            case SIGTERM:
-            case SIGQUIT:
-                pthread_mutex_lock(&mutexSignal);
-                handledSignal = SIGQUIT;
-                pthread_mutex_unlock(&mutexSignal);
-                break;
-
-            /* SIGINT */
-            case SIGINT:
-                pthread_mutex_lock(&mutexSignal);
-                handledSignal = SIGINT;
-                pthread_mutex_unlock(&mutexSignal);
-                break;
-
-            /* SIGHUP */
-            case SIGHUP:
-                pthread_mutex_lock(&mutexSignal);
-                handledSignal = SIGHUP;
-                pthread_mutex_unlock(&mutexSignal);
-                break;
-
-            /* other signals 
-            default:
-                pthread_mutex_lock(&mutexSignal);
-                handledSignal = 0;
-                pthread_mutex_unlock(&mutexSignal);
-                break;*/
+            control_error(client, "Cannot write metrics: [%d] %s", errno, strerror(errno));
+            
+            return;
         }
+        
+        write_metrics(fp);
+        fclose(fp);
+        
+        /* Without the last newline, which the reply adds */
+        if (size > 0)
+        {
+            buffer[size - 1] = '\0';
+            control_reply(client, "%s", buffer);
+        }
+        
+        free(buffer);
+        
+        control_ok(client);
+    }
+    else
+    {
+        control_error(client, "Unknown command or wrong arguments, try help");
     }
-    
-    return (void*)0;
 }
 
 /**
  * Main
  *
+ * Runs every pool in the list of settings.   Pools share the event loop,
+ * deadline heap and logging system, and max_processes (from the first pool's
+ * settings) limits the jobs running in all of them at once.   On SIGHUP the
+ * log files are reopened and the settings are reloaded with reload, see
+ * reload_pools().
  */
-void dispatch(struct dispatching_settings *settings, int daemon)
+void dispatch(struct dispatching_settings *settings, int daemon, settings_loader reload)
 {
-    int rc, i;
-    int running = 1;
+    int i, started, wanted, log_destination;
+    int direct_reaping = 0;
+    struct dispatching_settings *pool_settings;
+    pool_spawn *spawn;
+    pool *pool;
+    slot *changed;
     size_t stacksize;
     sigset_t signalSet;
-    pthread_t threadSignalHandler;
     pthread_attr_t attr;
-    int (*threadModel)(slot *slot, int daemon, int *running, void *state) = NULL;
-    void (*pre_state_check)(void *state) = NULL;
-    void (*post_state_check)(void *state) = NULL;
-    void *state = NULL;
     
-    /* If any calls to subprocslog_write_buffers fail then this is set to 0 and
-       no more calls are made and The Fat Controller is shut down.
-    */
-    int logging_enabled = 1;
+    for (pool_settings = settings; pool_settings != NULL; pool_settings = pool_settings->next_pool)
+    {
+        direct_reaping |= pool_settings->direct_reaping;
+    }
     
-    /* Allocate space on the heap for thread slots */
-    slots = sfmalloc(settings->threads*sizeof( slot *));
+    max_processes = settings->max_processes;
+    capture_mode = log_capture_mode(settings);
+    load_settings = reload;
+    
+    /* Before any thread is started, so that they share the dispatcher's CPUs
+       rather than the pools' */
+    dispatcher_cpus = settings->dispatcher_cpus;
+    placement_initialize(dispatcher_cpus);
     
-    dp_settings = settings;
-
-    /* Initialise the signal mutex lock */
-    pthread_mutex_init(&mutexSignal, NULL);
-
     /* Initialise and set thread attributes */
     pthread_attr_init(&attr);
-
+    
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
+    
     /* Ensure each thread has a given stack size - portability */
     pthread_attr_getstacksize(&attr, &stacksize);
     /*printf("Default stack size = %li\n", (long) stacksize);*/
     _syslog(LOG_DEBUG, "Default stack size = %li", (long) stacksize);
-
+        
         /* Determine and set a new stack size */
         stacksize = sizeof(sigset_t) + THREAD_STACK_HEADROOM;
         /*printf("Amount of stack calculated per thread = %li\n", (long) stacksize);*/
         _syslog(LOG_DEBUG, "Amount of stack calculated per thread = %li", (long) stacksize);
         pthread_attr_setstacksize(&attr, stacksize);
-
-    /* block all signals */
+    
+    /* block all signals, they are read from the event loop instead */
     sigfillset(&signalSet);
     pthread_sigmask(SIG_BLOCK, &signalSet, NULL );
-
-    /* create the signal handling thread */
-    pthread_create(&threadSignalHandler, NULL, signalHandler, NULL);
-
-    /* Determine thread model */
-    if (settings->threadModel == THREAD_MODEL_INDEPENDENT)
+    
+    /* Check pidfds are supported, if not then direct reaping falls back to
+       SIGCHLD.   Checked even without direct reaping in case a reload adds a
+       pool which uses it. */
     {
-        threadModel = &independentThreadModel;
-        pre_state_check = &presc_independent_model;
-        post_state_check = &postsc_independent_model;
+        int pidfd = pidfd_open_safe(getpid());
         
-        state = sfmalloc(sizeof(independent_mode_state));
-        init_state_independent_model(state);
+        if (pidfd != -1)
+        {
+            reap_with_pidfd = 1;
+            sfclose(pidfd, "Cannot close pidfd.");
+        }
     }
-    else if (settings->threadModel == THREAD_MODEL_DEPENDENT)
+    
+    if (direct_reaping == 1)
     {
-        threadModel = &dependentThreadModel;
-        pre_state_check = &presc_dependent_model;
-        post_state_check = &postsc_dependent_model;
-        
-        /* At the moment this thread mode doesn't have state so this is a bit
-           useless but it's here for completeness
-        */
-        init_state_dependent_model(state);
+        _syslog(LOG_DEBUG, "Direct reaping using %s", reap_with_pidfd ? "pidfd" : "SIGCHLD");
     }
-    else if (settings->threadModel == THREAD_MODEL_FIXED_INTERVAL)
+    
+    /* SIGCHLD is always caught with direct reaping in case a pidfd cannot be
+       opened for a sub-process */
+    if (eventloop_initialize(direct_reaping) != RV_OK)
     {
-        threadModel = &fixedIntervalThreadModel;
-        pre_state_check = &presc_fixed_interval;
-        post_state_check = &postsc_fixed_interval;
-        
-        state = sfmalloc(sizeof(fixed_interval_state));
-        init_state_fixed_interval(state);
+        _syslog(LOG_CRIT, "Could not initialise the event loop");
+        exit(EXIT_FAILURE);
     }
     
-    /* Allocate heap space and initialise slots */
-    for (i=0; i<settings->threads;i++)
+    sigchld_caught = direct_reaping;
+    
+    /* Grows as slots are added */
+    deadlines_initialize(0);
+    
+    /* Before any sub-process is started, as the dispatcher may move */
+    cgroup_root = settings->cgroup;
+    
+    if (cgroup_root != NULL)
     {
-        slots[i] = sfmalloc(sizeof(slot));
-        
-        slots[i]->id = sfmalloc(sizeof(long));
-        *slots[i]->id = i;
-        slots[i]->status = THREAD_STATUS_AVAILABLE;
-        slots[i]->thread = sfcalloc(1, sizeof(pthread_t));
-        slots[i]->last_started_at = 0;
+        cgroups = cgroup_initialize(cgroup_root) == RV_OK;
         
-        slot_reset(slots[i]);
+        if (!cgroups)
+        {
+            _syslog(LOG_WARNING, "Running without cgroups");
+        }
     }
     
-    /* If we're to run only once, then we must turn off repeated running */
-    running = (settings->run_once > 0) ? 0 : 1;
-    
-    /* Initialise the sub-process logging system */
+    /* Initialise the sub-process logging system with the first pool's log
+       files, other pools add their own */
     /* (if there's no log file specified for stderr then use the stdout log) */
-    if (subprocslog_initialize(settings->logfile, 
-                               settings->errlogfile == NULL ? settings->logfile 
-                                                            : settings->errlogfile) == RV_OK)
+    if (subprocslog_initialize(settings->logfile,
+                               settings->errlogfile == NULL ? settings->logfile
+                                                            : settings->errlogfile,
+                               capture_mode,
+                               settings->log_line_prefix) == RV_OK)
     {
-        while (running > 0 || settings->run_once-- > 0)
+        for (pool_settings = settings; pool_settings != NULL; pool_settings = pool_settings->next_pool)
+        {
+            log_destination = SUBPROCSLOG_DEFAULT_DESTINATION;
+            
+            if (pool_settings != settings)
+            {
+                log_destination = subprocslog_add_destination(pool_settings->logfile,
+                                                              pool_settings->errlogfile == NULL ? pool_settings->logfile
+                                                                                                : pool_settings->errlogfile);
+                
+                if (log_destination == RV_FAIL)
+                {
+                    _syslog(LOG_CRIT, "Pool %s: Could not open the log file %s", pool_settings->pool_name, pool_settings->logfile);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            
+            /* The settings stay owned by the caller */
+            pool = add_pool(pool_settings, log_destination, 0);
+            
+            if (open_queue(pool, pool_settings, LOG_CRIT) != RV_OK)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+        
+        control_socket = settings->control_socket;
+        
+        if (control_socket != NULL && control_initialize(control_socket, control_command) != RV_OK)
+        {
+            exit(EXIT_FAILURE);
+        }
+        
+        metrics_file = settings->metrics_file;
+        metrics_interval = settings->metrics_interval;
+        time_exec = metrics_file != NULL || control_socket != NULL;
+        
+        while (activate_pools())
         {
-            (*pre_state_check)(state);
-                    /* Scan through the thread slots */
-            for (i=0; i<settings->threads;i++)
+            /* Wake sleeping threads and check long-running threads */
+            run_deadlines(daemon);
+            
+            /* A paused pool's thread model is left as it is, so that it does
+               not act on jobs it cannot start, e.g. terminating the longest
+               running job in the fixed-interval model */
+            for (i=0; i<pool_count; i++)
+            {
+                if (!pools[i]->paused)
+                {
+                    (*pools[i]->pre_state_check)(pools[i]);
+                }
+            }
+            /* Flush output buffer */
+            fflush(stdout);
+            
+            /* File the slots which have changed state, letting the thread
+               model act on any results */
+            take_changed_slots();
+            
+            while ((changed = next_changed_slot()) != NULL)
             {
-                /* Flush output buffer */
-                fflush(stdout);
+                pool = changed->pool;
                 
-                /* Check for long-running threads */
-                check_thread(slots[i]);
+                file_slot(changed);
                 
-                if ((*threadModel)(slots[i], daemon, &running, state) == 1)
+                /* The sub-process has gone, a worker stays */
+                if (changed->worker_pid == 0
+                 && changed->status != THREAD_STATUS_RUNNING
+                 && changed->status != THREAD_STATUS_BOOTSTRAPPING)
                 {
-                    /* Create a new thread */
-                    
-                    /* Set this slot as used, -1 is a temporary value before being replaced by the PID of the forked process (prevents race hazards) */
-                    slots[i]->status = THREAD_STATUS_BOOTSTRAPPING;
-
-                    /*printf("Main: creating thread %d\n", i);*/
-                    _syslog(LOG_DEBUG, "Main: creating thread %d", i);
+                    release_spawn(changed);
+                }
+                
+                if (changed->status == THREAD_STATUS_DONE_OK
+                 || changed->status == THREAD_STATUS_DONE_MORE
+                 || changed->status == THREAD_STATUS_DONE_FAIL)
+                {
+                    breaker_outcome(changed);
+                }
+                
+                wanted = changed->status != THREAD_STATUS_AVAILABLE
+                      && (*pool->threadModel)(changed, daemon, &pool->running, pool->state) == 1;
+                
+                /* A slot beyond the size of a pool which has shrunk is retired
+                   once the thread model has seen the result of its job */
+                if (retire_slot(changed) == 0
+                 && wanted
+                 && pool->active
+                 && below_process_limit())
+                {
+                    start_slot(changed, &attr);
+                }
+                
+                file_slot(changed);
+            }
+            
+            /* Start jobs in available slots for as long as the thread models
+               want them, without looking at the slots which are busy.   Pools
+               take turns to start one job each, so that one pool cannot use
+               all of max_processes. */
+            for (i=0; i<pool_count; i++)
+            {
+                pools[i]->starting = pools[i]->active;
+            }
+            
+            do
+            {
+                started = 0;
+                
+                for (i=0; i<pool_count && below_process_limit(); i++)
+                {
+                    pool = pools[i];
                     
-                    rc = pthread_create((slots[i]->thread), &attr, task, (void *) slots[i]->id );
-
-                    if (rc)
+                    if (pool->starting)
                     {
-                        _syslog(LOG_CRIT, "ERROR: return code from pthread_create() is %d", rc);
-                        exit(EXIT_FAILURE);
+                        pool->starting = pool->active
+                                      && pool->ready_slots.head != NULL
+                                      && (*pool->threadModel)(pool->ready_slots.head, daemon, &pool->running, pool->state) == 1
+                                      && start_slot(pool->ready_slots.head, &attr) == 1;
+                        
+                        started |= pool->starting;
                     }
-                    
-                    pthread_detach(*(slots[i]->thread));
-                    
-                    slots[i]->last_started_at = time(0);
                 }
-            }
+            } while (started);
             
-
-            pthread_mutex_lock(&mutexSignal);
-
             switch ( handledSignal )
             {
                 case SIGTERM:
@@ -760,8 +4051,16 @@ void dispatch(struct dispatching_settings *settings, int daemon)
                 case SIGINT:
                     _syslog(LOG_DEBUG, "Main: shutdown signal: %d", handledSignal);
                     handledSignal = -1;
-                    running = -1;
+                    
+                    for (i=0; i<pool_count; i++)
+                    {
+                        pools[i]->running = -1;
+                    }
+                    
                     thread_proc_term_all();
+                    
+                    /* Leave the loop without waiting for another event */
+                    eventloop_rescan();
                     break;
                 
                 case SIGHUP:
@@ -769,28 +4068,67 @@ void dispatch(struct dispatching_settings *settings, int daemon)
                     handledSignal = -1;
                     /*thread_proc_term_all();*/
                     subprocslog_reinitialize();
+                    
+                    if (load_settings != NULL)
+                    {
+                        reload_pools();
+                    }
                     break;
             }
-
-            pthread_mutex_unlock(&mutexSignal);
-            
-            (*post_state_check)(state);
             
-            /* Write any unwritten data collected from the stdout and stderr of sub processes */
-            if (logging_enabled == 1)
+            /* Only for pools which could start jobs in this pass, not ones
+               which are paused or whose breaker is open */
+            for (i=0; i<pool_count; i++)
             {
-                if (subprocslog_write_buffers() != RV_OK)
+                if (pools[i]->active)
                 {
-                    logging_enabled = 0;
+                    (*pools[i]->post_state_check)(pools[i]);
                 }
             }
-
-            /* Sleep for a bit - all this thread creation is hard work! */
-            usleep(200000);
+            
+            for (i=0; i<pool_count; i++)
+            {
+                account_pool_sleep(pools[i], eventloop_now());
+            }
+            
+            export_metrics();
+            
+            /* Sleep until there is something to do */
+            waitForEvents();
+        }
+        
+        /* Stop reading work items.   Anything not yet read is left in the
+           source for the next run, as are items still queued from a spool
+           directory, but items still queued from a FIFO or socket are lost
+           (see jobqueue_deinitialize()). */
+        for (i=0; i<pool_count; i++)
+        {
+            jobqueue_deinitialize(pools[i]->queue);
+            pools[i]->queue = NULL;
         }
         
+        /* Workers would otherwise wait for jobs indefinitely */
+        stop_workers();
+        
         /* Wait for all threads to end */
-        waitForThreads(logging_enabled);
+        waitForThreads();
+        
+        /* Now that the jobs have left them */
+        for (i=0; i<pool_count; i++)
+        {
+            cgroup_destroy(pools[i]->cgroup);
+            pools[i]->cgroup = NULL;
+        }
+        
+        cgroup_deinitialize();
+        
+        control_deinitialize();
+        
+        /* With the last jobs, before the log files are closed */
+        if (metrics_file != NULL)
+        {
+            metrics_write_file(metrics_file, write_metrics);
+        }
         
         /* Shutdown the sub-process logging system */
         subprocslog_deinitialize();
@@ -800,85 +4138,144 @@ void dispatch(struct dispatching_settings *settings, int daemon)
     
     pthread_attr_destroy(&attr);
     
-    free(state);
+    eventloop_deinitialize();
     
-    for (i=0; i<settings->threads;i++)
+    deadlines_deinitialize();
+    
+    for (i=0; i<pool_count; i++)
     {
-        free(slots[i]->id);
-        
-        free(slots[i]->thread);
+        while ((spawn = pools[i]->spawn) != NULL)
+        {
+            pools[i]->spawn = spawn->next;
+            free_spawn(spawn);
+        }
         
-        free(slots[i]);
+        free(pools[i]->state);
+        breaker_deinitialize(&pools[i]->breaker);
+        free(pools[i]->slots);
+        free(pools[i]);
+    }
+    
+    free(pools);
+    pools = NULL;
+    pool_count = 0;
+    
+    for (i=0; i<slot_block_count; i++)
+    {
+        free(slot_blocks[i]);
     }
     
+    free(slot_blocks);
+    slot_blocks = NULL;
+    slot_block_count = 0;
+    
     free(slots);
+    slots = NULL;
+    slot_count = 0;
     
     _syslog(LOG_DEBUG, "Bye");
 }
 
-int independentThreadModel(slot *slot, int daemon, int *running, void *state_vp)
+/* Returns how long to sleep after a job which found no more work, or which
+ * failed if failed is set, moving on the backoff for that outcome and ending
+ * the run of the other (sleep_backoff may be NULL if there is none).
+ */
+static eventloop_time next_sleep(struct dispatching_settings *settings, backoff *sleep_backoff, backoff *error_backoff, int failed)
 {
-    /*
-        TODO:   The thread should simply return the result of the child process, 
-        i.e. ok, ok+more, or fail.   This function should, based on that result
-        decide what to do, i.e. mark thread as available or put it to sleep.
-    */
+    if (failed)
+    {
+        if (sleep_backoff != NULL)
+        {
+            backoff_reset(sleep_backoff);
+        }
+        
+        return backoff_next(error_backoff, settings->sleep_on_error_backoff, settings->sleepOnError, settings->sleep_on_error_max);
+    }
     
+    backoff_reset(error_backoff);
+    
+    return backoff_next(sleep_backoff, settings->sleep_backoff, settings->sleep, settings->sleep_max);
+}
+
+int independentThreadModel(slot *slot, int daemon, int *running, void *state_vp)
+{
     independent_mode_state *state = (independent_mode_state *) state_vp;
+    eventloop_time duration;
+    
+    /* Threads only report the result of the sub-process (or job of a
+       persistent worker), it is decided here whether the slot is used again
+       straight away or put to sleep */
+    if (slot->status == THREAD_STATUS_DONE_MORE)
+    {
+        _syslog(LOG_DEBUG, "Thread %ld: ok+more Returning to pool", slot->id);
+        
+        backoff_reset(&slot->backoffs->sleep);
+        backoff_reset(&slot->backoffs->error);
+        
+        slot->status = THREAD_STATUS_AVAILABLE;
+    }
+    else if (slot->status == THREAD_STATUS_DONE_OK)
+    {
+        duration = next_sleep(slot->pool->settings, &slot->backoffs->sleep, &slot->backoffs->error, 0);
+        
+        _syslog(LOG_DEBUG, "Thread %ld: ok Putting thread to sleep for %.3fs", slot->id, EVENTLOOP_SECONDS(duration));
+        slot_sleep(slot, duration);
+    }
+    else if (slot->status == THREAD_STATUS_DONE_FAIL)
+    {
+        duration = next_sleep(slot->pool->settings, &slot->backoffs->sleep, &slot->backoffs->error, 1);
+        
+        _syslog(LOG_DEBUG, "Thread %ld: fail Putting thread to sleep for %.3fs (failure %d in a row)", slot->id, EVENTLOOP_SECONDS(duration), slot->backoffs->error.count);
+        slot_sleep(slot, duration);
+    }
     
     if (slot->status == THREAD_STATUS_AVAILABLE)  /* Thread is currently not doing anything, so let's give it something to do */
     {
         /* This slot is spare */
         return 1;
     }
-    else if (slot->status < THREAD_STATUS_BOOTSTRAPPING)     /* Thread is sleeping, see if we should wake it up */
+    else if (slot->status == THREAD_STATUS_SLEEPING)     /* Thread is sleeping (it is woken up by run_deadlines()) */
     {
         if ( daemon == 0 )
         {
             /* Application mode */
-            state->unavailable_slots_count++;
+            file_slot(slot);
+            state->unavailable_slots_count = slot->pool->sleeping_slots.length;
             
-            if ( state->unavailable_slots_count == dp_settings->threads )
+            if ( state->unavailable_slots_count == slot->pool->threads )
             {
                 _syslog(LOG_DEBUG, "All threads finished.");
                 *running = 0;
             }
         }
-        else
-        {
-            /* Daemon mode */
-            if (time(0) > (-1 * slot->status) )
-            {
-                /* Thread has slept long enough so let's wake it up */
-                slot->status = THREAD_STATUS_AVAILABLE;
-            }
-        }
     }
     
     return 0;
 }
 
-int dependentThreadModel(slot *slot, int daemon, int *running, void *state)
+int dependentThreadModel(slot *slot, int daemon, int *running, void *state_vp)
 {
-    static int noThreads = 1;
-    static int sleepUntil = 0;
-    
-    UNUSED(state);
+    dependent_model_state *state = (dependent_model_state *) state_vp;
+    eventloop_time now = eventloop_now();
     
     /*
     If running as an application (i.e. not as a daemon) then if a thread
     returns anything but THREAD_STATUS_DONE_MORE then it sets running=0
     which stops any new threads from being created.
-    Note that when running is set to 0, noThreads is also set  1, so that
-    there is no need to check running here if a thread is 
-    THREAD_STATUS_AVAILABLE
+    The number of threads which may run at once is decided by the
+    concurrency controller (see concurrency.h)
     */
     
     if (slot->status == THREAD_STATUS_AVAILABLE)
     {
-        if (*slot->id<noThreads && time(0) > sleepUntil)
+        if (slot->pool->running_slots.length < state->concurrency.limit)
         {
-            return 1;
+            if (eventloop_now() >= state->sleep_until)
+            {
+                return 1;
+            }
+            
+            eventloop_wake_at(state->sleep_until);
         }
     }
     else
@@ -886,16 +4283,29 @@ int dependentThreadModel(slot *slot, int daemon, int *running, void *state)
         if (slot->status == THREAD_STATUS_DONE_MORE)
         {
             /* Child returned ok+more */
-            noThreads += (noThreads + 1) > dp_settings->threads ? 0 : 1;
+            concurrency_more(&state->concurrency);
+            
+            backoff_reset(&state->sleep_backoff);
+            backoff_reset(&state->error_backoff);
             
             slot->status = THREAD_STATUS_AVAILABLE;
+            eventloop_rescan();
         }
         else if (slot->status == THREAD_STATUS_DONE_FAIL)
         {
             /* Child returned fail */
-            noThreads = 1;
+            concurrency_failed(&state->concurrency);
             
-            sleepUntil = time(0) + dp_settings->sleepOnError;
+            /* Jobs already running when the pool began sleeping do not make
+               it back off further */
+            if (slot->last_started_at >= state->slept_at)
+            {
+                state->sleep_until = now + next_sleep(slot->pool->settings, &state->sleep_backoff, &state->error_backoff, 1);
+                state->slept_at = now;
+                
+                _syslog(LOG_DEBUG, "Pool %s: fail Sleeping for %.3fs (failure %d in a row)", slot->pool->settings->pool_name,
+                        EVENTLOOP_SECONDS(state->sleep_until - now), state->error_backoff.count);
+            }
             
             if ( daemon == 0 )
             {
@@ -903,12 +4313,21 @@ int dependentThreadModel(slot *slot, int daemon, int *running, void *state)
             }
             
             slot->status = THREAD_STATUS_AVAILABLE;
+            eventloop_rescan();
         }
         else if (slot->status == THREAD_STATUS_DONE_OK)
         {
-            /* Child returned ok+nomore */
-            noThreads = 1;
-            sleepUntil = time(0) + dp_settings->sleep;
+            /* Child returned ok+nomore, only sleep once there is nothing left
+               to back off */
+            if (!concurrency_no_more(&state->concurrency))
+            {
+                backoff_reset(&state->error_backoff);
+            }
+            else if (slot->last_started_at >= state->slept_at)
+            {
+                state->sleep_until = now + next_sleep(slot->pool->settings, &state->sleep_backoff, &state->error_backoff, 0);
+                state->slept_at = now;
+            }
             
             if ( daemon == 0 )
             {
@@ -916,6 +4335,7 @@ int dependentThreadModel(slot *slot, int daemon, int *running, void *state)
             }
             
             slot->status = THREAD_STATUS_AVAILABLE;
+            eventloop_rescan();
         }
         /* If no condition matches then the thread is either still running or unavailable */
     }
@@ -933,44 +4353,38 @@ int fixedIntervalThreadModel(slot *slot, int daemon, int *running, void *state_v
     if (slot->status == THREAD_STATUS_DONE_OK
      || slot->status == THREAD_STATUS_DONE_MORE)
     {
+        backoff_reset(&state->error_backoff);
+        
         slot->status = THREAD_STATUS_AVAILABLE;
     }
     else if (slot->status == THREAD_STATUS_DONE_FAIL)
     {
         state->is_sleeping = 1;
-        state->sleep_until = time(0) + dp_settings->sleepOnError;
         
-        slot->status = THREAD_STATUS_AVAILABLE;
-    }
-    
-    /* If thread is available */
-    if (slot->status == THREAD_STATUS_AVAILABLE)
-    {
-        /* If thread required */
-        if (state->new_thread_required == 1
-         && state->is_sleeping == 0)
+        /* The interval is the sleep, so only failures back off */
+        if (slot->last_started_at >= state->slept_at)
         {
-            /* Set new thread not required */
-            state->new_thread_required = 0;
-            
-            state->wait_until = 0;
-            
-            state->last_run_slot = slot;
-            
-            /* Create thread */
-            return 1;
+            state->slept_at = eventloop_now();
+            state->sleep_until = state->slept_at + next_sleep(slot->pool->settings, NULL, &state->error_backoff, 1);
         }
+        
+        slot->status = THREAD_STATUS_AVAILABLE;
     }
-    else
+    
+    /* If thread is available and a thread is required */
+    if (slot->status == THREAD_STATUS_AVAILABLE
+     && state->new_thread_required == 1
+     && state->is_sleeping == 0)
     {
-        /* If no condition matches then the thread is either still running or 
-           unavailable, so check if it is the longest running */
-        if (state->longest_running_slot == NULL
-         || state->longest_running_slot->status < 1
-         || state->longest_running_slot->last_started_at > slot->last_started_at)
-        {
-            state->longest_running_slot = slot;
-        }
+        /* Set new thread not required */
+        state->new_thread_required = 0;
+        
+        state->wait_until = 0;
+        
+        state->last_run_slot = slot;
+        
+        /* Create thread */
+        return 1;
     }
     
     return 0;
@@ -978,18 +4392,34 @@ int fixedIntervalThreadModel(slot *slot, int daemon, int *running, void *state_v
 
 /* State initialisers */
 
-void init_state_independent_model(void *state_vp)
+void init_state_independent_model(pool *pool)
 {
-    independent_mode_state *state = (independent_mode_state *) state_vp;
+    independent_mode_state *state = sfmalloc(sizeof(independent_mode_state));
+    
+    pool->state = state;
 
     state->unavailable_slots_count = 0;
 }
 
-void init_state_dependent_model(void *state){ UNUSED(state); }
+void init_state_dependent_model(pool *pool)
+{
+    dependent_model_state *state = sfmalloc(sizeof(dependent_model_state));
+    
+    pool->state = state;
+    
+    concurrency_initialize(&state->concurrency, pool->settings->concurrency_controller, pool->threads, pool->settings->concurrency_decay);
+    state->sleep_until = 0;
+    state->slept_at = 0;
+    
+    backoff_reset(&state->sleep_backoff);
+    backoff_reset(&state->error_backoff);
+}
 
-void init_state_fixed_interval(void *state_vp)
+void init_state_fixed_interval(pool *pool)
 {
-    fixed_interval_state *state = (fixed_interval_state *) state_vp;
+    fixed_interval_state *state = sfmalloc(sizeof(fixed_interval_state));
+    
+    pool->state = state;
     
     state->new_thread_required = 0;
     state->longest_running_slot = NULL;
@@ -997,33 +4427,98 @@ void init_state_fixed_interval(void *state_vp)
     state->is_sleeping = 0;
     state->sleep_until = 0;
     state->wait_until = 0;
+    state->slept_at = 0;
+    
+    backoff_reset(&state->error_backoff);
 }
 
 
 /* Pre and post state handlers */
 
-void presc_independent_model(void *state_vp)
+void presc_independent_model(pool *pool)
 {
-    independent_mode_state *state = (independent_mode_state *) state_vp;
+    independent_mode_state *state = (independent_mode_state *) pool->state;
 
     state->unavailable_slots_count = 0;
 }
 
-void postsc_independent_model(void *state){ UNUSED(state); }
-void presc_dependent_model(void *state){ UNUSED(state); }
-void postsc_dependent_model(void *state){ UNUSED(state); }
+void postsc_independent_model(pool *pool){ UNUSED(pool); }
+void presc_dependent_model(pool *pool){ UNUSED(pool); }
+void postsc_dependent_model(pool *pool){ UNUSED(pool); }
+
+
+/* Wake handlers, which start a job now rather than once the pool has slept
+   (see control_command()) */
+
+void wake_independent_model(pool *pool)
+{
+    while (pool->sleeping_slots.head != NULL)
+    {
+        wake_slot(pool->sleeping_slots.head);
+    }
+}
+
+void wake_dependent_model(pool *pool)
+{
+    dependent_model_state *state = (dependent_model_state *) pool->state;
+    
+    state->sleep_until = 0;
+    
+    eventloop_rescan();
+}
 
-void presc_fixed_interval(void *state_vp)
+void wake_fixed_interval(pool *pool)
 {
-    fixed_interval_state *state = (fixed_interval_state *) state_vp;
+    fixed_interval_state *state = (fixed_interval_state *) pool->state;
+    
+    /* As if the interval had passed */
+    state->is_sleeping = 0;
+    state->new_thread_required = 1;
+    
+    eventloop_rescan();
+}
+
+
+/* Sleeping handlers, which say whether the pool as a whole is sleeping, see
+   account_pool_sleep() */
+
+int sleeping_independent_model(pool *pool)
+{
+    /* Its slots sleep on their own */
+    UNUSED(pool);
+    
+    return 0;
+}
+
+int sleeping_dependent_model(pool *pool)
+{
+    dependent_model_state *state = (dependent_model_state *) pool->state;
+    
+    return eventloop_now() < state->sleep_until;
+}
+
+int sleeping_fixed_interval(pool *pool)
+{
+    fixed_interval_state *state = (fixed_interval_state *) pool->state;
+    
+    return state->is_sleeping == 1 && eventloop_now() < state->sleep_until;
+}
+
+void presc_fixed_interval(pool *pool)
+{
+    fixed_interval_state *state = (fixed_interval_state *) pool->state;
     
     /* If thread creation is sleeping, see if we should wake it up */
     if (state->is_sleeping == 1)
     {
-        if (state->sleep_until <= time(0))
+        if (state->sleep_until <= eventloop_now())
         {
             state->is_sleeping = 0;
         }
+        else
+        {
+            eventloop_wake_at(state->sleep_until);
+        }
     }
     
     /* Determine if a new thread is required */
@@ -1037,18 +4532,35 @@ void presc_fixed_interval(void *state_vp)
         else
         {
             /* If there is a value, check if it was longer than now-sleep */
-            if ((time(0) - dp_settings->sleep) >= state->last_run_slot->last_started_at)
+            if ((eventloop_now() - pool->settings->sleep) >= state->last_run_slot->last_started_at)
             {
                 state->new_thread_required = 1;
             }
+            else
+            {
+                eventloop_wake_at(state->last_run_slot->last_started_at + pool->settings->sleep);
+            }
         }
     }
 }
 
 
-void postsc_fixed_interval(void *state_vp)
+void postsc_fixed_interval(pool *pool)
 {
-    fixed_interval_state *state = (fixed_interval_state *) state_vp;
+    fixed_interval_state *state = (fixed_interval_state *) pool->state;
+    
+    /* Slots are filed in the order they were started */
+    state->longest_running_slot = pool->running_slots.head;
+    
+    /* A thread is free, so the job was only held back by max_processes and
+       the interval has not overrun.   It is started once a process ends,
+       which wakes the dispatcher. */
+    if (pool->ready_slots.head != NULL)
+    {
+        state->wait_until = 0;
+        
+        return;
+    }
     
     /* Determine if we need to terminate a thread */
     
@@ -1056,7 +4568,7 @@ void postsc_fixed_interval(void *state_vp)
     if (state->new_thread_required == 1
      && state->is_sleeping == 0 )
     {
-        if (dp_settings->fi_wait_time_max == -1)
+        if (pool->settings->fi_wait_time_max == FI_WAIT_INDEFINITELY)
         {
             /* If wait is -1, then skip termination */
             
@@ -1072,17 +4584,24 @@ void postsc_fixed_interval(void *state_vp)
             
             state->wait_until = FI_WAIT_INDEFINITELY;
         }
-        else if (dp_settings->fi_wait_time_max > 0
+        else if (pool->settings->fi_wait_time_max > 0
               && state->wait_until == 0)
         {
             /* If wait is >0 and we are not currently waiting, then start waiting */
-            state->wait_until = time(0) + dp_settings->fi_wait_time_max;
+            state->wait_until = eventloop_now() + pool->settings->fi_wait_time_max;
             
             _syslog(LOG_DEBUG, "No free thread available - started waiting.");
+            
+            eventloop_wake_at(state->wait_until);
+        }
+        else if (state->wait_until > eventloop_now())
+        {
+            /* Still waiting */
+            eventloop_wake_at(state->wait_until);
         }
-        else if (dp_settings->fi_wait_time_max ==0
+        else if (pool->settings->fi_wait_time_max ==0
                  || (state->wait_until > 0 
-                     && state->wait_until <= time(0)))
+                     && state->wait_until <= eventloop_now()))
         {
             /* If wait is zero or has timed out, then proceed to terminate the longest running thread proc */
             
@@ -1091,7 +4610,7 @@ void postsc_fixed_interval(void *state_vp)
             {
                 if (state->longest_running_slot->termination_requested == 0)
                 {
-                    _syslog(LOG_DEBUG, "Terminating oldest thread: %d, running %ds", state->longest_running_slot->status, (int) (time(0)-state->longest_running_slot->last_started_at));
+                    _syslog(LOG_DEBUG, "Terminating oldest thread: %d, running %.3fs", state->longest_running_slot->pid, EVENTLOOP_SECONDS(eventloop_now() - state->longest_running_slot->last_started_at));
                     
                     /* Request to terminate the oldest thread (longest running) */
                     /* This will be acted upon by the check_thread function */
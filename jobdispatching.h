@@ -22,26 +22,48 @@
 #ifndef JOBDISPATCHING_H
 #define JOBDISPATCHING_H
 
+#include <stdatomic.h>
+#include "concurrency.h"
+#include "eventloop.h"
+#include "metrics.h"
+#include "cgroup.h"
+#include "placement.h"
+#include "backoff.h"
+#include "breaker.h"
+
 #define DEFAULT_NO_THREADS 1
-#define DEFAULT_SLEEP 30
-#define DEFAULT_SLEEP_ON_ERROR 300
+
+/* Most threads a pool can be given on the control socket, a guard against
+   typing mistakes */
+#define CONTROL_MAX_THREADS 100000
+#define DEFAULT_POOL_NAME "default"
 #define THREAD_STACK_HEADROOM 1048576
-#define DEFAULT_THREAD_RUN_TIME_WARN 3600
+
+/* Durations (see eventloop_time) */
+#define DEFAULT_SLEEP (30 * EVENTLOOP_SECOND)
+#define DEFAULT_SLEEP_ON_ERROR (300 * EVENTLOOP_SECOND)
+#define DEFAULT_SLEEP_MAX (3600 * EVENTLOOP_SECOND)
+#define DEFAULT_SLEEP_ON_ERROR_MAX (3600 * EVENTLOOP_SECOND)
+#define DEFAULT_THREAD_RUN_TIME_WARN (3600 * EVENTLOOP_SECOND)
 #define DEFAULT_THREAD_RUN_TIME_MAX 0
-#define DEFAULT_TERMINATION_TIMEOUT 30
-#define DEFAULT_FI_WAIT_TIME_MAX -1
+#define DEFAULT_TERMINATION_TIMEOUT (30 * EVENTLOOP_SECOND)
+#define DEFAULT_FI_WAIT_TIME_MAX FI_WAIT_INDEFINITELY
+#define DEFAULT_METRICS_INTERVAL (15 * EVENTLOOP_SECOND)
 
 #define THREAD_MODEL_INDEPENDENT 1
 #define THREAD_MODEL_DEPENDENT 2
 #define THREAD_MODEL_FIXED_INTERVAL 3
+#define THREAD_MODEL_PERSISTENT 4
 
-/* Thread status values */
+/* Thread status values, see slot_transition() */
+#define THREAD_STATUS_RUNNING 1
 #define THREAD_STATUS_AVAILABLE 0
 #define THREAD_STATUS_BOOTSTRAPPING -1
 #define THREAD_STATUS_DONE_MORE -2
 #define THREAD_STATUS_DONE_OK -3
 #define THREAD_STATUS_DONE_FAIL -4
 #define THREAD_STATUS_UNAVAILABLE -5
+#define THREAD_STATUS_SLEEPING -6
 
 #define FI_WAIT_INDEFINITELY -1
 
@@ -49,8 +71,8 @@
 
 /* 
     Thread status values:
-    Note that >0 is an active thread and the value denotes the PID of the child process
-    and <-4 denotes a sleeping thread, negative timestamp when will finish sleeping.
+    Note that >0 is an active thread and the value denotes the PID of the child process.
+    A sleeping thread (THREAD_STATUS_SLEEPING) sleeps until the slot's wake_at.
 */
 
 /* Define exit statuses */
@@ -58,40 +80,365 @@
 #define EXIT_STATUS_FAIL 255
 #define EXIT_STATUS_OK_MORE 64
 
+/* How jobs ended, as counted in the metrics */
+#define JOB_EXIT_OK 0
+#define JOB_EXIT_OK_MORE 1
+#define JOB_EXIT_FAIL 2
+#define JOB_EXIT_SIGNAL 3
+#define JOB_EXITS 4
+
+/* Longest label written with the metrics of a pool */
+#define METRICS_LABEL_SIZE 256
+
+/* Persistent model protocol, see run_worker_job() */
+#define WORKER_COMMAND_RUN "run"
+#define WORKER_REPLY_OK "ok"
+#define WORKER_REPLY_OK_MORE "ok-more"
+#define WORKER_REPLY_FAIL "fail"
+
+/* Longest line read from a worker's STDOUT (including the terminating null),
+   longer lines are logged in pieces */
+#define WORKER_LINE_SIZE 4096
 
+/* Slots are aligned to cache lines */
+#define SLOT_ALIGNMENT 64
+
+
+/* Settings of one pool of slots.   Pools are linked by next_pool, the first
+   also holding the settings which apply to the whole dispatcher (log capture
+   mode and max_processes). */
 struct dispatching_settings
 {
+    char *pool_name;
     char *logfile;
     char *logformat;
     char *errlogfile;
-    int sleep;
-    int sleepOnError;
+    eventloop_time sleep;
+    eventloop_time sleepOnError;
+    int sleep_backoff;
+    eventloop_time sleep_max;
+    int sleep_on_error_backoff;
+    eventloop_time sleep_on_error_max;
+    double breaker_threshold;
+    int breaker_window;
+    eventloop_time breaker_open_time;
     char *path;
     char *cmd;
     char **argv;
     int argc;
     int threads;
     int threadModel;
-    int thread_run_time_warn;
-    int thread_run_time_max;
-    int termination_timeout;
-    int fi_wait_time_max;
+    eventloop_time thread_run_time_warn;
+    eventloop_time thread_run_time_max;
+    eventloop_time termination_timeout;
+    eventloop_time fi_wait_time_max;
     int append_thread_id;
     int run_once;
+    int direct_reaping;
+    int posix_spawn;
+    int log_splice;
+    int log_lines;
+    int log_line_prefix;
+    int max_jobs_per_child;
+    int queue_source;
+    char *queue_location;
+    int queue_delivery;
+    int queue_batch;
+    int concurrency_controller;
+    double concurrency_decay;
+    char *cgroup_cpu_max;
+    char *cgroup_memory_max;
+    char *cgroup_io_max;
+    int cgroup_per_job;
+    char *cpus;
+    int pin_threads;
+    char *numa_nodes;
+    int nice;
+    int ionice;
+    int scheduler;
+    int max_processes;
+    char *control_socket;
+    char *metrics_file;
+    eventloop_time metrics_interval;
+    char *cgroup;
+    char *dispatcher_cpus;
+    struct dispatching_settings *next_pool;
 };
 
 
 /* Do we need all this in the header file? */
 
+struct slot;
+struct pool;
+
+/* Loads the settings again for a reload, see reload_pools().   Returns NULL,
+   having reported why, if they are not valid. */
+typedef struct dispatching_settings *(*settings_loader)();
+
+/* What a pool's sub-processes are started with: its settings, argument vector
+   and log destination.   Never changed once in use, so threads may read it
+   without locking.   A reload gives the pool a new one, older ones are freed
+   once no slot uses them (see release_spawn()). */
+typedef struct pool_spawn
+{
+    struct dispatching_settings *settings;
+    
+    /* Argument vector shared by the sub-processes, see build_argv_template() */
+    char **argv_template;
+    int argv_template_size;
+    int tid_index;
+    
+    /* Logging system destination of the sub-processes */
+    int log_destination;
+    
+    /* CPUs, NUMA nodes and priorities of the sub-processes */
+    placement *placement;
+    
+    /* Number of slots using it */
+    int users;
+    
+    /* Only changed if sub-processes are started differently */
+    int version;
+    
+    /* Set if settings were loaded by a reload and are freed with it */
+    int reloaded;
+    
+    /* Older one, NULL if none */
+    struct pool_spawn *next;
+} pool_spawn;
+
+/* List of slots in the same state, see file_slot().   For the metrics it
+   also keeps the time slots which have left it spent on it, and the sum of
+   the times the slots still on it were added, so that the time they have
+   spent on it so far is length * now - listed_at_sum.   The sum may wrap
+   around, which does not change the result. */
+typedef struct
+{
+    struct slot *head;
+    struct slot *tail;
+    int length;
+    eventloop_time time;
+    uint64_t listed_at_sum;
+} slot_list;
+
+/* Resources used by the sub-processes of a slot or pool, as reported by
+   wait4() when each is reaped, see account_usage().   A persistent worker is
+   only reaped when it exits, so its usage covers all of its jobs. */
 typedef struct
 {
-    long *id;
-    int status;
-    pthread_t *thread;
-    time_t last_started_at;
-    int termination_requested;
+    /* Sub-processes reaped */
+    atomic_ullong processes;
+    
+    /* CPU time in user and kernel mode (ns) */
+    atomic_ullong user_time;
+    atomic_ullong system_time;
+    
+    /* Largest resident set size of any one sub-process (kB) */
+    atomic_ullong max_rss;
+    
+    atomic_ullong minor_faults;
+    atomic_ullong major_faults;
+    atomic_ullong voluntary_switches;
+    atomic_ullong involuntary_switches;
+    
+    /* Block I/O, in 512 byte blocks */
+    atomic_ullong blocks_in;
+    atomic_ullong blocks_out;
+    
+    /* Jobs killed by the OOM killer, and oom_kill of the cgroup's
+       memory.events when last looked at, see killed_by_oom() */
+    atomic_ullong oom_kills;
+    atomic_ullong oom_events;
+} resource_usage;
+
+/* Independent model: how long a slot sleeps after its next job if it finds no
+   more work or fails, see independentThreadModel() */
+typedef struct
+{
+    backoff sleep;
+    backoff error;
+} slot_backoffs;
+
+/* Counters and histograms of a pool, see write_metrics().   Updated by
+   whichever thread starts or reaps a sub-process. */
+typedef struct
+{
+    atomic_ullong spawns;
+    atomic_ullong spawn_failures;
+    atomic_ullong exits[JOB_EXITS];
+    
+    /* From the start of a job to its end */
+    metrics_histogram job_duration;
+    
+    /* From fork() (or posix_spawn()) until the sub-process has called exec */
+    metrics_histogram exec_latency;
+    
+    resource_usage usage;
+} pool_metrics;
+
+typedef struct slot
+{
+    /* Hot: used whenever the state of the slot is checked or changed, kept
+       together in the first cache line */
+    long id;
+    
+    /* State of the slot (THREAD_STATUS_*).   Changed by the dispatcher and,
+       while a sub-process is starting or running, by the thread waiting for
+       it. */
+    atomic_int status;
+    
+    /* PID of the running sub-process (or worker running a job), 0 if none,
+       see signal_slot() */
+    _Atomic pid_t pid;
+    
+    eventloop_time last_started_at;
+    
+    /* Time SIGTERM was sent to the sub-process, 0 if not */
+    eventloop_time termination_requested;
+    
+    /* Time a sleeping thread wakes up */
+    eventloop_time wake_at;
+    
+    /* List the slot is on (by state) and its neighbours on that list */
+    slot_list *list;
+    struct slot *list_prev;
+    struct slot *list_next;
+    
+    /* Time the slot was added to that list */
+    eventloop_time listed_at;
+    
     int duration_warning_issued;
-} slot;
+    
+    /* Set while the slot is queued to be filed after a state change */
+    atomic_int changed;
+    struct slot *changed_next;
+    
+    /* Pool the slot belongs to */
+    struct pool *pool;
+    
+    /* Set while the dispatcher is signalling pid */
+    atomic_int signalling;
+    
+    /* Persistent model: PID of the worker, 0 if none */
+    pid_t worker_pid;
+    
+    /* pidfd of the sub-process (direct reaping only), -1 if none */
+    int pidfd;
+    
+    /* Position in the pool, given to sub-processes as --tid=x.   Slots at or
+       beyond the pool's threads setting are retired, see retire_slot(). */
+    int number;
+    
+    /* Cold: only used when a sub-process or job starts or ends */
+    
+    /* Resources used by its sub-processes and its backoffs, kept after the
+       slot's block of slots so that a slot is three cache lines, see
+       add_slots() */
+    resource_usage *usage;
+    slot_backoffs *backoffs;
+    
+    /* Logging system source of the sub-process and its pipes */
+    int logger_id;
+    int log_fd_stdout;
+    int log_fd_stderr;
+    
+    /* Persistent model: pipes to the worker's STDIN and from its STDOUT, jobs
+       it has run, result of its last job if it is retiring (0 if not) and any
+       incomplete line from its STDOUT (allocated while it has a worker) */
+    int worker_stdin;
+    int worker_stdout;
+    int worker_jobs;
+    int worker_result;
+    int worker_line_length;
+    char *worker_line;
+    
+    /* Work items taken from the job queue for the next sub-process or job,
+       NULL if none */
+    struct jobqueue_item *queue_items;
+    int queue_item_count;
+    
+    /* Wait status of the last sub-process or job (a worker's reply as the
+       exit status it stands for), -1 if none.   Reported on the control
+       socket. */
+    atomic_int last_status;
+    
+    /* What the sub-process or worker was started with, NULL if there is none */
+    struct pool_spawn *spawn;
+} __attribute__((aligned(SLOT_ALIGNMENT))) slot;
+
+/* Slots running one command with the same settings and thread model.   Every
+   pool has its own slots, lists and job queue, but all pools share one event
+   loop, deadline heap and logging system, see dispatch(). */
+typedef struct pool
+{
+    int id;
+    struct dispatching_settings *settings;
+    
+    /* The pool's slots by number.   Slots are only added, a pool which shrinks
+       retires its last slots, see reload_pools(). */
+    slot **slots;
+    int size;
+    
+    /* Number of slots in use, the threads setting unless the pool has been
+       removed by a reload */
+    int threads;
+    
+    /* Slots by state, see file_slot().   Slots are added at the tail, so the
+       head of running_slots is the one which has been running the longest. */
+    slot_list ready_slots;
+    slot_list running_slots;
+    slot_list sleeping_slots;
+    slot_list other_slots;
+    
+    /* Thread model and its state */
+    int (*threadModel)(slot *slot, int daemon, int *running, void *state);
+    void (*pre_state_check)(struct pool *pool);
+    void (*post_state_check)(struct pool *pool);
+    void (*wake)(struct pool *pool);
+    int (*sleeping)(struct pool *pool);
+    void *state;
+    
+    /* Set while the thread model has the whole pool sleeping rather than its
+       slots, whose ready slots are then sleeping too, with the time they had
+       spent on ready_slots when it started and the time they have spent
+       sleeping so.   See account_pool_sleep(). */
+    int asleep;
+    eventloop_time asleep_from;
+    eventloop_time asleep_time;
+    
+    /* Cleared by the thread model once no more jobs should be started, -1
+       when shutting down */
+    int running;
+    
+    /* Set for each pass of the dispatcher in which the pool starts jobs, and
+       while it still may during the pass */
+    int active;
+    int starting;
+    
+    /* Set while no jobs are to be started, see control_command() */
+    int paused;
+    
+    /* Set once a reload has removed the pool */
+    int removed;
+    
+    /* What new sub-processes are started with, followed by older ones still
+       in use */
+    pool_spawn *spawn;
+    
+    /* Job queue, NULL if none */
+    struct jobqueue *queue;
+    
+    /* cgroup of the pool, NULL if none, and whether each of its slots has a
+       cgroup within it for its jobs (see job_cgroup_name()).   Never changed
+       once the pool has been added. */
+    cgroup *cgroup;
+    int cgroup_per_job;
+    
+    /* Stops jobs being started while too many fail, see breaker.h */
+    breaker breaker;
+    
+    pool_metrics metrics;
+} pool;
 
 typedef struct
 {
@@ -107,14 +454,35 @@ typedef struct
     /* Specifies if thread creation should be halted */
     int is_sleeping;
     
-    /* Timestamp to sleep (halt thread creation) until (used if a process fails) */
-    int sleep_until;
+    /* Time to sleep (halt thread creation) until (used if a process fails) */
+    eventloop_time sleep_until;
+    
+    /* Time to wait until before terminating the longest running thread proc */
+    eventloop_time wait_until;
     
-    /* Timestamp to wait until before terminating the longest running thread proc */
-    int wait_until;
+    /* How long to sleep for when a job fails, and when the pool last started
+       sleeping */
+    backoff error_backoff;
+    eventloop_time slept_at;
     
 } fixed_interval_state;
 
+typedef struct
+{
+    /* Decides how many slots may be used at once */
+    concurrency_controller concurrency;
+    
+    /* Time to sleep (halt thread creation) until */
+    eventloop_time sleep_until;
+    
+    /* How long to sleep for when work runs out or a job fails, and when the
+       pool last started sleeping */
+    backoff sleep_backoff;
+    backoff error_backoff;
+    eventloop_time slept_at;
+    
+} dependent_model_state;
+
 typedef struct
 {
     /* Number of unavailable slots */
@@ -123,28 +491,35 @@ typedef struct
 } independent_mode_state;
 
 void logPipe(int pipefd);
-void* signalHandler();
 void slot_reset(slot *slotp);
 void thread_proc_term(slot *slot);
 void thread_proc_kill(slot *slot);
 void thread_proc_term_all();
 void check_thread(slot *slot);
 void *task(void *i);
-void dispatch(struct dispatching_settings *settings, int daemon);
+void dispatch(struct dispatching_settings *settings, int daemon, settings_loader reload);
 
 int independentThreadModel(slot *slot, int daemon, int *running, void *state);
 int dependentThreadModel(slot *slot, int daemon, int *running, void *state);
 int fixedIntervalThreadModel(slot *slot, int daemon, int *running, void *state);
 
-void init_state_independent_model(void *state);
-void init_state_dependent_model(void *state);
-void init_state_fixed_interval(void *state);
+void init_state_independent_model(pool *pool);
+void init_state_dependent_model(pool *pool);
+void init_state_fixed_interval(pool *pool);
+
+void presc_independent_model(pool *pool);
+void postsc_independent_model(pool *pool);
+void presc_dependent_model(pool *pool);
+void postsc_dependent_model(pool *pool);
+void presc_fixed_interval(pool *pool);
+void postsc_fixed_interval(pool *pool);
+
+void wake_independent_model(pool *pool);
+void wake_dependent_model(pool *pool);
+void wake_fixed_interval(pool *pool);
 
-void presc_independent_model(void *state);
-void postsc_independent_model(void *state);
-void presc_dependent_model(void *state);
-void postsc_dependent_model(void *state);
-void presc_fixed_interval(void *state);
-void postsc_fixed_interval(void *state);
+int sleeping_independent_model(pool *pool);
+int sleeping_dependent_model(pool *pool);
+int sleeping_fixed_interval(pool *pool);
 
 #endif
@@ -0,0 +1,698 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <search.h>
+#include "extern.h"
+#include "eventloop.h"
+#include "sfmemlib.h"
+#include "jobqueue.h"
+
+/*
+    The job queue lets the dispatcher read work items itself, so that
+    sub-processes are only started when there is work for them rather than
+    being started to look for work.
+
+    Items are newline delimited and are read from one source:
+
+    - a FIFO, which is opened for reading and writing so that it never reports
+      end of file when the last writer closes it
+    - a Unix domain datagram socket, each datagram holding whole items
+    - a spool directory watched with inotify, each file holding whole items
+
+    Items are queued in memory in the order they are read.   If too many are
+    queued, the source is no longer watched until half of them have been
+    taken, so that producers block (FIFO), are refused (socket) or their files
+    wait in the spool directory.
+
+    A spool file is only deleted once all of its items have been taken, so
+    items still queued when the queue is closed (on shutdown or a reload) are
+    not lost.   Files read but not yet deleted are skipped when the directory
+    is scanned again.
+
+    Each pool of the dispatcher may have a queue of its own.
+*/
+
+/* Adds an item to the end of the queue, empty items are ignored */
+static void push_item(jobqueue *queue, const char *data, size_t length)
+{
+    jobqueue_item *item;
+
+    if (length == 0)
+    {
+        return;
+    }
+
+    item = sfmalloc(sizeof(jobqueue_item) + length + 1);
+    item->next = NULL;
+    item->file = queue->spool_file;
+    item->length = length;
+    memcpy(item->data, data, length);
+    item->data[length] = '\0';
+
+    if (queue->tail == NULL)
+    {
+        queue->head = item;
+    }
+    else
+    {
+        queue->tail->next = item;
+    }
+
+    queue->tail = item;
+    queue->length++;
+
+    if (item->file != NULL)
+    {
+        item->file->queued++;
+    }
+}
+
+/* Splits data into items.   Incomplete items are kept until the rest is fed,
+   or until feed_end() is called. */
+static void feed(jobqueue *queue, const char *data, size_t length)
+{
+    const char *newline;
+    size_t line_length;
+
+    while (length > 0)
+    {
+        newline = memchr(data, '\n', length);
+        line_length = newline != NULL ? (size_t) (newline - data) : length;
+
+        if (queue->discarding == 0 && queue->partial_length + line_length >= JOBQUEUE_ITEM_SIZE)
+        {
+            _syslog(LOG_WARNING, "jobqueue: discarding item longer than %d bytes", JOBQUEUE_ITEM_SIZE - 1);
+
+            queue->discarding = 1;
+            queue->partial_length = 0;
+        }
+
+        if (queue->discarding == 0)
+        {
+            memcpy(queue->partial + queue->partial_length, data, line_length);
+            queue->partial_length += line_length;
+        }
+
+        if (newline == NULL)
+        {
+            break;
+        }
+
+        if (queue->discarding == 0)
+        {
+            push_item(queue, queue->partial, queue->partial_length);
+        }
+
+        queue->partial_length = 0;
+        queue->discarding = 0;
+
+        data += line_length + 1;
+        length -= line_length + 1;
+    }
+}
+
+/* Queues any incomplete item, used at the end of a datagram or file */
+static void feed_end(jobqueue *queue)
+{
+    if (queue->discarding == 0)
+    {
+        push_item(queue, queue->partial, queue->partial_length);
+    }
+
+    queue->partial_length = 0;
+    queue->discarding = 0;
+}
+
+/* Stops watching the source while the queue is full */
+static void pause_source(jobqueue *queue)
+{
+    if (queue->paused == 0)
+    {
+        _syslog(LOG_WARNING, "jobqueue: %d items queued, no more will be read until some have been taken", queue->length);
+
+        eventloop_remove(queue->source_fd);
+        queue->paused = 1;
+    }
+}
+
+static void read_fifo(jobqueue *queue)
+{
+    char buffer[JOBQUEUE_ITEM_SIZE];
+    ssize_t bytes_read;
+
+    while (queue->length < JOBQUEUE_MAX_ITEMS)
+    {
+        bytes_read = read(queue->source_fd, buffer, sizeof(buffer));
+
+        if (bytes_read > 0)
+        {
+            feed(queue, buffer, bytes_read);
+        }
+        else if (bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            if (bytes_read == -1 && errno != EAGAIN)
+            {
+                _syslog(LOG_ERR, "jobqueue: cannot read from FIFO: [%d] %s", errno, strerror(errno));
+            }
+
+            break;
+        }
+    }
+}
+
+static void read_socket(jobqueue *queue)
+{
+    static char buffer[JOBQUEUE_DATAGRAM_SIZE];
+    ssize_t bytes_read;
+
+    while (queue->length < JOBQUEUE_MAX_ITEMS)
+    {
+        bytes_read = recv(queue->source_fd, buffer, sizeof(buffer), 0);
+
+        if (bytes_read >= 0)
+        {
+            feed(queue, buffer, bytes_read);
+            feed_end(queue);
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            if (errno != EAGAIN)
+            {
+                _syslog(LOG_ERR, "jobqueue: cannot receive from socket: [%d] %s", errno, strerror(errno));
+            }
+
+            break;
+        }
+    }
+}
+
+/* The tree of spool files holds their names */
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+static void free_spool_file(void *name)
+{
+    free((char *) name - offsetof(jobqueue_spool_file, name));
+}
+
+/* Deletes a spool file */
+static void unlink_spool_file(jobqueue *queue, const char *name)
+{
+    char path[strlen(queue->source_location) + strlen(name) + 2];
+
+    sprintf(path, "%s/%s", queue->source_location, name);
+
+    if (unlink(path) != 0)
+    {
+        _syslog(LOG_ERR, "jobqueue: cannot delete spool file %s, its items may be run again: [%d] %s", path, errno, strerror(errno));
+    }
+}
+
+/* Deletes a spool file once all of its items have been taken */
+static void spool_file_taken(jobqueue *queue, jobqueue_spool_file *file)
+{
+    file->queued--;
+    file->taken++;
+
+    if (file->queued == 0)
+    {
+        unlink_spool_file(queue, file->name);
+
+        tdelete(file->name, &queue->spool_files, compare_names);
+        free(file);
+    }
+}
+
+/* Queues the items in a spool file, which is deleted once they have been
+   taken (or straight away if it has none) */
+static void read_spool_file(jobqueue *queue, const char *name)
+{
+    char buffer[JOBQUEUE_ITEM_SIZE];
+    char path[strlen(queue->source_location) + strlen(name) + 2];
+    jobqueue_spool_file *file;
+    ssize_t bytes_read;
+    struct stat st;
+    int fd;
+
+    sprintf(path, "%s/%s", queue->source_location, name);
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        /* Probably taken by someone else */
+        return;
+    }
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+
+        return;
+    }
+
+    file = sfcalloc(1, sizeof(jobqueue_spool_file) + strlen(name) + 1);
+    strcpy(file->name, name);
+
+    queue->spool_file = file;
+
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0
+        || (bytes_read == -1 && errno == EINTR))
+    {
+        if (bytes_read > 0)
+        {
+            feed(queue, buffer, bytes_read);
+        }
+    }
+
+    feed_end(queue);
+
+    queue->spool_file = NULL;
+
+    if (bytes_read == -1)
+    {
+        _syslog(LOG_ERR, "jobqueue: cannot read spool file %s: [%d] %s", path, errno, strerror(errno));
+    }
+
+    close(fd);
+
+    if (file->queued == 0)
+    {
+        unlink_spool_file(queue, name);
+        free(file);
+    }
+    else
+    {
+        tsearch(file->name, &queue->spool_files, compare_names);
+    }
+}
+
+/* Writes the items of a spool file which have not been taken back to it, in
+   place of those it held, and returns the item after them */
+static jobqueue_item *write_back_spool_file(jobqueue *queue, jobqueue_item *items)
+{
+    jobqueue_spool_file *file = items->file;
+    char path[strlen(queue->source_location) + strlen(file->name) + 2];
+    char temporary[sizeof(path) + 1];
+    jobqueue_item *item;
+    FILE *fp;
+    int err;
+
+    sprintf(path, "%s/%s", queue->source_location, file->name);
+    sprintf(temporary, "%s/.%s", queue->source_location, file->name);
+
+    /* Written under a name which is not read, then renamed into place */
+    fp = fopen(temporary, "we");
+    err = fp == NULL;
+
+    for (item = items; item != NULL && item->file == file; item = item->next)
+    {
+        if (fp != NULL && fprintf(fp, "%s\n", item->data) < 0)
+        {
+            err = 1;
+        }
+    }
+
+    if (fp != NULL && fclose(fp) != 0)
+    {
+        err = 1;
+    }
+
+    if (err || rename(temporary, path) != 0)
+    {
+        _syslog(LOG_ERR, "jobqueue: cannot rewrite spool file %s, the %d items already taken may be run again: [%d] %s", path, file->taken, errno, strerror(errno));
+
+        unlink(temporary);
+    }
+
+    return item;
+}
+
+/* Leaves the items of spool files which are still queued in their files,
+   rewriting those which have had items taken */
+static void put_back_spool_files(jobqueue *queue)
+{
+    jobqueue_item *item = queue->head;
+
+    /* The items of a file are queued together */
+    while (item != NULL)
+    {
+        if (item->file->taken > 0)
+        {
+            item = write_back_spool_file(queue, item);
+        }
+        else
+        {
+            item = item->next;
+        }
+    }
+
+    if (queue->length > 0)
+    {
+        _syslog(LOG_INFO, "jobqueue: %d queued items left in the spool directory", queue->length);
+    }
+}
+
+static int filter_spool_file(const struct dirent *entry)
+{
+    return entry->d_name[0] != '.';
+}
+
+/* Reads spool files in name order */
+static void read_spool(jobqueue *queue)
+{
+    char buffer[JOBQUEUE_INOTIFY_BUFFER_SIZE];
+    struct dirent **entries;
+    int i, n;
+
+    /* Events only say that something has changed, so discard them */
+    while (read(queue->source_fd, buffer, sizeof(buffer)) > 0);
+
+    n = scandir(queue->source_location, &entries, filter_spool_file, alphasort);
+
+    if (n == -1)
+    {
+        _syslog(LOG_ERR, "jobqueue: cannot read spool directory %s: [%d] %s", queue->source_location, errno, strerror(errno));
+
+        return;
+    }
+
+    for (i=0; i<n; i++)
+    {
+        /* Files whose items are still queued have been read already */
+        if (queue->length < JOBQUEUE_MAX_ITEMS && tfind(entries[i]->d_name, &queue->spool_files, compare_names) == NULL)
+        {
+            read_spool_file(queue, entries[i]->d_name);
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+}
+
+static int open_fifo(const char *location)
+{
+    struct stat st;
+    int fd;
+
+    if (mkfifo(location, 0660) != 0 && errno != EEXIST)
+    {
+        _syslog(LOG_CRIT, "jobqueue: cannot create FIFO %s: [%d] %s", location, errno, strerror(errno));
+
+        return -1;
+    }
+
+    /* Opened for writing too, so there is always a writer */
+    fd = open(location, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+    {
+        _syslog(LOG_CRIT, "jobqueue: cannot open FIFO %s", location);
+
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+static int open_socket(const char *location)
+{
+    struct sockaddr_un address;
+    struct stat st;
+    int fd;
+
+    if (strlen(location) >= sizeof(address.sun_path))
+    {
+        _syslog(LOG_CRIT, "jobqueue: socket path too long: %s", location);
+
+        return -1;
+    }
+
+    /* Remove a socket left behind by a previous run */
+    if (stat(location, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(location);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, location);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd == -1 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0)
+    {
+        _syslog(LOG_CRIT, "jobqueue: cannot create socket %s: [%d] %s", location, errno, strerror(errno));
+
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+static int open_spool(const char *location)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd == -1 || inotify_add_watch(fd, location, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        _syslog(LOG_CRIT, "jobqueue: cannot watch spool directory %s: [%d] %s", location, errno, strerror(errno));
+
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+jobqueue *jobqueue_initialize(int source, const char *location, int id)
+{
+    jobqueue *queue;
+    int fd = -1;
+
+    switch (source)
+    {
+        case JOBQUEUE_SOURCE_FIFO:
+            fd = open_fifo(location);
+            break;
+
+        case JOBQUEUE_SOURCE_SOCKET:
+            fd = open_socket(location);
+            break;
+
+        case JOBQUEUE_SOURCE_SPOOL:
+            fd = open_spool(location);
+            break;
+    }
+
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    queue = sfcalloc(1, sizeof(jobqueue));
+    queue->id = id;
+    queue->source_type = source;
+    queue->source_fd = fd;
+    queue->source_location = sfmalloc(strlen(location) + 1);
+    strcpy(queue->source_location, location);
+
+    if (eventloop_add(queue->source_fd, EVENTLOOP_SOURCE_QUEUE, queue->id, EPOLLIN) != RV_OK)
+    {
+        jobqueue_deinitialize(queue);
+
+        return NULL;
+    }
+
+    /* Pick up anything already waiting */
+    jobqueue_read(queue);
+
+    return queue;
+}
+
+void jobqueue_deinitialize(jobqueue *queue)
+{
+    if (queue == NULL)
+    {
+        return;
+    }
+
+    if (queue->source_fd != -1)
+    {
+        close(queue->source_fd);
+    }
+
+    if (queue->source_type == JOBQUEUE_SOURCE_SOCKET)
+    {
+        unlink(queue->source_location);
+    }
+
+    if (queue->source_type == JOBQUEUE_SOURCE_SPOOL)
+    {
+        put_back_spool_files(queue);
+    }
+    else if (queue->length > 0)
+    {
+        _syslog(LOG_WARNING, "jobqueue: discarding %d queued items", queue->length);
+    }
+
+    jobqueue_free(queue->head);
+    tdestroy(queue->spool_files, free_spool_file);
+
+    free(queue->source_location);
+    free(queue);
+}
+
+void jobqueue_read(jobqueue *queue)
+{
+    if (queue->paused == 1)
+    {
+        return;
+    }
+
+    switch (queue->source_type)
+    {
+        case JOBQUEUE_SOURCE_FIFO:
+            read_fifo(queue);
+            break;
+
+        case JOBQUEUE_SOURCE_SOCKET:
+            read_socket(queue);
+            break;
+
+        case JOBQUEUE_SOURCE_SPOOL:
+            read_spool(queue);
+            break;
+    }
+
+    if (queue->length >= JOBQUEUE_MAX_ITEMS)
+    {
+        pause_source(queue);
+    }
+}
+
+int jobqueue_length(jobqueue *queue)
+{
+    return queue->length;
+}
+
+jobqueue_item *jobqueue_take(jobqueue *queue, int max, int *count)
+{
+    jobqueue_item *items = queue->head, *last = NULL;
+
+    *count = 0;
+
+    while (*count < max && queue->head != NULL)
+    {
+        last = queue->head;
+        queue->head = queue->head->next;
+        (*count)++;
+
+        if (last->file != NULL)
+        {
+            spool_file_taken(queue, last->file);
+            last->file = NULL;
+        }
+    }
+
+    if (last == NULL)
+    {
+        return NULL;
+    }
+
+    last->next = NULL;
+
+    if (queue->head == NULL)
+    {
+        queue->tail = NULL;
+    }
+
+    queue->length -= *count;
+
+    /* Start reading again once there is room */
+    if (queue->paused == 1 && queue->length < JOBQUEUE_MAX_ITEMS / 2)
+    {
+        if (eventloop_add(queue->source_fd, EVENTLOOP_SOURCE_QUEUE, queue->id, EPOLLIN) == RV_OK)
+        {
+            queue->paused = 0;
+
+            /* New files in the spool directory may have been missed */
+            if (queue->source_type == JOBQUEUE_SOURCE_SPOOL)
+            {
+                jobqueue_read(queue);
+            }
+        }
+    }
+
+    return items;
+}
+
+void jobqueue_free(jobqueue_item *items)
+{
+    jobqueue_item *next;
+
+    while (items != NULL)
+    {
+        next = items->next;
+        free(items);
+        items = next;
+    }
+}
@@ -0,0 +1,139 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <stddef.h>
+
+#define RV_FAIL -1
+#define RV_OK 0
+
+/* Where work items are read from */
+#define JOBQUEUE_SOURCE_NONE 0
+#define JOBQUEUE_SOURCE_FIFO 1
+#define JOBQUEUE_SOURCE_SPOOL 2
+#define JOBQUEUE_SOURCE_SOCKET 3
+
+/* How work items are given to sub-processes */
+#define JOBQUEUE_DELIVERY_ARGV 1
+#define JOBQUEUE_DELIVERY_ENV 2
+#define JOBQUEUE_DELIVERY_STDIN 3
+
+/* Environment variable holding work items (JOBQUEUE_DELIVERY_ENV) */
+#define JOBQUEUE_ENV_NAME "FATCONTROLLER_ITEMS"
+
+/* Longest work item (including the newline), longer items are discarded.
+   A full batch of items fits in a pipe (JOBQUEUE_DELIVERY_STDIN). */
+#define JOBQUEUE_ITEM_SIZE 4096
+#define JOBQUEUE_MAX_BATCH 16
+
+/* Reading stops while this many items are queued */
+#define JOBQUEUE_MAX_ITEMS 65536
+
+#define JOBQUEUE_DATAGRAM_SIZE 65536
+#define JOBQUEUE_INOTIFY_BUFFER_SIZE 4096
+
+/* Spool file whose items are queued, deleted once they have all been taken */
+typedef struct jobqueue_spool_file
+{
+    /* Items still queued and already taken */
+    int queued;
+    int taken;
+
+    char name[];
+} jobqueue_spool_file;
+
+typedef struct jobqueue_item
+{
+    struct jobqueue_item *next;
+
+    /* Spool file the item was read from, NULL if none or once taken */
+    jobqueue_spool_file *file;
+
+    /* Length of data, excluding the terminating null */
+    size_t length;
+
+    char data[];
+} jobqueue_item;
+
+typedef struct jobqueue
+{
+    /* Passed to the event loop with EVENTLOOP_SOURCE_QUEUE */
+    int id;
+
+    int source_type;
+    char *source_location;
+
+    /* FIFO, socket or inotify file descriptor */
+    int source_fd;
+
+    /* Set while the source is not watched because the queue is full */
+    int paused;
+
+    /* Queued items */
+    jobqueue_item *head;
+    jobqueue_item *tail;
+    int length;
+
+    /* Names of the spool files with items queued, a tsearch() tree, and the
+       file being read */
+    void *spool_files;
+    jobqueue_spool_file *spool_file;
+
+    /* Incomplete item read from a FIFO, or the remainder of an item that is
+       too long being discarded */
+    char partial[JOBQUEUE_ITEM_SIZE];
+    size_t partial_length;
+    int discarding;
+} jobqueue;
+
+/* Opens the source of work items and watches it with the event loop
+   (EVENTLOOP_SOURCE_QUEUE, with the id given).   A FIFO is created if it does
+   not exist, as is a socket (a Unix domain datagram socket, each datagram
+   holding one or more items).   For a spool directory, each file that does
+   not start with "." holds items and is deleted once all of them have been
+   taken, so files should be written under another name and renamed into
+   place.   Returns NULL on failure. */
+jobqueue *jobqueue_initialize(int source, const char *location, int id);
+
+/* Closes the source and frees the queue and any items still queued.   Items
+   from a FIFO or socket are lost, those from a spool directory are left in
+   their files (which are rewritten without the items already taken). */
+void jobqueue_deinitialize(jobqueue *queue);
+
+/* Reads any new items from the source, called when the event loop reports
+   the source as ready */
+void jobqueue_read(jobqueue *queue);
+
+/* Number of items queued */
+int jobqueue_length(jobqueue *queue);
+
+/* Takes up to max items from the front of the queue, deleting any spool
+   files which then have no items left.   Returns them linked by their next
+   pointers (NULL if there are none) and their number in count.   Items must
+   be freed with jobqueue_free(). */
+jobqueue_item *jobqueue_take(jobqueue *queue, int max, int *count);
+
+/* Frees a list of items returned by jobqueue_take() */
+void jobqueue_free(jobqueue_item *items);
+
+#endif
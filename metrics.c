@@ -0,0 +1,240 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "extern.h"
+#include "sfmemlib.h"
+#include "metrics.h"
+
+/* Buckets are in units of 500ns, the first ending at 1us */
+#define BUCKET_UNIT 500
+
+/* End of a bucket in units of BUCKET_UNIT: 2, 3, 4, 6, 8, 12, 16... */
+static unsigned long long bucket_end(int bucket)
+{
+    if (bucket % 2 == 0)
+    {
+        return 2ULL << (bucket / 2);
+    }
+
+    return 3ULL << ((bucket - 1) / 2);
+}
+
+/* Returns the bucket a duration falls in, METRICS_BUCKETS if it is beyond
+   the last */
+static int bucket_of(eventloop_time duration)
+{
+    unsigned long long units;
+    int power;
+
+    if (duration <= 2 * BUCKET_UNIT)
+    {
+        return 0;
+    }
+
+    /* Whole units below the duration, so that a duration exactly at the end
+       of a bucket falls in it, at least 2 */
+    units = (unsigned long long) (duration - 1) / BUCKET_UNIT;
+
+    /* The highest bit gives the power of two and the next bit the half of it */
+    power = 63 - __builtin_clzll(units);
+
+    if (power >= METRICS_BUCKETS / 2 + 1)
+    {
+        return METRICS_BUCKETS;
+    }
+
+    return 2 * power - 1 + (int) ((units >> (power - 1)) & 1);
+}
+
+void metrics_observe(metrics_histogram *histogram, eventloop_time duration)
+{
+    int bucket;
+
+    /* In case the clock stepped back, which it should not */
+    if (duration < 0)
+    {
+        duration = 0;
+    }
+
+    bucket = bucket_of(duration);
+
+    if (bucket < METRICS_BUCKETS)
+    {
+        atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, (unsigned long long) duration, memory_order_relaxed);
+}
+
+void metrics_add(atomic_ullong *counter, unsigned long long value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+void metrics_max(atomic_ullong *gauge, unsigned long long value)
+{
+    unsigned long long current = atomic_load_explicit(gauge, memory_order_relaxed);
+
+    while (current < value
+        && !atomic_compare_exchange_weak_explicit(gauge, &current, value, memory_order_relaxed, memory_order_relaxed))
+    {
+        /* Changed by another thread, current now holds its value */
+    }
+}
+
+void metrics_format_label(char *buffer, size_t size, const char *name, const char *value)
+{
+    size_t length;
+
+    length = (size_t) snprintf(buffer, size, "%s=\"", name);
+
+    /* Room for an escape, the closing quote and the null */
+    for (; *value != '\0' && length + 4 <= size; value++)
+    {
+        if (*value == '\\' || *value == '"')
+        {
+            buffer[length++] = '\\';
+            buffer[length++] = *value;
+        }
+        else if (*value == '\n')
+        {
+            buffer[length++] = '\\';
+            buffer[length++] = 'n';
+        }
+        else
+        {
+            buffer[length++] = *value;
+        }
+    }
+
+    if (length + 2 <= size)
+    {
+        buffer[length++] = '"';
+        buffer[length] = '\0';
+    }
+}
+
+void metrics_write_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write_value(FILE *fp, const char *name, const char *labels, double value)
+{
+    if (labels != NULL)
+    {
+        fprintf(fp, "%s{%s} ", name, labels);
+    }
+    else
+    {
+        fprintf(fp, "%s ", name);
+    }
+
+    /* Counts as they are, durations to the nanosecond */
+    if (value == (double) (long long) value)
+    {
+        fprintf(fp, "%lld\n", (long long) value);
+    }
+    else
+    {
+        fprintf(fp, "%.9f\n", value);
+    }
+}
+
+void metrics_write_histogram(FILE *fp, const char *name, const char *labels, metrics_histogram *histogram)
+{
+    const char *separator = labels != NULL ? "," : "";
+    unsigned long long cumulative = 0, count;
+    int i;
+
+    if (labels == NULL)
+    {
+        labels = "";
+    }
+
+    /* Read first so that no bucket is ever above the count */
+    count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+
+    for (i=0; i<METRICS_BUCKETS; i++)
+    {
+        cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+
+        fprintf(fp, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, separator,
+                (double) (bucket_end(i) * BUCKET_UNIT) / EVENTLOOP_SECOND,
+                cumulative < count ? cumulative : count);
+    }
+
+    fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, count);
+    fprintf(fp, "%s_sum{%s} %.9f\n", name, labels,
+            EVENTLOOP_SECONDS(atomic_load_explicit(&histogram->sum, memory_order_relaxed)));
+    fprintf(fp, "%s_count{%s} %llu\n", name, labels, count);
+}
+
+int metrics_write_file(const char *path, metrics_writer writer)
+{
+    char *temporary;
+    FILE *fp;
+    int written;
+
+    /* In the same directory, so that it can be renamed over the file */
+    temporary = sfmalloc(strlen(path) + 5);
+    sprintf(temporary, "%s.tmp", path);
+
+    fp = fopen(temporary, "w");
+
+    if (fp == NULL)
+    {
+        _syslog(LOG_ERR, "metrics: cannot open %s: [%d] %s", temporary, errno, strerror(errno));
+        free(temporary);
+
+        return RV_FAIL;
+    }
+
+    (*writer)(fp);
+
+    written = !ferror(fp);
+
+    if (fclose(fp) != 0)
+    {
+        written = 0;
+    }
+
+    if (!written || rename(temporary, path) != 0)
+    {
+        _syslog(LOG_ERR, "metrics: cannot write %s: [%d] %s", path, errno, strerror(errno));
+
+        unlink(temporary);
+        free(temporary);
+
+        return RV_FAIL;
+    }
+
+    free(temporary);
+
+    return RV_OK;
+}
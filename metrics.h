@@ -0,0 +1,88 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "eventloop.h"
+
+#define RV_FAIL -1
+#define RV_OK 0
+
+/* Number of histogram buckets, the last ending at 2^37 x 500ns (about 19
+   hours).   Longer durations are only counted in +Inf. */
+#define METRICS_BUCKETS 73
+
+/*
+    Counters and histograms, written in the Prometheus text format.   They
+    may be updated from any thread without locking.
+
+    Histograms are log-linear, like an HDR histogram with one significant bit:
+    two buckets for each power of two, ending at 1us, 1.5us, 2us, 3us, 4us, 6us
+    and so on, so each is within 50% of the duration measured whatever its
+    size.   Every bucket is always written so the series do not change from one
+    scrape to the next.
+*/
+typedef struct
+{
+    atomic_ullong buckets[METRICS_BUCKETS];
+
+    /* Durations in all buckets and beyond, and their total */
+    atomic_ullong count;
+    atomic_ullong sum;
+} metrics_histogram;
+
+/* Writes the metrics, see metrics_write_file() */
+typedef void (*metrics_writer)(FILE *fp);
+
+/* Counts a duration, which should not be negative */
+void metrics_observe(metrics_histogram *histogram, eventloop_time duration);
+
+/* Adds to a counter */
+void metrics_add(atomic_ullong *counter, unsigned long long value);
+
+/* Raises a gauge to value if it is below it */
+void metrics_max(atomic_ullong *gauge, unsigned long long value);
+
+/* Formats a label as name="value", escaping the value, e.g. for a pool name.
+   The label is cut short if buffer is too small. */
+void metrics_format_label(char *buffer, size_t size, const char *name, const char *value);
+
+/* Writes the HELP and TYPE lines of a metric, type being "counter", "gauge" or
+   "histogram" */
+void metrics_write_header(FILE *fp, const char *name, const char *type, const char *help);
+
+/* Writes a sample of a counter or gauge.   labels are written as they are
+   between braces, e.g. pool="default", and may be NULL.   Durations should
+   be converted to seconds first (see EVENTLOOP_SECONDS). */
+void metrics_write_value(FILE *fp, const char *name, const char *labels, double value);
+
+/* Writes the buckets, sum (in seconds) and count of a histogram */
+void metrics_write_histogram(FILE *fp, const char *name, const char *labels, metrics_histogram *histogram);
+
+/* Writes metrics to a file through a temporary file which replaces it, so
+   that a reader never sees a partly written file.   Returns RV_FAIL, having
+   logged why, if it could not be written. */
+int metrics_write_file(const char *path, metrics_writer writer);
+
+#endif
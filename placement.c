@@ -0,0 +1,440 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "extern.h"
+#include "sfmemlib.h"
+#include "placement.h"
+
+/* From linux/ioprio.h, which older kernel headers do not have */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* Level of the best-effort and realtime classes if none is given */
+#define IOPRIO_DEFAULT_LEVEL 4
+
+#define NODE_WORD_BITS (8 * sizeof(unsigned long))
+
+struct placement
+{
+    /* CPUs the sub-processes run on, none to leave their affinity alone */
+    cpu_set_t cpus;
+    int cpu_count;
+    int pin;
+
+    /* NUMA nodes memory is allocated from, as given to set_mempolicy() */
+    unsigned long nodes[PLACEMENT_MAX_NODES / NODE_WORD_BITS];
+    int node_count;
+
+    int nice;
+    int ioprio;
+    int policy;
+};
+
+/* CPUs the dispatcher was started with, and whether it has since been
+   pinned to others */
+static cpu_set_t initial_cpus;
+static int dispatcher_pinned = 0;
+
+/* Parses a list such as "0-3,8" into a set, an empty list (or only a
+   newline, as sysfs gives for a node without CPUs) being an empty set */
+static int parse_list(const char *text, cpu_set_t *set)
+{
+    const char *p = text;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+
+    if (*p == '\0' || strcmp(p, "\n") == 0)
+    {
+        return RV_OK;
+    }
+
+    while (1)
+    {
+        first = strtol(p, &end, 10);
+
+        if (end == p || *p == '-' || *p == '+' || first >= CPU_SETSIZE)
+        {
+            return RV_FAIL;
+        }
+
+        last = first;
+        p = end;
+
+        if (*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+
+            if (end == p || *p == '-' || *p == '+' || last < first || last >= CPU_SETSIZE)
+            {
+                return RV_FAIL;
+            }
+
+            p = end;
+        }
+
+        for (; first <= last; first++)
+        {
+            CPU_SET(first, set);
+        }
+
+        if (*p == ',')
+        {
+            p++;
+        }
+        else if (*p == '\0' || strcmp(p, "\n") == 0)
+        {
+            return RV_OK;
+        }
+        else
+        {
+            return RV_FAIL;
+        }
+    }
+}
+
+/* Reads the CPUs of a NUMA node from sysfs */
+static int node_cpus(int node, cpu_set_t *set)
+{
+    char path[64], list[4096];
+    FILE *fp;
+    int rv = RV_FAIL;
+
+    snprintf(path, sizeof(path), PLACEMENT_NODE_CPULIST, node);
+
+    fp = fopen(path, "re");
+
+    if (fp == NULL)
+    {
+        return RV_FAIL;
+    }
+
+    if (fgets(list, sizeof(list), fp) != NULL)
+    {
+        rv = parse_list(list, set);
+    }
+
+    fclose(fp);
+
+    return rv;
+}
+
+int placement_initialize(const char *cpus)
+{
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus) != 0)
+    {
+        _syslog(LOG_WARNING, "placement: cannot read the CPUs of the dispatcher: [%d] %s", errno, strerror(errno));
+
+        CPU_ZERO(&initial_cpus);
+    }
+
+    if (cpus == NULL)
+    {
+        return RV_OK;
+    }
+
+    if (parse_list(cpus, &set) != RV_OK || CPU_COUNT(&set) == 0)
+    {
+        _syslog(LOG_WARNING, "placement: invalid list of CPUs for the dispatcher: %s", cpus);
+
+        return RV_FAIL;
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        _syslog(LOG_WARNING, "placement: cannot pin the dispatcher to CPUs %s: [%d] %s", cpus, errno, strerror(errno));
+
+        return RV_FAIL;
+    }
+
+    /* Pools without CPUs of their own can only be given the initial ones
+       back if they are known */
+    dispatcher_pinned = CPU_COUNT(&initial_cpus) > 0;
+
+    _syslog(LOG_DEBUG, "placement: dispatcher pinned to CPUs %s", cpus);
+
+    return RV_OK;
+}
+
+int placement_check_list(const char *text)
+{
+    cpu_set_t set;
+
+    if (parse_list(text, &set) != RV_OK || CPU_COUNT(&set) == 0)
+    {
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+int placement_parse_ionice(const char *text, int *ioprio)
+{
+    static const struct
+    {
+        const char *name;
+        int class;
+    } classes[] = {
+        {"realtime",    IOPRIO_CLASS_RT},
+        {"best-effort", IOPRIO_CLASS_BE},
+        {"idle",        IOPRIO_CLASS_IDLE}
+    };
+    const char *colon = strchr(text, ':');
+    size_t length = colon != NULL ? (size_t) (colon - text) : strlen(text);
+    unsigned int i;
+    int level = IOPRIO_DEFAULT_LEVEL;
+    char *end;
+
+    for (i=0; i<sizeof(classes)/sizeof(classes[0]); i++)
+    {
+        if (strlen(classes[i].name) == length && strncmp(text, classes[i].name, length) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == sizeof(classes)/sizeof(classes[0]))
+    {
+        return RV_FAIL;
+    }
+
+    if (colon != NULL)
+    {
+        /* The idle class has no levels */
+        level = (int) strtol(colon + 1, &end, 10);
+
+        if (classes[i].class == IOPRIO_CLASS_IDLE || end == colon + 1 || *end != '\0' || level < 0 || level > 7)
+        {
+            return RV_FAIL;
+        }
+    }
+
+    if (classes[i].class == IOPRIO_CLASS_IDLE)
+    {
+        level = 0;
+    }
+
+    *ioprio = (classes[i].class << IOPRIO_CLASS_SHIFT) | level;
+
+    return RV_OK;
+}
+
+int placement_parse_policy(const char *text, int *policy)
+{
+    if (strcmp(text, "other") == 0)
+    {
+        *policy = SCHED_OTHER;
+    }
+    else if (strcmp(text, "batch") == 0)
+    {
+        *policy = SCHED_BATCH;
+    }
+    else if (strcmp(text, "idle") == 0)
+    {
+        *policy = SCHED_IDLE;
+    }
+    else
+    {
+        return RV_FAIL;
+    }
+
+    return RV_OK;
+}
+
+/* Binds a placement to NUMA nodes, keeping only the CPUs on them */
+static void set_nodes(placement *p, const char *nodes, int have_cpus)
+{
+    cpu_set_t node_set, on_nodes, cpus, both;
+    int node;
+
+    parse_list(nodes, &node_set);
+    CPU_ZERO(&on_nodes);
+
+    for (node=0; node<CPU_SETSIZE && node<PLACEMENT_MAX_NODES; node++)
+    {
+        if (!CPU_ISSET(node, &node_set))
+        {
+            continue;
+        }
+
+        p->nodes[node / NODE_WORD_BITS] |= 1UL << (node % NODE_WORD_BITS);
+        p->node_count++;
+
+        if (node_cpus(node, &cpus) != RV_OK)
+        {
+            _syslog(LOG_WARNING, "placement: cannot read the CPUs of NUMA node %d", node);
+
+            continue;
+        }
+
+        CPU_OR(&on_nodes, &on_nodes, &cpus);
+    }
+
+    if (CPU_COUNT(&on_nodes) == 0)
+    {
+        return;
+    }
+
+    if (!have_cpus)
+    {
+        p->cpus = on_nodes;
+
+        return;
+    }
+
+    CPU_AND(&both, &p->cpus, &on_nodes);
+
+    if (CPU_COUNT(&both) == 0)
+    {
+        _syslog(LOG_WARNING, "placement: none of the CPUs are on NUMA nodes %s, using them anyway", nodes);
+    }
+    else
+    {
+        p->cpus = both;
+    }
+}
+
+placement *placement_create(const char *cpus, int pin, const char *nodes, int nice, int ioprio, int policy)
+{
+    /* Zeroed, padding included, for placement_equal() */
+    placement *p = sfcalloc(1, sizeof(placement));
+
+    if (cpus != NULL)
+    {
+        parse_list(cpus, &p->cpus);
+    }
+
+    if (nodes != NULL)
+    {
+        set_nodes(p, nodes, cpus != NULL);
+    }
+
+    if (pin && CPU_COUNT(&p->cpus) == 0)
+    {
+        p->cpus = initial_cpus;
+    }
+
+    p->cpu_count = CPU_COUNT(&p->cpus);
+    p->pin = pin && p->cpu_count > 0;
+    p->nice = nice;
+    p->ioprio = ioprio;
+    p->policy = policy;
+
+    return p;
+}
+
+void placement_free(placement *p)
+{
+    free(p);
+}
+
+int placement_equal(const placement *a, const placement *b)
+{
+    return memcmp(a, b, sizeof(placement)) == 0;
+}
+
+const char *placement_apply(const placement *p, int number, pid_t pid)
+{
+    const cpu_set_t *cpus = NULL;
+    cpu_set_t pinned;
+    struct sched_param param;
+    const char *failed = NULL;
+    int cpu, n;
+
+    if (p->cpu_count > 0 && p->pin)
+    {
+        /* The (number mod count)th CPU of the set */
+        n = number % p->cpu_count;
+
+        for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &p->cpus) && n-- == 0)
+            {
+                break;
+            }
+        }
+
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        cpus = &pinned;
+    }
+    else if (p->cpu_count > 0)
+    {
+        cpus = &p->cpus;
+    }
+    else if (dispatcher_pinned)
+    {
+        /* Not on the dispatcher's CPUs */
+        cpus = &initial_cpus;
+    }
+
+    if (cpus != NULL && sched_setaffinity(pid, sizeof(cpu_set_t), cpus) != 0)
+    {
+        failed = "CPU affinity";
+    }
+
+    if (p->node_count > 0 && pid == 0
+     && syscall(SYS_set_mempolicy, MPOL_BIND, p->nodes, (unsigned long) PLACEMENT_MAX_NODES + 1) != 0)
+    {
+        failed = "NUMA nodes";
+    }
+
+    if (p->policy != PLACEMENT_UNSET)
+    {
+        memset(&param, 0, sizeof(param));
+
+        if (sched_setscheduler(pid, p->policy, &param) != 0)
+        {
+            failed = "scheduling policy";
+        }
+    }
+
+    if (p->nice != PLACEMENT_UNSET && setpriority(PRIO_PROCESS, (id_t) pid, p->nice) != 0)
+    {
+        failed = "nice level";
+    }
+
+    if (p->ioprio != PLACEMENT_UNSET && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, p->ioprio) != 0)
+    {
+        failed = "I/O priority";
+    }
+
+    return failed;
+}
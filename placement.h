@@ -0,0 +1,90 @@
+/*
+ *  FatController - Parallel execution handler
+ *  Copyright (C) 2010 Nicholas Giles    http://www.4pmp.com
+ *
+ *  This file is part of FatController.
+ *
+ *  FatController is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  FatController is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with FatController.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sys/types.h>
+
+#define RV_FAIL -1
+#define RV_OK 0
+
+/* Nice level, I/O priority or scheduling policy left as the sub-process
+   inherits it */
+#define PLACEMENT_UNSET -1000
+
+/* Most NUMA nodes a pool may be bound to, the kernel's largest MAX_NUMNODES */
+#define PLACEMENT_MAX_NODES 1024
+
+/* Where the CPUs of a NUMA node are listed, with its number */
+#define PLACEMENT_NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+
+/*
+    Where and how the sub-processes of a pool run: the CPUs and NUMA nodes
+    they may use, their nice level, I/O priority and scheduling policy.   A
+    placement is made for each set of settings a pool starts sub-processes
+    with and applied to each of them between fork() and exec (see
+    placement_apply()).
+
+    The dispatcher may be pinned to CPUs of its own, in which case the
+    sub-processes of pools without CPUs are given back the ones it was
+    started with rather than inheriting its own.
+*/
+
+typedef struct placement placement;
+
+/* Notes the CPUs the dispatcher was started with and pins it, and the
+   threads it starts from then on, to the list cpus if it is not NULL.
+   Returns RV_FAIL, having logged why, if it cannot be pinned. */
+int placement_initialize(const char *cpus);
+
+/* Returns RV_OK if text is a list of CPUs (or NUMA nodes) such as
+   "0-3,8,10-11" */
+int placement_check_list(const char *text);
+
+/* Parses an I/O scheduling class and level, "idle", "best-effort[:0-7]" or
+   "realtime[:0-7]" (the level defaulting to 4), into an I/O priority as
+   given to ioprio_set() */
+int placement_parse_ionice(const char *text, int *ioprio);
+
+/* Parses a scheduling policy, "other", "batch" or "idle" */
+int placement_parse_policy(const char *text, int *policy);
+
+/* Makes a placement from a pool's settings, any of which may be NULL or
+   PLACEMENT_UNSET.   The CPUs are those in cpus which are on the NUMA nodes,
+   and if pin is set the sub-process of slot number i only runs on the (i mod
+   count)th of them (of the dispatcher's initial CPUs if cpus is NULL).
+   Problems with the nodes are logged, the CPUs then being left as given. */
+placement *placement_create(const char *cpus, int pin, const char *nodes, int nice, int ioprio, int policy);
+
+void placement_free(placement *p);
+
+/* Returns 1 if sub-processes are placed in the same way with both */
+int placement_equal(const placement *a, const placement *b);
+
+/* Applies a placement to the sub-process of slot number, given as pid or 0
+   for the calling process.   Only makes system calls, so it may be called
+   between fork() and exec.   The NUMA nodes can only be set for the calling
+   process.   Carries on if anything cannot be set, returning what the last
+   was (e.g. "CPU affinity"), or NULL if all was set. */
+const char *placement_apply(const placement *p, int number, pid_t pid);
+
+#endif
@@ -30,10 +30,10 @@
     Nick Giles 2010
     http://wwww.4pmp.com/
 
-    A simple library which wraps malloc, calloc and realloc functions to ensure
-    they succeed.   If the functiond don't succeed then the application is
-    terminated so you don't have to pepper your code with condition statements
-    to check the calls succeeded.
+    A simple library which wraps malloc, calloc, realloc and posix_memalign
+    functions to ensure they succeed.   If the functiond don't succeed then the
+    application is terminated so you don't have to pepper your code with
+    condition statements to check the calls succeeded.
     
     Note that this is not a drop-in replacement for all instances of malloc and
     realloc, there may well be times when you can take another, less drastic
@@ -79,3 +79,16 @@ void *sfrealloc(void *ptr, size_t sz)
     
     return ret;
 }
+
+void *sfaligned_alloc(size_t alignment, size_t sz)
+{
+    void *ret = NULL;
+    
+    if (posix_memalign(&ret, alignment, sz) != 0)
+    {
+        _syslog(LOG_CRIT, "Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    
+    return ret;
+}
@@ -24,4 +24,5 @@
 void *sfmalloc(size_t sz);
 void *sfcalloc(size_t nelem, size_t elsize);
 void *sfrealloc(void *ptr, size_t sz);
+void *sfaligned_alloc(size_t alignment, size_t sz);
 #endif
@@ -19,6 +19,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <pthread.h>
 #include <syslog.h>
@@ -28,7 +29,12 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <time.h>
 #include "extern.h"
 #include "sfmemlib.h"
 #include "subprocslog.h"
@@ -51,12 +57,63 @@
     immediate shutdown of the application.
 */
 
-subprocslog_source *source_list_start = NULL;
-pthread_mutex_t source_list_mutex;
-unsigned int source_count = 0;
+/*
+    Writer thread:
+    --------------
+    
+    Output is written to the log files by a thread owned by this module, so
+    that slow log files never delay the dispatcher and pipes are drained as
+    soon as there is data in them.   The receiving end of each pipe is watched
+    with epoll from when the source is appended.
+    
+    Sources are only ever freed by the writer thread (or once it has stopped),
+    after it has handled all events which may refer to them.   Removing a
+    source only marks it as mothballed and wakes the writer thread.
+*/
+
+/* Sources are held in a table indexed by the low bits of their id.   The
+   high bits are the generation of the table entry, which changes each time
+   the entry is reused, so a stale id never matches a newer source.   Unused
+   entries are chained together through next_free.   The mutex is only held
+   while the table itself is changed, never during I/O. */
+subprocslog_table_entry *source_table = NULL;
+int source_table_size = 0;
+int source_table_free = -1;
+pthread_mutex_t source_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Removed sources waiting for the writer thread to write the last of their
+   output, linked by their next pointers */
+subprocslog_source *retired_sources = NULL;
 int initialized = SUBPROCSLOG_UNINITIALIZED;
-FILE *log_stdout, *log_stderr;
-char *loc_stdout = NULL, *loc_stderr = NULL;
+
+/* Log files and the destinations using them.   Both only change with
+   initialized_state_rwlock held for writing, so the writer thread may use
+   them freely while holding it for reading. */
+subprocslog_file *log_files = NULL;
+int log_file_count = 0;
+subprocslog_destination *destinations = NULL;
+int destination_count = 0;
+
+/* How data is moved from the pipes to the log files */
+int capture_mode = SUBPROCSLOG_CAPTURE_COPY;
+
+/* In SUBPROCSLOG_CAPTURE_LINES mode, set if lines are prefixed with the time,
+   slot and PID */
+int line_prefix = 0;
+
+/* Used to copy data when not splicing, only used by the writer thread (or
+   once it has stopped) */
+static char copy_buffer[SUBPROCSLOG_BUFFER_SIZE];
+
+/* Writer thread, the epoll instance it waits on and an eventfd to wake it
+   when a source is removed or it should stop */
+static pthread_t writer_thread;
+static int writer_started = 0;
+static int writer_epoll_fd = -1;
+static int writer_wake_fd = -1;
+
+/* Set (under source_table_mutex) to stop the writer thread */
+static int writer_stop = 0;
 
 pthread_rwlock_t initialized_state_rwlock = PTHREAD_RWLOCK_INITIALIZER;
 
@@ -65,78 +122,454 @@ pthread_rwlock_t initialized_state_rwlock = PTHREAD_RWLOCK_INITIALIZER;
    Internal 
    -------- */
 
-static int write_fdsource_to_fhsink(int source, FILE *sink)
-{    
-    char buffer[255];
-    ssize_t bytes_read;
-    size_t buffer_size, element_size;
+/* Writes all of a buffer, retrying partial writes */
+static int write_all(int sink, const char *buffer, size_t length)
+{
+    ssize_t bytes_written;
+    
+    while (length > 0)
+    {
+        bytes_written = write(sink, buffer, length);
+        
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            
+            syslog(LOG_ERR, "Cannot write to log file: ERRNO:%d, MSG:%s", errno, strerror(errno));
+            
+            return RV_FAIL;
+        }
+        
+        buffer += bytes_written;
+        length -= bytes_written;
+    }
     
-    buffer_size = sizeof(buffer);
-    element_size = sizeof(char);
+    return RV_OK;
+}
+
+/* Copies everything currently in a pipe to a log file, through a large buffer
+   so that there is one write for up to SUBPROCSLOG_BUFFER_SIZE bytes.   The
+   number of bytes read is added to bytes. */
+static int copy_fdsource_to_fdsink(int source, int sink, size_t *bytes)
+{
+    ssize_t bytes_read;
+    size_t buffered = 0;
     
     do
     {
-        bytes_read = read(source, buffer, buffer_size);
+        bytes_read = read(source, copy_buffer + buffered, sizeof(copy_buffer) - buffered);
                 
         if (bytes_read > 0)
         {
-            /* Write message */
-            fwrite(buffer, element_size, bytes_read, sink);
+            buffered += bytes_read;
+            *bytes += bytes_read;
         }
-        else if(bytes_read == -1)
+        else if(bytes_read == -1 && errno != EAGAIN && errno != EINTR)
         {
-            if (errno == EAGAIN)
+            /* Error */
+            syslog(LOG_ERR, "Cannot read from file descriptor on receiving end of pipe from sub-process: ERRNO:%d, MSG:%s", errno, strerror(errno));
+        }
+        
+        /* Write when the buffer is full or the pipe is empty */
+        if (buffered == sizeof(copy_buffer) || (bytes_read <= 0 && buffered > 0))
+        {
+            write_all(sink, copy_buffer, buffered);
+            
+            buffered = 0;
+        }
+        
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+    
+    return RV_OK;
+}
+
+/* Writes a vector of buffers, retrying partial writes */
+static int writev_all(int sink, struct iovec *iov, int iovcnt)
+{
+    ssize_t bytes_written;
+    
+    while (iovcnt > 0)
+    {
+        bytes_written = writev(sink, iov, iovcnt);
+        
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR)
             {
-                /* No data yet, try again, so no need to report this error */
+                continue;
+            }
+            
+            syslog(LOG_ERR, "Cannot write to log file: ERRNO:%d, MSG:%s", errno, strerror(errno));
+            
+            return RV_FAIL;
+        }
+        
+        /* Skip whatever has been written */
+        while (iovcnt > 0 && (size_t) bytes_written >= iov->iov_len)
+        {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+    
+    return RV_OK;
+}
+
+/* Formats the prefix written before each line, e.g.
+   "2013-07-31 12:00:00 [3:1234] " for slot 3, PID 1234 */
+static size_t format_line_prefix(long slot_id, pid_t pid, char *prefix, size_t size)
+{
+    time_t now = time(NULL);
+    struct tm tm_now;
+    size_t length;
+    int rv;
+    
+    localtime_r(&now, &tm_now);
+    
+    length = strftime(prefix, size, "%Y-%m-%d %H:%M:%S", &tm_now);
+    
+    rv = snprintf(prefix + length, size - length, " [%ld:%d] ", slot_id, (int) pid);
+    
+    return rv > 0 && (size_t) rv < size - length ? length + rv : length;
+}
+
+/* Writes the first length bytes of a line buffer as whole lines, with one
+   writev() per batch of lines.   If the data does not end with a newline then
+   one is added. */
+static int write_lines(subprocslog_source *source, subprocslog_line_buffer *lines, size_t length, int sink)
+{
+    struct iovec iov[SUBPROCSLOG_IOV_BATCH];
+    char prefix[SUBPROCSLOG_LINE_PREFIX_SIZE];
+    size_t prefix_length = 0, line_length;
+    char *line, *end, *newline;
+    int iovcnt = 0, rv = RV_OK;
+    
+    if (line_prefix == 1)
+    {
+        prefix_length = format_line_prefix(source->slot_id, source->pid, prefix, sizeof(prefix));
+    }
+    
+    line = lines->data;
+    end = lines->data + length;
+    
+    while (line < end)
+    {
+        newline = memchr(line, '\n', end - line);
+        line_length = newline != NULL ? (size_t) (newline - line) + 1 : (size_t) (end - line);
+        
+        if (prefix_length > 0)
+        {
+            iov[iovcnt].iov_base = prefix;
+            iov[iovcnt++].iov_len = prefix_length;
+        }
+        
+        iov[iovcnt].iov_base = line;
+        iov[iovcnt++].iov_len = line_length;
+        
+        if (newline == NULL)
+        {
+            iov[iovcnt].iov_base = "\n";
+            iov[iovcnt++].iov_len = 1;
+        }
+        
+        line += line_length;
+        
+        /* Leave room for the next line */
+        if (iovcnt > SUBPROCSLOG_IOV_BATCH - 3)
+        {
+            rv |= writev_all(sink, iov, iovcnt);
+            iovcnt = 0;
+        }
+    }
+    
+    if (iovcnt > 0)
+    {
+        rv |= writev_all(sink, iov, iovcnt);
+    }
+    
+    return rv == RV_OK ? RV_OK : RV_FAIL;
+}
+
+/* Reads everything currently in a pipe and writes only complete lines, so
+   that lines from different sub-processes are never mixed up.   Incomplete
+   lines are kept until the rest arrives or the source is removed, unless the
+   line fills the buffer in which case it is written as it is. */
+static int frame_fdsource_to_fdsink(subprocslog_source *source, int fd, subprocslog_line_buffer *lines, int sink, size_t *bytes)
+{
+    ssize_t bytes_read;
+    char *last_newline;
+    size_t complete;
+    
+    if (lines->data == NULL)
+    {
+        lines->data = sfmalloc(SUBPROCSLOG_LINE_BUFFER_SIZE);
+        lines->length = 0;
+    }
+    
+    do
+    {
+        bytes_read = read(fd, lines->data + lines->length, SUBPROCSLOG_LINE_BUFFER_SIZE - lines->length);
+        
+        if (bytes_read > 0)
+        {
+            lines->length += bytes_read;
+            *bytes += bytes_read;
+        }
+        else if(bytes_read == -1 && errno != EAGAIN && errno != EINTR)
+        {
+            syslog(LOG_ERR, "Cannot read from file descriptor on receiving end of pipe from sub-process: ERRNO:%d, MSG:%s", errno, strerror(errno));
+        }
+        
+        /* Write when the buffer is full or the pipe is empty */
+        if (lines->length > 0 && (lines->length == SUBPROCSLOG_LINE_BUFFER_SIZE || bytes_read <= 0))
+        {
+            last_newline = memrchr(lines->data, '\n', lines->length);
+            
+            if (last_newline != NULL)
+            {
+                complete = (last_newline - lines->data) + 1;
             }
             else
             {
-                /* Error */
-                _syslog(LOG_ERR, "Cannot read from file descriptor on receiving end of pipe from sub-process: ERRNO:%d, MSG:%s", errno, strerror(errno));
+                /* Either the line is longer than the buffer, or incomplete */
+                complete = lines->length == SUBPROCSLOG_LINE_BUFFER_SIZE ? lines->length : 0;
+            }
+            
+            if (complete > 0)
+            {
+                write_lines(source, lines, complete, sink);
+                
+                lines->length -= complete;
+                memmove(lines->data, lines->data + complete, lines->length);
             }
         }
         
-    } while (bytes_read > 0);
-    
-    fflush(sink);
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
     
     return RV_OK;
 }
 
+/* Writes any incomplete line left in a line buffer and frees it */
+static void flush_line_buffer(subprocslog_source *source, subprocslog_line_buffer *lines, int sink)
+{
+    if (lines->data != NULL && lines->length > 0)
+    {
+        write_lines(source, lines, lines->length, sink);
+    }
+    
+    free(lines->data);
+    
+    lines->data = NULL;
+    lines->length = 0;
+}
 
-static int do_initialize()
+/* Moves everything currently in a pipe to a log file without copying it
+   through user space, splicing until the pipe is empty (EAGAIN) as it is
+   watched with edge triggering and there is no other wake-up for what is
+   left.   A splice may move less than is in the pipe, which the loop takes
+   care of.   Returns RV_FAIL if it stopped with data possibly left in the
+   pipe, with errno EINVAL if the log file cannot be spliced into at all. */
+static int splice_fdsource_to_fdsink(int source, int sink, size_t *bytes)
 {
-    /* Check we're not already initialised */
-    if (subprocslog_is_initialized() == 0)
+    ssize_t bytes_moved;
+    
+    /* The log file cannot be opened with O_APPEND for splice() so seek to the
+       end each time in case it has been truncated, e.g. by logrotate */
+    if (lseek(sink, 0, SEEK_END) == -1)
     {
-        syslog(LOG_ERR, "Cannot initialize - already initialized");
-        
         return RV_FAIL;
     }
     
-    /* Open FP for STDOUT */
-    log_stdout = fopen(loc_stdout, "a+");
+    do
+    {
+        bytes_moved = splice(source, NULL, sink, NULL, SUBPROCSLOG_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        
+        if (bytes_moved > 0)
+        {
+            *bytes += bytes_moved;
+        }
+        else if (bytes_moved == -1 && errno != EAGAIN && errno != EINTR)
+        {
+            return RV_FAIL;
+        }
+        
+    } while (bytes_moved > 0 || (bytes_moved == -1 && errno == EINTR));
     
-    if (log_stdout == NULL)
+    return RV_OK;
+}
+
+/* Writes everything currently in a pipe to a log file.   If splicing stops
+   early the rest is copied, so that the pipe is still drained. */
+static int write_fdsource_to_fdsink(int source, int sink, int *use_splice, size_t *bytes)
+{
+    if (*use_splice == 1)
     {
-        syslog(LOG_ERR, "Could not open log file for STDOUT: %s", loc_stdout);
+        if (splice_fdsource_to_fdsink(source, sink, bytes) == RV_OK)
+        {
+            return RV_OK;
+        }
         
+        if (errno == EINVAL)
+        {
+            syslog(LOG_WARNING, "Cannot splice into log file, copying instead: ERRNO:%d, MSG:%s", errno, strerror(errno));
+            
+            *use_splice = 0;
+        }
+        else
+        {
+            syslog(LOG_ERR, "Cannot splice from pipe from sub-process, copying the rest: ERRNO:%d, MSG:%s", errno, strerror(errno));
+        }
+    }
+    
+    return copy_fdsource_to_fdsink(source, sink, bytes);
+}
+
+/* Writes everything currently in a pipe to a log file, see subprocslog_file */
+static void write_fdsource_to_log(int source, subprocslog_file *file, size_t *bytes)
+{
+    if (capture_mode == SUBPROCSLOG_CAPTURE_SPLICE)
+    {
+        pthread_mutex_lock(&file->mutex);
+    }
+    
+    write_fdsource_to_fdsink(source, file->fd, &file->use_splice, bytes);
+    
+    if (capture_mode == SUBPROCSLOG_CAPTURE_SPLICE)
+    {
+        pthread_mutex_unlock(&file->mutex);
+    }
+}
+
+/* Opens a log file.   Files to be spliced into cannot be opened for appending,
+   and splicing is only used for regular files. */
+static int open_log(const char *location, int *use_splice)
+{
+    struct stat st;
+    int fd;
+    
+    fd = open(location, O_WRONLY | O_CREAT | O_CLOEXEC | (capture_mode == SUBPROCSLOG_CAPTURE_SPLICE ? 0 : O_APPEND), 0666);
+    
+    if (fd == -1)
+    {
+        return -1;
+    }
+    
+    *use_splice = 0;
+    
+    if (capture_mode == SUBPROCSLOG_CAPTURE_SPLICE)
+    {
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            *use_splice = 1;
+        }
+        else
+        {
+            /* Not a regular file, so reopen for appending */
+            close(fd);
+            
+            fd = open(location, O_WRONLY | O_CREAT | O_CLOEXEC | O_APPEND, 0666);
+        }
+    }
+    
+    return fd;
+}
+
+
+/* Returns the index of the log file with the path given, adding it to the
+   file table (and opening it if the logging system is initialised) if it is
+   not already there */
+static int find_log_file(char *location)
+{
+    int i;
+    
+    for (i=0; i<log_file_count; i++)
+    {
+        if (strcmp(log_files[i].location, location) == 0)
+        {
+            return i;
+        }
+    }
+    
+    log_files = sfrealloc(log_files, (log_file_count + 1) * sizeof(subprocslog_file));
+    
+    log_files[i].fd = -1;
+    log_files[i].use_splice = 0;
+    pthread_mutex_init(&log_files[i].mutex, NULL);
+    
+    if (initialized == SUBPROCSLOG_INITIALIZED)
+    {
+        log_files[i].fd = open_log(location, &log_files[i].use_splice);
+        
+        if (log_files[i].fd == -1)
+        {
+            syslog(LOG_ERR, "Could not open log file: %s", location);
+            
+            return RV_FAIL;
+        }
+    }
+    
+    log_files[i].location = sfmalloc(strlen(location) + 1);
+    strcpy(log_files[i].location, location);
+    
+    log_file_count++;
+    
+    return i;
+}
+
+/* Adds a destination, must be called with initialized_state_rwlock held for
+   writing */
+static int add_destination(char *ploc_stdout, char *ploc_stderr)
+{
+    int file_stdout, file_stderr;
+    
+    file_stdout = find_log_file(ploc_stdout);
+    file_stderr = file_stdout == RV_FAIL ? RV_FAIL : find_log_file(ploc_stderr);
+    
+    if (file_stderr == RV_FAIL)
+    {
         return RV_FAIL;
     }
     
-    /* If a different file is specified, then open FP for STDERR */
-    if (strcmp(loc_stdout, loc_stderr) == 0)
+    destinations = sfrealloc(destinations, (destination_count + 1) * sizeof(subprocslog_destination));
+    
+    destinations[destination_count].file_stdout = file_stdout;
+    destinations[destination_count].file_stderr = file_stderr;
+    atomic_init(&destinations[destination_count].bytes_stdout, 0);
+    atomic_init(&destinations[destination_count].bytes_stderr, 0);
+    
+    return destination_count++;
+}
+
+static int do_initialize()
+{
+    int i;
+    
+    /* Check we're not already initialised */
+    if (subprocslog_is_initialized() == 0)
     {
-        /* If the paths for stdout and stderr are the same then we only need one FP */
-        log_stderr = log_stdout;
+        syslog(LOG_ERR, "Cannot initialize - already initialized");
+        
+        return RV_FAIL;
     }
-    else
+    
+    /* Open each log file once, however many destinations use it */
+    for (i=0; i<log_file_count; i++)
     {
-        log_stderr = fopen(loc_stderr, "a+");
+        log_files[i].fd = open_log(log_files[i].location, &log_files[i].use_splice);
         
-        if (log_stderr == NULL)
+        if (log_files[i].fd == -1)
         {
-            syslog(LOG_ERR, "Could not open log file for STDERR: %s", loc_stderr);
+            syslog(LOG_ERR, "Could not open log file: %s", log_files[i].location);
             
             return RV_FAIL;
         }
@@ -150,6 +583,8 @@ static int do_initialize()
 
 static int do_deinitialize()
 {
+    int i, rv = RV_OK;
+    
     /* Check we're already initialised */
     if (subprocslog_is_initialized() != 0)
     {
@@ -161,24 +596,19 @@ static int do_deinitialize()
     /* We're NOT initialised */
     initialized = SUBPROCSLOG_UNINITIALIZED;
     
-    if (log_stdout != log_stderr)
+    for (i=0; i<log_file_count; i++)
     {
-        if (fclose(log_stderr) != 0)
+        if (close(log_files[i].fd) != 0)
         {
-            syslog(LOG_WARNING, "Could not close log file for STDERR: [%d] %s", errno, strerror(errno));
+            syslog(LOG_ERR, "Could not close log file %s: [%d] %s", log_files[i].location, errno, strerror(errno));
             
-            return RV_FAIL;
+            rv = RV_FAIL;
         }
-    }
-    
-    if (fclose(log_stdout) != 0)
-    {
-        syslog(LOG_ERR, "Could not close log file for STDLOG: [%d] %s", errno, strerror(errno));
         
-        return RV_FAIL;
+        log_files[i].fd = -1;
     }
     
-    return RV_OK;
+    return rv;
 }
 
 /* Not needed yet
@@ -241,117 +671,307 @@ static int pthread_rwlock_unlock_elog(pthread_rwlock_t *rwlock)
     return RV_OK;
 }
 
-/* Writes the contents of all the STDOUT and STDIN receive buffers from all
- * attached pipes.
- * 
- * Note that this function DOES NOT ACQUIRE A READ LOCK, all calling functions
- * must acquire such a lock before calling.
- */
-static int do_write_buffers()
+/* Writes everything currently in both pipes of a source to the log files */
+static void drain_source(subprocslog_source *source)
 {
-    subprocslog_source *current, *next;
+    subprocslog_file *log_stdout = &log_files[destinations[source->destination].file_stdout];
+    subprocslog_file *log_stderr = &log_files[destinations[source->destination].file_stderr];
+    size_t bytes_stdout = 0, bytes_stderr = 0;
     
-    pthread_mutex_lock(&source_list_mutex);
+    if (capture_mode == SUBPROCSLOG_CAPTURE_LINES)
+    {
+        if (source->fd_stdout != -1)
+        {
+            frame_fdsource_to_fdsink(source, source->fd_stdout, &source->lines_stdout, log_stdout->fd, &bytes_stdout);
+        }
+        
+        frame_fdsource_to_fdsink(source, source->fd_stderr, &source->lines_stderr, log_stderr->fd, &bytes_stderr);
+    }
+    else
+    {
+        /* Dump STDOUT buffer */
+        if (source->fd_stdout != -1)
+        {
+            write_fdsource_to_log(source->fd_stdout, log_stdout, &bytes_stdout);
+        }
+    
+        /* Dump STDERR buffer */
+        write_fdsource_to_log(source->fd_stderr, log_stderr, &bytes_stderr);
+    }
+    
+    /* Read from outside the writer thread, see subprocslog_destination_bytes() */
+    if (bytes_stdout > 0)
+    {
+        atomic_fetch_add_explicit(&destinations[source->destination].bytes_stdout, bytes_stdout, memory_order_relaxed);
+    }
+    
+    if (bytes_stderr > 0)
+    {
+        atomic_fetch_add_explicit(&destinations[source->destination].bytes_stderr, bytes_stderr, memory_order_relaxed);
+    }
+}
 
-    current = source_list_start;
+/* Writes the last of the output of a source that has been removed from the
+   list, closes its pipes and frees it */
+static void retire_source(subprocslog_source *source)
+{
+    drain_source(source);
+    
+    /* Write whatever is left of the last lines */
+    flush_line_buffer(source, &source->lines_stdout, log_files[destinations[source->destination].file_stdout].fd);
+    flush_line_buffer(source, &source->lines_stderr, log_files[destinations[source->destination].file_stderr].fd);
+    
+    /* Stop watching explicitly, as closing our descriptor does not remove it
+       if a forked child which has not yet exec'd still has a copy */
+    if (writer_epoll_fd != -1)
+    {
+        if (source->fd_stdout != -1)
+        {
+            epoll_ctl(writer_epoll_fd, EPOLL_CTL_DEL, source->fd_stdout, NULL);
+        }
+        
+        epoll_ctl(writer_epoll_fd, EPOLL_CTL_DEL, source->fd_stderr, NULL);
+    }
+    
+    syslog(LOG_DEBUG, "subprocslog::retire_source() closing id: %d, fd_stderr: %d", source->id, source->fd_stderr);
+    
+    if (close(source->fd_stderr) != 0)
+    {
+        syslog(LOG_CRIT, "subprocslog::retire_source() cannot close stderr FD: %s", strerror(errno));
+    }
+    
+    if (source->fd_stdout != -1)
+    {
+        syslog(LOG_DEBUG, "subprocslog::retire_source() closing id: %d, fd_stdout: %d", source->id, source->fd_stdout);
+        
+        if (close(source->fd_stdout) != 0)
+        {
+            syslog(LOG_CRIT, "subprocslog::retire_source() cannot close stdout FD: %s", strerror(errno));
+        }
+    }
+    
+    free(source);
+}
+
+/* Retires all sources removed since the last call */
+static void retire_mothballed_sources()
+{
+    subprocslog_source *current, *next;
+    
+    pthread_mutex_lock(&source_table_mutex);
+    current = retired_sources;
+    retired_sources = NULL;
+    pthread_mutex_unlock(&source_table_mutex);
     
-    /* Iterate over list of sources */
     while (current != NULL)
     {
-        /* For each source, dump STDOUT buffer */
-        write_fdsource_to_fhsink(current->fd_stdout, log_stdout);
+        next = current->next;
+        
+        retire_source(current);
+        
+        current = next;
+    }
+}
+
+/* Doubles the size of the source table, chaining the new entries onto the
+   free list.   Must be called with source_table_mutex held. */
+static int grow_source_table()
+{
+    int i, new_size;
     
-        /* Dump STDERR buffer */
-        write_fdsource_to_fhsink(current->fd_stderr, log_stderr);
+    new_size = source_table_size == 0 ? SUBPROCSLOG_TABLE_INITIAL_SIZE : source_table_size * 2;
     
-        /* Check if mothballed */
-        if (current->state == SUBPROCSLOG_SOURCESTATE_MOTHBALLED)
+    if (new_size > SUBPROCSLOG_TABLE_INDEX_MASK + 1)
+    {
+        return RV_FAIL;
+    }
+    
+    source_table = sfrealloc(source_table, new_size * sizeof(subprocslog_table_entry));
+    
+    for (i=new_size-1; i>=source_table_size; i--)
+    {
+        source_table[i].source = NULL;
+        source_table[i].generation = 0;
+        source_table[i].next_free = source_table_free;
+        source_table_free = i;
+    }
+    
+    source_table_size = new_size;
+    
+    return RV_OK;
+}
+
+/* Takes a source out of the table and queues it to be retired.   Must be
+   called with source_table_mutex held. */
+static void release_source_entry(int index)
+{
+    subprocslog_source *source = source_table[index].source;
+    
+    source->state = SUBPROCSLOG_SOURCESTATE_MOTHBALLED;
+    source->next = retired_sources;
+    retired_sources = source;
+    
+    source_table[index].source = NULL;
+    source_table[index].generation = (source_table[index].generation + 1) & SUBPROCSLOG_TABLE_GENERATION_MASK;
+    source_table[index].next_free = source_table_free;
+    source_table_free = index;
+}
+
+/* Wakes the writer thread so it retires mothballed sources */
+static void wake_writer()
+{
+    uint64_t one = 1;
+    
+    if (writer_wake_fd != -1 && write(writer_wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        syslog(LOG_WARNING, "subprocslog: cannot wake writer thread: [%d] %s", errno, strerror(errno));
+    }
+}
+
+/* Writer thread, writes output as soon as it arrives in any pipe */
+static void *writer(void *arg)
+{
+    struct epoll_event events[SUBPROCSLOG_MAX_EVENTS];
+    int i, n, woken, stop = 0;
+    uint64_t counter;
+    
+    (void) arg;
+    
+    while (stop == 0)
+    {
+        n = epoll_wait(writer_epoll_fd, events, SUBPROCSLOG_MAX_EVENTS, -1);
+        
+        if (n == -1)
         {
-            /* Mothballed, so close FDs and remove from list */
-            syslog(LOG_DEBUG, "subprocslog::do_write_buffers() closing id: %d, fd_stderr: %d", current->id, current->fd_stderr);
-            
-            if (close(current->fd_stderr) != 0)
+            if (errno == EINTR)
             {
-                syslog(LOG_CRIT, "subprocslog::do_write_buffers() cannot close stderr FD: %s", strerror(errno));
+                continue;
             }
             
-            syslog(LOG_DEBUG, "subprocslog::do_write_buffers() closing id: %d, fd_stdout: %d", current->id, current->fd_stdout);
+            syslog(LOG_CRIT, "subprocslog: writer thread cannot wait for output: [%d] %s", errno, strerror(errno));
             
-            if (close(current->fd_stdout) != 0)
-            {
-                syslog(LOG_CRIT, "subprocslog::do_write_buffers() cannot close stdout FD: %s", strerror(errno));
-            }
-            
-            /* Now remove the struct from the list */
-            if (current->previous == NULL)
-            {
-                /* We're removing the first one in the list */
-                if (current->next != NULL)
-                {
-                    /* Only do this if it's not also the last, i.e. only one in the list */
-                    current->next->previous = NULL;
-                }
-                
-                source_list_start = current->next;
-            }
-            else if (current->next == NULL)
+            break;
+        }
+        
+        /* Log files may be being reopened */
+        pthread_rwlock_rdlock_elog(&initialized_state_rwlock);
+        
+        woken = 0;
+        
+        for (i=0; i<n; i++)
+        {
+            if (events[i].data.ptr == NULL)
             {
-                /* We're removing the last one from the list */
-                
-                if (current->previous == NULL)
+                if (read(writer_wake_fd, &counter, sizeof(counter)) == -1 && errno != EAGAIN)
                 {
-                    syslog(LOG_WARNING, "Null pointer when removing list element from end, element: %d", current->id);
+                    syslog(LOG_WARNING, "subprocslog: writer thread cannot read wake counter: [%d] %s", errno, strerror(errno));
                 }
                 
-                current->previous->next = NULL;
+                woken = 1;
             }
             else
             {
-                /* We're removing one from somewhere in the middle */
-                
-                if (current->previous == NULL)
-                {
-                    syslog(LOG_WARNING, "Null pointer (previous) when removing list element from middle, element: %d", current->id);
-                }
-                
-                if (current->next == NULL)
-                {
-                    syslog(LOG_WARNING, "Null pointer (next) when removing list element from middle, element: %d", current->id);
-                }
-                
-                current->previous->next = current->next;
-                
-                current->next->previous = current->previous;
+                drain_source(events[i].data.ptr);
             }
-            
-            next = current->next;
-            
-            free(current);
-            
-            current = next;
-            
-            /*source_count--;*/
         }
-        else
+        
+        /* Only now that no more events refer to them can sources be freed */
+        if (woken == 1)
         {
-            current = current->next;
+            retire_mothballed_sources();
         }
+        
+        pthread_rwlock_unlock_elog(&initialized_state_rwlock);
+        
+        pthread_mutex_lock(&source_table_mutex);
+        stop = writer_stop;
+        pthread_mutex_unlock(&source_table_mutex);
+    }
+    
+    return NULL;
+}
+
+static int start_writer()
+{
+    struct epoll_event ev;
+    
+    writer_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    writer_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    
+    if (writer_epoll_fd == -1 || writer_wake_fd == -1)
+    {
+        syslog(LOG_ERR, "subprocslog: cannot create writer file descriptors: [%d] %s", errno, strerror(errno));
+        
+        return RV_FAIL;
+    }
+    
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    
+    if (epoll_ctl(writer_epoll_fd, EPOLL_CTL_ADD, writer_wake_fd, &ev) != 0)
+    {
+        syslog(LOG_ERR, "subprocslog: cannot watch writer wake fd: [%d] %s", errno, strerror(errno));
+        
+        return RV_FAIL;
     }
     
-    pthread_mutex_unlock(&source_list_mutex);
+    writer_stop = 0;
+    
+    if (pthread_create(&writer_thread, NULL, writer, NULL) != 0)
+    {
+        syslog(LOG_ERR, "subprocslog: cannot create writer thread");
+        
+        return RV_FAIL;
+    }
+    
+    writer_started = 1;
     
     return RV_OK;
 }
 
+/* Stops the writer thread, anything left in the pipes is then written by
+   subprocslog_deinitialize() */
+static void stop_writer()
+{
+    if (writer_started == 1)
+    {
+        pthread_mutex_lock(&source_table_mutex);
+        writer_stop = 1;
+        pthread_mutex_unlock(&source_table_mutex);
+        
+        wake_writer();
+        
+        pthread_join(writer_thread, NULL);
+        
+        writer_started = 0;
+    }
+    
+    if (writer_wake_fd != -1)
+    {
+        close(writer_wake_fd);
+        writer_wake_fd = -1;
+    }
+    
+    if (writer_epoll_fd != -1)
+    {
+        close(writer_epoll_fd);
+        writer_epoll_fd = -1;
+    }
+}
+
 /*  -----------------
     Public functions
     ----------------- */
 
-int subprocslog_initialize(char *ploc_stdout, char *ploc_stderr)
+int subprocslog_initialize(char *ploc_stdout, char *ploc_stderr, int pcapture_mode, int pline_prefix)
 {
     int init_rv;
     
     syslog(LOG_DEBUG, "Initialising subproc logging, stdout: %s, stderr: %s", ploc_stdout, ploc_stderr);
+    
+    capture_mode = pcapture_mode;
+    line_prefix = pline_prefix;
 
     /* Lock for writing */
     if (pthread_rwlock_wrlock_elog(&initialized_state_rwlock) != 0)
@@ -359,21 +979,46 @@ int subprocslog_initialize(char *ploc_stdout, char *ploc_stderr)
         return RV_FAIL;
     }
     
-    /* Copy the log file paths to file-scope variables - we may need them again when reinitialising */
-    loc_stdout = sfrealloc(loc_stdout, (strlen(ploc_stdout) + 1) * sizeof(char));
-    loc_stderr = sfrealloc(loc_stderr, (strlen(ploc_stderr) + 1) * sizeof(char));
-    
-    strcpy(loc_stdout, ploc_stdout);
-    strcpy(loc_stderr, ploc_stderr);
+    /* Keep the log file paths - we may need them again when reinitialising */
+    init_rv = add_destination(ploc_stdout, ploc_stderr) == SUBPROCSLOG_DEFAULT_DESTINATION
+              ? RV_OK
+              : RV_FAIL;
     
     /* Now we can actually start initialising... */
-    init_rv = do_initialize();
+    if (init_rv == RV_OK)
+    {
+        init_rv = do_initialize();
+    }
+    
+    if (init_rv == RV_OK)
+    {
+        init_rv = start_writer();
+    }
     
     return pthread_rwlock_unlock_elog(&initialized_state_rwlock) == 0
            ? init_rv
            : RV_FAIL;
 }
 
+int subprocslog_add_destination(char *ploc_stdout, char *ploc_stderr)
+{
+    int destination;
+    
+    syslog(LOG_DEBUG, "Adding subproc log destination, stdout: %s, stderr: %s", ploc_stdout, ploc_stderr);
+    
+    /* Lock for writing, the writer thread may be using the tables */
+    if (pthread_rwlock_wrlock_elog(&initialized_state_rwlock) != 0)
+    {
+        return RV_FAIL;
+    }
+    
+    destination = add_destination(ploc_stdout, ploc_stderr);
+    
+    return pthread_rwlock_unlock_elog(&initialized_state_rwlock) == 0
+           ? destination
+           : RV_FAIL;
+}
+
 int subprocslog_reinitialize()
 {
     int init_rv;
@@ -404,56 +1049,55 @@ int subprocslog_reinitialize()
 
 int subprocslog_deinitialize()
 {
-    int deinit_rv;
+    int deinit_rv, i;
     
     syslog(LOG_DEBUG, "Deinitialising subproc logging");
     
+    /* Must be stopped before locking, as it takes a read lock */
+    stop_writer();
+    
     /* Lock for writing */
     if (pthread_rwlock_wrlock_elog(&initialized_state_rwlock) != 0)
     {
         return RV_FAIL;
     }
     
+    /* Write the last of the output of every source */
     subprocslog_remove_sources();
     
-    do_write_buffers();
+    retire_mothballed_sources();
         
     deinit_rv = do_deinitialize();
     
-    free(loc_stdout);
-    free(loc_stderr);
-    
-    return pthread_rwlock_unlock_elog(&initialized_state_rwlock) == 0
-           ? deinit_rv
-           : RV_FAIL;
-}
-
-int subprocslog_write_buffers()
-{
-    int write_rv;
-    
-    if (pthread_rwlock_rdlock_elog(&initialized_state_rwlock) != RV_OK)
-    {
-        return RV_FAIL;
-    }
-
-    if (initialized != SUBPROCSLOG_INITIALIZED)
+    for (i=0; i<log_file_count; i++)
     {
-        syslog(LOG_ERR, "subprocslog_write_buffers: Not initialised.");
-        
-        return RV_FAIL;
+        free(log_files[i].location);
+        pthread_mutex_destroy(&log_files[i].mutex);
     }
     
-    write_rv = do_write_buffers();
+    free(log_files);
+    log_files = NULL;
+    log_file_count = 0;
+    
+    free(destinations);
+    destinations = NULL;
+    destination_count = 0;
+    
+    free(source_table);
+    source_table = NULL;
+    source_table_size = 0;
+    source_table_free = -1;
     
     return pthread_rwlock_unlock_elog(&initialized_state_rwlock) == 0
-           ? write_rv
+           ? deinit_rv
            : RV_FAIL;
 }
 
-int subprocslog_append_source(int fd_stdout, int fd_stderr)
+int subprocslog_append_source(int fd_stdout, int fd_stderr, long slot_id, pid_t pid, int destination)
 {
     subprocslog_source *source;
+    struct epoll_event ev;
+    int index;
     
     /* --- Init lock --- */
     
@@ -463,43 +1107,84 @@ int subprocslog_append_source(int fd_stdout, int fd_stderr)
     {
         syslog(LOG_ERR, "subprocslog_append_source: Not initialised.");
         
+        pthread_rwlock_unlock_elog(&initialized_state_rwlock);
+        
         return RV_FAIL;
     }
     
-    /* --- Function body --- */
+    if (destination < 0 || destination >= destination_count)
+    {
+        syslog(LOG_ERR, "subprocslog_append_source: No such destination: %d", destination);
+        
+        pthread_rwlock_unlock_elog(&initialized_state_rwlock);
+        
+        return RV_FAIL;
+    }
     
-        pthread_mutex_lock(&source_list_mutex);
+    /* --- Function body --- */
     
-        fcntl(fd_stdout, F_SETFL, O_NONBLOCK);
+        if (fd_stdout != -1)
+        {
+            fcntl(fd_stdout, F_SETFL, O_NONBLOCK);
+        }
+        
         fcntl(fd_stderr, F_SETFL, O_NONBLOCK);
     
         /* Create a new struct to hold file descriptors */
         source = sfmalloc(sizeof(subprocslog_source));
-
-        if (source_count > 65000)
-        {
-            source_count = 0;
-        }
-    
-        source->id = source_count++;
+        
         source->fd_stdout = fd_stdout;
         source->fd_stderr = fd_stderr;
+        source->slot_id = slot_id;
+        source->pid = pid;
+        source->destination = destination;
+        source->lines_stdout.data = NULL;
+        source->lines_stdout.length = 0;
+        source->lines_stderr.data = NULL;
+        source->lines_stderr.length = 0;
         source->state = SUBPROCSLOG_SOURCESTATE_ACTIVE;
-        source->previous = NULL;
-        source->next = source_list_start;
-    
-        if (source_list_start != NULL)
+        source->next = NULL;
+        
+        /* Take a free table entry */
+        pthread_mutex_lock(&source_table_mutex);
+        
+        if (source_table_free == -1 && grow_source_table() != RV_OK)
         {
-            source_list_start->previous = source;
+            pthread_mutex_unlock(&source_table_mutex);
+            
+            syslog(LOG_ERR, "subprocslog_append_source: Too many sources.");
+            
+            free(source);
+            
+            pthread_rwlock_unlock_elog(&initialized_state_rwlock);
+            
+            return RV_FAIL;
         }
         
-        /* Add to beginning of linked list */
-        source_list_start = source;
+        index = source_table_free;
+        source_table_free = source_table[index].next_free;
+        
+        source_table[index].source = source;
+        source->id = (source_table[index].generation << SUBPROCSLOG_TABLE_INDEX_BITS) | index;
+        
+        pthread_mutex_unlock(&source_table_mutex);
         
         syslog(LOG_DEBUG, "subprocslog_append_source: Appending fd_stderr: %d", fd_stderr);
         syslog(LOG_DEBUG, "subprocslog_append_source: Appending fd_stdout: %d", fd_stdout);
         
-        pthread_mutex_unlock(&source_list_mutex);
+        /* Hand the pipes to the writer thread.   Pipes are always drained
+           completely, so edge triggering is enough (and means a pipe closed
+           by a sub-process that is still running is only reported once). */
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = source;
+        
+        if ((fd_stdout != -1 && epoll_ctl(writer_epoll_fd, EPOLL_CTL_ADD, fd_stdout, &ev) != 0)
+         || epoll_ctl(writer_epoll_fd, EPOLL_CTL_ADD, fd_stderr, &ev) != 0)
+        {
+            /* Output is then only written when the source is removed */
+            syslog(LOG_ERR, "subprocslog_append_source: Cannot watch pipes: [%d] %s", errno, strerror(errno));
+        }
     
     /* --- Init unlock --- */
     
@@ -510,7 +1195,7 @@ int subprocslog_append_source(int fd_stdout, int fd_stderr)
 
 void subprocslog_remove_sources()
 {
-    subprocslog_source *source;
+    int i;
     
     if (initialized != SUBPROCSLOG_INITIALIZED)
     {
@@ -519,19 +1204,24 @@ void subprocslog_remove_sources()
         return;
     }
     
-    source = source_list_start;
+    pthread_mutex_lock(&source_table_mutex);
     
-    while (source != NULL)
+    for (i=0; i<source_table_size; i++)
     {
-        source->state = SUBPROCSLOG_SOURCESTATE_MOTHBALLED;
-        
-        source = source->next;
+        if (source_table[i].source != NULL)
+        {
+            release_source_entry(i);
+        }
     }
+    
+    pthread_mutex_unlock(&source_table_mutex);
+    
+    wake_writer();
 }
 
 int subprocslog_remove_source(int source_id)
 {
-    subprocslog_source *source;
+    int index = source_id & SUBPROCSLOG_TABLE_INDEX_MASK;
     int return_value = RV_FAIL;
     
     if (initialized != SUBPROCSLOG_INITIALIZED)
@@ -543,25 +1233,103 @@ int subprocslog_remove_source(int source_id)
     
     syslog(LOG_DEBUG, "subprocslog_remove_source: Removing source id: %d", source_id);
     
-    pthread_mutex_lock(&source_list_mutex);
-    source = source_list_start;
+    pthread_mutex_lock(&source_table_mutex);
+    
+    if (source_id >= 0
+     && index < source_table_size
+     && source_table[index].source != NULL
+     && source_table[index].generation == source_id >> SUBPROCSLOG_TABLE_INDEX_BITS)
+    {
+        release_source_entry(index);
+        
+        return_value = RV_OK;
+    }
+    
+    pthread_mutex_unlock(&source_table_mutex);
+    
+    if (return_value == RV_OK)
+    {
+        wake_writer();
+    }
+    
+    return return_value;
+}
+
+int subprocslog_destination_bytes(int destination, unsigned long long *bytes_stdout, unsigned long long *bytes_stderr)
+{
+    int rv = RV_FAIL;
+    
+    /* The table may be moved by a destination being added */
+    if (pthread_rwlock_rdlock_elog(&initialized_state_rwlock) != 0)
+    {
+        return RV_FAIL;
+    }
+    
+    if (destination >= 0 && destination < destination_count)
+    {
+        *bytes_stdout = atomic_load_explicit(&destinations[destination].bytes_stdout, memory_order_relaxed);
+        *bytes_stderr = atomic_load_explicit(&destinations[destination].bytes_stderr, memory_order_relaxed);
+        rv = RV_OK;
+    }
+    
+    pthread_rwlock_unlock_elog(&initialized_state_rwlock);
+    
+    return rv;
+}
+
+int subprocslog_write_line(int destination, long slot_id, pid_t pid, const char *line, size_t length)
+{
+    struct iovec iov[3];
+    char prefix[SUBPROCSLOG_LINE_PREFIX_SIZE];
+    subprocslog_file *file;
+    int iovcnt = 0, rv = RV_FAIL, sink;
+    
+    if (pthread_rwlock_rdlock_elog(&initialized_state_rwlock) != 0)
+    {
+        return RV_FAIL;
+    }
     
-    while (source != NULL)
+    if (destination >= 0 && destination < destination_count)
     {
-        if (source->id == source_id)
+        file = &log_files[destinations[destination].file_stdout];
+        sink = file->fd;
+        
+        if (capture_mode == SUBPROCSLOG_CAPTURE_LINES && line_prefix == 1)
         {
-            source->state = SUBPROCSLOG_SOURCESTATE_MOTHBALLED;
-            
-            return_value = RV_OK;
+            iov[iovcnt].iov_base = prefix;
+            iov[iovcnt++].iov_len = format_line_prefix(slot_id, pid, prefix, sizeof(prefix));
+        }
+        
+        iov[iovcnt].iov_base = (char *) line;
+        iov[iovcnt++].iov_len = length;
+        iov[iovcnt].iov_base = "\n";
+        iov[iovcnt++].iov_len = 1;
+        
+        /* Files spliced into are not opened for appending, and the writer
+           thread may be splicing into this one, see subprocslog_file */
+        if (capture_mode == SUBPROCSLOG_CAPTURE_SPLICE)
+        {
+            pthread_mutex_lock(&file->mutex);
             
-            break;
+            if (file->use_splice == 1)
+            {
+                lseek(sink, 0, SEEK_END);
+            }
         }
         
-        source = source->next;
+        rv = writev_all(sink, iov, iovcnt);
+        
+        if (capture_mode == SUBPROCSLOG_CAPTURE_SPLICE)
+        {
+            pthread_mutex_unlock(&file->mutex);
+        }
+        
+        atomic_fetch_add_explicit(&destinations[destination].bytes_stdout, length + 1, memory_order_relaxed);
     }
-    pthread_mutex_unlock(&source_list_mutex);
     
-    return return_value;
+    pthread_rwlock_unlock_elog(&initialized_state_rwlock);
+    
+    return rv;
 }
 
 int subprocslog_is_initialized()
@@ -22,28 +22,120 @@
 #ifndef SUBPROCSLOG_H
 #define SUBPROCSLOG_H
 
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
 #define SUBPROCSLOG_SOURCESTATE_ACTIVE 1
 #define SUBPROCSLOG_SOURCESTATE_MOTHBALLED 2
 
 #define SUBPROCSLOG_UNINITIALIZED 0
 #define SUBPROCSLOG_INITIALIZED 1
 
+/* Capture modes: copy through a buffer or splice() pipes into the log files */
+#define SUBPROCSLOG_CAPTURE_COPY 1
+#define SUBPROCSLOG_CAPTURE_SPLICE 2
+#define SUBPROCSLOG_CAPTURE_LINES 3
+
+#define SUBPROCSLOG_BUFFER_SIZE 65536
+#define SUBPROCSLOG_SPLICE_SIZE 65536
+
+/* Longest line which is written whole, longer lines are split */
+#define SUBPROCSLOG_LINE_BUFFER_SIZE 16384
+#define SUBPROCSLOG_LINE_PREFIX_SIZE 64
+
+/* Number of buffers (a prefix and a line each) per writev() */
+#define SUBPROCSLOG_IOV_BATCH 512
+
+/* Events handled by the writer thread per epoll_wait() */
+#define SUBPROCSLOG_MAX_EVENTS 64
+
+/* Source ids are a table index (low bits) and a generation (high bits) */
+#define SUBPROCSLOG_TABLE_INITIAL_SIZE 64
+#define SUBPROCSLOG_TABLE_INDEX_BITS 16
+#define SUBPROCSLOG_TABLE_INDEX_MASK 0xffff
+#define SUBPROCSLOG_TABLE_GENERATION_MASK 0x7fff
+
+/* Destination of the output of sources appended without choosing one */
+#define SUBPROCSLOG_DEFAULT_DESTINATION 0
+
 #define RV_FAIL -1
 #define RV_OK 0
 
 
+/* Incomplete line read from a pipe (SUBPROCSLOG_CAPTURE_LINES only) */
+typedef struct
+{
+    char *data;
+    size_t length;
+} subprocslog_line_buffer;
+
 typedef struct subprocslog_source
 {
     int id;
     int fd_stdout;
     int fd_stderr;
+    long slot_id;
+    pid_t pid;
+    int destination;
+    subprocslog_line_buffer lines_stdout;
+    subprocslog_line_buffer lines_stderr;
     int state;
-    struct subprocslog_source *previous;
+    
+    /* Next source waiting to be retired */
     struct subprocslog_source *next;
 } subprocslog_source;
 
-/* Initialises logging system, opens log files */
-int subprocslog_initialize(char *loc_stdout, char *loc_stderr);
+typedef struct
+{
+    /* NULL if the entry is free */
+    subprocslog_source *source;
+    int generation;
+    int next_free;
+} subprocslog_table_entry;
+
+/* Log file, shared by every destination using the same path */
+typedef struct
+{
+    char *location;
+    int fd;
+    
+    /* Set if data is spliced into the file */
+    int use_splice;
+    
+    /* In SUBPROCSLOG_CAPTURE_SPLICE mode the file is not opened for
+       appending, so this is held from seeking to the end until the write is
+       done, as the dispatcher also writes to it (see subprocslog_write_line()) */
+    pthread_mutex_t mutex;
+} subprocslog_file;
+
+/* Pair of log files, as indexes into the file table, and the number of bytes
+   of output written to each */
+typedef struct
+{
+    int file_stdout;
+    int file_stderr;
+    atomic_ullong bytes_stdout;
+    atomic_ullong bytes_stderr;
+} subprocslog_destination;
+
+/* Initialises logging system, opens log files and starts the thread which
+   writes output from sources to them.
+   
+   In SUBPROCSLOG_CAPTURE_SPLICE mode output is moved to log files which are
+   regular files with splice(), other log files are copied to as normal.
+   
+   In SUBPROCSLOG_CAPTURE_LINES mode only whole lines are written, so output
+   from different sources is never mixed within a line.   If line_prefix is 1
+   then each line is prefixed with the time, slot id and PID of the source.
+   
+   The log files given become SUBPROCSLOG_DEFAULT_DESTINATION. */
+int subprocslog_initialize(char *loc_stdout, char *loc_stderr, int capture_mode, int line_prefix);
+
+/* Adds another pair of log files which sources may be written to, opening
+   them unless they are already open for another destination.   Returns the
+   id of the destination, or RV_FAIL. */
+int subprocslog_add_destination(char *loc_stdout, char *loc_stderr);
 
 /* Closes file handlers for log files and reopens them.
    
@@ -55,24 +147,36 @@ int subprocslog_initialize(char *loc_stdout, char *loc_stderr);
 */
 int subprocslog_reinitialize();
 
-/* Closes file handlers for log files */
+/* Stops the writer thread, writes any remaining output and closes file
+   handlers for log files */
 int subprocslog_deinitialize();
 
-/* Iterates over connected sources and flushes stdout and stderr buffers
-   to log files */
-int subprocslog_write_buffers();
-
-/* Adds a new source to the beginning of the source list */
-int subprocslog_append_source(int fd_stdout, int fd_stderr);
+/* Adds a new source to the source table, from then on output
+   is written as soon as it arrives.   fd_stdout may be -1 if only STDERR is
+   logged.   Output is written to the log files of the destination given.
+   The slot id and PID are only used for prefixing lines */
+int subprocslog_append_source(int fd_stdout, int fd_stderr, long slot_id, pid_t pid, int destination);
 
-/* Schedules ALL sources to be removed from the list after the next time it is
-   read. */
+/* Removes ALL sources from the table, the last of their output is written by
+   the writer thread (or when deinitialising). */
 void subprocslog_remove_sources();
 
-/* Schedules a source to be removed from the list after the next time it is
-   read.   Returns RV_OK if a matching source is found, otherwise RV_FAIL */
+/* Removes a source from the table, it is closed once the writer thread has
+   written the last of its output.   Returns RV_OK if a matching source is
+   found, otherwise RV_FAIL */
 int subprocslog_remove_source(int source_id);
 
+/* Gets the number of bytes of output read from the STDOUT and STDERR pipes
+   of the sources written to a destination so far (for metrics).   Returns
+   RV_FAIL if there is no such destination. */
+int subprocslog_destination_bytes(int destination, unsigned long long *bytes_stdout, unsigned long long *bytes_stderr);
+
+/* Writes a line of output which was not read from the pipes of a source,
+   e.g. by the dispatcher from a worker's STDOUT, to the STDOUT log file of a
+   destination with one write, adding the newline (and in
+   SUBPROCSLOG_CAPTURE_LINES mode any prefix).   Called from any thread. */
+int subprocslog_write_line(int destination, long slot_id, pid_t pid, const char *line, size_t length);
+
 /* Checks logging system is initialised */
 int subprocslog_is_initialized();
 